@@ -14,6 +14,328 @@ extern onion *o;
 
 #define ONION_FUNC_PROTO_STR void *p, onion_request *req, onion_response *res
 
+#define API_ATTACH_UPLOAD_MAX	5000000		///< 单个附件上传请求的大小上限
+#define API_MAX_THREADS			32			///< onion 线程池的默认大小
+#define API_CONFIG_FILE			"etc/bmyapi.conf"	///< 默认的配置文件，相对于 MY_BBS_HOME
+#define API_ROUTE_MAX			64			///< 可注册的路由个数上限
+
+/**
+ * @brief 运行时配置，参见 api_config.c
+ */
+struct api_config {
+	char listen_host[64];
+	char listen_port[16];
+	int workers;							///< 工作进程数，0 表示单进程，参见 api_prefork.c
+	int cpu_affinity;						///< 是否把工作进程绑定到各自的 CPU 上
+	int threads;							///< 每个进程的 onion 线程数
+	int threads_min;						///< 自适应模式下同时处理请求数的下限
+	int adaptive;							///< 是否依据负载调整同时处理请求数，参见 api_pool.c
+	int timeout_ms;							///< 连接超时
+	char redis_host[64];
+	int redis_port;
+	int search_max;							///< user/articlequery 最多检索的文章数
+	int cache_mb;							///< 响应缓存的容量上限
+	int slow_ms;							///< 慢请求日志的阈值，0 表示关闭
+	int ratelimit;							///< 是否限制请求频率，参见 api_ratelimit.c
+	int ratelimit_ip;						///< 每个 IP 每秒的令牌数，0 表示不限
+	int ratelimit_user;						///< 每个会话每秒的令牌数，0 表示不限
+	int ratelimit_appkey;					///< 每个 appkey 每秒的令牌数，0 表示不限
+	int ratelimit_burst;					///< 桶的容量，以秒计
+	char ratelimit_costs[256];				///< 覆盖路由表中的 cost，格式为"路径:cost"，以空格或逗号分隔
+	int admission;							///< 是否按延迟预算拒绝或降级请求，参见 api_admit.c
+	int admission_budget_ms;				///< 请求的延迟预算
+	char metrics_token[64];					///< 访问 meta/metrics 的令牌，空表示只允许本机直接访问
+};
+
+/**
+ * @brief 读取配置文件
+ * @param path 为 NULL 时使用 API_CONFIG_FILE，且文件可以不存在
+ * @return 成功返回 0
+ */
+int api_config_load(const char *path);
+
+/**
+ * @brief 重新读取配置文件，只更新可以重新加载的项
+ * @return 成功返回 0，失败时保留原有配置
+ */
+int api_config_reload(void);
+
+/**
+ * @brief 启动处理 SIGHUP 的线程
+ * 需要在创建其他线程之前调用，使所有线程都屏蔽 SIGHUP。
+ */
+int api_config_watch(void);
+
+/**
+ * @brief 当前配置，未读取配置文件时返回默认值
+ */
+const struct api_config *api_config_get(void);
+
+/**
+ * @brief 启动自适应并发的控制线程
+ * @param threads onion 线程数，即同时处理请求数的上限
+ */
+int api_pool_init(int threads);
+int api_pool_threads(void);
+
+/**
+ * @brief 在处理请求前后调用，由 api_route_dispatch() 使用
+ * @param timeout_ms 在闸门前最多等待的时间，0 表示不限
+ * @return api_pool_enter() 成功返回 0，超时返回 -1，此时不需要调用 api_pool_leave()
+ */
+int api_pool_enter(int timeout_ms);
+void api_pool_leave(void);
+
+/**
+ * @brief 以 Prometheus 文本格式输出并发控制的状态
+ */
+void api_pool_render(FILE *fp);
+
+/**
+ * @brief 映射共享的令牌桶表，无法映射时不限制请求频率
+ * @return 成功返回 0
+ */
+int api_ratelimit_init(void);
+
+/**
+ * @brief 从当前请求的来源对应的令牌桶中取出 cost 个令牌
+ * @return 成功或未开启限制时返回 0，令牌不足返回 -1
+ */
+int api_ratelimit_take(onion_request *req, int cost);
+
+/**
+ * @brief 以 Prometheus 文本格式输出频率限制的状态
+ */
+void api_ratelimit_render(FILE *fp);
+
+/**
+ * @brief 以监督进程的身份运行，创建监听套接字并启动、看护工作进程
+ * @param conf_path 命令行指定的配置文件，传给工作进程
+ * @return 收到 SIGTERM 或 SIGINT 后返回 0，无法监听时返回 -1
+ */
+int api_prefork_run(const char *conf_path);
+
+/**
+ * @brief 当前进程是否为监督进程启动的工作进程
+ */
+int api_prefork_is_worker(void);
+
+/**
+ * @brief 工作进程的初始化：绑定 CPU，并使用传入的监听套接字
+ * @return 1 表示已经添加了监听点，不需要再设置地址与端口；0 表示没有传入套接字
+ */
+int api_prefork_worker_init(onion *server);
+
+/**
+ * @brief 通知监督进程初始化已经完成，在 onion_listen() 之前调用
+ */
+void api_prefork_ready(void);
+
+/**
+ * @brief 编译时的 onion 版本是否允许访问其内部结构，参见 api_onion.c
+ */
+int api_onion_internals(void);
+
+/**
+ * @brief 让 onion 在已有的监听套接字 fd 上接受 HTTP 连接
+ * @return 成功返回 0，onion 版本不支持时返回 -1
+ */
+int api_onion_add_listen_fd(onion *server, int fd);
+
+/**
+ * @brief 在响应头之后直接把 fd 中 [offset, offset+length) 的内容写入连接
+ * @return 已写出返回 1；连接不是明文 HTTP 或 onion 版本不支持时返回 0，由调用者
+ * 经由 onion_response_write() 输出；写入失败返回 -1
+ */
+int api_onion_sendfile(onion_request *req, onion_response *res, int fd, off_t offset, size_t length);
+
+/**
+ * @brief 新建一个 GET 请求，处理函数的输出（包括响应头）写入 fp，用于 batch 的子请求
+ * @return 请求，以 onion_request_free() 释放；onion 版本不支持时返回 NULL
+ */
+onion_request *api_onion_capture_request(FILE *fp);
+
+/**
+ * @brief 设置 api_onion_capture_request() 所建请求的查询参数，替换已有的同名参数
+ */
+void api_onion_request_set_query(onion_request *req, const char *key, const char *value);
+
+/**
+ * @brief 响应的 HTTP 状态码，onion 版本不支持时返回 0
+ */
+int api_onion_response_code(onion_response *res);
+
+/**
+ * @brief 响应已经输出的字节数，包括仍在缓冲区中的部分，onion 版本不支持时返回 0
+ */
+size_t api_onion_response_bytes(onion_response *res);
+
+/**
+ * @brief 路由的属性，由 api_router.c 在调用处理函数之前统一检查
+ */
+enum api_route_flag {
+	API_ROUTE_POST		= 1 << 0,	///< 只接受 POST 请求，否则返回 API_RT_WRONGMETHOD
+	API_ROUTE_AUTH		= 1 << 1,	///< 缺少 userid、sessid、appkey 参数时返回 API_RT_WRONGPARAM
+	API_ROUTE_NOSTORE	= 1 << 2,	///< 响应与用户相关，输出 Cache-Control: no-store
+	API_ROUTE_BATCH		= 1 << 3,	///< 只读且输出 JSON，允许在 batch 中调用
+	API_ROUTE_DIR		= 1 << 4,	///< 扫描 .DIR 等磁盘密集的接口，过载时优先拒绝，参见 api_admit.c
+};
+
+/**
+ * @brief 路由信息，参见 main.c、api_router.c 与 api_metrics.c
+ */
+struct api_route {
+	const char *path;						///< 请求路径，不含开头的 /，同时作为统计中使用的名称
+	int (*handler)(ONION_FUNC_PROTO_STR);
+	int flags;								///< enum api_route_flag 的组合
+	int cost;								///< 频率限制中每次请求消耗的令牌数，0 表示 1
+	int index;								///< 注册时分配
+};
+
+/**
+ * @brief 建立路由表
+ * 为 routes 中的路径寻找一个没有冲突的散列种子，之后每个请求只需计算一次散列、
+ * 比较一次字符串即可找到处理函数。
+ * @param routes 以 path 为 NULL 的元素结尾，需要在程序运行期间一直有效
+ * @return 成功返回 0
+ */
+int api_router_init(struct api_route *routes);
+
+/**
+ * @brief 按路径查找路由，开头的 / 会被忽略
+ * @return 没有找到时返回 NULL
+ */
+struct api_route *api_route_find(const char *path);
+
+/**
+ * @brief 根处理函数，查找路由后交给 api_route_dispatch()
+ */
+int api_router_handler(ONION_FUNC_PROTO_STR);
+
+/**
+ * @brief 依据 route->flags 检查请求，通过后调用 route->handler
+ * 由 api_route_dispatch() 在计时范围内调用。
+ */
+int api_route_run(const struct api_route *route, ONION_FUNC_PROTO_STR);
+
+/**
+ * @brief 准入控制中路由的类别
+ */
+enum api_admit_class {
+	API_ADMIT_LIGHT = 0,
+	API_ADMIT_DIR,
+	API_ADMIT_WRITE,
+	API_ADMIT_CLASSES
+};
+
+enum api_admit_decision {
+	API_ADMIT_NORMAL = 0,
+	API_ADMIT_DEGRADE,						///< 处理，但省去可选的工作
+	API_ADMIT_REJECT,						///< 返回 API_RT_OVERLOADED
+};
+
+/**
+ * @brief 依据路由类别的排队与处理时间决定是否处理请求，由 api_route_dispatch() 调用
+ * 返回 API_ADMIT_REJECT 以外的结果时，之后需要调用 api_admit_end()。
+ */
+enum api_admit_decision api_admit_begin(const struct api_route *route);
+
+/**
+ * @brief 当前请求在并发闸门前最多等待的时间，0 表示不限
+ */
+int api_admit_wait_ms(void);
+
+/**
+ * @brief 通过并发闸门、开始处理时调用，记录排队时间
+ */
+void api_admit_started(void);
+
+/**
+ * @brief 请求结束时调用
+ * @param served 为 0 表示排队超时，没有处理
+ */
+void api_admit_end(int served);
+
+/**
+ * @brief 当前请求是否降级处理，处理函数可以据此省去可选的工作或使用过期的缓存
+ */
+int api_admit_degraded(void);
+
+/**
+ * @brief batch 按子请求中最重的类别、以 n 倍的处理时间重新检查
+ * @details 结果为降级时当前请求随之降级。返回 API_ADMIT_REJECT 时 batch 应返回
+ * API_RT_OVERLOADED，api_admit_end() 仍由 api_route_dispatch() 调用。
+ */
+enum api_admit_decision api_admit_batch(const struct api_route * const *routes, int n);
+
+/**
+ * @brief batch 执行子请求前调用，按子请求的类别检查并计入统计
+ * @details 保存 batch 自身的状态，由 api_admit_sub_end() 恢复，两者需要成对调用，
+ * 返回 API_ADMIT_REJECT 时同样如此。batch 降级（inherited）时子请求随之降级。
+ */
+enum api_admit_decision api_admit_sub_begin(const struct api_route *route, enum api_admit_decision inherited);
+
+/**
+ * @brief 子请求结束，记录处理时间并恢复 batch 的状态
+ */
+void api_admit_sub_end(void);
+
+/**
+ * @brief 以 Prometheus 文本格式输出准入控制的状态
+ */
+void api_admit_render(FILE *fp);
+
+/**
+ * @brief 路由当前的 cost，配置中的 ratelimit_costs 优先于路由表
+ */
+int api_ratelimit_cost(const struct api_route *route);
+
+/**
+ * @brief 按路由的 cost 取令牌，由 api_route_dispatch() 调用
+ * @return 成功返回 0，应当拒绝时返回 -1
+ */
+int api_ratelimit_check(const struct api_route *route, onion_request *req);
+
+/**
+ * @brief 为路由分配统计槽位，由 api_router_init() 调用
+ * @return 成功返回 0
+ */
+int api_metrics_add_route(struct api_route *route);
+
+/**
+ * @brief 统计请求后交给 api_route_run()
+ * @param p 对应的 struct api_route
+ */
+int api_route_dispatch(ONION_FUNC_PROTO_STR);
+
+/**
+ * @brief 记录当前请求的 errcode，由 api_error() 调用
+ */
+void api_metrics_set_errcode(int errcode);
+
+/**
+ * @brief 当前请求已记录的 errcode，batch 用于在子请求之后恢复
+ */
+int api_metrics_get_errcode(void);
+
+/**
+ * @brief 以 Server-Timing 响应头输出当前请求各阶段的耗时
+ * 由 api_set_json_header() 调用，不在 api_route_dispatch() 中时不输出。
+ */
+void api_timing_set_header(onion_response *res);
+
+/**
+ * @brief 设置慢请求日志的阈值
+ * @param ms 毫秒，0 表示关闭
+ */
+void api_metrics_set_slow_threshold(int ms);
+
+/**
+ * @brief 以 Prometheus 文本格式输出统计信息
+ * @return 字符串，记得 free
+ */
+char *api_metrics_render(void);
+
 int api_error(ONION_FUNC_PROTO_STR, enum api_error_code errcode);
 
 int api_user_login(ONION_FUNC_PROTO_STR);
@@ -54,14 +376,102 @@ int api_mail_send(ONION_FUNC_PROTO_STR);
 int api_mail_reply(ONION_FUNC_PROTO_STR);
 
 int api_meta_loginpics(ONION_FUNC_PROTO_STR);			// 进站画面
+int api_meta_metrics(ONION_FUNC_PROTO_STR);				// 运行统计，Prometheus 格式
 
 int api_attach_show(ONION_FUNC_PROTO_STR);				// 显示附件
 int api_attach_list(ONION_FUNC_PROTO_STR);				// 附件列表
 int api_attach_upload(ONION_FUNC_PROTO_STR);			// 上传附件
+int api_attach_delete(ONION_FUNC_PROTO_STR);			// 删除附件
 
 int api_notification_list(ONION_FUNC_PROTO_STR);
 int api_notification_del(ONION_FUNC_PROTO_STR);
 
+int api_batch(ONION_FUNC_PROTO_STR);					// 批量调用只读接口
+
+/**
+ * @brief 预压缩的响应片段，参见 api_output.c
+ */
+struct api_gzseg {
+	char *raw;				///< 原始内容
+	size_t raw_len;
+	char *deflated;			///< raw deflate 数据，以 Z_FULL_FLUSH 结束
+	size_t deflated_len;
+	unsigned long crc;		///< 原始内容的 crc32
+};
+
+/**
+ * @brief 压缩 raw 生成预压缩片段
+ * @param raw 原始内容，由 seg 接管，api_gzseg_free() 时释放
+ * @return 成功返回 0
+ */
+int api_gzseg_init(struct api_gzseg *seg, char *raw, size_t len);
+void api_gzseg_free(struct api_gzseg *seg);
+
+/**
+ * @brief 输出 JSON 响应，按照请求的 Accept-Encoding 压缩
+ * 设置 JSON 的 MIME 信息以及 Content-Length，用于替代
+ * api_set_json_header() 加 onion_response_write0() 的组合。
+ * @param s 以 '\0' 结尾的 JSON 字符串
+ */
+void api_write_json(onion_request *req, onion_response *res, const char *s);
+
+/**
+ * @brief 输出由 prefix、seg、suffix 依次拼接而成的 JSON 响应
+ * seg 的压缩结果直接复用，只有 prefix 和 suffix 需要实时压缩。
+ * @param prefix 可以为 NULL
+ * @param seg 预压缩片段，可以为 NULL
+ * @param suffix 可以为 NULL
+ */
+void api_write_json_parts(onion_request *req, onion_response *res,
+		const char *prefix, const struct api_gzseg *seg, const char *suffix);
+
+/**
+ * @brief 读取缓存
+ * @param key
+ * @param st 源文件当前的 stat，与缓存时不一致则视为失效
+ * @return 缓存的片段，不存在返回 NULL。使用完毕后需调用 api_cache_release()
+ */
+const struct api_gzseg *api_cache_get(const char *key, const struct stat *st);
+
+/**
+ * @brief 读取缓存，不检查是否失效，用于降级处理的请求
+ * @return 缓存的片段，不存在返回 NULL。使用完毕后需调用 api_cache_release()
+ */
+const struct api_gzseg *api_cache_get_stale(const char *key);
+
+/**
+ * @brief 写入缓存，并返回写入的片段
+ * @param ttl 有效期（秒），内容还依赖于 st 以外的数据时使用，0 表示不过期
+ * @param raw 原始内容，缓存保存一份副本，raw 仍归调用者所有
+ * @return 缓存的片段，失败时返回 NULL。使用完毕后需调用 api_cache_release()
+ */
+const struct api_gzseg *api_cache_put(const char *key, const struct stat *st, int ttl, const char *raw, size_t len);
+void api_cache_release(const struct api_gzseg *seg);
+
+/**
+ * @brief 由数据源的状态计算 ETag，参见 api_output.c
+ * 依次加入影响响应内容的文件状态和参数，最后调用 api_etag_respond()。
+ */
+struct api_etag {
+	unsigned long long h;
+};
+
+void api_etag_init(struct api_etag *e);
+void api_etag_add_int(struct api_etag *e, long long v);
+void api_etag_add_str(struct api_etag *e, const char *s);
+void api_etag_add_stat(struct api_etag *e, const struct stat *st);
+
+/**
+ * @brief 加入文件的 inode、大小和修改时间，文件不存在时同样作为一种状态
+ */
+void api_etag_add_file(struct api_etag *e, const char *path);
+
+/**
+ * @brief 设置 ETag 响应头，并处理 If-None-Match
+ * @return 与请求一致时已输出 304，返回 1；否则返回 0，调用者继续生成响应
+ */
+int api_etag_respond(onion_request *req, onion_response *res, const struct api_etag *e);
+
 /**
  * @brief 为 onion_response 添加 json 的 MIME 信息
  * @param res
@@ -71,6 +481,7 @@ static inline void api_set_json_header(onion_response *res)
 {
 	onion_response_set_header(res, "Content-Type", "application/json; charset=utf-8");
 	onion_response_set_header(res, "access-control-allow-origin", "*");
+	api_timing_set_header(res);
 }
 
 #endif
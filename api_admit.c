@@ -0,0 +1,265 @@
+/**
+ * @file	api_admit.c
+ * @brief	准入控制：预计无法在延迟预算内完成的请求尽早拒绝或降级处理。
+ * @details	路由按类别统计：带 API_ROUTE_POST 的为写入类，带 API_ROUTE_DIR 的为
+ * 			扫描 .DIR 等磁盘密集类，其余为轻量类。每个类别记录正在处理的请求数，以及
+ * 			在并发闸门前排队时间与处理时间的滑动平均（权重 1/8）。
+ *
+ * 			新请求的预计耗时为该类别排队与处理时间的平均值之和，与配置中的
+ * 			admission_budget_ms 比较：
+ * 			- 不超过预算的一半时正常处理；
+ * 			- 超过一半时降级处理，处理函数可以通过 api_admit_degraded() 省去可选的
+ * 			  工作（如主题模式中的 th_commenter 统计）或使用过期的缓存，响应带有
+ * 			  X-Degraded: 1；
+ * 			- 超过预算时，写入类与磁盘密集类直接返回 API_RT_OVERLOADED，不再占用
+ * 			  线程。同类请求全部处理完毕时总是放行一个，用于重新测量；每次拒绝都使
+ * 			  平均值略微衰减，负载下降后逐渐恢复。轻量类只降级，不拒绝。
+ *
+ * 			通过检查的请求在闸门前最多等待预算中扣除平均处理时间后剩余的部分，
+ * 			超时同样返回 API_RT_OVERLOADED，参见 api_pool_enter()。
+ *
+ * 			排队时间只在 api_pool.c 的闸门前测量。onion 在 api_route_dispatch() 之前
+ * 			没有可用的时间戳，连接在 onion 内部等待线程的时间无法计入，因此准入控制
+ * 			要求 adaptive 为 1：此时 onion 的线程数多于闸门的 limit，排队主要发生在
+ * 			闸门前。拒绝发生在请求已经占用 onion 线程之后，减轻的是 .DIR 扫描与写入
+ * 			等后端的负担，线程只是很快被释放，并不能减少 onion 线程池本身的排队。
+ *
+ * 			batch 的子请求不经过 api_route_dispatch()，先由 api_admit_batch() 按其中
+ * 			最重的类别、以子请求个数倍的处理时间整体检查；执行时再由
+ * 			api_admit_sub_begin() 按各自的类别检查并计入统计，batch 降级时子请求
+ * 			随之降级。子请求不经过闸门，只记录处理时间。
+ *
+ * 			配置中 admission 为 0（或 adaptive 为 0，参见 api_config.c）时所有请求
+ * 			正常处理，统计照常进行。
+ */
+
+#include "api.h"
+
+#define API_ADMIT_EWMA_SHIFT	3		///< 滑动平均的权重为 1/8
+#define API_ADMIT_DECAY_SHIFT	6		///< 每次拒绝使平均值减少 1/64
+
+struct api_admit_class_stats {
+	int inflight;
+	uint64_t wait_us;				///< 排队时间的滑动平均
+	uint64_t service_us;			///< 处理时间的滑动平均
+	uint64_t degraded;				///< 降级处理的请求数
+	uint64_t rejected;				///< 检查时拒绝的请求数
+	uint64_t timeouts;				///< 排队超时的请求数
+};
+
+static const char *api_admit_class_names[API_ADMIT_CLASSES] = {
+	"light", "dir", "write"
+};
+
+static struct api_admit_class_stats api_admit_stats[API_ADMIT_CLASSES];
+
+struct api_admit_state {
+	int active;
+	enum api_admit_class class;
+	enum api_admit_decision decision;
+	struct timespec begin;
+	struct timespec started;
+};
+
+static __thread struct api_admit_state api_admit;
+static __thread struct api_admit_state api_admit_parent;	///< 执行子请求期间保存的 batch 状态
+
+static uint64_t api_admit_diff_us(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000LL + (b->tv_nsec - a->tv_nsec) / 1000;
+}
+
+/**
+ * @brief 更新滑动平均，各线程之间的竞争只会丢失个别样本
+ */
+static void api_admit_ewma(uint64_t *avg, uint64_t sample)
+{
+	uint64_t old = __atomic_load_n(avg, __ATOMIC_RELAXED);
+	__atomic_store_n(avg, old - (old >> API_ADMIT_EWMA_SHIFT) + (sample >> API_ADMIT_EWMA_SHIFT), __ATOMIC_RELAXED);
+}
+
+static void api_admit_decay(uint64_t *avg)
+{
+	uint64_t old = __atomic_load_n(avg, __ATOMIC_RELAXED);
+	__atomic_store_n(avg, old - (old >> API_ADMIT_DECAY_SHIFT), __ATOMIC_RELAXED);
+}
+
+static enum api_admit_class api_admit_classify(const struct api_route *route)
+{
+	if(route->flags & API_ROUTE_POST)
+		return API_ADMIT_WRITE;
+	if(route->flags & API_ROUTE_DIR)
+		return API_ADMIT_DIR;
+	return API_ADMIT_LIGHT;
+}
+
+enum api_admit_decision api_admit_begin(const struct api_route *route)
+{
+	const struct api_config *conf = api_config_get();
+	struct api_admit_class_stats *cs;
+	uint64_t estimate, budget;
+	enum api_admit_class class = api_admit_classify(route);
+
+	cs = &api_admit_stats[class];
+	memset(&api_admit, 0, sizeof(api_admit));
+	api_admit.class = class;
+	api_admit.decision = API_ADMIT_NORMAL;
+	clock_gettime(CLOCK_MONOTONIC, &api_admit.begin);
+
+	if(conf->admission) {
+		estimate = __atomic_load_n(&cs->wait_us, __ATOMIC_RELAXED)
+			+ __atomic_load_n(&cs->service_us, __ATOMIC_RELAXED);
+		budget = conf->admission_budget_ms * 1000ULL;
+
+		if(estimate > budget && class != API_ADMIT_LIGHT
+				&& __atomic_load_n(&cs->inflight, __ATOMIC_RELAXED) > 0) {
+			api_admit_decay(&cs->wait_us);
+			api_admit_decay(&cs->service_us);
+			__atomic_add_fetch(&cs->rejected, 1, __ATOMIC_RELAXED);
+			return API_ADMIT_REJECT;
+		}
+		if(estimate > budget / 2) {
+			api_admit.decision = API_ADMIT_DEGRADE;
+			__atomic_add_fetch(&cs->degraded, 1, __ATOMIC_RELAXED);
+		}
+	}
+
+	__atomic_add_fetch(&cs->inflight, 1, __ATOMIC_RELAXED);
+	api_admit.active = 1;
+	return api_admit.decision;
+}
+
+int api_admit_wait_ms(void)
+{
+	const struct api_config *conf = api_config_get();
+	int64_t left;
+
+	if(!conf->admission || !api_admit.active)
+		return 0;
+	if(api_admit.class == API_ADMIT_LIGHT)
+		return conf->timeout_ms;
+
+	left = conf->admission_budget_ms
+		- (int64_t)(__atomic_load_n(&api_admit_stats[api_admit.class].service_us, __ATOMIC_RELAXED) / 1000);
+	return (left > 1) ? (int)left : 1;
+}
+
+void api_admit_started(void)
+{
+	clock_gettime(CLOCK_MONOTONIC, &api_admit.started);
+	api_admit_ewma(&api_admit_stats[api_admit.class].wait_us,
+			api_admit_diff_us(&api_admit.begin, &api_admit.started));
+}
+
+void api_admit_end(int served)
+{
+	struct api_admit_class_stats *cs = &api_admit_stats[api_admit.class];
+	struct timespec end;
+
+	if(!api_admit.active)
+		return;
+	api_admit.active = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if(served) {
+		api_admit_ewma(&cs->service_us, api_admit_diff_us(&api_admit.started, &end));
+	} else {
+		// 排队超时，整段时间都计为排队
+		api_admit_ewma(&cs->wait_us, api_admit_diff_us(&api_admit.begin, &end));
+		__atomic_add_fetch(&cs->timeouts, 1, __ATOMIC_RELAXED);
+	}
+	__atomic_sub_fetch(&cs->inflight, 1, __ATOMIC_RELAXED);
+}
+
+int api_admit_degraded(void)
+{
+	return api_admit.active && api_admit.decision == API_ADMIT_DEGRADE;
+}
+
+enum api_admit_decision api_admit_batch(const struct api_route * const *routes, int n)
+{
+	const struct api_config *conf = api_config_get();
+	struct api_admit_class_stats *cs;
+	enum api_admit_class class = API_ADMIT_LIGHT, c;
+	uint64_t estimate, budget;
+	int i;
+
+	if(!conf->admission || !api_admit.active)
+		return api_admit.active ? api_admit.decision : API_ADMIT_NORMAL;
+
+	for(i=0; i<n; ++i) {
+		c = api_admit_classify(routes[i]);
+		if(c > class)
+			class = c;
+	}
+
+	// 子请求可能串行执行，按 n 倍的处理时间估计
+	cs = &api_admit_stats[class];
+	estimate = __atomic_load_n(&cs->wait_us, __ATOMIC_RELAXED)
+		+ __atomic_load_n(&cs->service_us, __ATOMIC_RELAXED) * n;
+	budget = conf->admission_budget_ms * 1000ULL;
+
+	if(estimate > budget && class != API_ADMIT_LIGHT
+			&& __atomic_load_n(&cs->inflight, __ATOMIC_RELAXED) > 0) {
+		api_admit_decay(&cs->wait_us);
+		api_admit_decay(&cs->service_us);
+		__atomic_add_fetch(&cs->rejected, 1, __ATOMIC_RELAXED);
+		return API_ADMIT_REJECT;
+	}
+	if(estimate > budget / 2 && api_admit.decision == API_ADMIT_NORMAL) {
+		api_admit.decision = API_ADMIT_DEGRADE;
+		__atomic_add_fetch(&cs->degraded, 1, __ATOMIC_RELAXED);
+	}
+	return api_admit.decision;
+}
+
+enum api_admit_decision api_admit_sub_begin(const struct api_route *route, enum api_admit_decision inherited)
+{
+	api_admit_parent = api_admit;
+	if(api_admit_begin(route) == API_ADMIT_REJECT)
+		return API_ADMIT_REJECT;
+
+	api_admit.started = api_admit.begin;
+	if(inherited > api_admit.decision)
+		api_admit.decision = inherited;
+	return api_admit.decision;
+}
+
+void api_admit_sub_end(void)
+{
+	api_admit_end(1);
+	api_admit = api_admit_parent;
+}
+
+void api_admit_render(FILE *fp)
+{
+	struct api_admit_class_stats *cs;
+	int i;
+
+	fprintf(fp, "# HELP bmyapi_admit_inflight Requests being handled or queued, by route class.\n");
+	fprintf(fp, "# TYPE bmyapi_admit_inflight gauge\n");
+	for(i=0; i<API_ADMIT_CLASSES; ++i)
+		fprintf(fp, "bmyapi_admit_inflight{class=\"%s\"} %d\n", api_admit_class_names[i],
+				__atomic_load_n(&api_admit_stats[i].inflight, __ATOMIC_RELAXED));
+	fprintf(fp, "# HELP bmyapi_admit_wait_seconds Moving average of the time spent waiting for a worker slot.\n");
+	fprintf(fp, "# TYPE bmyapi_admit_wait_seconds gauge\n");
+	for(i=0; i<API_ADMIT_CLASSES; ++i)
+		fprintf(fp, "bmyapi_admit_wait_seconds{class=\"%s\"} %.6f\n", api_admit_class_names[i],
+				__atomic_load_n(&api_admit_stats[i].wait_us, __ATOMIC_RELAXED) / 1e6);
+	fprintf(fp, "# HELP bmyapi_admit_service_seconds Moving average of the time spent handling a request.\n");
+	fprintf(fp, "# TYPE bmyapi_admit_service_seconds gauge\n");
+	for(i=0; i<API_ADMIT_CLASSES; ++i)
+		fprintf(fp, "bmyapi_admit_service_seconds{class=\"%s\"} %.6f\n", api_admit_class_names[i],
+				__atomic_load_n(&api_admit_stats[i].service_us, __ATOMIC_RELAXED) / 1e6);
+	fprintf(fp, "# HELP bmyapi_admit_total Requests that were degraded, rejected up front or timed out in the queue.\n");
+	fprintf(fp, "# TYPE bmyapi_admit_total counter\n");
+	for(i=0; i<API_ADMIT_CLASSES; ++i) {
+		cs = &api_admit_stats[i];
+		fprintf(fp, "bmyapi_admit_total{class=\"%s\",result=\"degraded\"} %llu\n", api_admit_class_names[i],
+				(unsigned long long)__atomic_load_n(&cs->degraded, __ATOMIC_RELAXED));
+		fprintf(fp, "bmyapi_admit_total{class=\"%s\",result=\"rejected\"} %llu\n", api_admit_class_names[i],
+				(unsigned long long)__atomic_load_n(&cs->rejected, __ATOMIC_RELAXED));
+		fprintf(fp, "bmyapi_admit_total{class=\"%s\",result=\"timeout\"} %llu\n", api_admit_class_names[i],
+				(unsigned long long)__atomic_load_n(&cs->timeouts, __ATOMIC_RELAXED));
+	}
+}
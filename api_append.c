@@ -0,0 +1,160 @@
+/**
+ * @file	api_append.c
+ * @brief	索引文件的合并追加，代替逐条 append_record()。
+ * @details	每个索引文件（如 boards/<board>/.DIR）对应一个队列。追加记录时先加入队列，
+ * 			队列空闲时当前线程成为写入者，取出队列中的全部记录，在一次 flock 内
+ * 			以一次 write() 追加到文件末尾；写入期间到达的记录留在队列中。写入者
+ * 			完成后唤醒等待的线程并返回，记录尚未写入的线程中的一个成为下一轮的
+ * 			写入者，取走队列中积累的全部记录。
+ *
+ * 			记录按加入队列的顺序写入，每条记录的序号由加锁后的文件大小得出，与其他
+ * 			进程（telnet、其他工作进程）的追加同样通过 flock 互斥。与 append_record()
+ * 			相同，写入后不调用 fsync；写入失败时截断回原来的长度，该批记录全部失败。
+ *
+ * 			队列在第一次使用时创建，之后不释放，数量不超过版面数与收到或发出过信件的
+ * 			信箱数之和，每个不到一百字节；散列表随之扩展，查找不会退化。
+ */
+
+#include <pthread.h>
+#include "apilib.h"
+
+struct api_append_entry {
+	const void *record;
+	size_t size;
+	int pos;							///< 写入后的序号，从 1 开始，失败为 -1
+	int done;
+	struct api_append_entry *next;
+};
+
+struct api_append_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int writing;						///< 是否已有线程在写入
+	struct api_append_entry *head;
+	struct api_append_entry **tail;
+	char path[0];
+};
+
+static ght_hash_table_t *api_append_queues = NULL;
+static pthread_mutex_t api_append_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct api_append_queue *api_append_queue_get(const char *path)
+{
+	struct api_append_queue *q;
+	size_t len = strlen(path);
+
+	pthread_mutex_lock(&api_append_lock);
+	if(!api_append_queues) {
+		api_append_queues = ght_create(1024);
+		if(api_append_queues)
+			ght_set_rehash(api_append_queues, 1);
+	}
+	q = api_append_queues ? ght_get(api_append_queues, len, path) : NULL;
+	if(!q && api_append_queues) {
+		q = (struct api_append_queue *)calloc(1, sizeof(*q) + len + 1);
+		if(q) {
+			pthread_mutex_init(&q->lock, NULL);
+			pthread_cond_init(&q->cond, NULL);
+			q->tail = &q->head;
+			memcpy(q->path, path, len + 1);
+			if(ght_insert(api_append_queues, q, len, q->path) < 0) {
+				free(q);
+				q = NULL;
+			}
+		}
+	}
+	pthread_mutex_unlock(&api_append_lock);
+	return q;
+}
+
+/**
+ * @brief 在一次加锁内写入 batch 中的所有记录
+ * @warning 调用时不持有 q->lock
+ */
+static void api_append_write(const char *path, struct api_append_entry *batch)
+{
+	struct api_append_entry *e;
+	struct stat st;
+	size_t total = 0, off;
+	char *buf;
+	int fd;
+
+	for(e = batch; e; e = e->next) {
+		e->pos = -1;
+		total += e->size;
+	}
+
+	buf = malloc(total);
+	if(!buf)
+		return;
+	for(e = batch, off = 0; e; off += e->size, e = e->next)
+		memcpy(buf + off, e->record, e->size);
+
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0660);
+	if(fd < 0) {
+		free(buf);
+		return;
+	}
+
+	flock(fd, LOCK_EX);
+	if(fstat(fd, &st) == 0) {
+		if(write(fd, buf, total) == (ssize_t)total) {
+			for(e = batch, off = st.st_size; e; off += e->size, e = e->next)
+				e->pos = off / e->size + 1;
+		} else {
+			errlog("append to %s failed, errno %d: %s.\n", path, errno, strerror(errno));
+			if(ftruncate(fd, st.st_size) < 0)
+				errlog("truncate %s failed, errno %d: %s.\n", path, errno, strerror(errno));
+		}
+	}
+	flock(fd, LOCK_UN);
+	close(fd);
+	free(buf);
+}
+
+int api_append_record(const char *path, const void *record, size_t size)
+{
+	struct api_append_queue *q = api_append_queue_get(path);
+	struct api_append_entry entry, *batch, *e;
+	struct stat st;
+
+	if(!q) {
+		// 无法建立队列时退回逐条追加
+		if(append_record((char *)path, (void *)record, size) < 0 || stat(path, &st) < 0)
+			return -1;
+		return st.st_size / size;
+	}
+
+	entry.record = record;
+	entry.size = size;
+	entry.pos = -1;
+	entry.done = 0;
+	entry.next = NULL;
+
+	pthread_mutex_lock(&q->lock);
+	*q->tail = &entry;
+	q->tail = &entry.next;
+
+	while(!entry.done && q->writing)
+		pthread_cond_wait(&q->cond, &q->lock);
+
+	// 自己的记录尚未写入且没有写入者时，由当前线程写入队列中的全部记录
+	while(!entry.done) {
+		q->writing = 1;
+		batch = q->head;
+		q->head = NULL;
+		q->tail = &q->head;
+		pthread_mutex_unlock(&q->lock);
+
+		api_append_write(q->path, batch);
+
+		pthread_mutex_lock(&q->lock);
+		for(e = batch; e; e = e->next)
+			e->done = 1;	// 之后 e 可能随等待者的返回失效，不再访问
+		q->writing = 0;
+		pthread_cond_broadcast(&q->cond);
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	return entry.pos;
+}
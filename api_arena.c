@@ -0,0 +1,303 @@
+/**
+ * @file	api_arena.c
+ * @brief	请求范围内的内存分配。
+ * @details	每个线程持有一个分配区，分配只是移动指针，不需要逐个释放。
+ * 			api_route_dispatch() 在请求处理完毕、响应已写入 onion 的缓冲区后调用
+ * 			api_arena_reset() 一次性回收，处理函数中提前返回的分支不再需要 free()。
+ *
+ * 			第一个块在线程的生命周期内保留，一般的请求不会调用 malloc；超出时
+ * 			追加新的块，超过块大小四分之一的分配单独占用一个块，reset 时归还。
+ *
+ * 			分配区中的内存只在当前请求内有效，需要保留到请求之外的数据（如
+ * 			api_cache_put() 的内容）由接收方自行复制。在 onion 线程以外调用时，
+ * 			需要由调用者负责 api_arena_reset() 或 api_arena_release()。
+ */
+
+#include "apilib.h"
+
+#define API_ARENA_CHUNK		(64 * 1024)		///< 保留块的大小
+#define API_ARENA_ALIGN		16
+
+struct api_arena_chunk {
+	struct api_arena_chunk *next;
+	size_t size;
+	size_t used;
+	char data[] __attribute__((aligned(API_ARENA_ALIGN)));
+};
+
+static __thread struct api_arena_chunk *api_arena_head = NULL;	///< 当前分配的块，之后为较早的块
+static __thread struct api_arena_chunk *api_arena_first = NULL;	///< 保留的块，位于链表末尾
+
+static size_t api_arena_round(size_t size)
+{
+	return (size + API_ARENA_ALIGN - 1) & ~(size_t)(API_ARENA_ALIGN - 1);
+}
+
+static struct api_arena_chunk *api_arena_chunk_new(size_t size)
+{
+	struct api_arena_chunk *c = malloc(sizeof(struct api_arena_chunk) + size);
+
+	if(!c)
+		return NULL;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+void *api_arena_alloc(size_t size)
+{
+	struct api_arena_chunk *c;
+
+	size = api_arena_round(size ? size : 1);
+
+	if(!api_arena_head) {
+		api_arena_first = api_arena_chunk_new(API_ARENA_CHUNK);
+		if(!api_arena_first)
+			return NULL;
+		api_arena_head = api_arena_first;
+	}
+
+	c = api_arena_head;
+	if(c->size - c->used >= size) {
+		c->used += size;
+		return c->data + c->used - size;
+	}
+
+	if(size > API_ARENA_CHUNK / 4) {
+		// 单独占用一个块，挂在当前块之后，当前块的剩余空间继续使用
+		c = api_arena_chunk_new(size);
+		if(!c)
+			return NULL;
+		c->used = size;
+		c->next = api_arena_head->next;
+		api_arena_head->next = c;
+		return c->data;
+	}
+
+	c = api_arena_chunk_new(API_ARENA_CHUNK);
+	if(!c)
+		return NULL;
+	c->used = size;
+	c->next = api_arena_head;
+	api_arena_head = c;
+	return c->data;
+}
+
+void *api_arena_grow(void *ptr, size_t old_size, size_t new_size)
+{
+	struct api_arena_chunk *c = api_arena_head;
+	size_t old_round, new_round;
+	void *p;
+
+	if(!ptr)
+		return api_arena_alloc(new_size);
+	if(new_size <= old_size)
+		return ptr;
+
+	// 最后一次分配可以原地扩展
+	old_round = api_arena_round(old_size);
+	new_round = api_arena_round(new_size);
+	if(c && (char *)ptr + old_round == c->data + c->used
+			&& c->size - c->used >= new_round - old_round) {
+		c->used += new_round - old_round;
+		return ptr;
+	}
+
+	p = api_arena_alloc(new_size);
+	if(p)
+		memcpy(p, ptr, old_size);
+	return p;
+}
+
+char *api_arena_strndup(const char *s, size_t n)
+{
+	size_t len = strnlen(s, n);
+	char *r = api_arena_alloc(len + 1);
+
+	if(!r)
+		return NULL;
+	memcpy(r, s, len);
+	r[len] = 0;
+	return r;
+}
+
+char *api_arena_strdup(const char *s)
+{
+	return api_arena_strndup(s, strlen(s));
+}
+
+char *api_arena_printf(const char *fmt, ...)
+{
+	va_list ap;
+	char *r;
+	int len;
+
+	va_start(ap, fmt);
+	len = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if(len < 0)
+		return NULL;
+
+	r = api_arena_alloc(len + 1);
+	if(!r)
+		return NULL;
+
+	va_start(ap, fmt);
+	vsnprintf(r, len + 1, fmt, ap);
+	va_end(ap);
+	return r;
+}
+
+char *api_arena_replace_all(const char *s, const char *old, const char *new)
+{
+	size_t old_len = strlen(old), new_len = strlen(new), n = 0;
+	const char *p, *q;
+	char *r, *w;
+
+	for(p = s; (q = strstr(p, old)) != NULL; p = q + old_len)
+		n++;
+
+	r = api_arena_alloc(strlen(s) + n * new_len - n * old_len + 1);
+	if(!r)
+		return NULL;
+
+	for(p = s, w = r; (q = strstr(p, old)) != NULL; p = q + old_len) {
+		memcpy(w, p, q - p);
+		w += q - p;
+		memcpy(w, new, new_len);
+		w += new_len;
+	}
+	strcpy(w, p);
+	return r;
+}
+
+void api_arena_reset(void)
+{
+	struct api_arena_chunk *c, *next;
+
+	for(c = api_arena_head; c && c != api_arena_first; c = next) {
+		next = c->next;
+		free(c);
+	}
+	// 单独占用的块可能挂在保留块之后
+	if(api_arena_first) {
+		for(c = api_arena_first->next; c; c = next) {
+			next = c->next;
+			free(c);
+		}
+		api_arena_first->next = NULL;
+		api_arena_first->used = 0;
+	}
+	api_arena_head = api_arena_first;
+}
+
+void api_arena_release(void)
+{
+	api_arena_reset();
+	free(api_arena_first);
+	api_arena_first = NULL;
+	api_arena_head = NULL;
+}
+
+void api_arena_buf_init(struct api_arena_buf *b, size_t cap)
+{
+	b->len = 0;
+	b->cap = cap ? cap : 256;
+	b->s = api_arena_alloc(b->cap);
+	if(b->s)
+		b->s[0] = 0;
+}
+
+/**
+ * @brief 保证还能写入 n 个字节及结尾的 '\0'
+ * @return 成功返回 0；失败时 b->s 置为 NULL，之后的写入都被忽略
+ */
+static int api_arena_buf_reserve(struct api_arena_buf *b, size_t n)
+{
+	size_t cap;
+
+	if(!b->s)
+		return -1;
+	if(b->len + n + 1 <= b->cap)
+		return 0;
+
+	cap = b->cap * 2;
+	while(cap < b->len + n + 1)
+		cap *= 2;
+	b->s = api_arena_grow(b->s, b->cap, cap);
+	b->cap = cap;
+	return b->s ? 0 : -1;
+}
+
+void api_arena_buf_append(struct api_arena_buf *b, const char *s, size_t n)
+{
+	if(api_arena_buf_reserve(b, n) < 0)
+		return;
+	memcpy(b->s + b->len, s, n);
+	b->len += n;
+	b->s[b->len] = 0;
+}
+
+void api_arena_buf_puts(struct api_arena_buf *b, const char *s)
+{
+	api_arena_buf_append(b, s, strlen(s));
+}
+
+void api_arena_buf_printf(struct api_arena_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int len;
+
+	if(!b->s)
+		return;
+
+	va_start(ap, fmt);
+	len = vsnprintf(b->s + b->len, b->cap - b->len, fmt, ap);
+	va_end(ap);
+	if(len < 0 || (size_t)len < b->cap - b->len) {
+		if(len > 0)
+			b->len += len;
+		return;
+	}
+
+	if(api_arena_buf_reserve(b, len) < 0)
+		return;
+	va_start(ap, fmt);
+	vsnprintf(b->s + b->len, b->cap - b->len, fmt, ap);
+	va_end(ap);
+	b->len += len;
+}
+
+void api_arena_buf_json_str(struct api_arena_buf *b, const char *s)
+{
+	static const char hex[] = "0123456789abcdef";
+	const unsigned char *p, *run;
+	char esc[6];
+
+	api_arena_buf_append(b, "\"", 1);
+	for(p = run = (const unsigned char *)s; *p; ++p) {
+		if(*p >= 0x20 && *p != '"' && *p != '\\')
+			continue;
+
+		api_arena_buf_append(b, (const char *)run, p - run);
+		run = p + 1;
+		switch(*p) {
+		case '"':	api_arena_buf_append(b, "\\\"", 2); break;
+		case '\\':	api_arena_buf_append(b, "\\\\", 2); break;
+		case '\n':	api_arena_buf_append(b, "\\n", 2); break;
+		case '\r':	api_arena_buf_append(b, "\\r", 2); break;
+		case '\t':	api_arena_buf_append(b, "\\t", 2); break;
+		case '\b':	api_arena_buf_append(b, "\\b", 2); break;
+		case '\f':	api_arena_buf_append(b, "\\f", 2); break;
+		default:
+			memcpy(esc, "\\u00", 4);
+			esc[4] = hex[*p >> 4];
+			esc[5] = hex[*p & 0xf];
+			api_arena_buf_append(b, esc, 6);
+			break;
+		}
+	}
+	api_arena_buf_append(b, (const char *)run, p - run);
+	api_arena_buf_append(b, "\"", 1);
+}
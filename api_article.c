@@ -1,17 +1,8 @@
 #include "api.h"
 
-/**
- * @brief 将 struct bmy_article 数组序列化为 json 字符串。
- * 这个方法不考虑异常，因此方法里确定了 errcode 为 0，也就是 API_RT_SUCCESSFUL，
- * 相关的异常应该在从 BMY 数据转为 bmy_article 的过程中判断、处理。
- * @param ba_list struct bmy_article 数组
- * @param count 数组长度
- * @param mode 0:不输出文章所在版面信息, 1:输出每个文章所在的版面信息。
- * @return json 字符串
- * @warning 记得调用完成 free
- */
-static char* bmy_article_array_to_json_string(struct bmy_article *ba_list, int count, int mode);
-static char* bmy_article_with_num_array_to_json_string(struct bmy_article *ba_list, int count, int mode);
+#define API_COMMEND_TTL				60		///< 推荐列表中的同主题文章数取自各版面 .DIR，缓存与 ETag 每分钟刷新
+#define API_COMMEND_MAX				100		///< 推荐列表单次返回的最大条数
+#define API_CONTENT_CACHE_CONTROL	"private, max-age=604800"	///< 文章内容允许客户端缓存一周
 
 /**
  * @brief 将十大、分区热门话题转为 JSON 数据输出
@@ -21,6 +12,22 @@ static char* bmy_article_with_num_array_to_json_string(struct bmy_article *ba_li
  */
 static int api_article_list_xmltopfile(ONION_FUNC_PROTO_STR, int mode, const char *secstr);
 
+/**
+ * @brief 输出可以在用户之间共享的列表，并以预压缩的形式缓存
+ * @param key 缓存的键
+ * @param st 数据源文件的 stat，文件变化后缓存失效
+ * @param ttl 缓存有效期，参见 api_cache_put()
+ * @param s 输出的 JSON 字符串，为 NULL 时返回 API_RT_NOTENGMEM
+ * @return
+ */
+static int api_article_write_cached(ONION_FUNC_PROTO_STR, const char *key, const struct stat *st, int ttl, const char *s);
+
+/**
+ * @brief 读取缓存并输出，降级处理时可以使用已经失效的缓存
+ * @return 命中返回 1，否则返回 0
+ */
+static int api_article_write_from_cache(ONION_FUNC_PROTO_STR, const char *key, const struct stat *st);
+
 /**
  * @brief 将美文推荐，或通知公告转为JSON数据输出
  * @param board 版面名
@@ -187,6 +194,22 @@ static int api_article_list_xmltopfile(ONION_FUNC_PROTO_STR, int mode, const cha
 		sprintf(ttfile, "etc/Area_Dir/%s", secstr);
 	}
 
+	struct stat st;
+	char cache_key[64];
+	if(stat(ttfile, &st) < 0)
+		return api_error(p, req, res, API_RT_NOTOP10FILE);
+
+	struct api_etag etag;
+	api_etag_init(&etag);
+	api_etag_add_str(&etag, ttfile);
+	api_etag_add_stat(&etag, &st);
+	if(api_etag_respond(req, res, &etag))
+		return OCS_PROCESSED;
+
+	snprintf(cache_key, sizeof(cache_key), "article/list/%s", ttfile);
+	if(api_article_write_from_cache(p, req, res, cache_key, &st))
+		return OCS_PROCESSED;
+
 	struct bmy_article top_list[listmax];
 	struct fileheader fh;
 	memset(top_list, 0, sizeof(top_list[0]) * listmax);
@@ -300,18 +323,15 @@ static int api_article_list_xmltopfile(ONION_FUNC_PROTO_STR, int mode, const cha
 	xmlXPathFreeContext(ctx);
 	xmlFreeDoc(doc);
 
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-
-	free(s);
-
-	return OCS_PROCESSED;
+	return api_article_write_cached(p, req, res, cache_key, &st, 0, s);
 }
 
 static int api_article_list_commend(ONION_FUNC_PROTO_STR, int mode, int startnum, int number)
 {
 	if(0 >= number)
 		number = 20;
+	if(number > API_COMMEND_MAX)
+		number = API_COMMEND_MAX;
 	struct bmy_article commend_list[number];
 	struct commend x;
 	memset(commend_list, 0, sizeof(commend_list[0]) * number);
@@ -321,7 +341,28 @@ static int api_article_list_commend(ONION_FUNC_PROTO_STR, int mode, int startnum
 		strcpy(dir, ".COMMEND");
 	else if(1 == mode)
 		strcpy(dir, ".COMMEND2");
-	int fsize = file_size_s(dir);
+	struct stat st;
+	char cache_key[64];
+	if(stat(dir, &st) < 0 || st.st_size == 0)
+		return api_error(p, req, res, API_RT_NOCMMNDFILE);
+
+	struct api_etag etag;
+	api_etag_init(&etag);
+	api_etag_add_str(&etag, dir);
+	api_etag_add_stat(&etag, &st);
+	api_etag_add_int(&etag, startnum);
+	api_etag_add_int(&etag, number);
+	api_etag_add_int(&etag, time(NULL) / API_COMMEND_TTL);
+	if(api_etag_respond(req, res, &etag))
+		return OCS_PROCESSED;
+
+	// 只缓存最新一页，其余页不会被频繁访问，也避免客户端以任意的 startnum 占满缓存
+	int cacheable = (startnum == 0);
+	snprintf(cache_key, sizeof(cache_key), "article/list/%s/%d", dir, number);
+	if(cacheable && api_article_write_from_cache(p, req, res, cache_key, &st))
+		return OCS_PROCESSED;
+
+	int fsize = st.st_size;
 	int total = fsize / sizeof(struct commend);
 	fp = fopen(dir, "r");
 
@@ -352,12 +393,48 @@ static int api_article_list_commend(ONION_FUNC_PROTO_STR, int mode, int startnum
 	}
 	fclose(fp);
 	char *s = bmy_article_array_to_json_string(commend_list, count, 1);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(s);
+	if(!cacheable) {
+		if(!s)
+			return api_error(p, req, res, API_RT_NOTENGMEM);
+		api_write_json(req, res, s);
+		return OCS_PROCESSED;
+	}
+	return api_article_write_cached(p, req, res, cache_key, &st, API_COMMEND_TTL, s);
+}
+
+static int api_article_write_cached(ONION_FUNC_PROTO_STR, const char *key, const struct stat *st, int ttl, const char *s)
+{
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+
+	const struct api_gzseg *seg = api_cache_put(key, st, ttl, s, strlen(s));
+	if(!seg) {
+		api_write_json(req, res, s);
+		return OCS_PROCESSED;
+	}
+
+	api_write_json_parts(req, res, NULL, seg, NULL);
+	api_cache_release(seg);
 	return OCS_PROCESSED;
 }
 
+static int api_article_write_from_cache(ONION_FUNC_PROTO_STR, const char *key, const struct stat *st)
+{
+	const struct api_gzseg *seg = api_cache_get(key, st);
+	if(!seg && api_admit_degraded()) {
+		// 过期的内容与已经设置的 ETag 不符，不允许客户端保存
+		seg = api_cache_get_stale(key);
+		if(seg)
+			onion_response_set_header(res, "Cache-Control", "no-store");
+	}
+	if(!seg)
+		return 0;
+
+	api_write_json_parts(req, res, NULL, seg, NULL);
+	api_cache_release(seg);
+	return 1;
+}
+
 static int api_article_list_board(ONION_FUNC_PROTO_STR)
 {
 	const char * board        = onion_request_get_query(req, "board");
@@ -376,16 +453,13 @@ static int api_article_list_board(ONION_FUNC_PROTO_STR)
 	//TODO: 签名检查
 	//...
 	//判断版面访问权
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL){
-		free(ue);
 		return api_error(p, req, res, r);
 	}
-	if(ue != NULL)
-		free(ue);
 	struct user_info *ui = &(shm_utmp->uinfo[get_user_utmp_index(sessid)]);
 	struct boardmem *b   = getboardbyname(board);
 	if(b == NULL) {
@@ -395,6 +469,21 @@ static int api_article_list_board(ONION_FUNC_PROTO_STR)
 		return api_error(p, req, res, API_RT_NOBRDRPERM);
 	}
 
+	// 列表完全由 .DIR 决定，未变化时不必扫描
+	char dir[80];
+	struct api_etag etag;
+	sprintf(dir, "boards/%s/.DIR", board);
+	api_etag_init(&etag);
+	api_etag_add_file(&etag, dir);
+	api_etag_add_str(&etag, "board");
+	api_etag_add_str(&etag, str_btype);
+	api_etag_add_str(&etag, str_startnum);
+	api_etag_add_str(&etag, str_count);
+	api_etag_add_str(&etag, str_page);
+	api_etag_add_int(&etag, api_admit_degraded());
+	if(api_etag_respond(req, res, &etag))
+		return OCS_PROCESSED;
+
 	int mode = 0, startnum = 0, count = 0;
 	if(str_startnum != NULL)
 		startnum = atoi(str_startnum);
@@ -409,20 +498,21 @@ static int api_article_list_board(ONION_FUNC_PROTO_STR)
 	int fd = 0;
 	struct bmy_article board_list[count];
 	memset(board_list, 0, sizeof(board_list[0]) * count);
-	struct fileheader *data = NULL, x2;
-	char dir[80], filename[80];
+	struct fileheader *data = NULL;
 	int i = 0, total = 0, total_article = 0;
 
-	sprintf(dir, "boards/%s/.DIR", board);
 	int fsize = file_size_s(dir);
 	fd = open(dir, O_RDONLY);
 	if(0 == fd || 0 == fsize) {
 		return api_error(p, req, res, API_RT_EMPTYBRD);
 	}
 
+	// DIR 阶段包括映射、扫描与之后的主题统计
+	api_phase_begin(API_PHASE_DIR);
 	data = mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
 	if(MAP_FAILED == data) {
+		api_phase_end(API_PHASE_DIR);
 		return api_error(p, req, res, API_RT_CNTMAPBRDIR);
 	}
 
@@ -455,27 +545,8 @@ static int api_article_list_board(ONION_FUNC_PROTO_STR)
 			continue;
 		}
 
-		if (data[i].sizebyte == 0) { // 如果内存中数据库记录的 sizebyte 为 0，则修正 .DIR 文件
-			sprintf(filename, "boards/%s/%s", board, fh2fname(&data[i]));
-			data[i].sizebyte = numbyte(eff_size(filename));
-
-			fd = open(dir, O_RDWR);
-			if (fd < 0)
-				break;
-
-			flock(fd, LOCK_EX);
-			lseek(fd, (startnum - 1 + i) * sizeof (struct fileheader),SEEK_SET);
-			if (read(fd, &x2, sizeof (x2)) == sizeof (x2) && data[i].filetime == x2.filetime) {
-				x2.sizebyte = data[i].sizebyte;
-				lseek(fd, -1 * sizeof (x2), SEEK_CUR);
-				if(write(fd, &x2, sizeof (x2)) == -1) {
-					errlog("write error to fileheader %s, at No. %d record, from file %s. Errno %d: %s.\n",
-							dir, (startnum-1+i), filename, errno, strerror(errno));
-				}
-			}
-			flock(fd, LOCK_UN);
-			close(fd);
-		}
+		if (data[i].sizebyte == 0) // 交给后台线程修正 .DIR，本次请求只读
+			api_repair_sizebyte(board, &data[i]);
 
 		board_list[num].mark = data[i].accessed;
 		board_list[num].filetime = data[i].filetime;
@@ -492,13 +563,15 @@ static int api_article_list_board(ONION_FUNC_PROTO_STR)
 		}
 	}
 	munmap(data, fsize);
-	for(i = 0; i < num; ++i){
+	// 每篇文章都要从主题开始扫描 .DIR，降级处理时省去，th_num 等字段为 0
+	for(i = 0; i < num && !api_admit_degraded(); ++i){
 		parse_thread_info(&board_list[i]);
 	}
+	api_phase_end(API_PHASE_DIR);
 	char *s = bmy_article_with_num_array_to_json_string(board_list, num, mode);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(s);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, s);
 	return OCS_PROCESSED;
 }
 
@@ -520,16 +593,13 @@ static int api_article_list_thread(ONION_FUNC_PROTO_STR)
 	//TODO: 签名检查
 	//...
 	//判断版面访问权
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL){
-		free(ue);
 		return api_error(p, req, res, r);
 	}
-	if(ue != NULL)
-		free(ue);
 	struct user_info *ui = &(shm_utmp->uinfo[get_user_utmp_index(sessid)]);
 	struct boardmem *b   = getboardbyname(board);
 	if(b == NULL)
@@ -537,6 +607,18 @@ static int api_article_list_thread(ONION_FUNC_PROTO_STR)
 	if(!check_user_read_perm_x(ui, b))
 		return api_error(p, req, res, API_RT_FBDNUSER);
 
+	char dir[80];
+	struct api_etag etag;
+	sprintf(dir, "boards/%s/.DIR", board);
+	api_etag_init(&etag);
+	api_etag_add_file(&etag, dir);
+	api_etag_add_str(&etag, "thread");
+	api_etag_add_int(&etag, thread);
+	api_etag_add_str(&etag, str_startnum);
+	api_etag_add_str(&etag, str_count);
+	if(api_etag_respond(req, res, &etag))
+		return OCS_PROCESSED;
+
 	int startnum = 0, count = 0;
 	if(str_startnum != NULL)
 		startnum = atoi(str_startnum);
@@ -544,19 +626,20 @@ static int api_article_list_thread(ONION_FUNC_PROTO_STR)
 		count = atoi(str_count);
 
 	int fd = 0;
-	struct fileheader *data = NULL, x2;
-	char dir[80], filename[80];
+	struct fileheader *data = NULL;
 	int i = 0, total = 0, total_article = 0;
-	sprintf(dir, "boards/%s/.DIR", board);
 	int fsize = file_size_s(dir);
 	fd = open(dir, O_RDONLY);
 	if(0 == fd || 0 == fsize) {
 		return api_error(p, req, res, API_RT_EMPTYBRD);
 	}
+	api_phase_begin(API_PHASE_DIR);
 	data = mmap(NULL, fsize, PROT_READ, MAP_SHARED, fd, 0);
 	close(fd);
-	if(MAP_FAILED == data)
+	if(MAP_FAILED == data) {
+		api_phase_end(API_PHASE_DIR);
 		return api_error(p, req, res, API_RT_CNTMAPBRDIR);
+	}
 
 	total = fsize / sizeof(struct fileheader);
 	total_article = 0;
@@ -583,25 +666,8 @@ static int api_article_list_thread(ONION_FUNC_PROTO_STR)
 		++sum;
 		if(sum < startnum)
 			continue;
-		if (data[i].sizebyte == 0) {
-			sprintf(filename, "boards/%s/%s", board, fh2fname(&data[i]));
-			data[i].sizebyte = numbyte(eff_size(filename));
-			fd = open(dir, O_RDWR);
-			if (fd < 0)
-				break;
-			flock(fd, LOCK_EX);
-			lseek(fd, (startnum - 1 + i) * sizeof (struct fileheader),SEEK_SET);
-			if (read(fd, &x2, sizeof (x2)) == sizeof (x2) && data[i].filetime == x2.filetime) {
-				x2.sizebyte = data[i].sizebyte;
-				lseek(fd, -1 * sizeof (x2), SEEK_CUR);
-				if(write(fd, &x2, sizeof (x2)) == -1) {
-					errlog("write error to fileheader %s, at No. %d record, from file %s. Errno %d: %s.\n",
-							dir, (startnum-1+i), filename, errno, strerror(errno));
-				}
-			}
-			flock(fd, LOCK_UN);
-			close(fd);
-		}
+		if (data[i].sizebyte == 0)
+			api_repair_sizebyte(board, &data[i]);
 
 		board_list[num].mark = data[i].accessed;
 		board_list[num].filetime = data[i].filetime;
@@ -620,10 +686,11 @@ static int api_article_list_thread(ONION_FUNC_PROTO_STR)
 	for(i = 0; i < num; ++i){
 		board_list[i].th_num = get_number_of_articles_in_thread(board_list[i].board, board_list[i].thread);
 	}
+	api_phase_end(API_PHASE_DIR);
 	char *s = bmy_article_array_to_json_string(board_list, num, 1);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(s);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, s);
 	return OCS_PROCESSED;
 }
 
@@ -640,19 +707,15 @@ static int api_article_list_boardtop(ONION_FUNC_PROTO_STR)
 	//TODO: 签名检查
 	//...
 	//判断版面访问权
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL){
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
-	if(ue != NULL)
-		free(ue);
-
 	struct user_info *ui = &(shm_utmp->uinfo[get_user_utmp_index(sessid)]);
 	struct boardmem *b   = getboardbyname(board);
 	if(b == NULL)
@@ -661,10 +724,18 @@ static int api_article_list_boardtop(ONION_FUNC_PROTO_STR)
 	if(!check_user_read_perm_x(ui, b))
 		return api_error(p, req, res, API_RT_NOBRDRPERM);
 
-	char topdir[80];
+	char topdir[80], dir[80];
 	FILE *fp;
 	struct fileheader x;
+	struct api_etag etag;
 	sprintf(topdir, "boards/%s/.TOPFILE", b->header.filename);
+	sprintf(dir, "boards/%s/.DIR", b->header.filename);	// 同主题文章数
+	api_etag_init(&etag);
+	api_etag_add_file(&etag, topdir);
+	api_etag_add_file(&etag, dir);
+	if(api_etag_respond(req, res, &etag))
+		return OCS_PROCESSED;
+
 	fp = fopen(topdir, "r");
 	if(fp == 0)
 		return api_error(p, req, res, API_RT_NOBRDTPFILE);
@@ -691,9 +762,9 @@ static int api_article_list_boardtop(ONION_FUNC_PROTO_STR)
 	fclose(fp);
 
 	char *s = bmy_article_array_to_json_string(board_list, count, 1);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(s);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, s);
 
 	return OCS_PROCESSED;
 }
@@ -717,34 +788,34 @@ static int api_article_get_content(ONION_FUNC_PROTO_STR, int mode)
 	const char * sessid = onion_request_get_query(req, "sessid");
 	const char * appkey = onion_request_get_query(req, "appkey");
 
-	if(!userid || !sessid || !appkey)
-		return api_error(p, req, res, API_RT_WRONGPARAM);
+	// 未提供 userid、userid 为 guest 或 session 不合法时以 guest 身份阅读，
+	// 此时 ue 与 ui 均为 NULL，不查询用户信息和回复提醒
+	struct userec *ue = NULL;
+	struct user_info *ui = NULL;
+	if(userid && strcasecmp(userid, "guest")) {
+		if(!sessid || !appkey)
+			return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
-	if(ue == 0)
-		return api_error(p, req, res, API_RT_WRONGPARAM);
+		ue = api_getuser(userid);
+		if(ue == 0)
+			return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	if(check_user_session(ue, sessid, appkey) != API_RT_SUCCESSFUL) {
-		free(ue);
-		userid = "guest";	// session 不合法的情况下，userid 和 ue 转为 guest
-		ue = getuser(userid);
+		if(check_user_session(ue, sessid, appkey) == API_RT_SUCCESSFUL)
+			ui = &(shm_utmp->uinfo[get_user_utmp_index(sessid)]);
+		else
+			ue = NULL;
 	}
 
-	int uent_index = get_user_utmp_index(sessid);
-	struct user_info *ui = (strcasecmp(userid, "guest")==0) ?
-		NULL : &(shm_utmp->uinfo[uent_index]);
 	if(!check_user_read_perm_x(ui, bmem)) {
-		free(ue);
 		return api_error(p, req, res, API_RT_NOBRDRPERM);
 	}
 
 	// 删除回复提醒
-	if(is_post_in_notification(ue->userid, bname, aid))
-		del_post_notification(ue->userid, bname, aid);
+	if(ue && api_notification_has_post(ue->userid, bname, aid))
+		api_notification_del_post(ue->userid, bname, aid);
 
 	int total = bmem->total;
 	if(total<=0) {
-		free(ue);
 		return api_error(p, req, res, API_RT_EMPTYBRD);
 	}
 
@@ -754,23 +825,23 @@ static int api_article_get_content(ONION_FUNC_PROTO_STR, int mode)
 	sprintf(dir_file, "boards/%s/.DIR", bname);
 
 	struct mmapfile mf = { ptr:NULL };
+	api_phase_begin(API_PHASE_DIR);
 	if(mmapfile(dir_file, &mf) == -1) {
-		free(ue);
+		api_phase_end(API_PHASE_DIR);
 		return api_error(p, req, res, API_RT_EMPTYBRD);
 	}
 
 	const char * num_str = onion_request_get_query(req, "num");
 	int num = (num_str == NULL) ? -1 : (atoi(num_str)-1);
 	fh = findbarticle(&mf, aid, &num, 1);
+	api_phase_end(API_PHASE_DIR);
 	if(fh == NULL) {
 		mmapfile(NULL, &mf);
-		free(ue);
 		return api_error(p, req, res, API_RT_NOSUCHATCL);
 	}
 
 	if(fh->owner[0] == '-') {
 		mmapfile(NULL, &mf);
-		free(ue);
 		return api_error(p, req, res, API_RT_ATCLDELETED);
 	}
 
@@ -778,47 +849,94 @@ static int api_article_get_content(ONION_FUNC_PROTO_STR, int mode)
 	memset(title_utf8, 0, 180);
 	g2u(fh->title, strlen(fh->title), title_utf8, 180);
 
-	struct attach_link *attach_link_list=NULL;
-	char * article_content_utf8 = parse_article(bmem->header.filename,
-			filename, mode, &attach_link_list);
+	// 正文和附件部分与用户无关，以预压缩片段的形式缓存，文章被修改后自动失效
+	struct stat st;
+	char article_path[STRLEN], cache_key[80];
+	const struct api_gzseg *seg = NULL;
+	snprintf(article_path, sizeof(article_path), "boards/%s/%s", bmem->header.filename, filename);
+	snprintf(cache_key, sizeof(cache_key), "article/content/%s/%s/%d", bmem->header.filename, filename, mode);
+	int cacheable = (stat(article_path, &st) == 0);
+
+	// 文章写入后基本不再变化，允许客户端长期缓存，过期后以 ETag 校验
+	struct api_etag etag;
+	api_etag_init(&etag);
+	if(cacheable)
+		api_etag_add_stat(&etag, &st);
+	api_etag_add_str(&etag, cache_key);
+	api_etag_add_str(&etag, fh->title);
+	api_etag_add_str(&etag, fh->owner);
+	api_etag_add_int(&etag, fh->accessed);
+	api_etag_add_int(&etag, fh->thread);
+	api_etag_add_int(&etag, num);
+	api_etag_add_str(&etag, ue ? ue->userid : "guest");	// can_edit 与用户相关
+	onion_response_set_header(res, "Cache-Control", API_CONTENT_CACHE_CONTROL);
+	if(cacheable && api_etag_respond(req, res, &etag)) {
+		mmapfile(NULL, &mf);
+		return OCS_PROCESSED;
+	}
 
-	char * article_json_str = (char *)malloc(strlen(article_content_utf8) + 512);
-	memset(article_json_str, 0, strlen(article_content_utf8) + 512);
-	int curr_permission = !strncmp(ui->userid, fh->owner, IDLEN+1);
-	sprintf(article_json_str, "{\"errcode\":0, \"attach\":[], "
-			"\"can_edit\":%d, \"can_delete\":%d, \"can_reply\":%d, "
-			"\"board\":\"%s\", \"author\":\"%s\", \"thread\":%d, \"num\":%d}",
-			curr_permission, curr_permission,
-			!(fh->accessed & FH_NOREPLY), bmem->header.filename,
-			fh2owner(fh), fh->thread, num);
+	if(cacheable)
+		seg = api_cache_get(cache_key, &st);
 
-	struct json_object * jp = json_tokener_parse(article_json_str);
-	json_object_object_add(jp, "content", json_object_new_string(article_content_utf8));
-	json_object_object_add(jp, "title", json_object_new_string(title_utf8));
-	if(attach_link_list) {
-		struct json_object * attach_array = json_object_object_get(jp, "attach");
-		char at_buf[320];
-		struct attach_link * alp = attach_link_list;
-		while(alp) {
-			memset(at_buf, 0, 320);
-			sprintf(at_buf, "{\"link\":\"%s\", \"size\":%d}", alp->link, alp->size);
-			json_object_array_add(attach_array, json_tokener_parse(at_buf));
-			alp=alp->next;
+	const char *fragment = NULL;
+	if(!seg) {
+		struct attach_link *attach_link_list=NULL;
+		char * article_content_utf8 = parse_article(bmem->header.filename,
+				filename, mode, &attach_link_list);
+		if(!article_content_utf8) {
+			mmapfile(NULL, &mf);
+			return api_error(p, req, res, API_RT_NOSUCHATCL);
+		}
+
+		// 只生成成员部分，前后由 prefix 与 "}" 补全
+		struct api_arena_buf frag;
+		struct attach_link * alp;
+		api_arena_buf_init(&frag, strlen(article_content_utf8) + 256);
+		api_arena_buf_puts(&frag, "\"content\":");
+		api_arena_buf_json_str(&frag, article_content_utf8);
+		api_arena_buf_puts(&frag, ", \"attach\":[");
+		for(alp = attach_link_list; alp; alp = alp->next) {
+			api_arena_buf_puts(&frag, (alp == attach_link_list) ? "{\"link\":" : ", {\"link\":");
+			api_arena_buf_json_str(&frag, alp->link);
+			api_arena_buf_printf(&frag, ", \"size\":%d}", alp->size);
 		}
+		api_arena_buf_puts(&frag, "]");
+		fragment = frag.s;
+
+		free_attach_link_list(attach_link_list);
+
+		if(fragment && cacheable)
+			seg = api_cache_put(cache_key, &st, 0, fragment, frag.len);
 	}
 
-	char * api_output = strdup(json_object_to_json_string(jp));
+	int curr_permission = ui && !strncmp(ui->userid, fh->owner, IDLEN+1);
+	struct api_arena_buf out;
+	api_arena_buf_init(&out, 512);
+	api_arena_buf_printf(&out, "{\"errcode\":0, "
+			"\"can_edit\":%d, \"can_delete\":%d, \"can_reply\":%d, "
+			"\"board\":\"%s\", \"author\":\"%s\", \"thread\":%d, \"num\":%d, "
+			"\"title\":",
+			curr_permission, curr_permission,
+			!(fh->accessed & FH_NOREPLY), bmem->header.filename,
+			fh2owner(fh), fh->thread, num);
+	api_arena_buf_json_str(&out, title_utf8);
+	api_arena_buf_puts(&out, ", ");
 
-	free(ue);
 	mmapfile(NULL, &mf);
-	free(article_content_utf8);
-	free(article_json_str);
-	json_object_put(jp);
-	free_attach_link_list(attach_link_list);
 
-	api_set_json_header(res);
-	onion_response_write0(res, api_output);
-	free(api_output);
+	if(seg) {
+		if(out.s)
+			api_write_json_parts(req, res, out.s, seg, "}");
+		api_cache_release(seg);
+	} else {
+		api_arena_buf_puts(&out, fragment ? fragment : "\"content\":\"\", \"attach\":[]");
+		api_arena_buf_puts(&out, "}");
+		if(out.s)
+			api_write_json(req, res, out.s);
+	}
+
+	if(!out.s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 	return OCS_PROCESSED;
 }
 
@@ -857,12 +975,11 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 	if(title[0]==0)
 		return api_error(p, req, res, API_RT_ATCLNOTITLE);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue==NULL)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	if(check_user_session(ue, sessid, appkey) != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, API_RT_WRONGSESS);
 	}
 
@@ -870,7 +987,6 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 
 	struct boardmem * bmem = getboardbyname(board);
 	if(bmem==NULL) {
-		free(ue);
 		return api_error(p, req, res, API_RT_NOSUCHBRD);
 	}
 
@@ -885,7 +1001,6 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 
 		struct mmapfile mf = { ptr:NULL };
 		if(mmapfile(dir, &mf) == -1) {
-			free(ue);
 			return api_error(p, req, res, API_RT_CNTMAPBRDIR);
 		}
 
@@ -893,7 +1008,6 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 
 		if(x->accessed & FH_NOREPLY) {
 			mmapfile(NULL, &mf);
-			free(ue);
 			return api_error(p, req, res, API_RT_ATCLFBDREPLY);
 		}
 
@@ -921,17 +1035,14 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 	struct user_info *ui = &(shm_utmp->uinfo[uent_index]);
 
 	if(!check_user_post_perm_x(ui, bmem)) {
-		free(ue);
 		return api_error(p, req, res, API_RT_NOBRDPPERM);
 	}
 
 	if(strcmp(ui->token, token) !=0 ) {
-		free(ue);
 		return api_error(p, req, res, API_RT_WRONGTOKEN);
 	}
 
 	if(!strcasecmp(ue->userid, "guest") && seek_in_file(MY_BBS_HOME "/etc/guestbanip", fromhost)) {
-		free(ue);
 		return api_error(p, req, res, API_RT_FBDGSTPIP);
 	}
 
@@ -939,15 +1050,9 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 	if(data==NULL)
 		data = " ";
 
-	char filename[80];
-	sprintf(filename, "bbstmpfs/tmp/%s_%s.tmp", ue->userid, appkey); // line:141
-
-	char *data2 = strdup(data);
-	while(strstr(data2, "[ESC]")!=NULL)
-		data2 = string_replace(data2, "[ESC]", "\033");
-
-	f_write(filename, data2);
-	free(data2);
+	char *data2 = api_arena_replace_all(data, "[ESC]", "\033");
+	if(!data2)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 
 	int is_anony = (onion_request_get_query(req, "anony")==NULL) ? 0 : 1;
 	int is_norep = (onion_request_get_query(req, "norep")==NULL) ? 0 : 1;
@@ -961,9 +1066,9 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 
 	int is_1984 = (bmem->header.flag & IS1984_FLAG) ? 1 : 0;
 
-	char * title_gbk = (char *)malloc(strlen(title)*2);
-	memset(title_gbk, 0, strlen(title)*2);
-	u2g(title, strlen(title), title_gbk, strlen(title)*2);
+	char * title_gbk = api_arena_u2g(title, strlen(title));
+	if(!title_gbk)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 	int i;
 	for(i=0;i<strlen(title_gbk);++i) {
 		if(title_gbk[i]<=27 && title_gbk[i]>=-1)
@@ -980,29 +1085,24 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 	//if(insertattachments(filename, data_gbk, ue->userid))
 		//mark = mark | FH_ATTACHED;
 
-	int r;
+	int r, num = 0;
 	if(is_anony) {
-		r = do_article_post(bmem->header.filename, title, filename, "Anonymous",
+		r = do_article_post(bmem->header.filename, title, data2, "Anonymous",
 				"我是匿名天使", "匿名天使的家", 0, mark,
-				0, ui->userid, thread);
+				0, ui->userid, thread, &num);
 	} else {
-		r = do_article_post(bmem->header.filename, title, filename, ui->userid,
+		r = do_article_post(bmem->header.filename, title, data2, ui->userid,
 				ui->username, fromhost, 0, mark,
-				0, ui->userid, thread);
+				0, ui->userid, thread, &num);
 	}
 
 	if(r<=0) {
-		free(ue);
-		free(title_gbk);
-		unlink(filename);
-		api_error(p, req, res, API_RT_ATCLINNERR);
+		return api_error(p, req, res, API_RT_ATCLINNERR);
 	}
 
 	// TODO: 更新未读标记
 	//brc_initial
 
-	unlink(filename);
-
 	char buf[256];
 	sprintf(buf, "%s post %s %s", ui->userid, bmem->header.filename, title_gbk);
 	newtrace(buf);
@@ -1018,94 +1118,87 @@ static int api_article_do_post(ONION_FUNC_PROTO_STR, int mode)
 				bmem->header.filename, r, title_gbk);
 	}
 
-	free(ue);
-	free(title_gbk);
 	getrandomstr_r(ui->token, TOKENLENGTH+1);
 	memset(ui->from, 0, 20);
 	strncpy(ui->from, fromhost, 20);
 	api_set_json_header(res);
-	onion_response_printf(res, "{ \"errcode\":0, \"aid\":%d, \"token\":\"%s\" }",
-			r, ui->token);
+	onion_response_printf(res, "{ \"errcode\":0, \"aid\":%d, \"num\":%d, \"token\":\"%s\" }",
+			r, num, ui->token);
 
 	return OCS_NOT_IMPLEMENTED;
 }
 
-static char* bmy_article_array_to_json_string(struct bmy_article *ba_list, int count, int mode)
+char* bmy_article_array_to_json_string(struct bmy_article *ba_list, int count, int mode)
 {
-	char buf[512];
 	int i;
 	struct boardmem *b;
 	struct bmy_article *p;
-	struct json_object *jp;
-	struct json_object *obj = json_tokener_parse("{\"errcode\":0, \"articlelist\":[]}");
-	struct json_object *json_array = json_object_object_get(obj, "articlelist");
+	struct api_arena_buf buf;
+	api_phase_begin(API_PHASE_JSON);
 
+	api_arena_buf_init(&buf, 64 + count * 256);
+	api_arena_buf_puts(&buf, "{\"errcode\":0, \"articlelist\":[");
 	for(i=0; i<count; ++i) {
 		p = &(ba_list[i]);
-		memset(buf, 0, 512);
-		if(mode==0) {
-			sprintf(buf, "{ \"type\":%d, \"aid\":%d, \"tid\":%d, "
-				"\"th_num\":%d, \"mark\":%d }",
-				p->type, p->filetime, p->thread, p->th_num, p->mark);
-		} else {
+		api_arena_buf_printf(&buf, "%s{\"type\":%d, \"aid\":%d, \"tid\":%d, \"th_num\":%d, \"mark\":%d, ",
+				(i == 0) ? "" : ", ", p->type, (int)p->filetime, (int)p->thread, p->th_num, p->mark);
+		if(mode != 0) {
 			b = getboardbyname(p->board);
-			sprintf(buf, "{ \"type\":%d, \"aid\":%d, \"tid\":%d, "
-				"\"th_num\":%d, \"mark\":%d, \"secstr\":\"%s\" }",
-				p->type, p->filetime, p->thread, p->th_num, p->mark, b->header.sec1);
-		}
-		jp = json_tokener_parse(buf);
-		if(jp) {
-			json_object_object_add(jp, "board", json_object_new_string(p->board));
-			json_object_object_add(jp, "title", json_object_new_string(p->title));
-			json_object_object_add(jp, "author", json_object_new_string(p->author));
-			json_object_array_add(json_array, jp);
+			api_arena_buf_puts(&buf, "\"secstr\":");
+			api_arena_buf_json_str(&buf, b ? b->header.sec1 : "");
+			api_arena_buf_puts(&buf, ", ");
 		}
+		api_arena_buf_puts(&buf, "\"board\":");
+		api_arena_buf_json_str(&buf, p->board);
+		api_arena_buf_puts(&buf, ", \"title\":");
+		api_arena_buf_json_str(&buf, p->title);
+		api_arena_buf_puts(&buf, ", \"author\":");
+		api_arena_buf_json_str(&buf, p->author);
+		api_arena_buf_puts(&buf, "}");
 	}
+	api_arena_buf_puts(&buf, "]}");
 
-	char *r = strdup(json_object_to_json_string(obj));
-	json_object_put(obj);
-
-	return r;
+	api_phase_end(API_PHASE_JSON);
+	return buf.s;
 }
-static char* bmy_article_with_num_array_to_json_string(struct bmy_article *ba_list, int count, int mode)
+
+char* bmy_article_with_num_array_to_json_string(struct bmy_article *ba_list, int count, int mode)
 {
-	char buf[512];
 	int i, j;
 	struct bmy_article *p;
-	struct json_object *jp;
-	struct json_object *obj = json_tokener_parse("{\"errcode\":0, \"articlelist\":[]}");
-	struct json_object *json_array = json_object_object_get(obj, "articlelist");
+	struct api_arena_buf buf;
+	api_phase_begin(API_PHASE_JSON);
 
+	api_arena_buf_init(&buf, 64 + count * 320);
+	api_arena_buf_puts(&buf, "{\"errcode\":0, \"articlelist\":[");
 	for(i=0; i<count; ++i) {
 		p = &(ba_list[i]);
-		memset(buf, 0, 512);
-		sprintf(buf, "{ \"type\":%d, \"aid\":%d, \"tid\":%d, "
-				"\"th_num\":%d, \"mark\":%d ,\"num\":%d, \"th_size\":%d, \"th_commenter\":[] }",
-				p->type, p->filetime, p->thread, p->th_num, p->mark, p->sequence_num, p->th_size);
-		jp = json_tokener_parse(buf);
-		if(jp) {
-			json_object_object_add(jp, "board", json_object_new_string(p->board));
-			json_object_object_add(jp, "title", json_object_new_string(p->title));
-			json_object_object_add(jp, "author", json_object_new_string(p->author));
-
-			if(mode == 1) {
-				// 主题模式下输出评论者
-				struct json_object *json_array_commenter = json_object_object_get(jp, "th_commenter");
-				for(j = 0; j < p->th_commenter_count; ++j) {
-					if(p->th_commenter[j][0] == 0)
-						break;
-					json_object_array_add(json_array_commenter, json_object_new_string(p->th_commenter[j]));
-				}
+		api_arena_buf_printf(&buf, "%s{\"type\":%d, \"aid\":%d, \"tid\":%d, \"th_num\":%d, \"mark\":%d, "
+				"\"num\":%d, \"th_size\":%d, \"th_commenter\":[",
+				(i == 0) ? "" : ", ", p->type, (int)p->filetime, (int)p->thread, p->th_num, p->mark,
+				p->sequence_num, p->th_size);
+		if(mode == 1) {
+			// 主题模式下输出评论者
+			for(j = 0; j < p->th_commenter_count; ++j) {
+				if(p->th_commenter[j][0] == 0)
+					break;
+				if(j > 0)
+					api_arena_buf_puts(&buf, ", ");
+				api_arena_buf_json_str(&buf, p->th_commenter[j]);
 			}
-
-			json_object_array_add(json_array, jp);
 		}
+		api_arena_buf_puts(&buf, "], \"board\":");
+		api_arena_buf_json_str(&buf, p->board);
+		api_arena_buf_puts(&buf, ", \"title\":");
+		api_arena_buf_json_str(&buf, p->title);
+		api_arena_buf_puts(&buf, ", \"author\":");
+		api_arena_buf_json_str(&buf, p->author);
+		api_arena_buf_puts(&buf, "}");
 	}
+	api_arena_buf_puts(&buf, "]}");
 
-	char *r = strdup(json_object_to_json_string(obj));
-	json_object_put(obj);
-
-	return r;
+	api_phase_end(API_PHASE_JSON);
+	return buf.s;
 }
 
 static int get_thread_by_filetime(char *board, int filetime)
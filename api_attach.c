@@ -2,15 +2,41 @@
 
 static int api_attach_show_mail(ONION_FUNC_PROTO_STR);
 
-static void output_binary_attach(onion_response *res, const char *filename, const char *attachname, int attachpos);
+static int api_attach_show_board(ONION_FUNC_PROTO_STR);
+
+/**
+ * @brief 输出信件或文章中的二进制附件
+ * 附件直接由所在的文件输出（参见 api_onion_sendfile()），支持 Range 断点续传，
+ * 以及基于 ETag/Last-Modified 的 304 响应。
+ * @param filename 附件所在的信件或文章文件
+ * @param attachname 附件名，用于判断 MIME 类型
+ * @param attachpos 附件长度字段在文件中的偏移，参见 parse_article
+ * @return
+ */
+static int output_binary_attach(ONION_FUNC_PROTO_STR, const char *filename, const char *attachname, int attachpos);
+
+/**
+ * @brief 解析单个区间的 Range 请求头
+ * @param range Range 请求头
+ * @param size 附件大小
+ * @param start 传出参数，起始偏移
+ * @param length 传出参数，区间长度
+ * @return 合法区间返回 1，无法满足返回 -1，不支持的格式返回 0（按完整内容输出）
+ */
+static int parse_range(const char *range, unsigned int size, unsigned int *start, unsigned int *length);
 
 static char * get_mime_type(const char *name);
 
 int api_attach_show(ONION_FUNC_PROTO_STR)
 {
 	const char *type = onion_request_get_query(req, "type");
+	if(!type)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
 	if(!strcasecmp(type, "mail"))
 		return api_attach_show_mail(p, req, res);
+	else if(!strcasecmp(type, "board"))
+		return api_attach_show_board(p, req, res);
 	else
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 }
@@ -24,20 +50,18 @@ int api_attach_list(ONION_FUNC_PROTO_STR)
 	if(!userid || !sessid || !appkey)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
 	char userattachpath[256];
 	snprintf(userattachpath, sizeof(userattachpath), PATHUSERATTACH "/%s", ue->userid);
 	mkdir(userattachpath, 0760);
-	free(ue);
 
 	DIR *pdir;
 	struct dirent *pdent;
@@ -67,8 +91,7 @@ int api_attach_list(ONION_FUNC_PROTO_STR)
 	}
 
 	closedir(pdir);
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(obj));
+	api_write_json(req, res, json_object_to_json_string(obj));
 	json_object_put(obj);
 
 	return OCS_PROCESSED;
@@ -82,77 +105,157 @@ int api_attach_upload(ONION_FUNC_PROTO_STR)
 	const char * userid = onion_request_get_query(req, "userid");
 	const char * sessid = onion_request_get_query(req, "sessid");
 	const char * appkey = onion_request_get_query(req, "appkey");
+	const char * length_str = onion_request_get_header(req, "Content-Length");
+
+	if(!userid || !sessid || !appkey || !length_str)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	// 先检查请求大小，超过上限的请求在 onion 解析阶段已被拒绝（参见 main.c）
+	int upload_size = atoi(length_str);
+	if (upload_size <= 0 || upload_size > API_ATTACH_UPLOAD_MAX)
+		return api_error(p, req, res, API_RT_ATTTOOBIG);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
-	char userattachpath[256], finalname[1024];
-	snprintf(userattachpath, sizeof(userattachpath), PATHUSERATTACH "/%s", ue->userid);
-	mkdir(userattachpath, 0760);
-	free(ue);
+	// 配额取自账本，不再遍历附件目录
+	long long current_size = api_ledger_get(&attach_size_ledger, ue->userid);
+	if(current_size > MAXATTACHSIZE || current_size + upload_size > MAXATTACHSIZE) {
+		return api_error(p, req, res, API_RT_ATTNOSPACE);
+	}
 
 	const char * name=onion_request_get_post(req,"file");
 	const char * filename=onion_request_get_file(req,"file");
-	const char * length_str = onion_request_get_header(req, "Content-Length");
 
-	if(!name || !filename || !length_str)
+	if(!name || !filename || !name[0] || strchr(name, '/') || name[0] == '.') {
 		return api_error(p, req, res, API_RT_WRONGPARAM);
+	}
+
+	char userattachpath[256], finalname[1024];
+	snprintf(userattachpath, sizeof(userattachpath), PATHUSERATTACH "/%s", ue->userid);
 
-	if(strlen(userattachpath) + strlen(name) > 1022)	// 1024 - '\0' - '/'
+	if(strlen(userattachpath) + strlen(name) > 1022) {	// 1024 - '\0' - '/'
 		return api_error(p, req, res, API_RT_WRONGPARAM);
+	}
 
-	sprintf(filename, "%s/%s", userattachpath, name);
-	char * ext_name = name + strlen(name);
-	int upload_size = atoi(length_str);
-	if (upload_size <= 0 || upload_size > 5000000)
-		return api_error(p, req, res, API_RT_ATTTOOBIG);
-	if (!strcasecmp(ext_name - 4, ".gif") || !strcasecmp(ext_name - 4, ".jpg") ||
-		!strcasecmp(ext_name - 4, ".bmp") || !strcasecmp(ext_name - 4, ".png") ||
-		!strcasecmp(ext_name - 4, ".jpeg")) {
+	const char * ext_name = strrchr(name, '.');
+	if (ext_name && (!strcasecmp(ext_name, ".gif") || !strcasecmp(ext_name, ".jpg") ||
+		!strcasecmp(ext_name, ".bmp") || !strcasecmp(ext_name, ".png") ||
+		!strcasecmp(ext_name, ".jpeg"))) {
 		if (upload_size > MAXPICSIZE) {
 			return api_error(p, req, res, API_RT_ATTTOOBIG);
 		}
 	}
 
-	int current_size = 0;
+	// 以实际文件大小为准，Content-Length 中还包含了 multipart 的边界
+	int file_size = file_size_s(filename);
+
+	mkdir(userattachpath, 0760);
+	sprintf(finalname, "%s/%s", userattachpath, name);
+	int old_size = file_size_s(finalname);	// 同名文件将被覆盖
+
+	// 检查与预留在账本的锁内完成，并发的上传不会共同超出配额
+	long long delta = file_size - old_size;
+	if(api_ledger_reserve(&attach_size_ledger, ue->userid, delta, MAXATTACHSIZE) < 0) {
+		return api_error(p, req, res, API_RT_ATTNOSPACE);
+	}
+
+	if(onion_shortcut_rename(filename, finalname) != 0) {
+		api_ledger_add(&attach_size_ledger, ue->userid, -delta, 0);
+		return api_error(p, req, res, API_RT_ATTITNERR);
+	}
+
+	return api_error(p, req, res, API_RT_SUCCESSFUL);
+}
+
+int api_attach_delete(ONION_FUNC_PROTO_STR)
+{
+	const char * userid = onion_request_get_query(req, "userid");
+	const char * sessid = onion_request_get_query(req, "sessid");
+	const char * appkey = onion_request_get_query(req, "appkey");
+	const char * name = onion_request_get_query(req, "file");
+
+	if(!userid || !sessid || !appkey || !name)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	if(!name[0] || strchr(name, '/') || name[0] == '.')
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	struct userec *ue = api_getuser(userid);
+	if(ue == 0)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	int r = check_user_session(ue, sessid, appkey);
+	if(r != API_RT_SUCCESSFUL) {
+		return api_error(p, req, res, r);
+	}
+
+	char fname[1024];
+	if(snprintf(fname, sizeof(fname), PATHUSERATTACH "/%s/%s", ue->userid, name) >= sizeof(fname)) {
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+	}
+
+	int size = file_size_s(fname);
+	if(unlink(fname) < 0) {
+		return api_error(p, req, res, API_RT_NOSUCHFILE);
+	}
+
+	api_ledger_add(&attach_size_ledger, ue->userid, -size, 0);
+
+	return api_error(p, req, res, API_RT_SUCCESSFUL);
+}
+
+static void attach_size_ledger_stamp_path(char *path, const char *userid)
+{
+	// 附件目录的修改时间随文件增删变化，其他程序删除附件时账本会被重新核对
+	snprintf(path, STRLEN, PATHUSERATTACH "/%s", userid);
+}
+
+static long long attach_size_ledger_scan(const char *userid)
+{
 	DIR *pdir;
 	struct dirent *pdent;
-	char fname[1024];
+	char userattachpath[256], fname[1024];
+	long long size = 0;
 
+	snprintf(userattachpath, sizeof(userattachpath), PATHUSERATTACH "/%s", userid);
 	pdir = opendir(userattachpath);
 	if(!pdir)
-		return api_error(p, req, res, API_RT_NOSUCHFILE);
+		return 0;
 
 	while((pdent = readdir(pdir))) {
 		if(!strcmp(pdent->d_name, "..") || !strcmp(pdent->d_name, "."))
 			continue;
 
-		if(strlen(pdent->d_name) + strlen(userattachpath) >= sizeof(fname) - 2) {
-			closedir(pdir);
-			return api_error(p, req, res, API_RT_ATTITNERR);
-		}
+		if(strlen(pdent->d_name) + strlen(userattachpath) >= sizeof(fname) - 2)
+			continue;
 
 		sprintf(fname, "%s/%s", userattachpath, pdent->d_name);
-		current_size += file_size_s(fname);
+		size += file_size_s(fname);
 	}
 
 	closedir(pdir);
-
-	if(current_size > MAXATTACHSIZE || current_size + upload_size > MAXATTACHSIZE)
-		return api_error(p, req, res, API_RT_ATTNOSPACE);
-
-	onion_shortcut_rename(filename, finalname);
-
-	return api_error(p, req, res, API_RT_SUCCESSFUL);
+	return size;
 }
 
+/**
+ * 目录没有定长的记录，record_size 取 0，增删文件后戳记不顺延：目录的修改时间
+ * 变化后，api_ledger_reserve() 检查配额前重新统计，其他进程增删的附件同样计入。
+ */
+const struct api_ledger_kind attach_size_ledger = {
+	.filename = ".attachsize",
+	.scan = attach_size_ledger_scan,
+	.stamp_path = attach_size_ledger_stamp_path,
+	.record_size = 0,
+	.max_age = 86400,
+};
+
 static int api_attach_show_mail(ONION_FUNC_PROTO_STR)
 {
 	const char * userid = onion_request_get_query(req, "userid");
@@ -165,66 +268,218 @@ static int api_attach_show_mail(ONION_FUNC_PROTO_STR)
 	if(!userid || !sessid || !appkey || !str_mid || !str_pos || !attname)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
 	char mailfilename[STRLEN];
-	sprintf(mailfilename, MY_BBS_HOME "/mail/%c/%s/M.%s.A", mytoupper(ue->userid[0]), ue->userid, str_mid);
-
-
-	output_binary_attach(res, mailfilename, attname, atoi(str_pos));
+	sprintf(mailfilename, MY_BBS_HOME "/mail/%c/%s/M.%d.A", mytoupper(ue->userid[0]), ue->userid, atoi(str_mid));
 
-	free(ue);
-	return OCS_PROCESSED;
+	return output_binary_attach(p, req, res, mailfilename, attname, atoi(str_pos));
 }
 
-static void output_binary_attach(onion_response *res, const char *filename, const char *attachname, int attachpos)
+static int api_attach_show_board(ONION_FUNC_PROTO_STR)
 {
-	struct mmapfile mf = {ptr:NULL};
+	const char * bname = onion_request_get_query(req, "board");
+	const char * str_aid = onion_request_get_query(req, "aid");
+	const char * str_pos = onion_request_get_query(req, "pos");
+	const char * attname = onion_request_get_query(req, "attname");
 
-	if(mmapfile(filename, &mf) < 0) {
-		api_error(NULL, NULL, res, API_RT_MAILATTERR);
-		return ;
-	}
+	if(!bname || !str_aid || !str_pos || !attname)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	struct boardmem *bmem = getboardbyname(bname);
+	if(!bmem)
+		return api_error(p, req, res, API_RT_NOSUCHBRD);
 
-	if(attachpos >= mf.size-4 || attachpos < 1) {
-		mmapfile(NULL, &mf);
-		api_error(NULL, NULL, res, API_RT_MAILATTERR);
-		return ;
+	// 与阅读文章一致，session 不合法时按 guest 处理
+	const char * userid = onion_request_get_query(req, "userid");
+	const char * sessid = onion_request_get_query(req, "sessid");
+	const char * appkey = onion_request_get_query(req, "appkey");
+	struct user_info *ui = NULL;
+	if(userid && sessid && appkey) {
+		struct userec *ue = api_getuser(userid);
+		if(ue && check_user_session(ue, sessid, appkey) == API_RT_SUCCESSFUL)
+			ui = &(shm_utmp->uinfo[get_user_utmp_index(sessid)]);
 	}
 
-	if(mf.ptr[attachpos-1] != 0) {
-		mmapfile(NULL, &mf);
-		api_error(NULL, NULL, res, API_RT_MAILATTERR);
-		return ;
+	if(!check_user_read_perm_x(ui, bmem))
+		return api_error(p, req, res, API_RT_NOBRDRPERM);
+
+	char filename[STRLEN];
+	sprintf(filename, MY_BBS_HOME "/boards/%s/M.%d.A", bmem->header.filename, atoi(str_aid));
+
+	return output_binary_attach(p, req, res, filename, attname, atoi(str_pos));
+}
+
+static int output_binary_attach(ONION_FUNC_PROTO_STR, const char *filename, const char *attachname, int attachpos)
+{
+	struct stat st;
+	unsigned char head[5];
+	unsigned int size, start, length;
+	int fd;
+
+	fd = open(filename, O_RDONLY);
+	if(fd < 0)
+		return api_error(p, req, res, API_RT_MAILATTERR);
+
+	if(fstat(fd, &st) < 0 || attachpos < 1 || attachpos + 4 > st.st_size) {
+		close(fd);
+		return api_error(p, req, res, API_RT_MAILATTERR);
 	}
 
 	/* attachpos 的说明
 	 * 例如原文件为：
 	 * beginbinaryattach test.txt\n\0\0\0\0\024....
 	 * 省略号为 test.txt 的正文
-	 * 此处 attachpos 指向的位置为 \n
+	 * 此处 attachpos 指向附件长度字段，其前一个字节为 \0
 	 */
-	unsigned int size = ntohl(*(unsigned int *)(mf.ptr + attachpos));
-	char * body = (char *)malloc(size);
+	if(pread(fd, head, 5, attachpos - 1) != 5 || head[0] != 0) {
+		close(fd);
+		return api_error(p, req, res, API_RT_MAILATTERR);
+	}
+
+	size = ntohl(*(unsigned int *)(head + 1));
+	if((off_t)attachpos + 4 + size > st.st_size) {
+		close(fd);
+		return api_error(p, req, res, API_RT_MAILATTERR);
+	}
+
+	// 信件和文章写入后不再修改，inode、修改时间和偏移足以作为强校验的 ETag
+	char etag[64], last_modified[64];
+	struct tm tm;
+	snprintf(etag, sizeof(etag), "\"%lx-%lx-%x-%x\"",
+			(unsigned long)st.st_ino, (unsigned long)st.st_mtime, attachpos, size);
+	gmtime_r(&st.st_mtime, &tm);
+	strftime(last_modified, sizeof(last_modified), "%a, %d %b %Y %H:%M:%S GMT", &tm);
+
+	onion_response_set_header(res, "ETag", etag);
+	onion_response_set_header(res, "Last-Modified", last_modified);
+	onion_response_set_header(res, "Cache-Control", "private, max-age=2592000");
+	onion_response_set_header(res, "Accept-Ranges", "bytes");
+	onion_response_set_header(res, "access-control-allow-origin", "*");
+
+	const char * if_none_match = onion_request_get_header(req, "If-None-Match");
+	const char * if_modified_since = onion_request_get_header(req, "If-Modified-Since");
+	int not_modified = 0;
+	if(if_none_match) {
+		not_modified = (strstr(if_none_match, etag) != NULL || !strcmp(if_none_match, "*"));
+	} else if(if_modified_since) {
+		memset(&tm, 0, sizeof(tm));
+		if(strptime(if_modified_since, "%a, %d %b %Y %H:%M:%S GMT", &tm) != NULL)
+			not_modified = (st.st_mtime <= timegm(&tm));
+	}
+
+	if(not_modified) {
+		close(fd);
+		onion_response_set_code(res, HTTP_NOT_MODIFIED);
+		onion_response_set_length(res, 0);
+		onion_response_write_headers(res);
+		return OCS_PROCESSED;
+	}
 
-	if(body==NULL) {
-		mmapfile(NULL, &mf);
-		api_error(NULL, NULL, res, API_RT_NOTENGMEM);
-		return ;
+	start = 0;
+	length = size;
+	const char * range = onion_request_get_header(req, "Range");
+	const char * if_range = onion_request_get_header(req, "If-Range");
+	if(range && (!if_range || !strcmp(if_range, etag))) {
+		int r = parse_range(range, size, &start, &length);
+		if(r < 0) {
+			char content_range[64];
+			close(fd);
+			snprintf(content_range, sizeof(content_range), "bytes */%u", size);
+			onion_response_set_header(res, "Content-Range", content_range);
+			onion_response_set_code(res, HTTP_RANGE_NOT_SATISFIABLE);
+			onion_response_set_length(res, 0);
+			onion_response_write_headers(res);
+			return OCS_PROCESSED;
+		} else if(r > 0) {
+			char content_range[64];
+			snprintf(content_range, sizeof(content_range), "bytes %u-%u/%u",
+					start, start + length - 1, size);
+			onion_response_set_header(res, "Content-Range", content_range);
+			onion_response_set_code(res, HTTP_PARTIAL_CONTENT);
+		}
+	}
+
+	onion_response_set_header(res, "Content-Type", get_mime_type(attachname));
+	onion_response_set_length(res, length);
+
+	// HEAD 请求时 onion 返回 OR_SKIP_CONTENT，只输出响应头
+	if(onion_response_write_headers(res) == OR_SKIP_CONTENT || length == 0) {
+		close(fd);
+		return OCS_PROCESSED;
+	}
+
+	off_t offset = attachpos + 4 + start;
+	int sent = api_onion_sendfile(req, res, fd, offset, length);
+	if(sent < 0) {
+		close(fd);
+		return OCS_CLOSE_CONNECTION;
+	} else if(sent == 0) {
+		// 无法直接写入连接时经由 onion 写出，映射所需的区间即可
+		long pagesize = sysconf(_SC_PAGESIZE);
+		off_t map_start = offset - offset % pagesize;
+		size_t map_len = length + (offset - map_start);
+		char *ptr = mmap(NULL, map_len, PROT_READ, MAP_SHARED, fd, map_start);
+		if(ptr == MAP_FAILED) {
+			close(fd);
+			return OCS_INTERNAL_ERROR;
+		}
+		onion_response_write(res, ptr + (offset - map_start), length);
+		munmap(ptr, map_len);
 	}
 
-	onion_response_set_header(res, "Content-Type", get_mime_type(filename));
-	onion_response_write(res, mf.ptr+attachpos+4, size);
+	close(fd);
+	return OCS_PROCESSED;
+}
+
+static int parse_range(const char *range, unsigned int size, unsigned int *start, unsigned int *length)
+{
+	unsigned long long a, b;
+	char *end;
+
+	if(strncasecmp(range, "bytes=", 6) != 0 || strchr(range, ',') != NULL)
+		return 0;	// 多区间不支持，输出完整内容
+	range += 6;
+
+	if(*range == '-') {
+		// 末尾 n 个字节
+		b = strtoull(range + 1, &end, 10);
+		if(end == range + 1 || b == 0)
+			return -1;
+		if(b > size)
+			b = size;
+		if(b == 0)
+			return -1;	// 空附件没有可以满足的区间
+		*start = size - b;
+		*length = b;
+		return 1;
+	}
+
+	a = strtoull(range, &end, 10);
+	if(end == range || *end != '-' || a >= size)
+		return -1;
+
+	range = end + 1;
+	if(*range == 0) {
+		b = size - 1;
+	} else {
+		b = strtoull(range, &end, 10);
+		if(end == range || b < a)
+			return -1;
+		if(b >= size)
+			b = size - 1;
+	}
 
-	mmapfile(NULL, &mf);
+	*start = a;
+	*length = b - a + 1;
+	return 1;
 }
 
 static char * get_mime_type(const char *name)
@@ -0,0 +1,290 @@
+/**
+ * @file	api_batch.c
+ * @brief	批量请求接口，在一次 HTTP 请求中调用多个只读接口。
+ * @details	请求体（或 requests 参数）为 JSON 数组，例如：
+ * 			[{"path":"user/query"}, {"path":"mail/list","query":{"count":"10"}}]
+ *
+ * 			userid、sessid、appkey 只需在 batch 请求中给出一次，校验通过后注入到
+ * 			每个子请求中，并通过 api_session_set_verified() 告知处理函数，子请求中
+ * 			不再重复 getuser() 与 check_user_session()。子请求直接调用原有的处理函数，
+ * 			输出由 api_onion.c 中的内部 listen point 截获，按顺序拼接为
+ * 			{"errcode":0, "results":[{"path":..., "status":..., "body":...}]}。
+ * 			parallel=1 时子请求在独立的线程中并行执行。
+ */
+
+#include <pthread.h>
+#include "api.h"
+
+#define API_BATCH_MAX	16		///< 单次批量请求允许的子请求个数
+
+struct api_batch_job {
+	const struct api_route *route;
+	struct json_object *query;		///< 子请求参数，可以为 NULL
+	const char *userid;
+	const char *sessid;
+	const char *appkey;
+	int verified;					///< 是否有已校验的会话
+	struct api_session session;		///< 子请求自己的会话，ue 指向下面的副本
+	struct userec ue;				///< 会话用户的副本，各子请求互不共享
+	enum api_admit_decision admit;		///< batch 的准入结果
+	int errcode;					///< 非 0 时不执行子请求，直接输出该错误
+	int status;						///< 子请求的 HTTP 状态码
+	char *output;					///< 截获的完整输出，包含响应头
+	size_t output_len;
+};
+
+/**
+ * 只允许批量调用路由表中标记为 API_ROUTE_BATCH 的接口，即输出 JSON 的只读接口。
+ * 并行的子请求只共享 batch 请求中只读的参数；会话用户各自持有副本，处理函数
+ * 分配的内存来自各自线程的分配区。新增 API_ROUTE_BATCH 的接口同样不能修改
+ * 共享的状态或写入文件。
+ */
+static const struct api_route *api_batch_find_route(const char *path)
+{
+	const struct api_route *r = api_route_find(path);
+	return (r && (r->flags & API_ROUTE_BATCH)) ? r : NULL;
+}
+
+/**
+ * @brief 执行一个子请求
+ * 请求不带 HTTP/1.1 标志，onion 既不会使用 chunked 编码，也不会保持连接，
+ * 截获的内容即为响应头加上原始的响应体。
+ */
+static void api_batch_run(struct api_batch_job *job)
+{
+	onion_request *req;
+	onion_response *res;
+	FILE *fp;
+	int errcode, admitted = 0;
+
+	job->status = HTTP_INTERNAL_ERROR;
+	job->output = NULL;
+	job->output_len = 0;
+
+	fp = open_memstream(&job->output, &job->output_len);
+	if(!fp)
+		return;
+
+	req = api_onion_capture_request(fp);
+	if(!req) {
+		fclose(fp);
+		return;
+	}
+
+	if(job->query) {
+		json_object_object_foreach(job->query, key, val) {
+			api_onion_request_set_query(req, key, json_object_get_string(val));
+		}
+	}
+
+	// 认证信息以 batch 请求为准
+	if(job->userid) {
+		api_onion_request_set_query(req, "userid", job->userid);
+		api_onion_request_set_query(req, "sessid", job->sessid);
+		api_onion_request_set_query(req, "appkey", job->appkey);
+	}
+
+	// 按子请求自己的类别计入准入控制的统计
+	if(!job->errcode) {
+		admitted = 1;
+		if(api_admit_sub_begin(job->route, job->admit) == API_ADMIT_REJECT)
+			job->errcode = API_RT_OVERLOADED;
+	}
+
+	// 子请求中的 api_error() 不应覆盖 batch 本身的 errcode
+	errcode = api_metrics_get_errcode();
+	api_session_set_verified(job->verified ? &job->session : NULL);
+	res = onion_response_new(req);
+	if(job->errcode)
+		api_error(NULL, req, res, job->errcode);
+	else
+		api_route_run(job->route, NULL, req, res);
+	job->status = api_onion_response_code(res);
+	api_session_set_verified(NULL);
+	api_metrics_set_errcode(errcode);
+	if(admitted)
+		api_admit_sub_end();
+	onion_response_free(res);	// 输出缓冲中剩余的内容
+	onion_request_free(req);
+
+	fclose(fp);
+}
+
+static void *api_batch_thread(void *arg)
+{
+	struct api_batch_job *job = (struct api_batch_job *)arg;
+
+	api_batch_run(job);
+	api_arena_release();	// 线程即将退出，不保留分配区
+	return NULL;
+}
+
+/**
+ * @brief 取出截获内容中的响应体
+ */
+static const char *api_batch_body(const struct api_batch_job *job)
+{
+	const char *body;
+
+	if(!job->output)
+		return NULL;
+	body = strstr(job->output, "\r\n\r\n");
+	return body ? body + 4 : NULL;
+}
+
+int api_batch(ONION_FUNC_PROTO_STR)
+{
+	struct api_batch_job jobs[API_BATCH_MAX];
+	pthread_t tids[API_BATCH_MAX];
+	int started[API_BATCH_MAX];
+	struct json_object *list, *item, *path, *query;
+	struct api_session session, *verified = NULL;
+	const struct api_route *routes[API_BATCH_MAX];
+	enum api_admit_decision admit;
+	const char *str, *body;
+	int i, n, nrun = 0;
+
+	const char * userid = onion_request_get_query(req, "userid");
+	const char * sessid = onion_request_get_query(req, "sessid");
+	const char * appkey = onion_request_get_query(req, "appkey");
+	const char * parallel = onion_request_get_query(req, "parallel");
+
+	str = onion_request_get_query(req, "requests");
+	if(!str) {
+		const onion_block *data = onion_request_get_data(req);
+		str = data ? onion_block_data(data) : NULL;
+	}
+	if(!str)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	// 统一校验一次，子请求中不再需要携带认证信息
+	if(userid || sessid || appkey) {
+		if(!userid || !sessid || !appkey)
+			return api_error(p, req, res, API_RT_WRONGPARAM);
+
+		struct userec *ue = getuser(userid);
+		if(ue == 0)
+			return api_error(p, req, res, API_RT_NOSUCHUSER);
+
+		int r = check_user_session(ue, sessid, appkey);
+		if(r != API_RT_SUCCESSFUL)
+			return api_error(p, req, res, r);
+
+		session.ue = ue;
+		session.utmp_index = get_user_utmp_index(sessid);
+		session.sessid = sessid;
+		session.appkey = appkey;
+		verified = &session;
+	}
+
+	list = json_tokener_parse(str);
+	if(!list || !json_object_is_type(list, json_type_array)) {
+		if(list)
+			json_object_put(list);
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+	}
+
+	n = json_object_array_length(list);
+	if(n <= 0 || n > API_BATCH_MAX) {
+		json_object_put(list);
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+	}
+
+	memset(jobs, 0, sizeof(jobs));
+	for(i=0; i<n; ++i) {
+		item = json_object_array_get_idx(list, i);
+		if(!item || !json_object_object_get_ex(item, "path", &path)
+				|| !json_object_is_type(path, json_type_string)) {
+			json_object_put(list);
+			return api_error(p, req, res, API_RT_WRONGPARAM);
+		}
+
+		jobs[i].route = api_batch_find_route(json_object_get_string(path));
+		if(!jobs[i].route) {
+			json_object_put(list);
+			return api_error(p, req, res, API_RT_FUNCNOTIMPL);
+		}
+
+		if(json_object_object_get_ex(item, "query", &query)
+				&& json_object_is_type(query, json_type_object))
+			jobs[i].query = query;
+
+		jobs[i].userid = userid;
+		jobs[i].sessid = sessid;
+		jobs[i].appkey = appkey;
+		if(verified) {
+			jobs[i].ue = *verified->ue;
+			jobs[i].session = *verified;
+			jobs[i].session.ue = &jobs[i].ue;
+			jobs[i].verified = 1;
+		}
+	}
+
+	// batch 本身的 cost 已在 api_route_dispatch() 中取出，各子请求与单独请求时
+	// 一样分别取令牌，令牌不足的子请求返回 API_RT_THROTTLED
+	for(i=0; i<n; ++i) {
+		if(api_ratelimit_take(req, api_ratelimit_cost(jobs[i].route)) < 0)
+			jobs[i].errcode = API_RT_THROTTLED;
+		else
+			routes[nrun++] = jobs[i].route;
+	}
+	if(nrun == 0) {
+		json_object_put(list);
+		onion_response_set_header(res, "Retry-After", "1");
+		return api_error(p, req, res, API_RT_THROTTLED);
+	}
+
+	// 子请求不经过 api_route_dispatch()，在这里按其中最重的类别整体检查，
+	// 执行时再由 api_admit_sub_begin() 逐个检查
+	admit = api_admit_batch(routes, nrun);
+	if(admit == API_ADMIT_REJECT) {
+		json_object_put(list);
+		onion_response_set_header(res, "Retry-After", "1");
+		return api_error(p, req, res, API_RT_OVERLOADED);
+	}
+	if(admit == API_ADMIT_DEGRADE)
+		onion_response_set_header(res, "X-Degraded", "1");
+	for(i=0; i<n; ++i)
+		jobs[i].admit = admit;
+
+	// 子请求需要截获输出，参见 api_onion.c
+	if(!api_onion_internals()) {
+		json_object_put(list);
+		return api_error(p, req, res, API_RT_FUNCNOTIMPL);
+	}
+
+	if(parallel && atoi(parallel) == 1) {
+		// 第一个子请求在当前线程执行，线程创建失败时同样退回串行
+		for(i=1; i<n; ++i)
+			started[i] = (pthread_create(&tids[i], NULL, api_batch_thread, &jobs[i]) == 0);
+		api_batch_run(&jobs[0]);
+		for(i=1; i<n; ++i) {
+			if(started[i])
+				pthread_join(tids[i], NULL);
+			else
+				api_batch_run(&jobs[i]);
+		}
+	} else {
+		for(i=0; i<n; ++i)
+			api_batch_run(&jobs[i]);
+	}
+
+	// 子接口输出的都是 JSON，直接拼接即可
+	api_set_json_header(res);
+	onion_response_write0(res, "{\"errcode\":0,\"results\":[");
+	for(i=0; i<n; ++i) {
+		body = api_batch_body(&jobs[i]);
+		onion_response_printf(res, "%s{\"path\":\"%s\",\"status\":%d,\"body\":",
+				(i == 0) ? "" : ",", jobs[i].route->path, jobs[i].status);
+		if(body && *body)
+			onion_response_write0(res, body);
+		else
+			onion_response_write0(res, "null");
+		onion_response_write0(res, "}");
+		free(jobs[i].output);
+	}
+	onion_response_write0(res, "]}");
+
+	json_object_put(list);
+	return OCS_PROCESSED;
+}
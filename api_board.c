@@ -1,14 +1,15 @@
 #include "api.h"
 
+#define API_GUEST_TTL				5		///< guest 版面列表的共享缓存有效期，秒
+
 /**
  * @brief 将 boardmem 数组输出为 json 字符串
- * @warning 注意使用完成释放
  * @warning 输出的版主id仅为大版主
  * @param board_array 指针数组
  * @param count board_array 数组的长度
  * @param sortmode 排序方式，1为按英文名称，2为人气，3为在线人数。默认值为2
  * @param ui 当前会话的 user_info 指针，用于判断版面是否存在未读信息
- * @return 字符指针
+ * @return 字符指针，分配自请求分配区，失败返回 NULL
  */
 static char* bmy_board_array_to_json_string(struct boardmem **board_array, int count, int sortmode, const char *fromhost, struct user_info *ui);
 
@@ -29,6 +30,8 @@ static int api_board_list_sec(ONION_FUNC_PROTO_STR);
 
 /**
  * @brief 返回分区版面列表（guest权限）
+ * @details 未提供 userid 或 userid 为 guest 时使用，不检查 session，
+ * 输出在所有 guest 之间共享缓存。
  * @param ONION_FUNC_PROTO_STR
  * @return
  */
@@ -112,30 +115,22 @@ int api_board_info(ONION_FUNC_PROTO_STR)
 	if(!bmem)
 		return api_error(p, req, res, API_RT_NOSUCHBRD);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
-	free(ue);
-
 	int uent_index = get_user_utmp_index(sessid);
 	struct user_info *ui = &(shm_utmp->uinfo[uent_index]);
 
 	if(!check_user_read_perm_x(ui, bmem))
 		return api_error(p, req, res, API_RT_NOBRDRPERM);
 
-	char buf[512];
-	char zh_name[80];//, type[16], keyword[128];
-	g2u(bmem->header.title, 24, zh_name, 80);
-	//g2u(bmem->header.keyword, 64, keyword, 128);
-	//g2u(bmem->header.type, 5, type, 16);
-
+	// 以下内容来自版面共享内存、.DIR、TOPN 和用户收藏夹，均未变化时直接返回 304
 	int today_num=0, thread_num=0, i;
 	struct tm tm;
 	memset(&tm, 0, sizeof(tm));
@@ -144,6 +139,32 @@ int api_board_info(ONION_FUNC_PROTO_STR)
 	time_t day_begin = get_time_of_the_biginning_of_the_day(&tm);
 	char filename[256];
 
+	struct api_etag etag;
+	api_etag_init(&etag);
+	sprintf(filename, "boards/%s/.DIR", bmem->header.filename);
+	api_etag_add_file(&etag, filename);
+	sprintf(filename, "boards/%s/TOPN", bmem->header.filename);
+	api_etag_add_file(&etag, filename);
+	sethomefile(filename, ui->userid, ".goodbrd");
+	api_etag_add_file(&etag, filename);
+	api_etag_add_int(&etag, day_begin);
+	api_etag_add_int(&etag, bmem->total);
+	api_etag_add_int(&etag, bmem->score);
+	api_etag_add_int(&etag, bmem->inboard);
+	api_etag_add_int(&etag, bmem->header.flag);
+	api_etag_add_str(&etag, bmem->header.title);
+	api_etag_add_str(&etag, bmem->header.sec1);
+	for(i=0; i<BMNUM; ++i)
+		api_etag_add_str(&etag, bmem->header.bm[i]);
+	if(api_etag_respond(req, res, &etag))
+		return OCS_PROCESSED;
+
+	char buf[512];
+	char zh_name[80];//, type[16], keyword[128];
+	g2u(bmem->header.title, 24, zh_name, 80);
+	//g2u(bmem->header.keyword, 64, keyword, 128);
+	//g2u(bmem->header.type, 5, type, 16);
+
 	sprintf(filename, "boards/%s/.DIR", bmem->header.filename);
 	int fsize = file_size_s(filename);
 	int fd = open(filename, O_RDONLY);
@@ -227,8 +248,7 @@ int api_board_info(ONION_FUNC_PROTO_STR)
 		xmlFreeDoc(doc);
 	}
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(jp));
+	api_write_json(req, res, json_object_to_json_string(jp));
 	json_object_put(jp);
 	return OCS_PROCESSED;
 }
@@ -246,12 +266,11 @@ int api_board_fav_add(ONION_FUNC_PROTO_STR)
 	if(strcasecmp(userid, "guest")==0)
 		return api_error(p, req, res, API_RT_NOTLOGGEDIN);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
-	free(ue);
 	if(r != API_RT_SUCCESSFUL) {
 		return api_error(p, req, res, r);
 	}
@@ -318,12 +337,11 @@ int api_board_fav_del(ONION_FUNC_PROTO_STR)
 	if(strcasecmp(userid, "guest")==0)
 		return api_error(p, req, res, API_RT_NOTLOGGEDIN);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
-	free(ue);
 	if(r != API_RT_SUCCESSFUL) {
 		return api_error(p, req, res, r);
 	}
@@ -380,12 +398,11 @@ int api_board_fav_list(ONION_FUNC_PROTO_STR)
 	if(strcasecmp(userid, "guest")==0)
 		return api_error(p, req, res, API_RT_NOTLOGGEDIN);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
-	free(ue);
 	if(r != API_RT_SUCCESSFUL) {
 		return api_error(p, req, res, r);
 	}
@@ -419,8 +436,7 @@ int api_board_fav_list(ONION_FUNC_PROTO_STR)
 		json_object_array_add(json_array_board, item);
 	}
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(obj));
+	api_write_json(req, res, json_object_to_json_string(obj));
 
 	json_object_put(obj);
 	return OCS_PROCESSED;
@@ -439,12 +455,11 @@ int api_board_autocomplete(ONION_FUNC_PROTO_STR)
 	if(strlen(search_str) < 2)
 		return api_error(p, req, res, API_RT_SUCCESSFUL);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
-	free(ue);
 	if(r != API_RT_SUCCESSFUL) {
 		return api_error(p, req, res, r);
 	}
@@ -469,8 +484,7 @@ int api_board_autocomplete(ONION_FUNC_PROTO_STR)
 		}
 	}
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(obj));
+	api_write_json(req, res, json_object_to_json_string(obj));
 
 	json_object_put(obj);
 
@@ -493,13 +507,12 @@ static int api_board_list_fav(ONION_FUNC_PROTO_STR)
 	if(strcasecmp(userid, "guest")==0)
 		return api_error(p, req, res, API_RT_NOTLOGGEDIN);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
@@ -507,7 +520,6 @@ static int api_board_list_fav(ONION_FUNC_PROTO_STR)
 	int mybrdnum;
 	r = readmybrd(mybrd, &mybrdnum, ue->userid);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
@@ -528,10 +540,9 @@ static int api_board_list_fav(ONION_FUNC_PROTO_STR)
 	}
 
 	char *s = bmy_board_array_to_json_string(board_array, count, sortmode, fromhost, ui);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(ue);
-	free(s);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, s);
 	return OCS_PROCESSED;
 }
 
@@ -548,17 +559,16 @@ static int api_board_list_sec(ONION_FUNC_PROTO_STR)
 
 	if(secstr == NULL || strlen(secstr)>=2 || strstr(sec_array, secstr) == NULL)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
-	if(!userid)
+	if(!userid || strcasecmp(userid, "guest")==0)
 		return api_board_list_sec_guest(p, req, res);
 	if(!sessid || !appkey)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 	int sortmode = (sortmode_s) ? atoi(sortmode_s) : 2;
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
@@ -588,37 +598,45 @@ static int api_board_list_sec(ONION_FUNC_PROTO_STR)
 		count++;
 	}
 	char *s = bmy_board_array_to_json_string(board_array, count, sortmode, fromhost, ui);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(ue);
-	free(s);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, s);
 	return OCS_PROCESSED;
 }
 
 static int api_board_list_sec_guest(ONION_FUNC_PROTO_STR)
 {
-	int guest_uid = getusernum("guest");
-	int guest_uent_index, i;
-	struct user_info *ui=NULL;
-	for(i=0; i<6; i++) {
-		guest_uent_index = shm_uindex->user[guest_uid][i];
-		ui = &(shm_utmp->uinfo[guest_uent_index-1]);
-		if(strcasecmp(ui->userid, "guest")==0)
-			break;
-	}
-
-	if(strcasecmp(ui->userid, "guest")!=0)
-		return api_error(p, req, res, API_RT_WRONGPARAM);
-
 	const char * secstr = onion_request_get_query(req, "secstr");
 	const char * sortmode_s = onion_request_get_query(req, "sortmode");
-	const char * fromhost = onion_request_get_header(req, "X-Real-IP");
 
 	int sortmode = (sortmode_s) ? atoi(sortmode_s) : 2;
-	int len, hasintro=0, count=0;
+	if(sortmode<=0 || sortmode>3)
+		sortmode = 2;
 
+	// guest 看到的列表都相同，只以分区与排序方式为键在所有 guest 之间共享。
+	// 版面的文章数、人气等随时变化，以 .BOARDS 的变化和较短的有效期控制刷新
+	struct stat st;
+	char cache_key[64];
+	const struct api_gzseg *seg;
+	if(stat(".BOARDS", &st) < 0)
+		memset(&st, 0, sizeof(st));
+	snprintf(cache_key, sizeof(cache_key), "guest/board/list/%s/%d", secstr, sortmode);
+	seg = api_cache_get(cache_key, &st);
+	if(!seg && api_admit_degraded())
+		seg = api_cache_get_stale(cache_key);
+	if(seg) {
+		api_write_json_parts(req, res, NULL, seg, NULL);
+		api_cache_release(seg);
+		return OCS_PROCESSED;
+	}
+
+	struct user_info *ui = api_guest_info();
+	if(!ui)
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	int i, len, hasintro=0, count=0;
 	struct boardmem *board_array[MAXBOARD], *x;
-	struct sectree *sec = getsectree(secstr);
+	const struct sectree *sec = getsectree(secstr);
 	len = strlen(secstr);
 	if(sec->introstr[0])
 		hasintro = 1;
@@ -639,22 +657,28 @@ static int api_board_list_sec_guest(ONION_FUNC_PROTO_STR)
 		count++;
 	}
 
-	char *s = bmy_board_array_to_json_string(board_array, count, sortmode, fromhost, ui);
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(s);
-	return OCS_PROCESSED;
+	// 提供 ui 时未读标记取自 guest 的 utmp 项，与来源地址无关
+	char *s = bmy_board_array_to_json_string(board_array, count, sortmode, "", ui);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 
+	// 没有匹配版面的 secstr 不缓存，任意构造的分区不会占用缓存
+	seg = count ? api_cache_put(cache_key, &st, API_GUEST_TTL, s, strlen(s)) : NULL;
+	if(!seg) {
+		api_write_json(req, res, s);
+		return OCS_PROCESSED;
+	}
+	api_write_json_parts(req, res, NULL, seg, NULL);
+	api_cache_release(seg);
+	return OCS_PROCESSED;
 }
 
 static char* bmy_board_array_to_json_string(struct boardmem **board_array, int count, int sortmode, const char *fromhost, struct user_info *ui)
 {
-	char buf[512];
 	int i, j;
 	struct boardmem *bp;
-	struct json_object *jp;
-	struct json_object *obj = json_tokener_parse("{\"errcode\":0, \"boardlist\":[]}");
-	struct json_object *json_array = json_object_object_get(obj, "boardlist");
+	struct api_arena_buf buf;
+	api_phase_begin(API_PHASE_JSON);
 
 	if(sortmode<=0 || sortmode>3)
 		sortmode = 2;
@@ -672,9 +696,10 @@ static char* bmy_board_array_to_json_string(struct boardmem **board_array, int c
 		break;
 	}
 
+	api_arena_buf_init(&buf, 64 + count * 384);
+	api_arena_buf_puts(&buf, "{\"errcode\":0, \"boardlist\":[");
 	for(i=0; i<count; ++i) {
 		bp = board_array[i];
-		memset(buf, 0, 512);
 
 		// @warning: by IronBlood
 		// 此处将 boardmem 中的部分字符字段转为 utf-8 编码，若 boardmem 发生变更
@@ -683,31 +708,35 @@ static char* bmy_board_array_to_json_string(struct boardmem **board_array, int c
 		g2u(bp->header.title, 24, zh_name, 80);
 		g2u(bp->header.keyword, 64, keyword, 128);
 		g2u(bp->header.type, 5, type, 16);
-		sprintf(buf, "{\"name\":\"%s\", \"zh_name\":\"%s\", \"type\":\"%s\", \"bm\":[],"
-				"\"unread\":%d, \"voting\":%d, \"article_num\":%d, \"score\":%d,"
-				"\"inboard_num\":%d, \"secstr\":\"%s\", \"keyword\":\"%s\" }",
-				bp->header.filename, zh_name, type,
+
+		api_arena_buf_puts(&buf, (i == 0) ? "{\"name\":" : ", {\"name\":");
+		api_arena_buf_json_str(&buf, bp->header.filename);
+		api_arena_buf_puts(&buf, ", \"zh_name\":");
+		api_arena_buf_json_str(&buf, zh_name);
+		api_arena_buf_puts(&buf, ", \"type\":");
+		api_arena_buf_json_str(&buf, type);
+		api_arena_buf_puts(&buf, ", \"bm\":[");
+		for(j=0; j<4; j++) {
+			if(bp->header.bm[j][0]==0)
+				break;
+			if(j > 0)
+				api_arena_buf_puts(&buf, ", ");
+			api_arena_buf_json_str(&buf, bp->header.bm[j]);
+		}
+		api_arena_buf_printf(&buf, "], \"unread\":%d, \"voting\":%d, \"article_num\":%d, \"score\":%d,"
+				"\"inboard_num\":%d, \"secstr\":",
 				!board_read(bp->header.filename, bp->lastpost, fromhost, ui),
 				(bp->header.flag & VOTE_FLAG),
-				bp->total, bp->score,
-				bp->inboard, bp->header.sec1, keyword);
-		jp = json_tokener_parse(buf);
-		if(jp) {
-			struct json_object *bm_json_array = json_object_object_get(jp, "bm");
-			for(j=0; j<4; j++) {
-				if(bp->header.bm[j][0]==0)
-					break;
-				json_object_array_add(bm_json_array,
-						json_object_new_string(bp->header.bm[j]));
-			}
-			json_object_array_add(json_array, jp);
-		}
+				bp->total, bp->score, bp->inboard);
+		api_arena_buf_json_str(&buf, bp->header.sec1);
+		api_arena_buf_puts(&buf, ", \"keyword\":");
+		api_arena_buf_json_str(&buf, keyword);
+		api_arena_buf_puts(&buf, "}");
 	}
+	api_arena_buf_puts(&buf, "]}");
 
-	char *r = strdup(json_object_to_json_string(obj));
-	json_object_put(obj);
-
-	return r;
+	api_phase_end(API_PHASE_JSON);
+	return buf.s;
 }
 
 static int readmybrd(char mybrd[GOOD_BRC_NUM][80], int *mybrdnum, const char *userid)
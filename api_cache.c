@@ -0,0 +1,205 @@
+/**
+ * @file	api_cache.c
+ * @brief	热点响应的缓存，内容以预压缩片段 struct api_gzseg 保存。
+ * @details	每个缓存项以字符串为键，并记录生成时源文件的大小和修改时间，
+ * 			源文件变化或超过有效期后缓存项自动失效。缓存项按最近使用的顺序链接，
+ * 			总量超过配置中的 cache_mb 时从最久没有使用的一端逐个淘汰，热点内容
+ * 			不会因为一批冷门的键而全部失效。
+ *
+ * 			失效的缓存项在被替换之前仍然保留，降级处理的请求可以通过
+ * 			api_cache_get_stale() 使用。
+ *
+ * 			api_cache_get() 返回的缓存项带有引用计数，使用完毕后需要调用
+ * 			api_cache_release()，缓存项被替换时不会影响正在输出的请求。
+ */
+
+#include <pthread.h>
+#include "api.h"
+
+struct api_cache_entry {
+	struct api_gzseg seg;
+	struct timespec mtime;	///< 生成时源文件的修改时间
+	off_t size;				///< 生成时源文件的大小
+	time_t expires;			///< 过期时间，0 表示仅依据源文件判断
+	int refcount;			///< 缓存表本身持有一个引用
+	char *key;
+	struct api_cache_entry *prev, *next;	///< 按最近使用排列，表头最新
+};
+
+static ght_hash_table_t *api_cache_table = NULL;
+static size_t api_cache_bytes = 0;
+static struct api_cache_entry *api_cache_head = NULL, *api_cache_tail = NULL;
+static pthread_mutex_t api_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t api_cache_entry_bytes(const struct api_cache_entry *e)
+{
+	return e->seg.raw_len + e->seg.deflated_len + sizeof(*e);
+}
+
+/**
+ * @warning 调用前需要持有 api_cache_lock。
+ */
+static void api_cache_unref(struct api_cache_entry *e)
+{
+	if(--e->refcount > 0)
+		return;
+	api_gzseg_free(&e->seg);
+	free(e->key);
+	free(e);
+}
+
+/**
+ * @warning 以下链表操作调用前需要持有 api_cache_lock。
+ */
+static void api_cache_unlink(struct api_cache_entry *e)
+{
+	if(e->prev)
+		e->prev->next = e->next;
+	else
+		api_cache_head = e->next;
+	if(e->next)
+		e->next->prev = e->prev;
+	else
+		api_cache_tail = e->prev;
+	e->prev = e->next = NULL;
+}
+
+static void api_cache_push(struct api_cache_entry *e)
+{
+	e->prev = NULL;
+	e->next = api_cache_head;
+	if(api_cache_head)
+		api_cache_head->prev = e;
+	else
+		api_cache_tail = e;
+	api_cache_head = e;
+}
+
+static void api_cache_touch(struct api_cache_entry *e)
+{
+	if(e != api_cache_head) {
+		api_cache_unlink(e);
+		api_cache_push(e);
+	}
+}
+
+/**
+ * @brief 从表中移除缓存项，正在输出的请求仍持有各自的引用
+ * @warning 调用前需要持有 api_cache_lock。
+ */
+static void api_cache_remove(struct api_cache_entry *e)
+{
+	ght_remove(api_cache_table, strlen(e->key), e->key);
+	api_cache_unlink(e);
+	api_cache_bytes -= api_cache_entry_bytes(e);
+	api_cache_unref(e);
+}
+
+const struct api_gzseg *api_cache_get(const char *key, const struct stat *st)
+{
+	struct api_cache_entry *e;
+
+	pthread_mutex_lock(&api_cache_lock);
+	e = api_cache_table ? ght_get(api_cache_table, strlen(key), key) : NULL;
+	if(!e || e->size != st->st_size
+			|| e->mtime.tv_sec != st->st_mtim.tv_sec
+			|| e->mtime.tv_nsec != st->st_mtim.tv_nsec
+			|| (e->expires && e->expires <= time(NULL))) {
+		pthread_mutex_unlock(&api_cache_lock);
+		return NULL;
+	}
+	e->refcount++;
+	api_cache_touch(e);
+	pthread_mutex_unlock(&api_cache_lock);
+
+	return &e->seg;
+}
+
+const struct api_gzseg *api_cache_get_stale(const char *key)
+{
+	struct api_cache_entry *e;
+
+	pthread_mutex_lock(&api_cache_lock);
+	e = api_cache_table ? ght_get(api_cache_table, strlen(key), key) : NULL;
+	if(e) {
+		e->refcount++;
+		api_cache_touch(e);
+	}
+	pthread_mutex_unlock(&api_cache_lock);
+
+	return e ? &e->seg : NULL;
+}
+
+const struct api_gzseg *api_cache_put(const char *key, const struct stat *st, int ttl, const char *raw, size_t len)
+{
+	struct api_cache_entry *e, *old;
+	size_t limit = (size_t)api_config_get()->cache_mb * 1024 * 1024;
+	char *copy;
+
+	e = (struct api_cache_entry *)calloc(1, sizeof(*e));
+	if(!e)
+		return NULL;
+
+	// 调用者的内容通常位于请求分配区，缓存项需要自己的副本
+	e->key = strdup(key);
+	copy = malloc(len + 1);
+	if(!e->key || !copy) {
+		free(copy);
+		free(e->key);
+		free(e);
+		return NULL;
+	}
+	memcpy(copy, raw, len);
+	copy[len] = 0;
+
+	if(api_gzseg_init(&e->seg, copy, len) < 0) {
+		api_gzseg_free(&e->seg);
+		free(e->key);
+		free(e);
+		return NULL;
+	}
+	e->mtime = st->st_mtim;
+	e->size = st->st_size;
+	e->expires = (ttl > 0) ? time(NULL) + ttl : 0;
+	e->refcount = 2;	// 缓存表和调用者各持有一个
+
+	pthread_mutex_lock(&api_cache_lock);
+	if(!api_cache_table) {
+		api_cache_table = ght_create(1024);
+		if(api_cache_table)
+			ght_set_rehash(api_cache_table, 1);
+	}
+
+	if(api_cache_table && api_cache_entry_bytes(e) <= limit) {
+		old = ght_get(api_cache_table, strlen(key), key);
+		if(old)
+			api_cache_remove(old);
+		while(api_cache_tail && api_cache_bytes + api_cache_entry_bytes(e) > limit)
+			api_cache_remove(api_cache_tail);
+
+		if(ght_insert(api_cache_table, e, strlen(e->key), e->key) == 0) {
+			api_cache_push(e);
+			api_cache_bytes += api_cache_entry_bytes(e);
+		} else {
+			e->refcount--;
+		}
+	} else {
+		e->refcount--;
+	}
+	pthread_mutex_unlock(&api_cache_lock);
+
+	return &e->seg;
+}
+
+void api_cache_release(const struct api_gzseg *seg)
+{
+	struct api_cache_entry *e;
+
+	if(!seg)
+		return;
+
+	e = (struct api_cache_entry *)((char *)seg - offsetof(struct api_cache_entry, seg));
+	pthread_mutex_lock(&api_cache_lock);
+	api_cache_unref(e);
+	pthread_mutex_unlock(&api_cache_lock);
+}
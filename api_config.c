@@ -0,0 +1,283 @@
+/**
+ * @file	api_config.c
+ * @brief	运行时配置，默认读取 MY_BBS_HOME/etc/bmyapi.conf。
+ * @details	配置文件每行一项，格式为"键 = 值"，# 之后为注释，未出现的项使用默认值。
+ * 			默认的配置文件不存在时全部使用默认值。
+ *
+ * 			收到 SIGHUP 时重新读取，可以重新加载的项立即生效；监听地址、端口、
+ * 			进程数与线程数只在启动时读取，修改后需要重启。重新读取失败时保留原有配置。
+ *
+ * 			配置整体替换，api_config_get() 返回的指针在请求处理期间一直有效。
+ * 			被替换的配置不释放，每次重新加载只泄漏一个结构体。
+ */
+
+#include <stddef.h>
+#include <pthread.h>
+#include "api.h"
+
+struct api_config_key {
+	const char *name;
+	size_t offset;
+	size_t size;			///< 字符串的缓冲区大小，0 表示整数
+	int min;
+	int max;
+	int reload;				///< 是否可以通过 SIGHUP 重新加载
+};
+
+#define API_CONF_INT(name, field, min, max, reload) \
+	{ name, offsetof(struct api_config, field), 0, min, max, reload }
+#define API_CONF_STR(name, field, reload) \
+	{ name, offsetof(struct api_config, field), sizeof(((struct api_config *)0)->field), 0, 0, reload }
+
+static const struct api_config_key api_config_keys[] = {
+	API_CONF_STR("listen_host",		listen_host,	0),
+	API_CONF_STR("listen_port",		listen_port,	0),
+	API_CONF_INT("workers",			workers,		0, 256,			0),
+	API_CONF_INT("cpu_affinity",	cpu_affinity,	0, 1,			0),
+	API_CONF_INT("threads",			threads,		1, 1024,		0),
+	API_CONF_INT("threads_min",		threads_min,	1, 1024,		1),
+	API_CONF_INT("adaptive",		adaptive,		0, 1,			1),
+	API_CONF_INT("timeout_ms",		timeout_ms,		100, 600000,	1),
+	API_CONF_STR("redis_host",		redis_host,		1),
+	API_CONF_INT("redis_port",		redis_port,		1, 65535,		1),
+	API_CONF_INT("search_max",		search_max,		1, 100000,		1),
+	API_CONF_INT("cache_mb",		cache_mb,		0, 65536,		1),
+	API_CONF_INT("slow_ms",			slow_ms,		0, 3600000,		1),
+	API_CONF_INT("ratelimit",		ratelimit,		0, 1,			1),
+	API_CONF_INT("ratelimit_ip",	ratelimit_ip,	0, 10000,		1),
+	API_CONF_INT("ratelimit_user",	ratelimit_user,	0, 10000,		1),
+	API_CONF_INT("ratelimit_appkey",	ratelimit_appkey,	0, 10000,	1),
+	API_CONF_INT("ratelimit_burst",	ratelimit_burst,	1, 60,		1),
+	API_CONF_STR("ratelimit_costs",	ratelimit_costs,	1),
+	API_CONF_INT("admission",		admission,		0, 1,			1),
+	API_CONF_INT("admission_budget_ms",	admission_budget_ms,	10, 600000,	1),
+	API_CONF_STR("metrics_token",	metrics_token,	1),
+	{ NULL, 0, 0, 0, 0, 0 }
+};
+
+static const struct api_config api_config_default = {
+	.listen_host	= "127.0.0.1",
+	.listen_port	= "8081",
+	.workers		= 0,
+	.cpu_affinity	= 0,
+	.threads		= API_MAX_THREADS,
+	.threads_min	= 4,
+	.adaptive		= 0,
+	.timeout_ms		= 5000,
+	.redis_host		= "127.0.0.1",
+	.redis_port		= 6379,
+	.search_max		= 1000,
+	.cache_mb		= 64,
+	.slow_ms		= 500,
+	.ratelimit		= 0,
+	.ratelimit_ip	= 50,
+	.ratelimit_user	= 20,
+	.ratelimit_appkey	= 0,
+	.ratelimit_burst	= 5,
+	.ratelimit_costs	= "",
+	.admission		= 0,
+	.admission_budget_ms	= 3000,
+	.metrics_token	= "",
+};
+
+static const struct api_config *api_config_current = NULL;
+static char api_config_path[256] = API_CONFIG_FILE;
+static int api_config_required = 0;		///< 由命令行指定时文件必须存在
+
+const struct api_config *api_config_get(void)
+{
+	const struct api_config *conf = __atomic_load_n(&api_config_current, __ATOMIC_ACQUIRE);
+	return conf ? conf : &api_config_default;
+}
+
+static char *api_config_trim(char *s)
+{
+	char *e;
+
+	while(*s == ' ' || *s == '\t')
+		s++;
+	e = s + strlen(s);
+	while(e > s && (e[-1] == ' ' || e[-1] == '\t' || e[-1] == '\r' || e[-1] == '\n'))
+		*--e = 0;
+	return s;
+}
+
+static int api_config_set(struct api_config *conf, const char *key, const char *value)
+{
+	const struct api_config_key *k;
+	char *end;
+	long v;
+
+	for(k = api_config_keys; k->name; ++k) {
+		if(strcmp(k->name, key))
+			continue;
+
+		if(k->size) {
+			if(strlen(value) >= k->size)
+				return -1;
+			strcpy((char *)conf + k->offset, value);
+			return 0;
+		}
+
+		v = strtol(value, &end, 10);
+		if(end == value || *end || v < k->min || v > k->max)
+			return -1;
+		*(int *)((char *)conf + k->offset) = (int)v;
+		return 0;
+	}
+
+	fprintf(stderr, "%s: unknown key %s, ignored\n", api_config_path, key);
+	return 0;
+}
+
+/**
+ * @brief 以默认值为基础读取配置文件
+ * @return 0 成功，-1 文件无法读取或有错误的项
+ */
+static int api_config_parse(struct api_config *conf)
+{
+	char line[512], *key, *value, *p;
+	int lineno = 0, ret = 0;
+	FILE *fp;
+
+	*conf = api_config_default;
+
+	p = getenv("BMYAPI_SLOW_MS");
+	if(p && atoi(p) > 0)
+		conf->slow_ms = atoi(p);
+
+	fp = fopen(api_config_path, "r");
+	if(!fp) {
+		if(errno == ENOENT && !api_config_required)
+			return 0;
+		fprintf(stderr, "%s: %s\n", api_config_path, strerror(errno));
+		return -1;
+	}
+
+	while(fgets(line, sizeof(line), fp)) {
+		lineno++;
+		p = strchr(line, '#');
+		if(p)
+			*p = 0;
+		key = api_config_trim(line);
+		if(!*key)
+			continue;
+
+		p = strchr(key, '=');
+		if(!p) {
+			fprintf(stderr, "%s:%d: expected key = value\n", api_config_path, lineno);
+			ret = -1;
+			continue;
+		}
+		*p = 0;
+		value = api_config_trim(p + 1);
+		key = api_config_trim(key);
+
+		if(api_config_set(conf, key, value) < 0) {
+			fprintf(stderr, "%s:%d: invalid value for %s\n", api_config_path, lineno, key);
+			ret = -1;
+		}
+	}
+	fclose(fp);
+
+	if(conf->threads_min > conf->threads)
+		conf->threads_min = conf->threads;
+	// 排队时间只能在 api_pool.c 的闸门前测得
+	if(conf->admission && !conf->adaptive) {
+		fprintf(stderr, "%s: admission requires adaptive = 1, disabled\n", api_config_path);
+		conf->admission = 0;
+	}
+	return ret;
+}
+
+/**
+ * @brief 使配置中需要主动设置的项生效
+ */
+static void api_config_apply(const struct api_config *conf)
+{
+	api_metrics_set_slow_threshold(conf->slow_ms);
+	if(o)
+		onion_set_timeout(o, conf->timeout_ms);	// 对之后建立的连接生效
+}
+
+int api_config_load(const char *path)
+{
+	struct api_config *conf;
+
+	if(path) {
+		strsncpy(api_config_path, path, sizeof(api_config_path));
+		api_config_required = 1;
+	}
+
+	conf = malloc(sizeof(struct api_config));
+	if(!conf)
+		return -1;
+	if(api_config_parse(conf) < 0) {
+		free(conf);
+		return -1;
+	}
+
+	__atomic_store_n(&api_config_current, conf, __ATOMIC_RELEASE);
+	api_config_apply(conf);
+	return 0;
+}
+
+int api_config_reload(void)
+{
+	const struct api_config *old = api_config_get();
+	const struct api_config_key *k;
+	struct api_config *conf;
+
+	conf = malloc(sizeof(struct api_config));
+	if(!conf)
+		return -1;
+	if(api_config_parse(conf) < 0) {
+		fprintf(stderr, "%s: reload failed, keeping the current configuration\n", api_config_path);
+		free(conf);
+		return -1;
+	}
+
+	for(k = api_config_keys; k->name; ++k) {
+		if(k->reload)
+			continue;
+		if(k->size ? strcmp((char *)conf + k->offset, (const char *)old + k->offset)
+				: *(int *)((char *)conf + k->offset) != *(const int *)((const char *)old + k->offset)) {
+			fprintf(stderr, "%s: %s changed, restart to apply\n", api_config_path, k->name);
+			memcpy((char *)conf + k->offset, (const char *)old + k->offset, k->size ? k->size : sizeof(int));
+		}
+	}
+	if(conf->threads_min > conf->threads)
+		conf->threads_min = conf->threads;
+
+	__atomic_store_n(&api_config_current, conf, __ATOMIC_RELEASE);
+	api_config_apply(conf);
+	fprintf(stderr, "%s: reloaded\n", api_config_path);
+	return 0;
+}
+
+static void *api_config_watch_thread(void *arg)
+{
+	sigset_t *set = (sigset_t *)arg;
+	int sig;
+
+	for(;;) {
+		if(sigwait(set, &sig) == 0 && sig == SIGHUP)
+			api_config_reload();
+	}
+	return NULL;
+}
+
+int api_config_watch(void)
+{
+	static sigset_t set;
+	pthread_t tid;
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGHUP);
+	if(pthread_sigmask(SIG_BLOCK, &set, NULL) != 0)
+		return -1;
+	if(pthread_create(&tid, NULL, api_config_watch_thread, &set) != 0)
+		return -1;
+	pthread_detach(tid);
+	return 0;
+}
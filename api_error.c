@@ -2,6 +2,7 @@
 
 int api_error(ONION_FUNC_PROTO_STR, enum api_error_code errcode)
 {
+	api_metrics_set_errcode(errcode);
 	api_set_json_header(res);
 	onion_response_printf(res, "{\"errcode\":%d}", errcode);
 	return OCS_PROCESSED;
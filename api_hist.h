@@ -0,0 +1,130 @@
+/**
+ * @file	api_hist.h
+ * @brief	对数-线性分桶的延迟直方图，思路同 HdrHistogram。
+ * @details	每个 2 的幂区间再均分为 2^API_HIST_SUB_BITS 个桶，相对误差不超过
+ * 			1/2^API_HIST_SUB_BITS。记录只是一次下标计算和一次加法，适合在请求
+ * 			路径上使用。
+ *
+ * 			直方图只允许一个线程写入（参见 api_metrics.c 中的线程局部统计），
+ * 			读取方使用 relaxed 原子读，合并多个线程的数据时允许轻微的不一致。
+ */
+
+#ifndef __BMYBBS_API_HIST_H
+#define __BMYBBS_API_HIST_H
+
+#include <stdint.h>
+
+#define API_HIST_SUB_BITS	3
+#define API_HIST_SUB_COUNT	(1 << API_HIST_SUB_BITS)
+#define API_HIST_MAX_MSB	36		///< 最大约 2^37 微秒，超出的记入最后一个桶
+#define API_HIST_BUCKETS	((API_HIST_MAX_MSB - API_HIST_SUB_BITS + 2) * API_HIST_SUB_COUNT)
+
+struct api_hist {
+	uint64_t buckets[API_HIST_BUCKETS];
+	uint64_t count;
+	uint64_t sum;			///< 所有记录值之和
+	uint64_t max;
+};
+
+/**
+ * @brief 记录值所在的桶
+ */
+static inline int api_hist_index(uint64_t v)
+{
+	int msb, idx;
+
+	if(v < API_HIST_SUB_COUNT)
+		return (int)v;
+
+	msb = 63 - __builtin_clzll(v);
+	if(msb > API_HIST_MAX_MSB)
+		return API_HIST_BUCKETS - 1;
+
+	idx = (msb - API_HIST_SUB_BITS + 1) * API_HIST_SUB_COUNT
+		+ (int)((v >> (msb - API_HIST_SUB_BITS)) & (API_HIST_SUB_COUNT - 1));
+	return idx;
+}
+
+/**
+ * @brief 桶的上界（不含）
+ */
+static inline uint64_t api_hist_upper(int idx)
+{
+	int range, sub;
+
+	if(idx < API_HIST_SUB_COUNT)
+		return (uint64_t)idx + 1;
+
+	range = idx / API_HIST_SUB_COUNT - 1;	// 对应 msb - API_HIST_SUB_BITS
+	sub = idx % API_HIST_SUB_COUNT;
+	return (uint64_t)(API_HIST_SUB_COUNT + sub + 1) << range;
+}
+
+static inline void api_hist_record(struct api_hist *h, uint64_t v)
+{
+	__atomic_store_n(&h->buckets[api_hist_index(v)], h->buckets[api_hist_index(v)] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->count, h->count + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&h->sum, h->sum + v, __ATOMIC_RELAXED);
+	if(v > h->max)
+		__atomic_store_n(&h->max, v, __ATOMIC_RELAXED);
+}
+
+/**
+ * @brief 把 src 累加到 dst 中，dst 为读取方私有
+ */
+static inline void api_hist_merge(struct api_hist *dst, const struct api_hist *src)
+{
+	int i;
+	uint64_t max;
+
+	for(i=0; i<API_HIST_BUCKETS; ++i)
+		dst->buckets[i] += __atomic_load_n(&src->buckets[i], __ATOMIC_RELAXED);
+	dst->count += __atomic_load_n(&src->count, __ATOMIC_RELAXED);
+	dst->sum += __atomic_load_n(&src->sum, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&src->max, __ATOMIC_RELAXED);
+	if(max > dst->max)
+		dst->max = max;
+}
+
+/**
+ * @brief 计算分位数
+ * @param q 0 到 1 之间
+ * @return 分位数所在桶的上界，没有数据时返回 0
+ */
+static inline uint64_t api_hist_quantile(const struct api_hist *h, double q)
+{
+	uint64_t total = 0, rank;
+	int i;
+
+	for(i=0; i<API_HIST_BUCKETS; ++i)
+		total += h->buckets[i];
+	if(total == 0)
+		return 0;
+
+	rank = (uint64_t)(q * total);
+	if(rank >= total)
+		rank = total - 1;
+
+	for(i=0; i<API_HIST_BUCKETS; ++i) {
+		if(h->buckets[i] > rank)
+			return (api_hist_upper(i) < h->max) ? api_hist_upper(i) : h->max;
+		rank -= h->buckets[i];
+	}
+	return h->max;
+}
+
+/**
+ * @brief 不超过 v 的记录个数，用于输出累积分布
+ * 按桶统计，桶的上界不超过 v + 1 才计入。
+ */
+static inline uint64_t api_hist_count_le(const struct api_hist *h, uint64_t v)
+{
+	uint64_t n = 0;
+	int i;
+
+	for(i=0; i<API_HIST_BUCKETS && api_hist_upper(i) <= v + 1; ++i)
+		n += h->buckets[i];
+	return n;
+}
+
+#endif
@@ -0,0 +1,279 @@
+/**
+ * @file	api_ledger.c
+ * @brief	用户空间占用账本。
+ * @details	账本以二进制形式保存在用户主目录下，记录某一类文件（例如信件）
+ * 			占用的总字节数，在写入、删除的时候增量更新，从而避免每次请求都遍历
+ * 			目录、逐个 stat 文件。
+ *
+ * 			账本同时记录了对应索引文件（例如邮箱 .DIR）的大小和修改时间。若
+ * 			索引文件被其他进程（term、nju09）修改，或者距上次核对时间过久，读取
+ * 			时先返回账本中的值，再交由后台线程完整统计一次。
+ */
+
+#include <pthread.h>
+#include "apilib.h"
+
+#define API_LEDGER_MAGIC		0x4c454447	// "LEDG"
+#define API_LEDGER_QUEUE_SIZE	256
+
+struct api_ledger_record {
+	int magic;
+	long long bytes;			///< 账本记录的字节数
+	off_t stamp_size;			///< 核对时索引文件的大小
+	struct timespec stamp_mtime;///< 核对时索引文件的修改时间
+	time_t reconciled;			///< 上次完整统计的时间
+};
+
+struct api_ledger_job {
+	const struct api_ledger_kind *kind;
+	char userid[IDLEN+2];
+};
+
+static struct api_ledger_job ledger_queue[API_LEDGER_QUEUE_SIZE];
+static int ledger_queue_head = 0, ledger_queue_len = 0;
+static pthread_mutex_t ledger_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ledger_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t ledger_worker_once = PTHREAD_ONCE_INIT;
+
+static void *api_ledger_worker(void *arg);
+
+static void api_ledger_worker_start(void)
+{
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, api_ledger_worker, NULL) == 0)
+		pthread_detach(tid);
+}
+
+/**
+ * @brief 读取账本文件所在的索引文件戳记
+ * @return 成功返回 0，索引文件不存在返回 -1，此时 st 清零。
+ */
+static int api_ledger_stat(const struct api_ledger_kind *kind, const char *userid, struct stat *st)
+{
+	char path[STRLEN];
+	memset(st, 0, sizeof(*st));
+	if(!kind->stamp_path)
+		return -1;
+
+	kind->stamp_path(path, userid);
+	if(stat(path, st) < 0) {
+		memset(st, 0, sizeof(*st));
+		return -1;
+	}
+	return 0;
+}
+
+static int api_ledger_stamp_equal(const struct api_ledger_record *r, const struct stat *st)
+{
+	return r->stamp_size == st->st_size
+		&& r->stamp_mtime.tv_sec == st->st_mtim.tv_sec
+		&& r->stamp_mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief 打开并锁定账本文件
+ * @return 文件描述符，失败返回 -1。
+ */
+static int api_ledger_open(const struct api_ledger_kind *kind, const char *userid, int lock)
+{
+	char path[STRLEN];
+	int fd;
+
+	sethomefile(path, userid, kind->filename);
+	fd = open(path, O_RDWR | O_CREAT, 0600);
+	if(fd < 0)
+		return -1;
+
+	flock(fd, lock);
+	return fd;
+}
+
+static int api_ledger_read(int fd, struct api_ledger_record *r)
+{
+	if(lseek(fd, 0, SEEK_SET) < 0 || read(fd, r, sizeof(*r)) != sizeof(*r)
+			|| r->magic != API_LEDGER_MAGIC) {
+		memset(r, 0, sizeof(*r));
+		return -1;
+	}
+	return 0;
+}
+
+static void api_ledger_write(int fd, struct api_ledger_record *r)
+{
+	r->magic = API_LEDGER_MAGIC;
+	if(lseek(fd, 0, SEEK_SET) == 0)
+		write(fd, r, sizeof(*r));
+}
+
+static void api_ledger_close(int fd)
+{
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+/**
+ * @brief 完整统计一次并写入账本
+ * 戳记取自统计之前，统计期间若索引文件发生变化，下次读取时会再次核对。
+ */
+static long long api_ledger_reconcile(const struct api_ledger_kind *kind, const char *userid)
+{
+	struct api_ledger_record r;
+	struct stat st;
+	long long bytes;
+	int fd;
+
+	api_ledger_stat(kind, userid, &st);
+	bytes = kind->scan(userid);
+
+	fd = api_ledger_open(kind, userid, LOCK_EX);
+	if(fd < 0)
+		return bytes;
+
+	memset(&r, 0, sizeof(r));
+	r.bytes = bytes;
+	r.stamp_size = st.st_size;
+	r.stamp_mtime = st.st_mtim;
+	r.reconciled = time(NULL);
+	api_ledger_write(fd, &r);
+	api_ledger_close(fd);
+
+	return bytes;
+}
+
+/**
+ * @brief 将账本交给后台线程核对，重复的请求会被合并，队列满时丢弃。
+ */
+static void api_ledger_schedule(const struct api_ledger_kind *kind, const char *userid)
+{
+	int i, pos;
+
+	pthread_once(&ledger_worker_once, api_ledger_worker_start);
+
+	pthread_mutex_lock(&ledger_queue_lock);
+	for(i=0; i<ledger_queue_len; ++i) {
+		pos = (ledger_queue_head + i) % API_LEDGER_QUEUE_SIZE;
+		if(ledger_queue[pos].kind == kind && !strcasecmp(ledger_queue[pos].userid, userid)) {
+			pthread_mutex_unlock(&ledger_queue_lock);
+			return;
+		}
+	}
+
+	if(ledger_queue_len < API_LEDGER_QUEUE_SIZE) {
+		pos = (ledger_queue_head + ledger_queue_len) % API_LEDGER_QUEUE_SIZE;
+		ledger_queue[pos].kind = kind;
+		strsncpy(ledger_queue[pos].userid, userid, sizeof(ledger_queue[pos].userid));
+		ledger_queue_len++;
+		pthread_cond_signal(&ledger_queue_cond);
+	}
+	pthread_mutex_unlock(&ledger_queue_lock);
+}
+
+static void *api_ledger_worker(void *arg)
+{
+	struct api_ledger_job job;
+
+	while(1) {
+		pthread_mutex_lock(&ledger_queue_lock);
+		while(ledger_queue_len == 0)
+			pthread_cond_wait(&ledger_queue_cond, &ledger_queue_lock);
+
+		memcpy(&job, &ledger_queue[ledger_queue_head], sizeof(job));
+		ledger_queue_head = (ledger_queue_head + 1) % API_LEDGER_QUEUE_SIZE;
+		ledger_queue_len--;
+		pthread_mutex_unlock(&ledger_queue_lock);
+
+		api_ledger_reconcile(job.kind, job.userid);
+	}
+
+	return NULL;
+}
+
+long long api_ledger_get(const struct api_ledger_kind *kind, const char *userid)
+{
+	struct api_ledger_record r;
+	struct stat st;
+	int fd, stale;
+
+	fd = api_ledger_open(kind, userid, LOCK_SH);
+	if(fd < 0)
+		return kind->scan(userid);
+
+	if(api_ledger_read(fd, &r) < 0) {
+		// 尚未建立账本，同步统计一次
+		api_ledger_close(fd);
+		return api_ledger_reconcile(kind, userid);
+	}
+	api_ledger_close(fd);
+
+	api_ledger_stat(kind, userid, &st);
+	stale = (kind->stamp_path && !api_ledger_stamp_equal(&r, &st))
+		|| (kind->max_age > 0 && time(NULL) - r.reconciled > kind->max_age);
+	if(stale)
+		api_ledger_schedule(kind, userid);
+
+	return (r.bytes < 0) ? 0 : r.bytes;
+}
+
+void api_ledger_add(const struct api_ledger_kind *kind, const char *userid, long long delta, int records)
+{
+	struct api_ledger_record r;
+	struct stat st;
+	int fd, consistent;
+
+	fd = api_ledger_open(kind, userid, LOCK_EX);
+	if(fd < 0)
+		return;
+
+	if(api_ledger_read(fd, &r) < 0) {
+		// 没有账本时不做增量，等待下次读取时完整统计
+		api_ledger_close(fd);
+		return;
+	}
+
+	r.bytes += delta;
+
+	if(kind->stamp_path && records != 0 && kind->record_size > 0) {
+		// 账本与索引文件仅相差本次变更的记录时，顺延戳记。没有定长记录时无法
+		// 区分本次与其他进程的变更，不顺延，留待下次核对
+		api_ledger_stat(kind, userid, &st);
+		consistent = (r.stamp_size + records * kind->record_size == st.st_size);
+		if(consistent) {
+			r.stamp_size = st.st_size;
+			r.stamp_mtime = st.st_mtim;
+		}
+	}
+
+	api_ledger_write(fd, &r);
+	api_ledger_close(fd);
+}
+
+int api_ledger_reserve(const struct api_ledger_kind *kind, const char *userid, long long delta, long long limit)
+{
+	struct api_ledger_record r;
+	struct stat st;
+	int fd;
+
+	fd = api_ledger_open(kind, userid, LOCK_EX);
+	if(fd < 0)	// 与 api_ledger_get() 相同，无法使用账本时直接统计
+		return (delta > 0 && kind->scan(userid) + delta > limit) ? -1 : 0;
+
+	// 尚未建立账本，或索引文件已被修改时，在锁内重新统计，不以过时的值判断配额
+	api_ledger_stat(kind, userid, &st);
+	if(api_ledger_read(fd, &r) < 0 || (kind->stamp_path && !api_ledger_stamp_equal(&r, &st))) {
+		memset(&r, 0, sizeof(r));
+		r.bytes = kind->scan(userid);
+		r.stamp_size = st.st_size;
+		r.stamp_mtime = st.st_mtim;
+		r.reconciled = time(NULL);
+	}
+
+	if(delta > 0 && r.bytes + delta > limit) {
+		api_ledger_close(fd);
+		return -1;
+	}
+
+	r.bytes += delta;
+	api_ledger_write(fd, &r);
+	api_ledger_close(fd);
+	return 0;
+}
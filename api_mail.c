@@ -20,7 +20,15 @@ static int api_mail_get_content(ONION_FUNC_PROTO_STR, int mode);
 
 static int api_mail_do_post(ONION_FUNC_PROTO_STR, int mode);
 
-static char * bmy_mail_array_to_json_string(struct bmy_article *ba_list, int count, int mode, struct userec *ue);
+/**
+ * @brief 将信件列表序列化为 json 字符串
+ * @param ba_list 信件列表
+ * @param count 列表长度
+ * @param total 信箱中的信件总数
+ * @param ue 当前用户
+ * @return json 字符串，分配自请求分配区，失败返回 NULL
+ */
+static char * bmy_mail_array_to_json_string(struct bmy_article *ba_list, int count, int total, struct userec *ue);
 
 static char * parse_mail(char * userid, int filetime, int mode, struct attach_link **attach_link_list);
 
@@ -28,6 +36,8 @@ int api_mail_list(ONION_FUNC_PROTO_STR)
 {
 	const char * str_startnum = onion_request_get_query(req, "startnum");
 	const char * str_count    = onion_request_get_query(req, "count");
+	const char * str_before   = onion_request_get_query(req, "before");
+	const char * str_after    = onion_request_get_query(req, "after");
 	const char * userid   = onion_request_get_query(req, "userid");
 	const char * appkey   = onion_request_get_query(req, "appkey");
 	const char * sessid   = onion_request_get_query(req, "sessid");
@@ -36,18 +46,19 @@ int api_mail_list(ONION_FUNC_PROTO_STR)
 	if(!userid || !appkey || !sessid)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(!ue)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
 	int startnum = (str_startnum) ? atoi(str_startnum) : 999999;
 	int count = (str_count) ? atoi(str_count) : 20;
+	if(count <= 0)
+		count = 20;
 
 	char mail_dir[80];
 
@@ -57,48 +68,68 @@ int api_mail_list(ONION_FUNC_PROTO_STR)
 	else
 		setsentmailfile(mail_dir, ue->userid, ".DIR");
 
-	int total = file_size_s(mail_dir) / sizeof(struct fileheader);
+	struct mmapfile mf = { ptr:NULL };
+	api_phase_begin(API_PHASE_DIR);
+	if(mmapfile(mail_dir, &mf) < 0) {
+		api_phase_end(API_PHASE_DIR);
+		return api_error(p, req, res, API_RT_MAILDIRERR);
+	}
 
+	int total = mf.size / sizeof(struct fileheader);
 	if(!total) {
-		free(ue);
+		api_phase_end(API_PHASE_DIR);
+		mmapfile(NULL, &mf);
 		return api_error(p, req, res, API_RT_MAILEMPTY);
 	}
 
-	FILE *fp = fopen(mail_dir, "r");
-	if(fp==0) {
-		free(ue);
-		return api_error(p, req, res, API_RT_MAILDIRERR);
+	/* 游标分页，游标为信件的 filetime（即 mid）。.DIR 按时间追加，因此可以
+	 * 二分查找。新信件到达不会改变已有信件的相对位置，游标始终有效。
+	 * before: 早于该 mid 的最近 count 封信
+	 * after:  晚于该 mid 的 count 封信，用于轮询增量
+	 */
+	int start, pos;
+	if(str_after) {
+		pos = Search_Bin(mf.ptr, atoi(str_after), 0, total - 1);
+		start = (pos >= 0) ? pos + 1 : -(pos + 1);
+		if(count > total - start)
+			count = total - start;
+	} else if(str_before) {
+		pos = Search_Bin(mf.ptr, atoi(str_before), 0, total - 1);
+		pos = (pos >= 0) ? pos : -(pos + 1);
+		start = pos - count;
+		if(start < 0)
+			start = 0;
+		count = pos - start;
+	} else {
+		if(startnum == 0 || startnum > total-count+1)
+			startnum = total - count + 1;
+		if(startnum <= 0)
+			startnum = 1;
+		start = startnum - 1;
+		if(count > total - start)
+			count = total - start;
 	}
 
-	if(startnum == 0 || startnum > total-count+1)
-		startnum = total - count + 1;
-	if(startnum <= 0)
-		startnum = 1;
-
-	struct fileheader x;
 	int i;
-	struct bmy_article mail_list[count];
-	memset(mail_list, 0, sizeof(struct bmy_article) * count);
-	fseek(fp, (startnum - 1) * sizeof(struct fileheader), SEEK_SET);
-	for(i=0; i<count; ++i) {
-		if(fread(&x, sizeof(x), 1, fp) <= 0)
-			break;
-
-		mail_list[i].sequence_num = i + startnum;
-		mail_list[i].mark = x.accessed;
-		strncpy(mail_list[i].author, fh2owner(&x), sizeof(mail_list[i].author));
-		mail_list[i].filetime = x.filetime;
-		g2u(x.title, strlen(x.title), mail_list[i].title, sizeof(mail_list[i].title));
+	struct fileheader *x = (struct fileheader *)mf.ptr + start;
+	struct bmy_article mail_list[count > 0 ? count : 1];
+	memset(mail_list, 0, sizeof(mail_list));
+	for(i=0; i<count; ++i, ++x) {
+		mail_list[i].sequence_num = start + i + 1;
+		mail_list[i].mark = x->accessed;
+		strncpy(mail_list[i].author, fh2owner(x), sizeof(mail_list[i].author));
+		mail_list[i].filetime = x->filetime;
+		g2u(x->title, strlen(x->title), mail_list[i].title, sizeof(mail_list[i].title));
 	}
 
-	fclose(fp);
+	mmapfile(NULL, &mf);
+	api_phase_end(API_PHASE_DIR);
 
-	char *s = bmy_mail_array_to_json_string(mail_list, count, 0, ue);
+	char *s = bmy_mail_array_to_json_string(mail_list, count, total, ue);
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 
-	api_set_json_header(res);
-	onion_response_write0(res, s);
-	free(s);
-	free(ue);
+	api_write_json(req, res, s);
 	return OCS_PROCESSED;
 }
 
@@ -139,11 +170,8 @@ static int get_user_max_mail_size(struct userec * ue)
 
 static int get_user_mail_size(char * userid)
 {
-	int currsize = 0;
-	char currmaildir[STRLEN], tmpmail[STRLEN];
-	struct fileheader tmpfh;
-	FILE *fp;
-	time_t t;
+	long long currsize = 0;
+	char tmpmail[STRLEN];
 
 	sethomefile(tmpmail, userid, "msgindex");
 	if(file_time(tmpmail))
@@ -157,22 +185,9 @@ static int get_user_mail_size(char * userid)
 	if(file_time(tmpmail))
 		currsize += file_size_s(tmpmail);
 
-	sprintf(currmaildir, "mail/%c/%s/%s", mytoupper(userid[0]), userid, DOT_DIR);
-	t = file_time(currmaildir);
-	if(!t)
-		return (currsize/1024);
-
-	fp = fopen(currmaildir, "r");
-	if(!fp)
-		return (currsize/1024);
-
-	while(fread(&tmpfh, 1, sizeof(tmpfh), fp) == sizeof(tmpfh)) {
-		setmailfile(tmpmail, userid, fh2fname(&tmpfh));
-		currsize += file_size_s(tmpmail);
-	}
-
-	fclose(fp);
-	return (currsize/1024);
+	// 信件部分由账本维护，不再逐封 stat
+	currsize += api_ledger_get(&mail_size_ledger, userid);
+	return (int)(currsize/1024);
 }
 
 static int check_user_maxmail(struct userec currentuser)
@@ -199,12 +214,11 @@ static int api_mail_get_content(ONION_FUNC_PROTO_STR, int mode)
 	if(!userid || !sessid || !appkey || !str_num)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec * ue = getuser(userid);
+	struct userec * ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
 	if(check_user_session(ue, sessid, appkey) != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, API_RT_WRONGSESS);
 	}
 
@@ -219,7 +233,6 @@ static int api_mail_get_content(ONION_FUNC_PROTO_STR, int mode)
 
 	FILE *fp = fopen(mail_dir, "r");
 	if(fp==0) {
-		free(ue);
 		return api_error(p, req, res, API_RT_MAILINNERR);
 	}
 
@@ -234,7 +247,6 @@ static int api_mail_get_content(ONION_FUNC_PROTO_STR, int mode)
 	fseek(fp, (num-1)*sizeof(struct fileheader), SEEK_SET);
 	if(fread(&fh, sizeof(fh), 1, fp) <= 0) {
 		fclose(fp);
-		free(ue);
 		return api_error(p, req, res, API_RT_MAILINNERR);
 	}
 
@@ -248,91 +260,73 @@ static int api_mail_get_content(ONION_FUNC_PROTO_STR, int mode)
 
 	if(!mail_content_utf8) {
 		// 文件不存在
-		free(ue);
 		free_attach_link_list(attach_link_list);
 		return api_error(p, req, res, API_RT_MAILEMPTY);
 	}
 
-	char * mail_json_str = (char *)malloc(strlen(mail_content_utf8) + 512);
-
-	if(!mail_json_str) {
-		free(ue);
-		free(mail_content_utf8);
-		free_attach_link_list(attach_link_list);
-		return api_error(p, req, res, API_RT_NOTENGMEM);
-	}
-
-	memset(mail_json_str, 0, strlen(mail_content_utf8)+512);
-	sprintf(mail_json_str, "{\"errcode\": 0, \"attach\":[]}");
-	struct json_object * jp = json_tokener_parse(mail_json_str);
-	if(!jp) {
-		free(ue);
-		free(mail_content_utf8);
-		free_attach_link_list(attach_link_list);
-		free(mail_json_str);
-		return api_error(p, req, res, API_RT_NOTENGMEM);
-	}
-
-	json_object_object_add(jp, "content", json_object_new_string(mail_content_utf8));
-	json_object_object_add(jp, "title", json_object_new_string(title_utf));
-	if(attach_link_list) {
-		struct json_object * attach_array = json_object_object_get(jp, "attach");
-		char at_buf[320];
-		struct attach_link * alp = attach_link_list;
-		while(alp) {
-			memset(at_buf, 0, 320);
-			sprintf(at_buf, "{\"link\": \"%s\", \"size\": %d}", alp->link, alp->size);
-			json_object_array_add(attach_array, json_tokener_parse(at_buf));
-			alp=alp->next;
-		}
+	// 收件箱中的未读信件标记为已读，同时更新未读计数缓存
+	if(box_type_i == API_MAIL_RECIEVE_BOX && !(fh.accessed & FH_READ))
+		mail_mark_read(ue->userid, num, fh.filetime);
+
+	struct api_arena_buf out;
+	struct attach_link * alp;
+	api_arena_buf_init(&out, strlen(mail_content_utf8) + 512);
+	api_arena_buf_puts(&out, "{\"errcode\": 0, \"attach\":[");
+	for(alp = attach_link_list; alp; alp = alp->next) {
+		api_arena_buf_puts(&out, (alp == attach_link_list) ? "{\"link\": " : ", {\"link\": ");
+		api_arena_buf_json_str(&out, alp->link);
+		api_arena_buf_printf(&out, ", \"size\": %d}", alp->size);
 	}
+	api_arena_buf_puts(&out, "], \"content\": ");
+	api_arena_buf_json_str(&out, mail_content_utf8);
+	api_arena_buf_puts(&out, ", \"title\": ");
+	api_arena_buf_json_str(&out, title_utf);
+	api_arena_buf_puts(&out, "}");
 
-	char * api_output = strdup(json_object_to_json_string(jp));
-
-	free(ue);
-	free(mail_content_utf8);
 	free_attach_link_list(attach_link_list);
-	free(mail_json_str);
-	json_object_put(jp);
 
-	api_set_json_header(res);
-	onion_response_write0(res, api_output);
-	free(api_output);
+	if(!out.s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, out.s);
 
 	return OCS_PROCESSED;
 }
 
-static char * bmy_mail_array_to_json_string(struct bmy_article *ba_list, int count, int mode, struct userec *ue)
+static char * bmy_mail_array_to_json_string(struct bmy_article *ba_list, int count, int total, struct userec *ue)
 {
-	char buf[512];
-	int i;
+	int i, cursor_before = 0, cursor_after = 0;
 	struct bmy_article *p;
-	struct json_object *jp;
+	struct api_arena_buf buf;
+
+	// 游标取当前页第一封和最后一封信的 mid
+	if(count > 0 && ba_list[0].filetime > 0) {
+		cursor_before = ba_list[0].filetime;
+		cursor_after = ba_list[count-1].filetime;
+	}
 
-	sprintf(buf, "{\"errcode\":0,\"max_size\":%d, \"current_size\":%d, \"maillist\":[]}", get_user_max_mail_size(ue), get_user_mail_size(ue->userid));
-	struct json_object *obj = json_tokener_parse(buf);
-	struct json_object *json_array = json_object_object_get(obj, "maillist");
+	api_arena_buf_init(&buf, 256 + count * 160);
+	api_arena_buf_printf(&buf, "{\"errcode\":0,\"max_size\":%d, \"current_size\":%d, \"total\":%d,"
+			"\"cursor_before\":%d, \"cursor_after\":%d, \"maillist\":[",
+			get_user_max_mail_size(ue), get_user_mail_size(ue->userid), total,
+			cursor_before, cursor_after);
+	api_phase_begin(API_PHASE_JSON);
 
 	for(i=0; i<count; ++i) {
 		p = &(ba_list[i]);
 		if(p->filetime<=0)	// 通过文件时间判断是否为空
 			break;
 
-		memset(buf, 0, 512);
-		sprintf(buf, "{ \"num\": %d, \"mark\": %d, \"mid\":%d }",
-				p->sequence_num, p->mark, p->filetime);
-		jp = json_tokener_parse(buf);
-		if(jp) {
-			json_object_object_add(jp, "title", json_object_new_string(p->title));
-			json_object_object_add(jp, "author", json_object_new_string(p->author));
-			json_object_array_add(json_array, jp);
-		}
+		api_arena_buf_printf(&buf, "%s{\"num\": %d, \"mark\": %d, \"mid\":%d, \"title\": ",
+				(i == 0) ? "" : ", ", p->sequence_num, p->mark, (int)p->filetime);
+		api_arena_buf_json_str(&buf, p->title);
+		api_arena_buf_puts(&buf, ", \"author\": ");
+		api_arena_buf_json_str(&buf, p->author);
+		api_arena_buf_puts(&buf, "}");
 	}
+	api_arena_buf_puts(&buf, "]}");
 
-	char *r = strdup(json_object_to_json_string(obj));
-	json_object_put(obj);
-
-	return r;
+	api_phase_end(API_PHASE_JSON);
+	return buf.s;
 }
 
 static int api_mail_do_post(ONION_FUNC_PROTO_STR, int mode)
@@ -348,13 +342,12 @@ static int api_mail_do_post(ONION_FUNC_PROTO_STR, int mode)
 	if(!userid || !appkey || !sessid || !title || !to_userid || !token)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(!ue)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	struct userec currentuser;
 	memcpy(&currentuser, ue, sizeof(currentuser));
-	free(ue);
 
 	int r = check_user_session(&currentuser, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
@@ -387,48 +380,31 @@ static int api_mail_do_post(ONION_FUNC_PROTO_STR, int mode)
 	}
 
 	if(inoverride(currentuser.userid, to_user->userid, "rejects")) {
-		free(to_user);
 		return api_error(p, req, res, API_RT_INUSERBLIST);
 	}
 
 	const char * data = onion_request_get_post(req, "content");
 
-	char filename[80];
-	sprintf(filename, "bbstmpfs/tmp/%s_%s.tmp", currentuser.userid, ui->token);
-
-	char * data2 = strdup(data);
-	while(strstr(data2, "[ESC]") != NULL)
-		data2 = string_replace(data2, "[ESC]", "\033");
-
-	char * data_gbk = (char *)malloc(strlen(data2)*2);
-	u2g(data2, strlen(data2), data_gbk, strlen(data2)*2);
-
-	f_write(filename, data_gbk);
-	free(data2);
+	char * data2 = api_arena_replace_all(data ? data : "", "[ESC]", "\033");
+	char * title_tmp = api_arena_u2g(title, strlen(title));
+	if(!data2 || !title_tmp)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 
 	int mark=0;		// 文件标记
 	//if(insertattachments(filename, data_gbk, currentuser->userid)>0)
 		//mark |= FH_ATTACHED;
 
-	free(data_gbk);
-
-	char * title_tmp = (char *)malloc(strlen(title)*2);
-	u2g(title, strlen(title), title_tmp, strlen(title)*2);
 	char title_gbk[80], title_tmp2[80];
 	strncpy(title_gbk, title_tmp[0]==0 ? "No Subject" : title_tmp, 80);
 	snprintf(title_tmp2, 80, "{%s} %s", to_user->userid, title);
-	free(title_tmp);
 
-	r = do_mail_post(to_user->userid, title, filename, currentuser.userid,
+	r = do_mail_post(to_user->userid, title, data2, currentuser.userid,
 			currentuser.username, fromhost, 0, mark);
 	if(backup && strcasecmp(backup, "true")==0) {
-		do_mail_post_to_sent_box(currentuser.userid, title_tmp2, filename, currentuser.userid,
+		do_mail_post_to_sent_box(currentuser.userid, title_tmp2, data2, currentuser.userid,
 			currentuser.username, fromhost, 0, mark);
 	}
 
-	unlink(filename);
-	free(to_user);
-
 	if(r<0) {
 		return api_error(p, req, res, API_RT_MAILINNERR);
 	}
@@ -453,6 +429,8 @@ static char * parse_mail(char * userid, int filetime, int mode, struct attach_li
 	if(!article_stream)
 		return NULL;
 
+	api_phase_begin(API_PHASE_PARSE);
+
 	FILE *mem_stream, *html_stream;
 	char *mem_buf, *html_buf, buf[512], attach_link[256], *tmp_buf, *attach_filename;
 	size_t mem_buf_len, html_buf_len, attach_file_size;
@@ -476,13 +454,14 @@ static char * parse_mail(char * userid, int filetime, int mode, struct attach_li
 			fflush(mem_stream);
 			fclose(mem_stream);
 			free(mem_buf);
+			api_phase_end(API_PHASE_PARSE);
 			return NULL;
 		} else if(checkbinaryattach(buf, article_stream, &attach_file_size)) {
 			attach_no++;
 			attach_filename = buf + 18;
 			fprintf(mem_stream, "#attach %s\n", attach_filename);
 			memset(attach_link, 0, 256);
-			snprintf(attach_link, 256, "/api/attach/get?mid=%d&pos=%d&attname=%s",
+			snprintf(attach_link, 256, "/api/attach/show?type=mail&mid=%d&pos=%d&attname=%s",
 					filetime, -4+(int)ftell(article_stream), attach_filename);
 			add_attach_link(attach_link_list, attach_link, attach_file_size);
 			fseek(article_stream, attach_file_size, SEEK_CUR);
@@ -491,14 +470,8 @@ static char * parse_mail(char * userid, int filetime, int mode, struct attach_li
 
 		// 常规字符处理
 		if(mode == ARTICLE_PARSE_WITHOUT_ANSICOLOR && strchr(buf, '\033')!=NULL) {
-			tmp_buf = strdup(buf);
-
-			while(strchr(tmp_buf, '\033') != NULL)
-				tmp_buf = string_replace(tmp_buf, "\033", "[ESC]");
-
-			fprintf(mem_stream, "%s", tmp_buf);
-			free(tmp_buf);
-			tmp_buf = NULL;
+			tmp_buf = api_arena_replace_all(buf, "\033", "[ESC]");
+			fprintf(mem_stream, "%s", tmp_buf ? tmp_buf : buf);
 		} else {
 			fprintf(mem_stream, "%s", buf[0]==0 ? "" : buf);
 		}
@@ -509,11 +482,9 @@ static char * parse_mail(char * userid, int filetime, int mode, struct attach_li
 	char *utf_content;
 	if(mode == ARTICLE_PARSE_WITHOUT_ANSICOLOR) {
 		if(strlen(mem_buf)==0) {
-			utf_content = strdup("");
+			utf_content = api_arena_strdup("");
 		} else {
-			utf_content = (char *)malloc(3*mem_buf_len);
-			memset(utf_content, 0, 3*mem_buf_len);
-			g2u(mem_buf, mem_buf_len, utf_content, 3*mem_buf_len);
+			utf_content = api_arena_g2u(mem_buf, mem_buf_len);
 		}
 	} else {
 		html_stream = open_memstream(&html_buf, &html_buf_len);
@@ -526,9 +497,7 @@ static char * parse_mail(char * userid, int filetime, int mode, struct attach_li
 		fflush(html_stream);
 		fclose(html_stream);
 
-		utf_content = (char*)malloc(3*html_buf_len);
-		memset(utf_content, 0, 3*html_buf_len);
-		g2u(html_buf, html_buf_len, utf_content, 3*html_buf_len);
+		utf_content = api_arena_g2u(html_buf, html_buf_len);
 		free(html_buf);
 	}
 
@@ -536,6 +505,7 @@ static char * parse_mail(char * userid, int filetime, int mode, struct attach_li
 	fclose(mem_stream);
 	free(mem_buf);
 
+	api_phase_end(API_PHASE_PARSE);
 	return utf_content;
 }
 
@@ -10,3 +10,56 @@ int api_meta_loginpics(ONION_FUNC_PROTO_STR)
 	free(pics);
 	return OCS_PROCESSED;
 }
+
+/**
+ * @brief meta/metrics 包含各接口的延迟与错误数，不对公开的访问者开放
+ * 允许直接来自本机回环地址、没有经过反向代理（不带 X-Real-IP、X-Forwarded-For）
+ * 的请求；配置了 metrics_token 时，也允许带有 "Authorization: Bearer <token>" 的请求。
+ * @return 允许访问返回 1
+ */
+static int api_meta_metrics_allowed(onion_request *req)
+{
+	const char *token = api_config_get()->metrics_token;
+	const char *auth = onion_request_get_header(req, "Authorization");
+	const char *from;
+	size_t i, len;
+	int diff;
+
+	if(token[0] && auth && !strncasecmp(auth, "Bearer ", 7)) {
+		auth += 7;
+		len = strlen(token);
+		if(strlen(auth) == len) {
+			// 逐字节比较全部内容，耗时不泄漏匹配的长度
+			for(i = 0, diff = 0; i < len; ++i)
+				diff |= auth[i] ^ token[i];
+			if(diff == 0)
+				return 1;
+		}
+	}
+
+	if(onion_request_get_header(req, "X-Real-IP") || onion_request_get_header(req, "X-Forwarded-For"))
+		return 0;
+	from = onion_request_get_client_description(req);
+	return from && (!strncmp(from, "127.", 4) || !strcmp(from, "::1") || !strncmp(from, "::ffff:127.", 11));
+}
+
+int api_meta_metrics(ONION_FUNC_PROTO_STR)
+{
+	char *s;
+
+	if(!api_meta_metrics_allowed(req)) {
+		onion_response_set_code(res, HTTP_FORBIDDEN);
+		onion_response_write0(res, "forbidden\n");
+		return OCS_PROCESSED;
+	}
+
+	s = api_metrics_render();
+	if(!s)
+		return OCS_INTERNAL_ERROR;
+
+	onion_response_set_header(res, "Content-Type", "text/plain; version=0.0.4; charset=utf-8");
+	onion_response_write0(res, s);
+
+	free(s);
+	return OCS_PROCESSED;
+}
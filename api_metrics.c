@@ -0,0 +1,458 @@
+/**
+ * @file	api_metrics.c
+ * @brief	请求统计：每个路由的请求数、延迟分布、状态码、errcode 与输出字节数。
+ * @details	每个工作线程第一次处理请求时分配自己的统计块，并挂到全局链表上，
+ * 			之后只由该线程写入，请求路径上没有锁和原子读改写。meta/metrics 读取
+ * 			时遍历链表合并，以 Prometheus 文本格式输出。
+ *
+ * 			所有路由由 api_router_init() 通过 api_metrics_add_route() 分配统计槽位，
+ * 			请求由 api_route_dispatch() 统一计时，通过频率限制（api_ratelimit.c）与
+ * 			准入控制（api_admit.c）后再交给 api_route_run()，处理完毕后回收请求
+ * 			分配区，参见 api_arena.c。
+ *
+ * 			处理函数内部可以用 api_phase_begin()/api_phase_end() 标记各个阶段，
+ * 			各阶段耗时通过 Server-Timing 响应头返回；总耗时超过阈值的请求连同
+ * 			参数和各阶段耗时写入慢请求日志。阈值由配置中的 slow_ms 设置。
+ */
+
+#include <pthread.h>
+#include "api.h"
+#include "api_hist.h"
+
+#define API_METRICS_ERRCODES	64	///< 每个线程记录的不同 errcode 个数上限
+#define API_SLOW_LOG			"reclog/api_slow.log"
+#define API_SLOW_MS_DEFAULT		500
+
+struct api_route_stats {
+	struct api_hist latency;		///< 微秒
+	uint64_t status[6];				///< 按状态码首位统计，0 为其他
+	uint64_t bytes;
+};
+
+struct api_errcode_stats {
+	int errcode;
+	uint64_t count;
+};
+
+struct api_metrics_thread {
+	struct api_route_stats routes[API_ROUTE_MAX];
+	struct api_errcode_stats errcodes[API_METRICS_ERRCODES];
+	int errcode_num;
+	struct api_metrics_thread *next;
+};
+
+static struct api_route *api_routes[API_ROUTE_MAX];
+static int api_route_num = 0;
+
+static struct api_metrics_thread *api_metrics_threads = NULL;
+static pthread_mutex_t api_metrics_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread struct api_metrics_thread *api_metrics_self = NULL;
+
+/**
+ * 当前线程正在处理的请求的 errcode，由 api_error() 设置
+ */
+static __thread int api_metrics_errcode = 0;
+
+struct api_timing {
+	int active;
+	struct timespec begin;
+	struct timespec phase_begin[API_PHASE_MAX];
+	uint64_t phase_ns[API_PHASE_MAX];
+	int depth[API_PHASE_MAX];
+};
+
+static __thread struct api_timing api_timing;
+static int api_slow_ms = API_SLOW_MS_DEFAULT;
+
+static const char *api_phase_names[API_PHASE_MAX] = {
+	"auth", "dir", "parse", "conv", "json", "redis", "output"
+};
+
+static int api_inflight = 0;
+static int api_inflight_peak = 0;
+static time_t api_started = 0;
+
+static struct api_metrics_thread *api_metrics_thread_get(void)
+{
+	struct api_metrics_thread *t = api_metrics_self;
+	if(t)
+		return t;
+
+	t = (struct api_metrics_thread *)calloc(1, sizeof(*t));
+	if(!t)
+		return NULL;
+
+	pthread_mutex_lock(&api_metrics_lock);
+	t->next = api_metrics_threads;
+	api_metrics_threads = t;
+	pthread_mutex_unlock(&api_metrics_lock);
+
+	api_metrics_self = t;
+	return t;
+}
+
+static inline void api_counter_inc(uint64_t *c, uint64_t v)
+{
+	__atomic_store_n(c, *c + v, __ATOMIC_RELAXED);
+}
+
+static void api_metrics_count_errcode(struct api_metrics_thread *t, int errcode)
+{
+	int i;
+
+	for(i=0; i<t->errcode_num; ++i) {
+		if(t->errcodes[i].errcode == errcode) {
+			api_counter_inc(&t->errcodes[i].count, 1);
+			return;
+		}
+	}
+
+	if(t->errcode_num < API_METRICS_ERRCODES) {
+		t->errcodes[i].errcode = errcode;
+		api_counter_inc(&t->errcodes[i].count, 1);
+		__atomic_store_n(&t->errcode_num, t->errcode_num + 1, __ATOMIC_RELEASE);
+	}
+}
+
+static inline uint64_t api_timespec_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+void api_phase_begin(enum api_phase phase)
+{
+	if(!api_timing.active)
+		return;
+	if(api_timing.depth[phase]++ == 0)
+		clock_gettime(CLOCK_MONOTONIC, &api_timing.phase_begin[phase]);
+}
+
+void api_phase_end(enum api_phase phase)
+{
+	struct timespec now;
+
+	if(!api_timing.active || api_timing.depth[phase] <= 0)
+		return;
+	if(--api_timing.depth[phase] == 0) {
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		api_timing.phase_ns[phase] += api_timespec_diff_ns(&api_timing.phase_begin[phase], &now);
+	}
+}
+
+void api_timing_set_header(onion_response *res)
+{
+	char buf[256];
+	struct timespec now;
+	int i, len = 0;
+
+	if(!api_timing.active)
+		return;
+
+	for(i=0; i<API_PHASE_MAX; ++i) {
+		if(api_timing.phase_ns[i] == 0)
+			continue;
+		len += snprintf(buf + len, sizeof(buf) - len, "%s;dur=%.3f, ",
+				api_phase_names[i], api_timing.phase_ns[i] / 1e6);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	snprintf(buf + len, sizeof(buf) - len, "total;dur=%.3f",
+			api_timespec_diff_ns(&api_timing.begin, &now) / 1e6);
+	onion_response_set_header(res, "Server-Timing", buf);
+}
+
+void api_metrics_set_slow_threshold(int ms)
+{
+	api_slow_ms = ms;
+}
+
+static void api_slow_log_param(void *data, const char *key, const void *value, int flags)
+{
+	FILE *fp = (FILE *)data;
+
+	// 不记录会话和密码
+	if(!strcasecmp(key, "sessid") || !strcasecmp(key, "passwd") || !strcasecmp(key, "token"))
+		value = "***";
+	fprintf(fp, " %s=%s", key, (const char *)value);
+}
+
+/**
+ * @brief 写入慢请求日志，每个请求一行，以 O_APPEND 一次写入
+ */
+static void api_slow_log(const struct api_route *route, onion_request *req, uint64_t total_ns)
+{
+	char *line = NULL, timestr[32];
+	size_t len = 0;
+	time_t now_t = time(NULL);
+	struct tm tm;
+	FILE *fp;
+	int i, fd;
+
+	fp = open_memstream(&line, &len);
+	if(!fp)
+		return;
+
+	localtime_r(&now_t, &tm);
+	strftime(timestr, sizeof(timestr), "%Y-%m-%d %H:%M:%S", &tm);
+	fprintf(fp, "%s %s total=%.3fms", timestr, route->path, total_ns / 1e6);
+	for(i=0; i<API_PHASE_MAX; ++i) {
+		if(api_timing.phase_ns[i])
+			fprintf(fp, " %s=%.3fms", api_phase_names[i], api_timing.phase_ns[i] / 1e6);
+	}
+	fprintf(fp, " |");
+	onion_dict_preorder(onion_request_get_query_dict(req), api_slow_log_param, fp);
+	fprintf(fp, "\n");
+	fclose(fp);
+
+	fd = open(API_SLOW_LOG, O_WRONLY | O_CREAT | O_APPEND, 0644);
+	if(fd >= 0) {
+		write(fd, line, len);
+		close(fd);
+	}
+	free(line);
+}
+
+void api_metrics_set_errcode(int errcode)
+{
+	api_metrics_errcode = errcode;
+}
+
+int api_metrics_get_errcode(void)
+{
+	return api_metrics_errcode;
+}
+
+int api_metrics_add_route(struct api_route *route)
+{
+	if(api_route_num >= API_ROUTE_MAX)
+		return -1;
+
+	if(!api_started)
+		api_started = time(NULL);
+
+	route->index = api_route_num;
+	api_routes[api_route_num++] = route;
+	return 0;
+}
+
+int api_route_dispatch(void *p, onion_request *req, onion_response *res)
+{
+	struct api_route *route = (struct api_route *)p;
+	struct api_metrics_thread *t;
+	struct timespec begin, end;
+	int ret, inflight, peak, code;
+
+	inflight = __atomic_add_fetch(&api_inflight, 1, __ATOMIC_RELAXED);
+	peak = __atomic_load_n(&api_inflight_peak, __ATOMIC_RELAXED);
+	while(inflight > peak
+			&& !__atomic_compare_exchange_n(&api_inflight_peak, &peak, inflight, 1,
+				__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+
+	api_metrics_errcode = 0;
+	memset(&api_timing, 0, sizeof(api_timing));
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	api_timing.begin = begin;
+	api_timing.active = 1;
+
+	// 被限制或拒绝的请求不占用并发名额
+	if(api_ratelimit_check(route, req) < 0) {
+		onion_response_set_header(res, "Retry-After", "1");
+		ret = api_error(p, req, res, API_RT_THROTTLED);
+	} else if(api_admit_begin(route) == API_ADMIT_REJECT) {
+		onion_response_set_header(res, "Retry-After", "1");
+		ret = api_error(p, req, res, API_RT_OVERLOADED);
+	} else if(api_pool_enter(api_admit_wait_ms()) < 0) {
+		api_admit_end(0);
+		onion_response_set_header(res, "Retry-After", "1");
+		ret = api_error(p, req, res, API_RT_OVERLOADED);
+	} else {
+		api_admit_started();
+		if(api_admit_degraded())
+			onion_response_set_header(res, "X-Degraded", "1");
+		ret = api_route_run(route, p, req, res);
+		api_pool_leave();
+		api_admit_end(1);
+	}
+	api_arena_reset();		// 响应已经复制到 onion 的缓冲区中
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	if(api_slow_ms > 0 && api_timespec_diff_ns(&begin, &end) >= api_slow_ms * 1000000LL)
+		api_slow_log(route, req, api_timespec_diff_ns(&begin, &end));
+	api_timing.active = 0;
+
+	__atomic_sub_fetch(&api_inflight, 1, __ATOMIC_RELAXED);
+
+	t = api_metrics_thread_get();
+	if(t) {
+		struct api_route_stats *rs = &t->routes[route->index];
+		uint64_t us = (end.tv_sec - begin.tv_sec) * 1000000LL + (end.tv_nsec - begin.tv_nsec) / 1000;
+
+		api_hist_record(&rs->latency, us);
+
+		code = api_onion_response_code(res) / 100;
+		api_counter_inc(&rs->status[(code >= 1 && code <= 5) ? code : 0], 1);
+		api_counter_inc(&rs->bytes, api_onion_response_bytes(res));
+
+		api_metrics_count_errcode(t, api_metrics_errcode);
+	}
+
+	return ret;
+}
+
+/**
+ * @brief 合并所有线程的 errcode 统计
+ * @return 不同 errcode 的个数
+ */
+static int api_metrics_merge_errcodes(struct api_errcode_stats *out, int max)
+{
+	struct api_metrics_thread *t;
+	int i, j, n = 0, num;
+
+	for(t = api_metrics_threads; t; t = t->next) {
+		num = __atomic_load_n(&t->errcode_num, __ATOMIC_ACQUIRE);
+		for(i=0; i<num; ++i) {
+			for(j=0; j<n; ++j) {
+				if(out[j].errcode == t->errcodes[i].errcode)
+					break;
+			}
+			if(j == n) {
+				if(n >= max)
+					continue;
+				out[n].errcode = t->errcodes[i].errcode;
+				out[n].count = 0;
+				n++;
+			}
+			out[j].count += __atomic_load_n(&t->errcodes[i].count, __ATOMIC_RELAXED);
+		}
+	}
+	return n;
+}
+
+char *api_metrics_render(void)
+{
+	static const uint64_t le_us[] = { 100, 250, 500, 1000, 2500, 5000, 10000, 25000,
+		50000, 100000, 250000, 500000, 1000000, 2500000, 5000000, 10000000 };
+	static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+	static const char *status_class[] = { "other", "1xx", "2xx", "3xx", "4xx", "5xx" };
+	struct api_errcode_stats errcodes[API_METRICS_ERRCODES * 4];
+	struct api_metrics_thread *t;
+	struct api_hist *hist;
+	uint64_t status[6], bytes;
+	char *buf = NULL;
+	size_t len = 0;
+	int i, j, n, threads = 0;
+	FILE *fp;
+
+	fp = open_memstream(&buf, &len);
+	if(!fp)
+		return NULL;
+
+	hist = (struct api_hist *)malloc(sizeof(struct api_hist));
+	if(!hist) {
+		fclose(fp);
+		free(buf);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&api_metrics_lock);
+
+	fprintf(fp, "# HELP bmyapi_request_duration_seconds Request latency by route.\n");
+	fprintf(fp, "# TYPE bmyapi_request_duration_seconds histogram\n");
+	for(i=0; i<api_route_num; ++i) {
+		memset(hist, 0, sizeof(*hist));
+		for(t = api_metrics_threads; t; t = t->next)
+			api_hist_merge(hist, &t->routes[i].latency);
+
+		for(j=0; j<sizeof(le_us)/sizeof(le_us[0]); ++j)
+			fprintf(fp, "bmyapi_request_duration_seconds_bucket{route=\"%s\",le=\"%g\"} %llu\n",
+					api_routes[i]->path, le_us[j] / 1e6,
+					(unsigned long long)api_hist_count_le(hist, le_us[j]));
+		fprintf(fp, "bmyapi_request_duration_seconds_bucket{route=\"%s\",le=\"+Inf\"} %llu\n",
+				api_routes[i]->path, (unsigned long long)hist->count);
+		fprintf(fp, "bmyapi_request_duration_seconds_sum{route=\"%s\"} %.6f\n",
+				api_routes[i]->path, hist->sum / 1e6);
+		fprintf(fp, "bmyapi_request_duration_seconds_count{route=\"%s\"} %llu\n",
+				api_routes[i]->path, (unsigned long long)hist->count);
+	}
+
+	fprintf(fp, "# HELP bmyapi_request_duration_quantile_seconds Latency quantiles by route, from the same histogram.\n");
+	fprintf(fp, "# TYPE bmyapi_request_duration_quantile_seconds gauge\n");
+	for(i=0; i<api_route_num; ++i) {
+		memset(hist, 0, sizeof(*hist));
+		for(t = api_metrics_threads; t; t = t->next)
+			api_hist_merge(hist, &t->routes[i].latency);
+		if(hist->count == 0)
+			continue;
+
+		for(j=0; j<sizeof(quantiles)/sizeof(quantiles[0]); ++j)
+			fprintf(fp, "bmyapi_request_duration_quantile_seconds{route=\"%s\",quantile=\"%g\"} %.6f\n",
+					api_routes[i]->path, quantiles[j], api_hist_quantile(hist, quantiles[j]) / 1e6);
+		fprintf(fp, "bmyapi_request_duration_quantile_seconds{route=\"%s\",quantile=\"1\"} %.6f\n",
+				api_routes[i]->path, hist->max / 1e6);
+	}
+
+	fprintf(fp, "# HELP bmyapi_responses_total Responses by route and HTTP status class.\n");
+	fprintf(fp, "# TYPE bmyapi_responses_total counter\n");
+	for(i=0; i<api_route_num; ++i) {
+		memset(status, 0, sizeof(status));
+		for(t = api_metrics_threads; t; t = t->next) {
+			for(j=0; j<6; ++j)
+				status[j] += __atomic_load_n(&t->routes[i].status[j], __ATOMIC_RELAXED);
+		}
+		for(j=0; j<6; ++j) {
+			if(status[j])
+				fprintf(fp, "bmyapi_responses_total{route=\"%s\",status=\"%s\"} %llu\n",
+						api_routes[i]->path, status_class[j], (unsigned long long)status[j]);
+		}
+	}
+
+	fprintf(fp, "# HELP bmyapi_response_bytes_total Response bytes written by route.\n");
+	fprintf(fp, "# TYPE bmyapi_response_bytes_total counter\n");
+	for(i=0; i<api_route_num; ++i) {
+		bytes = 0;
+		for(t = api_metrics_threads; t; t = t->next)
+			bytes += __atomic_load_n(&t->routes[i].bytes, __ATOMIC_RELAXED);
+		fprintf(fp, "bmyapi_response_bytes_total{route=\"%s\"} %llu\n",
+				api_routes[i]->path, (unsigned long long)bytes);
+	}
+
+	fprintf(fp, "# HELP bmyapi_errcode_total Responses by API errcode.\n");
+	fprintf(fp, "# TYPE bmyapi_errcode_total counter\n");
+	n = api_metrics_merge_errcodes(errcodes, sizeof(errcodes)/sizeof(errcodes[0]));
+	for(i=0; i<n; ++i)
+		fprintf(fp, "bmyapi_errcode_total{errcode=\"%d\"} %llu\n",
+				errcodes[i].errcode, (unsigned long long)errcodes[i].count);
+
+	for(t = api_metrics_threads; t; t = t->next)
+		threads++;
+
+	pthread_mutex_unlock(&api_metrics_lock);
+
+	fprintf(fp, "# HELP bmyapi_inflight_requests Requests currently being handled.\n");
+	fprintf(fp, "# TYPE bmyapi_inflight_requests gauge\n");
+	fprintf(fp, "bmyapi_inflight_requests %d\n", __atomic_load_n(&api_inflight, __ATOMIC_RELAXED));
+	fprintf(fp, "# HELP bmyapi_inflight_requests_peak Highest number of concurrent requests since start.\n");
+	fprintf(fp, "# TYPE bmyapi_inflight_requests_peak gauge\n");
+	fprintf(fp, "bmyapi_inflight_requests_peak %d\n", __atomic_load_n(&api_inflight_peak, __ATOMIC_RELAXED));
+	fprintf(fp, "# HELP bmyapi_pool_threads Size of the onion worker pool.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_threads gauge\n");
+	fprintf(fp, "bmyapi_pool_threads %d\n", api_pool_threads());
+	fprintf(fp, "# HELP bmyapi_pool_threads_seen Worker threads that have handled at least one request.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_threads_seen gauge\n");
+	fprintf(fp, "bmyapi_pool_threads_seen %d\n", threads);
+	fprintf(fp, "# HELP bmyapi_pool_saturation Fraction of the worker pool busy with requests.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_saturation gauge\n");
+	fprintf(fp, "bmyapi_pool_saturation %.4f\n",
+			(double)__atomic_load_n(&api_inflight, __ATOMIC_RELAXED) / api_pool_threads());
+	api_pool_render(fp);
+	api_ratelimit_render(fp);
+	api_admit_render(fp);
+	fprintf(fp, "# HELP bmyapi_start_time_seconds Unix time the server started.\n");
+	fprintf(fp, "# TYPE bmyapi_start_time_seconds gauge\n");
+	fprintf(fp, "bmyapi_start_time_seconds %ld\n", (long)api_started);
+
+	free(hist);
+	fclose(fp);
+	return buf;
+}
@@ -1,5 +1,175 @@
+#include <pthread.h>
 #include "api.h"
 
+/**
+ * libythtbbs 中提醒文件的文件名，位于用户主目录下。
+ * 缓存以该文件的大小和修改时间为戳记，若文件不存在则不做缓存。
+ */
+#define API_NOTIFICATION_FILE		"notification"
+#define API_NOTIFICATION_CACHE_MAX	8192
+
+struct notification_key {
+	char board[24];
+	int aid;
+};
+
+struct notification_cache_entry {
+	struct timespec mtime;			///< 解析时提醒文件的修改时间
+	off_t size;						///< 解析时提醒文件的大小，-1 表示失效
+	int count;
+	struct notification_key *keys;	///< 按 (board, aid) 排序，用于二分查找
+};
+
+static ght_hash_table_t *notification_cache = NULL;
+static pthread_mutex_t notification_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int notification_key_cmp(const void *a, const void *b)
+{
+	const struct notification_key *ka = a, *kb = b;
+	int r = strcasecmp(ka->board, kb->board);
+	if(r)
+		return r;
+	return (ka->aid > kb->aid) - (ka->aid < kb->aid);
+}
+
+/**
+ * @brief 由解析结果建立缓存项。
+ * @param st 解析之前提醒文件的 stat，解析期间若文件变化，下次访问时会再次解析
+ * @warning 调用前需要持有 notification_cache_lock。
+ */
+static void notification_cache_fill(const char *userid, const struct stat *st, NotifyItemList list)
+{
+	struct notification_cache_entry *e;
+	struct NotifyItem *item;
+	int n = 0;
+
+	if(!notification_cache) {
+		notification_cache = ght_create(4096);
+		if(!notification_cache)
+			return;
+	}
+
+	e = ght_get(notification_cache, strlen(userid), userid);
+	if(!e) {
+		if(ght_size(notification_cache) >= API_NOTIFICATION_CACHE_MAX)
+			return;
+		e = (struct notification_cache_entry *)calloc(1, sizeof(*e));
+		if(!e)
+			return;
+		if(ght_insert(notification_cache, e, strlen(userid), userid) < 0) {
+			free(e);
+			return;
+		}
+	}
+
+	for(item = (struct NotifyItem *)list; item != NULL; item = item->next)
+		n++;
+
+	free(e->keys);
+	e->keys = (n > 0) ? (struct notification_key *)malloc(n * sizeof(struct notification_key)) : NULL;
+	if(n > 0 && !e->keys) {
+		e->size = -1;
+		return;
+	}
+
+	n = 0;
+	for(item = (struct NotifyItem *)list; item != NULL; item = item->next) {
+		strsncpy(e->keys[n].board, item->board, sizeof(e->keys[n].board));
+		e->keys[n].aid = item->noti_time;
+		n++;
+	}
+	qsort(e->keys, n, sizeof(struct notification_key), notification_key_cmp);
+
+	e->count = n;
+	e->mtime = st->st_mtim;
+	e->size = st->st_size;
+}
+
+/**
+ * @brief 取得与提醒文件一致的缓存项，必要时重新解析。
+ * @return 缓存项，提醒文件不存在或无法缓存时返回 NULL。返回时持有
+ *         notification_cache_lock，由调用者释放。
+ */
+static struct notification_cache_entry *notification_cache_lock_entry(const char *userid)
+{
+	struct notification_cache_entry *e;
+	NotifyItemList list;
+	struct stat st;
+	char path[STRLEN];
+
+	sethomefile(path, userid, API_NOTIFICATION_FILE);
+	if(stat(path, &st) < 0) {
+		pthread_mutex_lock(&notification_cache_lock);
+		return NULL;
+	}
+
+	pthread_mutex_lock(&notification_cache_lock);
+	e = notification_cache ? ght_get(notification_cache, strlen(userid), userid) : NULL;
+	if(e && e->size == st.st_size
+			&& e->mtime.tv_sec == st.st_mtim.tv_sec
+			&& e->mtime.tv_nsec == st.st_mtim.tv_nsec)
+		return e;
+	pthread_mutex_unlock(&notification_cache_lock);
+
+	list = parse_notification((char *)userid);
+
+	pthread_mutex_lock(&notification_cache_lock);
+	notification_cache_fill(userid, &st, list);
+	free_notification(list);
+
+	e = notification_cache ? ght_get(notification_cache, strlen(userid), userid) : NULL;
+	return (e && e->size >= 0) ? e : NULL;
+}
+
+int api_notification_count(const char *userid)
+{
+	struct notification_cache_entry *e;
+	int count;
+
+	e = notification_cache_lock_entry(userid);
+	if(!e) {
+		pthread_mutex_unlock(&notification_cache_lock);
+		return count_notification_num((char *)userid);
+	}
+
+	count = e->count;
+	pthread_mutex_unlock(&notification_cache_lock);
+	return count;
+}
+
+int api_notification_has_post(const char *userid, const char *board, int aid)
+{
+	struct notification_cache_entry *e;
+	struct notification_key key;
+	int found;
+
+	e = notification_cache_lock_entry(userid);
+	if(!e) {
+		pthread_mutex_unlock(&notification_cache_lock);
+		return is_post_in_notification((char *)userid, (char *)board, aid);
+	}
+
+	strsncpy(key.board, board, sizeof(key.board));
+	key.aid = aid;
+	found = (e->count > 0
+			&& bsearch(&key, e->keys, e->count, sizeof(key), notification_key_cmp) != NULL);
+	pthread_mutex_unlock(&notification_cache_lock);
+	return found;
+}
+
+void api_notification_del_post(const char *userid, const char *board, int aid)
+{
+	struct notification_cache_entry *e;
+
+	del_post_notification((char *)userid, (char *)board, aid);
+
+	pthread_mutex_lock(&notification_cache_lock);
+	e = notification_cache ? ght_get(notification_cache, strlen(userid), userid) : NULL;
+	if(e)
+		e->size = -1;
+	pthread_mutex_unlock(&notification_cache_lock);
+}
+
 int api_notification_list(ONION_FUNC_PROTO_STR)
 {
 	const char * userid = onion_request_get_query(req, "userid");
@@ -10,19 +180,23 @@ int api_notification_list(ONION_FUNC_PROTO_STR)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 	}
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if (ue == 0) {
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r = check_user_session(ue, sessid, appkey);
 	if (r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
 	struct json_object *obj = json_tokener_parse("{\"errcode\": 0, \"notifications\": []}");
 	struct json_object *noti_array = json_object_object_get(obj, "notifications");
+	struct stat st;
+	char path[STRLEN];
+	sethomefile(path, ue->userid, API_NOTIFICATION_FILE);
+	int cacheable = (stat(path, &st) == 0);
+
 	NotifyItemList allNotifyItems = parse_notification(ue->userid);
 	struct json_object * item = NULL;
 	struct NotifyItem * currItem;
@@ -40,12 +214,16 @@ int api_notification_list(ONION_FUNC_PROTO_STR)
 		json_object_array_add(noti_array, item);
 	}
 
+	// 已经完整解析过一次，顺便刷新缓存
+	if(cacheable) {
+		pthread_mutex_lock(&notification_cache_lock);
+		notification_cache_fill(ue->userid, &st, allNotifyItems);
+		pthread_mutex_unlock(&notification_cache_lock);
+	}
 	free_notification(allNotifyItems);
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(obj));
+	api_write_json(req, res, json_object_to_json_string(obj));
 	json_object_put(obj);
-	free(ue);
 
 	return OCS_PROCESSED;
 }
@@ -68,23 +246,21 @@ int api_notification_del(ONION_FUNC_PROTO_STR)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 	}
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if (ue == 0) {
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r = check_user_session(ue, sessid, appkey);
 	if (r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
 	if ((type != NULL) && (strcasecmp(type, "delall") == 0)) {
 		del_all_notification(ue->userid);
 	} else {
-		del_post_notification(ue->userid, board, atoi(aid_str));
+		api_notification_del_post(ue->userid, board, atoi(aid_str));
 	}
 
-	free(ue);
 	return api_error(p, req, res, API_RT_SUCCESSFUL);
 }
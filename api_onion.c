@@ -0,0 +1,177 @@
+/**
+ * @file	api_onion.c
+ * @brief	访问 onion 内部结构的兼容层。
+ * @details	onion 没有公开的接口用于使用已有的监听套接字、直接取得连接的描述符、
+ * 			截获请求的输出，也不能读取响应的状态码与已输出的字节数。这些操作依赖
+ * 			onion/types_internal.h 中的结构布局，bmyapi 中全部集中在本文件，其他文件
+ * 			只调用这里的函数，不再包含 types_internal.h（压测工具 bench_handlers.c
+ * 			自行构造请求，不受此限）。
+ *
+ * 			只有编译时的 onion 版本经过核对（API_ONION_VERIFIED_MAJOR、_MINOR）才会
+ * 			访问内部结构，否则编译为退回的实现：不能使用传入的监听套接字，多进程
+ * 			模式不可用；附件不使用 sendfile，由调用者经由 onion_response_write() 输出；
+ * 			batch 接口不可用；meta/metrics 中各接口的状态码与输出字节数不再统计。
+ * 			升级 onion 时需要对照新版本的 types_internal.h 检查本文件后再修改版本号。
+ */
+
+#include <pthread.h>
+#include <sys/sendfile.h>
+#include <onion/http.h>
+#include "api.h"
+
+#define API_ONION_VERIFIED_MAJOR	0
+#define API_ONION_VERIFIED_MINOR	8
+
+#if defined(__has_include)
+#if __has_include(<onion/version.h>)
+#include <onion/version.h>
+#endif
+#endif
+
+#if defined(ONION_VERSION_MAJOR) && defined(ONION_VERSION_MINOR) \
+		&& ONION_VERSION_MAJOR == API_ONION_VERIFIED_MAJOR \
+		&& ONION_VERSION_MINOR == API_ONION_VERIFIED_MINOR
+#define API_ONION_INTERNALS	1
+#include <onion/types_internal.h>
+#else
+#define API_ONION_INTERNALS	0
+#endif
+
+int api_onion_internals(void)
+{
+	return API_ONION_INTERNALS;
+}
+
+#if API_ONION_INTERNALS
+
+static int api_onion_listen_fd = -1;
+
+static void api_onion_listen(onion_listen_point *op)
+{
+	op->listenfd = api_onion_listen_fd;
+}
+
+int api_onion_add_listen_fd(onion *server, int fd)
+{
+	onion_listen_point *lp = onion_http_new();
+
+	if(!lp)
+		return -1;
+	api_onion_listen_fd = fd;
+	lp->listen = api_onion_listen;
+	onion_add_listen_point(server, NULL, NULL, lp);
+	return 0;
+}
+
+int api_onion_sendfile(onion_request *req, onion_response *res, int fd, off_t offset, size_t length)
+{
+	size_t left = length;
+	ssize_t w;
+
+	// 只有明文 HTTP 连接的写函数直接写入套接字，参照 onion_shortcut_response_file
+	if(req->connection.listen_point->write != (void *)onion_http_write)
+		return 0;
+
+	onion_response_flush(res);	// 先把缓冲的响应头写出
+	while(left > 0) {
+		w = sendfile(req->connection.fd, fd, &offset, left);
+		if(w <= 0) {
+			if(w < 0 && errno == EINTR)
+				continue;
+			return -1;
+		}
+		left -= w;
+	}
+	res->sent_bytes += length;
+	return 1;
+}
+
+static onion_listen_point *api_onion_capture_lp = NULL;
+static pthread_once_t api_onion_capture_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief 截获用的 listen point 的写函数，写入请求对应的内存流
+ */
+static ssize_t api_onion_capture_write(onion_request *req, const char *data, size_t len)
+{
+	FILE *fp = (FILE *)req->connection.user_data;
+	return fwrite(data, 1, len, fp);
+}
+
+static void api_onion_capture_init(void)
+{
+	api_onion_capture_lp = onion_listen_point_new();
+	if(!api_onion_capture_lp)
+		return;
+	api_onion_capture_lp->server = o;
+	api_onion_capture_lp->write = api_onion_capture_write;
+	api_onion_capture_lp->read = NULL;
+	api_onion_capture_lp->close = NULL;
+}
+
+onion_request *api_onion_capture_request(FILE *fp)
+{
+	onion_request *req;
+
+	pthread_once(&api_onion_capture_once, api_onion_capture_init);
+	if(!api_onion_capture_lp)
+		return NULL;
+
+	req = onion_request_new(api_onion_capture_lp);
+	if(!req)
+		return NULL;
+	req->connection.user_data = fp;
+	req->flags |= OR_GET;
+	if(!req->GET)
+		req->GET = onion_dict_new();
+	return req;
+}
+
+void api_onion_request_set_query(onion_request *req, const char *key, const char *value)
+{
+	onion_dict_add(req->GET, key, value, OD_DUP_ALL | OD_REPLACE);
+}
+
+int api_onion_response_code(onion_response *res)
+{
+	return res->code;
+}
+
+size_t api_onion_response_bytes(onion_response *res)
+{
+	// 尚未刷新的部分仍在 onion 的缓冲区中
+	return res->sent_bytes + res->buffer_pos;
+}
+
+#else
+
+int api_onion_add_listen_fd(onion *server, int fd)
+{
+	return -1;
+}
+
+int api_onion_sendfile(onion_request *req, onion_response *res, int fd, off_t offset, size_t length)
+{
+	return 0;
+}
+
+onion_request *api_onion_capture_request(FILE *fp)
+{
+	return NULL;
+}
+
+void api_onion_request_set_query(onion_request *req, const char *key, const char *value)
+{
+}
+
+int api_onion_response_code(onion_response *res)
+{
+	return 0;
+}
+
+size_t api_onion_response_bytes(onion_response *res)
+{
+	return 0;
+}
+
+#endif
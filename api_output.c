@@ -0,0 +1,373 @@
+/**
+ * @file	api_output.c
+ * @brief	JSON 响应的输出，按照 Accept-Encoding 协商 gzip/deflate 压缩。
+ * @details	超过 API_COMPRESS_MIN 字节的响应才做压缩。
+ *
+ * 			预压缩片段 struct api_gzseg 以 Z_FULL_FLUSH 结束，不依赖前文，
+ * 			因此可以直接拼接在每个请求单独压缩的前缀和后缀之间，组成一个完整的
+ * 			gzip 流。热点数据（十大、文章正文等）只需要在填充缓存时压缩一次。
+ */
+
+#include <zlib.h>
+#include "api.h"
+
+#define API_COMPRESS_MIN	1024	///< 小于该长度的响应不压缩
+#define API_COMPRESS_LEVEL	6		///< 每个请求单独压缩时使用的级别
+#define API_GZSEG_LEVEL		9		///< 预压缩片段使用的级别
+
+enum api_encoding {
+	API_ENCODING_IDENTITY = 0,
+	API_ENCODING_GZIP,
+	API_ENCODING_DEFLATE,
+};
+
+static const unsigned char gzip_header[10] = { 0x1f, 0x8b, 8, 0, 0, 0, 0, 0, 0, 3 };
+
+/**
+ * @brief 写出 len 个字节，len 为 0 时不调用 onion（onion 将空写视为刷新）
+ */
+static void api_response_write_n(onion_response *res, const char *data, size_t len)
+{
+	if(len > 0)
+		onion_response_write(res, data, len);
+}
+
+/**
+ * @brief 判断 Accept-Encoding 中是否接受某种编码，q=0 视为不接受
+ */
+static int accept_encoding_has(const char *accept, const char *name)
+{
+	const char *s = accept;
+	size_t n = strlen(name);
+
+	while((s = strcasestr(s, name)) != NULL) {
+		if((s == accept || s[-1] == ' ' || s[-1] == ',')
+				&& (s[n] == 0 || s[n] == ',' || s[n] == ';' || s[n] == ' ')) {
+			const char *q = s + n;
+			while(*q == ' ')
+				q++;
+			if(*q == ';') {
+				q = strstr(q, "q=");
+				if(q && atof(q + 2) == 0)
+					return 0;
+			}
+			return 1;
+		}
+		s += n;
+	}
+	return 0;
+}
+
+static enum api_encoding api_negotiate_encoding(onion_request *req)
+{
+	const char *accept = onion_request_get_header(req, "Accept-Encoding");
+	if(!accept)
+		return API_ENCODING_IDENTITY;
+
+	if(accept_encoding_has(accept, "gzip"))
+		return API_ENCODING_GZIP;
+	if(accept_encoding_has(accept, "deflate"))
+		return API_ENCODING_DEFLATE;
+	return API_ENCODING_IDENTITY;
+}
+
+/**
+ * @brief 把 in 压缩后追加到 out 中
+ * @param flush Z_FULL_FLUSH 或 Z_FINISH
+ * @return 成功返回 0
+ */
+static int api_deflate_append(z_stream *zs, const char *in, size_t len, int flush, char **out, size_t *out_len, size_t *out_cap)
+{
+	int r;
+
+	zs->next_in = (Bytef *)in;
+	zs->avail_in = len;
+	do {
+		if(*out_cap - *out_len < 256) {
+			size_t cap = *out_cap ? *out_cap * 2 : deflateBound(zs, len) + 64;
+			char *p = realloc(*out, cap);
+			if(!p)
+				return -1;
+			*out = p;
+			*out_cap = cap;
+		}
+		zs->next_out = (Bytef *)(*out + *out_len);
+		zs->avail_out = *out_cap - *out_len;
+		r = deflate(zs, flush);
+		if(r == Z_STREAM_ERROR)
+			return -1;
+		*out_len = *out_cap - zs->avail_out;
+	} while(zs->avail_out == 0 || (flush == Z_FINISH && r != Z_STREAM_END));
+
+	return 0;
+}
+
+static void api_put_le32(char *p, uLong v)
+{
+	p[0] = v & 0xff;
+	p[1] = (v >> 8) & 0xff;
+	p[2] = (v >> 16) & 0xff;
+	p[3] = (v >> 24) & 0xff;
+}
+
+/**
+ * @brief 压缩 prefix、seg、suffix 三段组成的内容
+ * prefix 以 Z_FULL_FLUSH 结束后直接接上预压缩的 seg，seg 同样以 Z_FULL_FLUSH
+ * 结束、不引用前文，随后 suffix 在同一个流中压缩并结束。
+ * @param seg 预压缩片段，可以为 NULL
+ * @param head 传出参数，gzip 头加上压缩后的 prefix
+ * @param tail 传出参数，压缩后的 suffix 加上 gzip 尾
+ * @return 成功返回 0
+ */
+static int api_gzip_compose(const char *prefix, size_t prefix_len, const struct api_gzseg *seg,
+		const char *suffix, size_t suffix_len, int level, int gzip,
+		char **head, size_t *head_len, char **tail, size_t *tail_len)
+{
+	z_stream zs;
+	size_t head_cap = 0, tail_cap = 0;
+	uLong check, total;
+
+	*head = *tail = NULL;
+	*head_len = *tail_len = 0;
+
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, level, Z_DEFLATED, gzip ? -MAX_WBITS : MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	if(gzip) {
+		head_cap = sizeof(gzip_header) + deflateBound(&zs, prefix_len) + 64;
+		*head = malloc(head_cap);
+		if(!*head)
+			goto ERROR;
+		memcpy(*head, gzip_header, sizeof(gzip_header));
+		*head_len = sizeof(gzip_header);
+	}
+
+	if(seg) {
+		if(api_deflate_append(&zs, prefix, prefix_len, Z_FULL_FLUSH, head, head_len, &head_cap) < 0)
+			goto ERROR;
+	} else {
+		// 没有预压缩片段时，前后两段作为一个整体压缩
+		if(api_deflate_append(&zs, prefix, prefix_len, Z_NO_FLUSH, head, head_len, &head_cap) < 0)
+			goto ERROR;
+	}
+
+	if(api_deflate_append(&zs, suffix, suffix_len, Z_FINISH, tail, tail_len, &tail_cap) < 0)
+		goto ERROR;
+	deflateEnd(&zs);
+
+	if(gzip) {
+		total = prefix_len + suffix_len;
+		check = crc32(0L, (const Bytef *)prefix, prefix_len);
+		if(seg) {
+			check = crc32_combine(check, seg->crc, seg->raw_len);
+			total += seg->raw_len;
+		}
+		check = crc32(check, (const Bytef *)suffix, suffix_len);
+
+		if(tail_cap - *tail_len < 8) {
+			char *p = realloc(*tail, *tail_len + 8);
+			if(!p)
+				goto ERROR;
+			*tail = p;
+		}
+		api_put_le32(*tail + *tail_len, check);
+		api_put_le32(*tail + *tail_len + 4, total);
+		*tail_len += 8;
+	}
+
+	return 0;
+
+ERROR:
+	deflateEnd(&zs);
+	free(*head);
+	free(*tail);
+	*head = *tail = NULL;
+	return -1;
+}
+
+int api_gzseg_init(struct api_gzseg *seg, char *raw, size_t len)
+{
+	z_stream zs;
+	size_t cap;
+
+	memset(seg, 0, sizeof(*seg));
+	seg->raw = raw;
+	seg->raw_len = len;
+	seg->crc = crc32(0L, (const Bytef *)raw, len);
+
+	memset(&zs, 0, sizeof(zs));
+	if(deflateInit2(&zs, API_GZSEG_LEVEL, Z_DEFLATED, -MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+		return -1;
+
+	cap = 0;
+	if(api_deflate_append(&zs, raw, len, Z_FULL_FLUSH, &seg->deflated, &seg->deflated_len, &cap) < 0) {
+		deflateEnd(&zs);
+		free(seg->deflated);
+		seg->deflated = NULL;
+		seg->deflated_len = 0;
+		return -1;
+	}
+
+	deflateEnd(&zs);
+	return 0;
+}
+
+void api_gzseg_free(struct api_gzseg *seg)
+{
+	free(seg->raw);
+	free(seg->deflated);
+	memset(seg, 0, sizeof(*seg));
+}
+
+static void api_write_json_parts_do(onion_request *req, onion_response *res,
+		const char *prefix, const struct api_gzseg *seg, const char *suffix)
+{
+	if(!prefix)
+		prefix = "";
+	if(!suffix)
+		suffix = "";
+
+	size_t prefix_len = strlen(prefix);
+	size_t suffix_len = strlen(suffix);
+	size_t total = prefix_len + suffix_len + (seg ? seg->raw_len : 0);
+	enum api_encoding enc = API_ENCODING_IDENTITY;
+	char *head, *tail;
+	size_t head_len, tail_len;
+
+	api_set_json_header(res);
+	onion_response_set_header(res, "Vary", "Accept-Encoding");
+
+	if(total >= API_COMPRESS_MIN)
+		enc = api_negotiate_encoding(req);
+
+	// 预压缩片段只能拼接进 gzip 流（deflate 格式的 adler32 校验同样可以合并，但客户端支持不一，
+	// 这里统一对 deflate 请求实时压缩）
+	if(enc == API_ENCODING_DEFLATE && seg) {
+		char *buf = malloc(total + 1);
+		if(buf) {
+			memcpy(buf, prefix, prefix_len);
+			memcpy(buf + prefix_len, seg->raw, seg->raw_len);
+			memcpy(buf + prefix_len + seg->raw_len, suffix, suffix_len);
+			buf[total] = 0;
+			if(api_gzip_compose(buf, total, NULL, "", 0, API_COMPRESS_LEVEL, 0,
+						&head, &head_len, &tail, &tail_len) == 0) {
+				onion_response_set_header(res, "Content-Encoding", "deflate");
+				onion_response_set_length(res, head_len + tail_len);
+				api_response_write_n(res, head, head_len);
+				api_response_write_n(res, tail, tail_len);
+				free(head);
+				free(tail);
+				free(buf);
+				return;
+			}
+			free(buf);
+		}
+		enc = API_ENCODING_IDENTITY;
+	}
+
+	if(enc != API_ENCODING_IDENTITY
+			&& api_gzip_compose(prefix, prefix_len, seg, suffix, suffix_len,
+				API_COMPRESS_LEVEL, enc == API_ENCODING_GZIP, &head, &head_len, &tail, &tail_len) == 0) {
+		onion_response_set_header(res, "Content-Encoding", (enc == API_ENCODING_GZIP) ? "gzip" : "deflate");
+		onion_response_set_length(res, head_len + (seg ? seg->deflated_len : 0) + tail_len);
+		api_response_write_n(res, head, head_len);
+		if(seg)
+			api_response_write_n(res, seg->deflated, seg->deflated_len);
+		api_response_write_n(res, tail, tail_len);
+		free(head);
+		free(tail);
+		return;
+	}
+
+	onion_response_set_length(res, total);
+	api_response_write_n(res, prefix, prefix_len);
+	if(seg)
+		api_response_write_n(res, seg->raw, seg->raw_len);
+	api_response_write_n(res, suffix, suffix_len);
+}
+
+void api_write_json_parts(onion_request *req, onion_response *res,
+		const char *prefix, const struct api_gzseg *seg, const char *suffix)
+{
+	api_phase_begin(API_PHASE_OUTPUT);
+	api_write_json_parts_do(req, res, prefix, seg, suffix);
+	api_phase_end(API_PHASE_OUTPUT);
+}
+
+void api_write_json(onion_request *req, onion_response *res, const char *s)
+{
+	api_write_json_parts(req, res, s, NULL, NULL);
+}
+
+#define API_ETAG_FNV_OFFSET	14695981039346656037ULL
+#define API_ETAG_FNV_PRIME	1099511628211ULL
+
+static void api_etag_add_bytes(struct api_etag *e, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+	size_t i;
+
+	for(i=0; i<len; ++i) {
+		e->h ^= p[i];
+		e->h *= API_ETAG_FNV_PRIME;
+	}
+}
+
+void api_etag_init(struct api_etag *e)
+{
+	e->h = API_ETAG_FNV_OFFSET;
+}
+
+void api_etag_add_int(struct api_etag *e, long long v)
+{
+	api_etag_add_bytes(e, &v, sizeof(v));
+}
+
+void api_etag_add_str(struct api_etag *e, const char *s)
+{
+	if(s)
+		api_etag_add_bytes(e, s, strlen(s) + 1);
+	else
+		api_etag_add_int(e, -1);
+}
+
+void api_etag_add_stat(struct api_etag *e, const struct stat *st)
+{
+	api_etag_add_int(e, st->st_ino);
+	api_etag_add_int(e, st->st_size);
+	api_etag_add_int(e, st->st_mtim.tv_sec);
+	api_etag_add_int(e, st->st_mtim.tv_nsec);
+}
+
+void api_etag_add_file(struct api_etag *e, const char *path)
+{
+	struct stat st;
+
+	if(stat(path, &st) < 0)
+		memset(&st, 0, sizeof(st));
+	api_etag_add_stat(e, &st);
+}
+
+int api_etag_respond(onion_request *req, onion_response *res, const struct api_etag *e)
+{
+	static const char *suffix[] = { "", "-gzip", "-deflate" };
+	char etag[48];
+	const char *inm;
+
+	// 不同的编码是不同的表示，强校验的 ETag 需要区分
+	snprintf(etag, sizeof(etag), "\"%016llx%s\"", (unsigned long long)e->h,
+			suffix[api_negotiate_encoding(req)]);
+	onion_response_set_header(res, "ETag", etag);
+
+	inm = onion_request_get_header(req, "If-None-Match");
+	if(!inm || (strstr(inm, etag) == NULL && strcmp(inm, "*") != 0))
+		return 0;
+
+	onion_response_set_header(res, "Vary", "Accept-Encoding");
+	onion_response_set_header(res, "access-control-allow-origin", "*");
+	onion_response_set_code(res, HTTP_NOT_MODIFIED);
+	onion_response_set_length(res, 0);
+	onion_response_write_headers(res);
+	return 1;
+}
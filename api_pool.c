@@ -0,0 +1,240 @@
+/**
+ * @file	api_pool.c
+ * @brief	自适应并发：依据排队情况与阻塞比例调整同时处理请求的工作线程数。
+ * @details	onion 的线程池启动后不能改变大小，因此按配置的 threads 创建线程，再由一个
+ * 			闸门限制其中同时处理请求的个数 limit，其余线程在闸门前等待。
+ *
+ * 			控制线程每秒采样一次。处理请求期间线程 CPU 时间与墙钟时间之比为 1-b，
+ * 			b 即阻塞（主要是读 .DIR 与文章的磁盘 I/O）所占的比例。让本进程可用的
+ * 			ncpu 个 CPU 保持忙碌大约需要 ncpu/(1-b) 个并发：目标更大且有请求排队时
+ * 			limit 直接增加到目标，目标更小时每次最多减少四分之一。以 .DIR 扫描为主时
+ * 			b 较高，limit 随之增大；以渲染为主时 b 较低，limit 收缩到 CPU 数附近，
+ * 			减少争用。
+ *
+ * 			配置中 adaptive 为 0 时闸门不起作用，可以通过 SIGHUP 随时打开或关闭。
+ * 			准入控制（api_admit.c）为每个请求设置排队的时限，超时的请求不再处理。
+ */
+
+#include <sched.h>
+#include <pthread.h>
+#include "api.h"
+
+#define API_POOL_INTERVAL	1		///< 采样间隔，秒
+#define API_POOL_MAX_BLOCKED	0.95	///< 阻塞比例的上限，避免目标无限增大
+
+static pthread_mutex_t api_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t api_pool_cond = PTHREAD_COND_INITIALIZER;
+static int api_pool_size = API_MAX_THREADS;		///< onion 线程数
+static int api_pool_limit = API_MAX_THREADS;
+static int api_pool_active = 0;
+static int api_pool_waiting = 0;
+static uint64_t api_pool_queued_total = 0;		///< 需要排队的请求数
+static uint64_t api_pool_timeouts_total = 0;	///< 排队超时放弃的请求数
+static uint64_t api_pool_wall_ns = 0;			///< 通过闸门的请求处理时间之和
+static uint64_t api_pool_cpu_ns = 0;			///< 同上，线程 CPU 时间
+static double api_pool_blocked = 0;				///< 最近一次采样的阻塞比例
+
+static __thread int api_pool_entered = 0;
+static __thread struct timespec api_pool_wall_begin;
+static __thread struct timespec api_pool_cpu_begin;
+
+static uint64_t api_pool_diff_ns(const struct timespec *a, const struct timespec *b)
+{
+	return (b->tv_sec - a->tv_sec) * 1000000000LL + (b->tv_nsec - a->tv_nsec);
+}
+
+int api_pool_enter(int timeout_ms)
+{
+	struct timespec deadline;
+
+	if(!api_config_get()->adaptive) {
+		api_pool_entered = 0;
+		return 0;
+	}
+
+	if(timeout_ms > 0) {
+		clock_gettime(CLOCK_REALTIME, &deadline);
+		deadline.tv_sec += timeout_ms / 1000;
+		deadline.tv_nsec += (timeout_ms % 1000) * 1000000L;
+		if(deadline.tv_nsec >= 1000000000L) {
+			deadline.tv_sec++;
+			deadline.tv_nsec -= 1000000000L;
+		}
+	}
+
+	pthread_mutex_lock(&api_pool_lock);
+	if(api_pool_active >= api_pool_limit) {
+		api_pool_queued_total++;
+		api_pool_waiting++;
+		while(api_pool_active >= api_pool_limit) {
+			if(timeout_ms <= 0) {
+				pthread_cond_wait(&api_pool_cond, &api_pool_lock);
+			} else if(pthread_cond_timedwait(&api_pool_cond, &api_pool_lock, &deadline) == ETIMEDOUT
+					&& api_pool_active >= api_pool_limit) {
+				api_pool_waiting--;
+				api_pool_timeouts_total++;
+				pthread_mutex_unlock(&api_pool_lock);
+				api_pool_entered = 0;
+				return -1;
+			}
+		}
+		api_pool_waiting--;
+	}
+	api_pool_active++;
+	pthread_mutex_unlock(&api_pool_lock);
+
+	api_pool_entered = 1;
+	clock_gettime(CLOCK_MONOTONIC, &api_pool_wall_begin);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &api_pool_cpu_begin);
+	return 0;
+}
+
+void api_pool_leave(void)
+{
+	struct timespec wall, cpu;
+
+	if(!api_pool_entered)
+		return;
+	api_pool_entered = 0;
+
+	clock_gettime(CLOCK_MONOTONIC, &wall);
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu);
+	__atomic_add_fetch(&api_pool_wall_ns, api_pool_diff_ns(&api_pool_wall_begin, &wall), __ATOMIC_RELAXED);
+	__atomic_add_fetch(&api_pool_cpu_ns, api_pool_diff_ns(&api_pool_cpu_begin, &cpu), __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&api_pool_lock);
+	api_pool_active--;
+	pthread_cond_signal(&api_pool_cond);
+	pthread_mutex_unlock(&api_pool_lock);
+}
+
+/**
+ * @brief 依据一个采样周期内的数据调整 limit
+ * @param wall 周期内的请求处理时间
+ * @param cpu 周期内的线程 CPU 时间
+ * @param queued 周期内需要排队的请求数
+ */
+static void api_pool_adjust(uint64_t wall, uint64_t cpu, uint64_t queued, int ncpu)
+{
+	const struct api_config *conf = api_config_get();
+	double blocked;
+	int target, limit, lower;
+
+	blocked = (cpu < wall) ? 1 - (double)cpu / wall : 0;
+	if(blocked > API_POOL_MAX_BLOCKED)
+		blocked = API_POOL_MAX_BLOCKED;
+
+	lower = (conf->threads_min < api_pool_size) ? conf->threads_min : api_pool_size;
+	target = (int)(ncpu / (1 - blocked) + 0.5);
+	if(target < lower)
+		target = lower;
+	if(target > api_pool_size)
+		target = api_pool_size;
+
+	pthread_mutex_lock(&api_pool_lock);
+	limit = api_pool_limit;
+	if(target > limit && queued > 0)
+		limit = target;
+	else if(target < limit)
+		limit = (limit - (limit + 3) / 4 > target) ? limit - (limit + 3) / 4 : target;
+
+	if(limit > api_pool_limit)
+		pthread_cond_broadcast(&api_pool_cond);
+	api_pool_limit = limit;
+	api_pool_blocked = blocked;
+	pthread_mutex_unlock(&api_pool_lock);
+}
+
+/**
+ * @brief 本进程允许使用的 CPU 数
+ * cpu_affinity 为 1 时每个工作进程只绑定一个 CPU，不能按整台机器的 CPU 数计算。
+ * 每次采样时重新读取，绑定发生在控制线程启动之后同样有效。
+ */
+static int api_pool_ncpu(void)
+{
+	cpu_set_t set;
+	int n;
+
+	if(sched_getaffinity(0, sizeof(set), &set) == 0 && (n = CPU_COUNT(&set)) > 0)
+		return n;
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	return (n > 0) ? n : 1;
+}
+
+static void *api_pool_control(void *arg)
+{
+	uint64_t wall, cpu, queued, last_wall = 0, last_cpu = 0, last_queued = 0;
+
+	for(;;) {
+		sleep(API_POOL_INTERVAL);
+
+		wall = __atomic_load_n(&api_pool_wall_ns, __ATOMIC_RELAXED);
+		cpu = __atomic_load_n(&api_pool_cpu_ns, __ATOMIC_RELAXED);
+		pthread_mutex_lock(&api_pool_lock);
+		queued = api_pool_queued_total;
+		pthread_mutex_unlock(&api_pool_lock);
+
+		if(!api_config_get()->adaptive) {
+			// 关闭时恢复为全部线程，再次打开时从头开始调整
+			pthread_mutex_lock(&api_pool_lock);
+			api_pool_limit = api_pool_size;
+			pthread_cond_broadcast(&api_pool_cond);
+			pthread_mutex_unlock(&api_pool_lock);
+		} else if(wall > last_wall) {
+			api_pool_adjust(wall - last_wall, cpu - last_cpu, queued - last_queued, api_pool_ncpu());
+		}
+
+		last_wall = wall;
+		last_cpu = cpu;
+		last_queued = queued;
+	}
+	return NULL;
+}
+
+int api_pool_init(int threads)
+{
+	pthread_t tid;
+
+	api_pool_size = threads;
+	api_pool_limit = threads;
+	if(pthread_create(&tid, NULL, api_pool_control, NULL) != 0)
+		return -1;
+	pthread_detach(tid);
+	return 0;
+}
+
+int api_pool_threads(void)
+{
+	return api_pool_size;
+}
+
+void api_pool_render(FILE *fp)
+{
+	int limit, waiting;
+	uint64_t queued, timeouts;
+	double blocked;
+
+	pthread_mutex_lock(&api_pool_lock);
+	limit = api_pool_limit;
+	waiting = api_pool_waiting;
+	queued = api_pool_queued_total;
+	timeouts = api_pool_timeouts_total;
+	blocked = api_pool_blocked;
+	pthread_mutex_unlock(&api_pool_lock);
+
+	fprintf(fp, "# HELP bmyapi_pool_limit Worker threads allowed to handle requests at the same time.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_limit gauge\n");
+	fprintf(fp, "bmyapi_pool_limit %d\n", limit);
+	fprintf(fp, "# HELP bmyapi_pool_waiting Requests waiting for a free slot.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_waiting gauge\n");
+	fprintf(fp, "bmyapi_pool_waiting %d\n", waiting);
+	fprintf(fp, "# HELP bmyapi_pool_queued_total Requests that had to wait for a free slot.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_queued_total counter\n");
+	fprintf(fp, "bmyapi_pool_queued_total %llu\n", (unsigned long long)queued);
+	fprintf(fp, "# HELP bmyapi_pool_timeouts_total Requests that gave up waiting for a free slot.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_timeouts_total counter\n");
+	fprintf(fp, "bmyapi_pool_timeouts_total %llu\n", (unsigned long long)timeouts);
+	fprintf(fp, "# HELP bmyapi_pool_blocked_ratio Share of request time spent off CPU in the last interval.\n");
+	fprintf(fp, "# TYPE bmyapi_pool_blocked_ratio gauge\n");
+	fprintf(fp, "bmyapi_pool_blocked_ratio %.4f\n", blocked);
+}
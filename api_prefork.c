@@ -0,0 +1,343 @@
+/**
+ * @file	api_prefork.c
+ * @brief	多进程模式：一个监督进程加上若干个各自运行 onion 的工作进程。
+ * @details	配置中 workers 大于 0 时，启动的进程成为监督进程。它为每个工作进程的
+ * 			槽位创建一个设置了 SO_REUSEPORT 的监听套接字，由内核在这些套接字之间
+ * 			分配连接，然后为每个槽位 fork 并重新执行 bmyapi。套接字按 systemd 的约定
+ * 			以文件描述符 3 传给工作进程（LISTEN_FDS=1），因此单进程模式下同样可以
+ * 			使用 systemd 的 socket 激活。
+ *
+ * 			各进程之间不共享 malloc 分配区、json-c 与 stdio 的锁。cpu_affinity 为 1 时
+ * 			第 i 个工作进程绑定到允许使用的第 i 个 CPU 上。
+ *
+ * 			套接字始终由监督进程持有：
+ * 			- 工作进程异常退出后，监督进程在一秒后重新启动它，期间到达该槽位的连接
+ * 			  留在套接字的队列中，由新进程接受；
+ * 			- 收到 SIGUSR2 时逐个槽位滚动重启：先启动新进程并等待其就绪，两者共同
+ * 			  接受连接，再结束旧进程。重新执行的是磁盘上当前的 bmyapi，可用于升级；
+ * 			- SIGHUP 转发给所有工作进程，由它们各自重新读取配置；
+ * 			- SIGTERM、SIGINT 结束所有工作进程后退出。
+ *
+ * 			统计信息（meta/metrics）按进程分别计算。
+ */
+
+#include <sched.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/prctl.h>
+#include <limits.h>
+#include "api.h"
+
+#define API_PREFORK_LISTEN_FD		3		///< SD_LISTEN_FDS_START
+#define API_PREFORK_READY_FD		4
+#define API_PREFORK_READY_TIMEOUT	30		///< 等待工作进程就绪的时间，秒
+#define API_PREFORK_STOP_TIMEOUT	30		///< 等待工作进程退出的时间，超时后 SIGKILL
+#define API_PREFORK_MAX_WORKERS		256
+
+struct api_worker {
+	pid_t pid;
+	int listenfd;
+	time_t spawned;
+};
+
+static struct api_worker api_workers[API_PREFORK_MAX_WORKERS];
+static int api_worker_num = 0;
+static char api_prefork_exe[PATH_MAX];
+static const char *api_prefork_conf = NULL;
+
+/**
+ * @brief 创建一个设置了 SO_REUSEPORT 的监听套接字
+ */
+static int api_prefork_socket(const char *host, const char *port)
+{
+	struct addrinfo hints, *result, *rp;
+	int fd = -1, on = 1;
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	if(getaddrinfo(host, port, &hints, &result) != 0)
+		return -1;
+
+	for(rp = result; rp; rp = rp->ai_next) {
+		fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+		if(fd < 0)
+			continue;
+		if(setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) == 0
+				&& setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) == 0
+				&& bind(fd, rp->ai_addr, rp->ai_addrlen) == 0
+				&& listen(fd, SOMAXCONN) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	return fd;
+}
+
+/**
+ * @brief 启动槽位 slot 的工作进程，并等待它就绪
+ * @return 工作进程的 pid，失败返回 -1
+ */
+static pid_t api_prefork_spawn(int slot)
+{
+	char *args[4], buf[16];
+	struct pollfd pfd;
+	int ready[2], lfd, rfd, n = 0;
+	sigset_t empty;
+	pid_t pid;
+
+	if(pipe2(ready, O_CLOEXEC) < 0)
+		return -1;
+
+	pid = fork();
+	if(pid < 0) {
+		close(ready[0]);
+		close(ready[1]);
+		return -1;
+	}
+
+	if(pid == 0) {
+		// 先移到较大的描述符上，避免 dup2 时互相覆盖；这些副本带 FD_CLOEXEC，
+		// 不会泄漏到 execv 之后，只有 3/4 两个描述符留给工作进程
+		lfd = fcntl(api_workers[slot].listenfd, F_DUPFD_CLOEXEC, 16);
+		rfd = fcntl(ready[1], F_DUPFD_CLOEXEC, 16);
+		if(lfd < 0 || rfd < 0
+				|| dup2(lfd, API_PREFORK_LISTEN_FD) < 0
+				|| dup2(rfd, API_PREFORK_READY_FD) < 0
+				|| fcntl(API_PREFORK_LISTEN_FD, F_SETFD, 0) < 0
+				|| fcntl(API_PREFORK_READY_FD, F_SETFD, 0) < 0)
+			_exit(127);
+
+		snprintf(buf, sizeof(buf), "%d", (int)getpid());
+		setenv("LISTEN_PID", buf, 1);
+		setenv("LISTEN_FDS", "1", 1);
+		snprintf(buf, sizeof(buf), "%d", slot);
+		setenv("BMYAPI_WORKER", buf, 1);
+
+		prctl(PR_SET_PDEATHSIG, SIGTERM);
+		sigemptyset(&empty);
+		sigprocmask(SIG_SETMASK, &empty, NULL);
+
+		args[n++] = api_prefork_exe;
+		if(api_prefork_conf) {
+			args[n++] = "-c";
+			args[n++] = (char *)api_prefork_conf;
+		}
+		args[n] = NULL;
+		execv(api_prefork_exe, args);
+		_exit(127);
+	}
+
+	close(ready[1]);
+	pfd.fd = ready[0];
+	pfd.events = POLLIN;
+	n = poll(&pfd, 1, API_PREFORK_READY_TIMEOUT * 1000);
+	if(n <= 0 || read(ready[0], buf, 1) != 1) {
+		fprintf(stderr, "worker %d (pid %d) did not become ready\n", slot, (int)pid);
+		close(ready[0]);
+		kill(pid, SIGKILL);
+		waitpid(pid, NULL, 0);
+		return -1;
+	}
+	close(ready[0]);
+
+	fprintf(stderr, "worker %d started, pid %d\n", slot, (int)pid);
+	return pid;
+}
+
+/**
+ * @brief 结束一个工作进程并等待它退出
+ */
+static void api_prefork_stop(pid_t pid)
+{
+	int i;
+
+	kill(pid, SIGTERM);
+	for(i=0; i<API_PREFORK_STOP_TIMEOUT * 10; ++i) {
+		if(waitpid(pid, NULL, WNOHANG) == pid)
+			return;
+		usleep(100000);
+	}
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+/**
+ * @brief 逐个槽位启动新进程、结束旧进程
+ */
+static void api_prefork_rolling_restart(void)
+{
+	pid_t old, pid;
+	int i;
+
+	fprintf(stderr, "rolling restart\n");
+	for(i=0; i<api_worker_num; ++i) {
+		old = api_workers[i].pid;
+		pid = api_prefork_spawn(i);
+		if(pid < 0) {
+			fprintf(stderr, "rolling restart aborted at worker %d, keeping the old one\n", i);
+			return;
+		}
+		api_workers[i].pid = pid;
+		api_workers[i].spawned = time(NULL);
+		if(old > 0)
+			api_prefork_stop(old);
+	}
+}
+
+static void api_prefork_reap(void)
+{
+	pid_t pid;
+	int status, i;
+
+	while((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		for(i=0; i<api_worker_num; ++i) {
+			if(api_workers[i].pid != pid)
+				continue;
+			if(WIFSIGNALED(status))
+				fprintf(stderr, "worker %d (pid %d) killed by signal %d\n", i, (int)pid, WTERMSIG(status));
+			else
+				fprintf(stderr, "worker %d (pid %d) exited with %d\n", i, (int)pid, WEXITSTATUS(status));
+			api_workers[i].pid = 0;
+		}
+	}
+}
+
+int api_prefork_run(const char *conf_path)
+{
+	const struct api_config *conf = api_config_get();
+	struct timespec timeout = { 1, 0 };
+	sigset_t set;
+	ssize_t len;
+	int i, sig;
+
+	len = readlink("/proc/self/exe", api_prefork_exe, sizeof(api_prefork_exe) - 1);
+	if(len <= 0)
+		return -1;
+	api_prefork_exe[len] = 0;
+	api_prefork_conf = conf_path;
+
+	// 工作进程需要把监听套接字交给 onion，参见 api_onion.c
+	if(!api_onion_internals()) {
+		fprintf(stderr, "workers > 0 is not supported with this onion version\n");
+		return -1;
+	}
+
+	api_worker_num = (conf->workers < API_PREFORK_MAX_WORKERS) ? conf->workers : API_PREFORK_MAX_WORKERS;
+	for(i=0; i<api_worker_num; ++i) {
+		api_workers[i].listenfd = api_prefork_socket(conf->listen_host, conf->listen_port);
+		if(api_workers[i].listenfd < 0) {
+			fprintf(stderr, "cannot listen on %s:%s: %s\n", conf->listen_host, conf->listen_port, strerror(errno));
+			return -1;
+		}
+	}
+
+	sigemptyset(&set);
+	sigaddset(&set, SIGCHLD);
+	sigaddset(&set, SIGTERM);
+	sigaddset(&set, SIGINT);
+	sigaddset(&set, SIGHUP);
+	sigaddset(&set, SIGUSR2);
+	sigprocmask(SIG_BLOCK, &set, NULL);
+
+	for(;;) {
+		api_prefork_reap();
+
+		// 异常退出的工作进程至少间隔一秒重启，避免启动即崩溃时空转
+		for(i=0; i<api_worker_num; ++i) {
+			if(api_workers[i].pid == 0 && time(NULL) > api_workers[i].spawned) {
+				api_workers[i].spawned = time(NULL);
+				api_workers[i].pid = api_prefork_spawn(i);
+				if(api_workers[i].pid < 0)
+					api_workers[i].pid = 0;
+			}
+		}
+
+		sig = sigtimedwait(&set, NULL, &timeout);
+		if(sig == SIGTERM || sig == SIGINT)
+			break;
+		if(sig == SIGUSR2)
+			api_prefork_rolling_restart();
+		if(sig == SIGHUP) {
+			for(i=0; i<api_worker_num; ++i) {
+				if(api_workers[i].pid > 0)
+					kill(api_workers[i].pid, SIGHUP);
+			}
+		}
+	}
+
+	for(i=0; i<api_worker_num; ++i) {
+		if(api_workers[i].pid > 0)
+			kill(api_workers[i].pid, SIGTERM);
+	}
+	for(i=0; i<api_worker_num; ++i) {
+		if(api_workers[i].pid > 0)
+			api_prefork_stop(api_workers[i].pid);
+	}
+	return 0;
+}
+
+/**
+ * @brief 把工作进程绑定到允许使用的第 slot 个 CPU 上
+ */
+static void api_prefork_pin(int slot)
+{
+	cpu_set_t allowed, set;
+	int cpu, n = 0, count;
+
+	if(sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+		return;
+	count = CPU_COUNT(&allowed);
+	if(count <= 0)
+		return;
+
+	slot %= count;
+	for(cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if(!CPU_ISSET(cpu, &allowed))
+			continue;
+		if(n++ == slot)
+			break;
+	}
+
+	CPU_ZERO(&set);
+	CPU_SET(cpu, &set);
+	sched_setaffinity(0, sizeof(set), &set);
+}
+
+int api_prefork_worker_init(onion *server)
+{
+	const char *pid = getenv("LISTEN_PID");
+	const char *fds = getenv("LISTEN_FDS");
+	const char *slot = getenv("BMYAPI_WORKER");
+
+	if(slot && api_config_get()->cpu_affinity)
+		api_prefork_pin(atoi(slot));
+
+	if(!pid || !fds || atoi(pid) != getpid() || atoi(fds) < 1)
+		return 0;
+
+	unsetenv("LISTEN_PID");
+	unsetenv("LISTEN_FDS");
+	fcntl(API_PREFORK_LISTEN_FD, F_SETFD, FD_CLOEXEC);
+	if(api_onion_add_listen_fd(server, API_PREFORK_LISTEN_FD) < 0) {
+		fprintf(stderr, "this onion version cannot use an inherited socket\n");
+		return -1;
+	}
+	return 1;
+}
+
+int api_prefork_is_worker(void)
+{
+	return getenv("BMYAPI_WORKER") != NULL;
+}
+
+void api_prefork_ready(void)
+{
+	if(!api_prefork_is_worker())
+		return;
+	if(write(API_PREFORK_READY_FD, "1", 1) == 1)
+		close(API_PREFORK_READY_FD);
+}
@@ -0,0 +1,361 @@
+/**
+ * @file	api_ratelimit.c
+ * @brief	按来源限制请求频率：每个 IP、会话、appkey 各有一个令牌桶。
+ * @details	令牌桶保存在映射到 API_RATELIMIT_FILE 的共享表中，多进程模式下各工作
+ * 			进程映射同一个文件，限额在所有线程和进程之间共同生效。
+ *
+ * 			表中每个槽位由键和状态两个 64 位字组成，状态的高 32 位为剩余令牌数
+ * 			（千分之一个），低 32 位为上次更新的时间（毫秒，允许回绕），两者通过
+ * 			一次 CAS 同时更新，请求路径上没有锁。键在散列位置之后的 API_RATELIMIT_PROBE
+ * 			个槽位中查找，都被占用时替换其中最久没有更新的一个，被替换的来源重新获得
+ * 			满额的令牌。
+ *
+ * 			每个请求按路由的 cost 从三个桶中各取令牌，任何一个不足时归还已经取出的
+ * 			部分，返回 API_RT_THROTTLED。cost 超过桶的容量时按容量计，即需要满额的
+ * 			桶。cost 默认取自 main.c 的路由表，可以由配置中的 ratelimit_costs 覆盖。
+ *
+ * 			会话与 appkey 的桶只在会话有效时使用，键分别取自 shm_utmp 中登录时记录的
+ * 			userid 与 appkey，而不是请求中的参数：每次随机更换 sessid 或 appkey 不能
+ * 			得到新的满额的桶，也不会占用槽位、挤掉正常的桶。会话无效、未登录与 guest
+ * 			的请求只计入 IP 的桶。
+ */
+
+#include <sys/mman.h>
+#include "api.h"
+
+#define API_RATELIMIT_FILE		"bbstmpfs/tmp/bmyapi_ratelimit"
+#define API_RATELIMIT_SLOTS		65536		///< 2 的幂，共 1MB
+#define API_RATELIMIT_PROBE		8
+#define API_RATELIMIT_SKEW_MS	60000		///< 其他线程以稍晚的时间更新槽位时，时间差的上限
+
+struct api_ratelimit_slot {
+	uint64_t key;			///< 来源的散列值，0 表示空槽位
+	uint64_t state;			///< 令牌数 << 32 | 毫秒时间，0 表示满额
+};
+
+enum api_ratelimit_kind {
+	API_RATELIMIT_IP = 0,
+	API_RATELIMIT_USER,
+	API_RATELIMIT_APPKEY,
+	API_RATELIMIT_KINDS
+};
+
+static const char *api_ratelimit_kind_names[API_RATELIMIT_KINDS] = {
+	"ip", "user", "appkey"
+};
+
+static struct api_ratelimit_slot *api_ratelimit_table = NULL;
+static uint64_t api_ratelimit_throttled[API_RATELIMIT_KINDS];	///< 本进程拒绝的请求数
+static uint64_t api_ratelimit_evicted = 0;
+
+/**
+ * 每个线程缓存各路由的 cost，配置被替换后重新解析
+ */
+static __thread const struct api_config *api_ratelimit_conf = NULL;
+static __thread int api_ratelimit_costs[API_ROUTE_MAX];
+
+int api_ratelimit_init(void)
+{
+	size_t size = sizeof(struct api_ratelimit_slot) * API_RATELIMIT_SLOTS;
+	struct stat st;
+	void *ptr;
+	int fd;
+
+	fd = open(API_RATELIMIT_FILE, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if(fd < 0)
+		return -1;
+
+	// 大小不同的表来自其他版本，清空重建；全零即为空表
+	if(fstat(fd, &st) < 0
+			|| (st.st_size != (off_t)size && (ftruncate(fd, 0) < 0 || ftruncate(fd, size) < 0))) {
+		close(fd);
+		return -1;
+	}
+
+	ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if(ptr == MAP_FAILED)
+		return -1;
+
+	api_ratelimit_table = (struct api_ratelimit_slot *)ptr;
+	return 0;
+}
+
+static uint32_t api_ratelimit_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint32_t)(ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+}
+
+/**
+ * @brief 64 位 FNV-1a，字母不区分大小写
+ */
+static uint64_t api_ratelimit_hash(uint64_t h, const char *s)
+{
+	while(*s) {
+		h ^= (unsigned char)tolower((unsigned char)*s++);
+		h *= 1099511628211ULL;
+	}
+	return h;
+}
+
+static uint64_t api_ratelimit_key(enum api_ratelimit_kind kind, const char *a, const char *b)
+{
+	uint64_t h = 14695981039346656037ULL ^ (kind + 1);
+
+	h = api_ratelimit_hash(h * 1099511628211ULL, a);
+	if(b) {
+		h = (h ^ '\n') * 1099511628211ULL;
+		h = api_ratelimit_hash(h, b);
+	}
+	return h ? h : 1;
+}
+
+/**
+ * @brief 校验请求中的会话，与 check_user_session() 相同，但不需要 getuser()
+ * @return 有效时返回 shm_utmp 中的记录，否则返回 NULL
+ */
+static const struct user_info *api_ratelimit_session(const char *userid, const char *sessid,
+		const char *appkey)
+{
+	const struct user_info *ui;
+	int i;
+
+	if(!userid || !sessid || !appkey || !strcasecmp(userid, "guest"))
+		return NULL;
+	for(i=0; i<3; ++i) {
+		if(sessid[i] < 'A' || sessid[i] > 'Z')
+			return NULL;
+	}
+	i = get_user_utmp_index(sessid);
+	if(i >= MAXACTIVE)
+		return NULL;
+
+	ui = &(shm_utmp->uinfo[i]);
+	if(ui->pid != APPPID
+			|| strcasecmp(ui->userid, userid)
+			|| strcasecmp(ui->sessionid, sessid + 3)
+			|| strcasecmp(ui->appkey, appkey))
+		return NULL;
+	return ui;
+}
+
+static uint32_t api_ratelimit_state_time(uint64_t state)
+{
+	return (uint32_t)state;
+}
+
+/**
+ * @brief 找到或占用 key 对应的槽位
+ */
+static struct api_ratelimit_slot *api_ratelimit_slot(uint64_t key, uint32_t now)
+{
+	struct api_ratelimit_slot *slot, *oldest = NULL;
+	uint64_t k, state;
+	uint32_t age, oldest_age = 0;
+	int i;
+
+	for(i=0; i<API_RATELIMIT_PROBE; ++i) {
+		slot = &api_ratelimit_table[(key + i) & (API_RATELIMIT_SLOTS - 1)];
+		k = __atomic_load_n(&slot->key, __ATOMIC_ACQUIRE);
+		if(k == key)
+			return slot;
+		if(k == 0) {
+			if(__atomic_compare_exchange_n(&slot->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)
+					|| k == key)
+				return slot;
+		}
+
+		state = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+		age = state ? (uint32_t)(now - api_ratelimit_state_time(state)) : 0;
+		if(!oldest || age > oldest_age) {
+			oldest = slot;
+			oldest_age = age;
+		}
+	}
+
+	// 替换最久没有更新的来源，同时有其他线程在使用该槽位时结果只是近似的
+	k = __atomic_load_n(&oldest->key, __ATOMIC_ACQUIRE);
+	if(__atomic_compare_exchange_n(&oldest->key, &k, key, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+		__atomic_store_n(&oldest->state, 0, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&api_ratelimit_evicted, 1, __ATOMIC_RELAXED);
+	}
+	return oldest;
+}
+
+/**
+ * @brief 补充令牌后取出 take 个（千分之一个为单位），take 为负数时归还
+ * 32 位的毫秒时间约 24.8 天后超出 int32_t，时间差为负数且超过
+ * API_RATELIMIT_SKEW_MS 时视为闲置已久，按满额处理。
+ * @param rate 每秒补充的令牌数
+ * @param cap 桶的容量，千分之一个为单位
+ * @return 成功返回 0，令牌不足返回 -1
+ */
+static int api_ratelimit_take_slot(struct api_ratelimit_slot *slot, int64_t take,
+		uint32_t rate, uint64_t cap, uint32_t now)
+{
+	uint64_t old, new, tokens;
+	uint32_t t;
+	int32_t elapsed;
+
+	old = __atomic_load_n(&slot->state, __ATOMIC_RELAXED);
+	do {
+		t = now;
+		if(old == 0) {
+			tokens = cap;
+		} else {
+			elapsed = (int32_t)(now - api_ratelimit_state_time(old));
+			if(elapsed < -API_RATELIMIT_SKEW_MS) {
+				tokens = cap;
+			} else {
+				// 其他线程可能已经以稍晚的时间更新过，此时不补充，时间也不回退
+				if(elapsed < 0) {
+					elapsed = 0;
+					t = api_ratelimit_state_time(old);
+				}
+				tokens = (old >> 32) + (uint64_t)elapsed * rate;
+				if(tokens > cap)
+					tokens = cap;
+			}
+		}
+
+		if(take > 0 && tokens < (uint64_t)take)
+			return -1;
+		tokens -= take;
+		if(tokens > cap)
+			tokens = cap;
+
+		new = (tokens << 32) | t;
+		if(new == 0)
+			new = 1;
+	} while(!__atomic_compare_exchange_n(&slot->state, &old, new, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return 0;
+}
+
+int api_ratelimit_take(onion_request *req, int cost)
+{
+	const struct api_config *conf = api_config_get();
+	struct api_ratelimit_slot *slots[API_RATELIMIT_KINDS];
+	uint32_t rates[API_RATELIMIT_KINDS];
+	uint64_t caps[API_RATELIMIT_KINDS];
+	int64_t takes[API_RATELIMIT_KINDS];
+	uint32_t now;
+	int i, n;
+
+	if(!conf->ratelimit || !api_ratelimit_table || cost <= 0)
+		return 0;
+
+	const char * fromhost = onion_request_get_header(req, "X-Real-IP");
+	const char * userid = onion_request_get_query(req, "userid");
+	const char * sessid = onion_request_get_query(req, "sessid");
+	const char * appkey = onion_request_get_query(req, "appkey");
+
+	const struct user_info *ui = api_ratelimit_session(userid, sessid, appkey);
+
+	uint64_t keys[API_RATELIMIT_KINDS] = { 0, 0, 0 };
+	if(!fromhost)
+		fromhost = onion_request_get_client_description(req);
+	if(fromhost)
+		keys[API_RATELIMIT_IP] = api_ratelimit_key(API_RATELIMIT_IP, fromhost, NULL);
+	if(ui) {
+		keys[API_RATELIMIT_USER] = api_ratelimit_key(API_RATELIMIT_USER, ui->userid, NULL);
+		keys[API_RATELIMIT_APPKEY] = api_ratelimit_key(API_RATELIMIT_APPKEY, ui->appkey, NULL);
+	}
+	rates[API_RATELIMIT_IP] = conf->ratelimit_ip;
+	rates[API_RATELIMIT_USER] = conf->ratelimit_user;
+	rates[API_RATELIMIT_APPKEY] = conf->ratelimit_appkey;
+
+	now = api_ratelimit_now();
+	for(n=0; n<API_RATELIMIT_KINDS; ++n) {
+		slots[n] = NULL;
+		if(!keys[n] || !rates[n])
+			continue;
+
+		// 超过容量的 cost（如较大的 batch）按容量计，桶满时总能通过
+		caps[n] = (uint64_t)rates[n] * conf->ratelimit_burst * 1000;
+		takes[n] = cost * 1000LL;
+		if((uint64_t)takes[n] > caps[n])
+			takes[n] = caps[n];
+
+		slots[n] = api_ratelimit_slot(keys[n], now);
+		if(api_ratelimit_take_slot(slots[n], takes[n], rates[n], caps[n], now) < 0)
+			break;
+	}
+	if(n == API_RATELIMIT_KINDS)
+		return 0;
+
+	// 归还已经从前面的桶中取出的令牌
+	for(i=0; i<n; ++i) {
+		if(slots[i])
+			api_ratelimit_take_slot(slots[i], -takes[i], rates[i], caps[i], now);
+	}
+	__atomic_add_fetch(&api_ratelimit_throttled[n], 1, __ATOMIC_RELAXED);
+	return -1;
+}
+
+/**
+ * @brief 在 ratelimit_costs 中查找 path 的 cost
+ * @param costs 以空格或逗号分隔的"路径:cost"
+ * @return 没有找到返回 -1
+ */
+static int api_ratelimit_conf_cost(const char *costs, const char *path)
+{
+	size_t len = strlen(path);
+	const char *s = costs;
+	char *end;
+	long v;
+
+	while(*s) {
+		s += strspn(s, " ,");
+		if(!strncmp(s, path, len) && s[len] == ':') {
+			v = strtol(s + len + 1, &end, 10);
+			if(end != s + len + 1 && v >= 0)
+				return (int)v;
+		}
+		s += strcspn(s, " ,");
+	}
+	return -1;
+}
+
+int api_ratelimit_cost(const struct api_route *route)
+{
+	const struct api_config *conf = api_config_get();
+	int i, cost;
+
+	if(conf != api_ratelimit_conf) {
+		for(i=0; i<API_ROUTE_MAX; ++i)
+			api_ratelimit_costs[i] = -1;
+		api_ratelimit_conf = conf;
+	}
+
+	cost = api_ratelimit_costs[route->index];
+	if(cost < 0) {
+		cost = api_ratelimit_conf_cost(conf->ratelimit_costs, route->path);
+		if(cost < 0)
+			cost = route->cost ? route->cost : 1;
+		api_ratelimit_costs[route->index] = cost;
+	}
+	return cost;
+}
+
+int api_ratelimit_check(const struct api_route *route, onion_request *req)
+{
+	return api_ratelimit_take(req, api_ratelimit_cost(route));
+}
+
+void api_ratelimit_render(FILE *fp)
+{
+	int i;
+
+	fprintf(fp, "# HELP bmyapi_ratelimit_throttled_total Requests rejected by the rate limiter, by the bucket that ran out.\n");
+	fprintf(fp, "# TYPE bmyapi_ratelimit_throttled_total counter\n");
+	for(i=0; i<API_RATELIMIT_KINDS; ++i)
+		fprintf(fp, "bmyapi_ratelimit_throttled_total{bucket=\"%s\"} %llu\n", api_ratelimit_kind_names[i],
+				(unsigned long long)__atomic_load_n(&api_ratelimit_throttled[i], __ATOMIC_RELAXED));
+	fprintf(fp, "# HELP bmyapi_ratelimit_evicted_total Buckets replaced because the shared table was full.\n");
+	fprintf(fp, "# TYPE bmyapi_ratelimit_evicted_total counter\n");
+	fprintf(fp, "bmyapi_ratelimit_evicted_total %llu\n",
+			(unsigned long long)__atomic_load_n(&api_ratelimit_evicted, __ATOMIC_RELAXED));
+}
@@ -0,0 +1,166 @@
+/**
+ * @file	api_repair.c
+ * @brief	在后台修正 .DIR 中 sizebyte 为 0 的记录。
+ * @details	文章列表遇到 sizebyte 为 0 的记录时，只通过 api_repair_sizebyte() 登记
+ * 			（版面, filetime），本身仍然只读 .DIR，不会等待排他锁。
+ *
+ * 			后台线程在登记后稍等片刻以积累更多记录，然后一次取出整个队列，按版面
+ * 			分组：先在锁外计算各篇文章的 eff_size()，再对每个版面的 .DIR 只加锁一次，
+ * 			扫描一遍按 filetime 找到对应的记录写入。记录以 filetime 定位，不依赖
+ * 			登记时的序号，期间 .DIR 被其他进程改写也不会写错位置；已经不为 0 的
+ * 			记录不再修改。
+ *
+ * 			重复的登记会被合并，队列满时丢弃，之后的请求会再次登记。
+ */
+
+#include <pthread.h>
+#include "apilib.h"
+
+#define API_REPAIR_QUEUE_SIZE	1024
+#define API_REPAIR_DELAY_US		200000	///< 登记后等待 200ms 再处理，以便合并同一版面的记录
+
+struct api_repair_job {
+	char board[24];
+	char filename[32];			///< fh2fname() 的结果
+	time_t filetime;
+	int sizebyte;
+};
+
+static struct api_repair_job repair_queue[API_REPAIR_QUEUE_SIZE];
+static int repair_queue_len = 0;
+static pthread_mutex_t repair_queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t repair_queue_cond = PTHREAD_COND_INITIALIZER;
+static pthread_once_t repair_worker_once = PTHREAD_ONCE_INIT;
+
+static void *api_repair_worker(void *arg);
+
+static void api_repair_worker_start(void)
+{
+	pthread_t tid;
+	if(pthread_create(&tid, NULL, api_repair_worker, NULL) == 0)
+		pthread_detach(tid);
+}
+
+static int api_repair_job_cmp(const void *a, const void *b)
+{
+	const struct api_repair_job *x = a, *y = b;
+	int r = strcmp(x->board, y->board);
+
+	if(r)
+		return r;
+	return (x->filetime > y->filetime) - (x->filetime < y->filetime);
+}
+
+static int api_repair_job_cmp_time(const void *a, const void *b)
+{
+	const struct api_repair_job *x = a, *y = b;
+	return (x->filetime > y->filetime) - (x->filetime < y->filetime);
+}
+
+/**
+ * @brief 在一次加锁内写入同一版面的修正
+ * @param jobs 按 filetime 排序的记录
+ */
+static void api_repair_board(struct api_repair_job *jobs, int n)
+{
+	struct api_repair_job key, *job;
+	struct fileheader *data;
+	struct stat st;
+	char dir[80];
+	int fd, i, total, fixed = 0;
+
+	sprintf(dir, "boards/%s/.DIR", jobs[0].board);
+	fd = open(dir, O_RDWR);
+	if(fd < 0)
+		return;
+
+	flock(fd, LOCK_EX);
+	if(fstat(fd, &st) < 0 || st.st_size < (off_t)sizeof(struct fileheader))
+		goto out;
+
+	data = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	if(MAP_FAILED == data) {
+		errlog("mmap %s for repair failed, errno %d: %s.\n", dir, errno, strerror(errno));
+		goto out;
+	}
+
+	// 待修正的多为新近的文章，从末尾开始找
+	total = st.st_size / sizeof(struct fileheader);
+	for(i = total - 1; i >= 0 && fixed < n; --i) {
+		if(data[i].sizebyte != 0)
+			continue;
+		key.filetime = data[i].filetime;
+		job = bsearch(&key, jobs, n, sizeof(key), api_repair_job_cmp_time);
+		if(!job || job->sizebyte == 0)
+			continue;
+		data[i].sizebyte = job->sizebyte;
+		fixed++;
+	}
+	munmap(data, st.st_size);
+
+out:
+	flock(fd, LOCK_UN);
+	close(fd);
+}
+
+static void *api_repair_worker(void *arg)
+{
+	static struct api_repair_job jobs[API_REPAIR_QUEUE_SIZE];
+	char filename[80];
+	int i, j, n;
+
+	while(1) {
+		pthread_mutex_lock(&repair_queue_lock);
+		while(repair_queue_len == 0)
+			pthread_cond_wait(&repair_queue_cond, &repair_queue_lock);
+		pthread_mutex_unlock(&repair_queue_lock);
+
+		usleep(API_REPAIR_DELAY_US);
+
+		pthread_mutex_lock(&repair_queue_lock);
+		n = repair_queue_len;
+		memcpy(jobs, repair_queue, n * sizeof(jobs[0]));
+		repair_queue_len = 0;
+		pthread_mutex_unlock(&repair_queue_lock);
+
+		qsort(jobs, n, sizeof(jobs[0]), api_repair_job_cmp);
+		for(i = 0; i < n; ++i) {
+			sprintf(filename, "boards/%s/%s", jobs[i].board, jobs[i].filename);
+			jobs[i].sizebyte = numbyte(eff_size(filename));
+		}
+
+		for(i = 0; i < n; i = j) {
+			for(j = i + 1; j < n && !strcmp(jobs[i].board, jobs[j].board); ++j)
+				;
+			api_repair_board(jobs + i, j - i);
+		}
+	}
+
+	return NULL;
+}
+
+void api_repair_sizebyte(const char *board, const struct fileheader *fh)
+{
+	time_t filetime = fh->filetime;
+	int i;
+
+	pthread_once(&repair_worker_once, api_repair_worker_start);
+
+	pthread_mutex_lock(&repair_queue_lock);
+	for(i=0; i<repair_queue_len; ++i) {
+		if(repair_queue[i].filetime == filetime && !strcmp(repair_queue[i].board, board)) {
+			pthread_mutex_unlock(&repair_queue_lock);
+			return;
+		}
+	}
+
+	if(repair_queue_len < API_REPAIR_QUEUE_SIZE) {
+		strsncpy(repair_queue[repair_queue_len].board, board, sizeof(repair_queue[0].board));
+		strsncpy(repair_queue[repair_queue_len].filename, fh2fname((struct fileheader *)fh), sizeof(repair_queue[0].filename));
+		repair_queue[repair_queue_len].filetime = filetime;
+		repair_queue[repair_queue_len].sizebyte = 0;
+		repair_queue_len++;
+		pthread_cond_signal(&repair_queue_cond);
+	}
+	pthread_mutex_unlock(&repair_queue_lock);
+}
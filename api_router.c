@@ -0,0 +1,116 @@
+/**
+ * @file	api_router.c
+ * @brief	按路径分发请求，代替逐个匹配正则表达式的 onion_url。
+ * @details	所有路由都是不含通配的固定路径。启动时为 main.c 中的路由表寻找一个散列种子，
+ * 			使每个路径落在不同的槽位上（完美散列），之后每个请求只需一次散列、一次
+ * 			字符串比较。找不到种子时 api_router_init() 失败，程序不会启动。
+ *
+ * 			路由表中的 flags 描述方法、认证与缓存方面的要求，由 api_route_run()
+ * 			统一检查，batch 也依据 API_ROUTE_BATCH 决定允许调用的接口。
+ */
+
+#include "api.h"
+
+#define API_ROUTER_SLOTS		256			///< 2 的幂，为 API_ROUTE_MAX 的 4 倍，种子容易找到
+#define API_ROUTER_MAX_SEED		65536
+
+static struct api_route *api_router_slots[API_ROUTER_SLOTS];
+static uint32_t api_router_seed = 0;
+
+/**
+ * @brief 带种子的 FNV-1a
+ */
+static uint32_t api_router_hash(uint32_t seed, const char *s)
+{
+	uint32_t h = 2166136261u ^ seed;
+
+	while(*s) {
+		h ^= (unsigned char)*s++;
+		h *= 16777619u;
+	}
+	return (h ^ (h >> 16)) & (API_ROUTER_SLOTS - 1);
+}
+
+/**
+ * @brief 尝试以 seed 放置所有路由
+ * @return 没有冲突返回 0
+ */
+static int api_router_place(struct api_route *routes, uint32_t seed)
+{
+	struct api_route *route;
+	uint32_t h;
+
+	memset(api_router_slots, 0, sizeof(api_router_slots));
+	for(route = routes; route->path; ++route) {
+		h = api_router_hash(seed, route->path);
+		if(api_router_slots[h])
+			return -1;
+		api_router_slots[h] = route;
+	}
+	return 0;
+}
+
+int api_router_init(struct api_route *routes)
+{
+	struct api_route *route;
+	uint32_t seed;
+
+	for(route = routes; route->path; ++route) {
+		if(api_metrics_add_route(route) < 0) {
+			fprintf(stderr, "too many routes, raise API_ROUTE_MAX\n");
+			return -1;
+		}
+	}
+
+	for(seed = 0; seed < API_ROUTER_MAX_SEED; ++seed) {
+		if(api_router_place(routes, seed) == 0) {
+			api_router_seed = seed;
+			return 0;
+		}
+	}
+
+	// 同一路径出现两次时不可能没有冲突
+	fprintf(stderr, "cannot build route table, check for duplicated paths\n");
+	return -1;
+}
+
+struct api_route *api_route_find(const char *path)
+{
+	struct api_route *route;
+
+	if(!path)
+		return NULL;
+	if(*path == '/')
+		path++;
+
+	route = api_router_slots[api_router_hash(api_router_seed, path)];
+	return (route && !strcmp(route->path, path)) ? route : NULL;
+}
+
+int api_router_handler(ONION_FUNC_PROTO_STR)
+{
+	struct api_route *route = api_route_find(onion_request_get_path(req));
+
+	if(!route)
+		return api_error(p, req, res, API_RT_FUNCNOTIMPL);
+
+	return api_route_dispatch(route, req, res);
+}
+
+int api_route_run(const struct api_route *route, ONION_FUNC_PROTO_STR)
+{
+	if((route->flags & API_ROUTE_POST)
+			&& (onion_request_get_flags(req) & OR_METHODS) != OR_POST)
+		return api_error(p, req, res, API_RT_WRONGMETHOD);
+
+	if((route->flags & API_ROUTE_AUTH)
+			&& (!onion_request_get_query(req, "userid")
+				|| !onion_request_get_query(req, "sessid")
+				|| !onion_request_get_query(req, "appkey")))
+		return api_error(p, req, res, API_RT_WRONGPARAM);
+
+	if(route->flags & API_ROUTE_NOSTORE)
+		onion_response_set_header(res, "Cache-Control", "no-store");
+
+	return route->handler(p, req, res);
+}
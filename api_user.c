@@ -109,7 +109,7 @@ int api_user_login(ONION_FUNC_PROTO_STR)
 	if(!strcmp(userid, ""))
 		userid = "guest";
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0) {
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	} else if(strcasecmp(userid, "guest")) {
@@ -127,7 +127,6 @@ int api_user_login(ONION_FUNC_PROTO_STR)
 
 	int r = api_do_login(ue, fromhost, appkey, now_t, &utmp_index);
 	if(r != API_RT_SUCCESSFUL) { // TODO: 检查是否还有未释放的资源
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
@@ -161,11 +160,9 @@ int api_user_login(ONION_FUNC_PROTO_STR)
 			shm_utmp->uinfo[utmp_index-1].sessionid);
 	api_template_set(&tpl, "token", shm_utmp->uinfo[utmp_index-1].token);
 
-	api_set_json_header(res);
-	onion_response_write0(res, tpl);
+	api_write_json(req, res, tpl);
 
 	api_template_free(tpl);
-	free(ue);
 	return OCS_PROCESSED;
 }
 
@@ -184,11 +181,10 @@ int api_user_query(ONION_FUNC_PROTO_STR)
 		if(!userid || !appkey || !sessid)
 			return api_error(p, req, res, API_RT_WRONGPARAM);
 
-		ue = getuser(userid);
+		ue = api_getuser(userid);
 		if(ue == 0)
 			return api_error(p, req, res, API_RT_NOSUCHUSER);
 		if(check_user_session(ue, sessid, appkey) != API_RT_SUCCESSFUL) {
-			free(ue);
 			return api_error(p, req, res, API_RT_WRONGSESS);
 		}
 
@@ -199,7 +195,7 @@ int api_user_query(ONION_FUNC_PROTO_STR)
 				"\"job\":\"%s\", \"exp\":%d, \"perf\":%d,"
 				"\"exp_level\":\"%s\", \"perf_level\":\"%s\"}",
 				ue->userid, ue->numlogins, ue->numposts, unread_mail,
-				count_notification_num(ue->userid), getuserlevelname(ue->userlevel),
+				api_notification_count(ue->userid), getuserlevelname(ue->userlevel),
 				countexp(ue), countperf(ue),
 				calc_exp_str_utf8(countexp(ue)), calc_perf_str_utf8(countperf(ue)));
 	} else {
@@ -218,11 +214,9 @@ int api_user_query(ONION_FUNC_PROTO_STR)
 	struct json_object *jp = json_tokener_parse(buf);
 	json_object_object_add(jp, "nickname", json_object_new_string(ue->username));
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(jp));
+	api_write_json(req, res, json_object_to_json_string(jp));
 
 	json_object_put(jp);
-	free(ue);
 
 	return OCS_PROCESSED;
 }
@@ -248,14 +242,13 @@ int api_user_logout(ONION_FUNC_PROTO_STR)
 		return api_error(p, req, res, API_RT_CNTLGOTGST);
 	}
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0) {
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
@@ -273,8 +266,6 @@ int api_user_logout(ONION_FUNC_PROTO_STR)
 	if(check_user_perm(ue, PERM_BOARDS) && count_uindex(uid)==0)
 		setbmstatus(ue, 0);
 
-	free(ue);
-
 	return api_error(p, req, res, API_RT_SUCCESSFUL);
 	return OCS_PROCESSED;
 }
@@ -293,20 +284,17 @@ int api_user_check_session(ONION_FUNC_PROTO_STR)
 	if(!strcmp(userid, ""))
 		userid="guest";
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0) {
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r=check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
-	api_set_json_header(res);
-	onion_response_write0(res, "{\"errcode\":0}");
-	free(ue);
+	api_write_json(req, res, "{\"errcode\":0}");
 
 	return OCS_PROCESSED;
 }
@@ -334,9 +322,8 @@ int api_user_register(ONION_FUNC_PROTO_STR)
 		return api_error(p, req, res, API_RT_FBDUSERNAME);
 	}
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue) {
-		free(ue);
 		return api_error(p, req, res, API_RT_USEREXSITED);
 	}
 
@@ -373,8 +360,7 @@ int api_user_register(ONION_FUNC_PROTO_STR)
 	sprintf(buf, "%s newaccount %d %s api", x.userid, getusernum(x.userid), fromhost);
 	newtrace(buf);
 
-	api_set_json_header(res);
-	onion_response_write0(res, "{\"errcode\":0}");
+	api_write_json(req, res, "{\"errcode\":0}");
 
 	return OCS_PROCESSED;
 }
@@ -386,11 +372,12 @@ int api_user_articlequery(ONION_FUNC_PROTO_STR)
 	const char *appkey = onion_request_get_query(req, "appkey");
 	const char *qryuid = onion_request_get_query(req, "query_user");
 	const char *qryday_str = onion_request_get_query(req, "query_day");
+	const struct api_config *conf = api_config_get();
 
 	if(userid == NULL || sessid == NULL || appkey == NULL || qryuid == NULL)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0) {
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
@@ -398,21 +385,19 @@ int api_user_articlequery(ONION_FUNC_PROTO_STR)
 	struct userec *query_ue = getuser(qryuid);
 	if(query_ue == 0) {
 		// 查询的对方用户不存在
-		free(ue);
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, r);
 	}
 
 	// 通过权限检验，从 redis 中寻找缓存，若成功则使用缓存中的内容
 	redisContext * rContext;
 	redisReply * rReplyOut, * rReplyTime;
-	rContext = redisConnect((char *)"127.0.0.1", 6379);
+	api_phase_begin(API_PHASE_REDIS);
+	rContext = redisConnect(conf->redis_host, conf->redis_port);
 
 	time_t now_t = time(NULL);
 	if(rContext!=NULL && rContext->err ==0) {
@@ -430,16 +415,14 @@ int api_user_articlequery(ONION_FUNC_PROTO_STR)
 				// 缓存时间小于 5min 才使用缓存
 				rReplyOut = redisCommand(rContext, "GET useractivities-%s-%s",
 						ue->userid, query_ue->userid);
+				api_phase_end(API_PHASE_REDIS);
 
 				// 输出
-				api_set_json_header(res);
-				onion_response_write0(res, rReplyOut->str);
+				api_write_json(req, res, rReplyOut->str);
 
 				// 释放资源并结束
 				freeReplyObject(rReplyOut);
 				redisFree(rContext);
-				free(query_ue);
-				free(ue);
 
 				return OCS_PROCESSED;
 			}
@@ -449,67 +432,72 @@ int api_user_articlequery(ONION_FUNC_PROTO_STR)
 	if(rContext) {
 		redisFree(rContext);
 	}
+	api_phase_end(API_PHASE_REDIS);
 
-	const int MAX_SEARCH_NUM = 1000;
-	struct bmy_article * articles = (struct bmy_article*)malloc(sizeof(struct bmy_article) * MAX_SEARCH_NUM);
+	const int MAX_SEARCH_NUM = conf->search_max;
+	struct bmy_article * articles = api_arena_alloc(sizeof(struct bmy_article) * MAX_SEARCH_NUM);
+	if(!articles)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 	memset(articles, 0, sizeof(struct bmy_article) * MAX_SEARCH_NUM);
 
 	int qryday = 3; // 默认为3天
-	if(qryday_str!=NULL && atoi(qryday)>0)
-		qryday = atoi(qryday);
+	if(qryday_str!=NULL && atoi(qryday_str)>0)
+		qryday = atoi(qryday_str);
 
 	struct user_info * ui = &(shm_utmp->uinfo[get_user_utmp_index(sessid)]);
 	int num = search_user_article_with_title_keywords(articles, MAX_SEARCH_NUM, ui,
 			query_ue->userid, NULL, NULL, NULL, qryday * 86400);
 
-	// 输出
-	char * tmp_buf = NULL;
-	asprintf(&tmp_buf, "{\"errcode\":0, \"userid\":\"%s\", \"total\":%d, \"articles\":[]}",
-			query_ue->userid, num);
-	struct json_object *output_obj = json_tokener_parse(tmp_buf);
-	free(tmp_buf);
-
-	struct json_object *output_array = json_object_object_get(output_obj, "articles");
-	struct json_object *json_board_obj=NULL, *json_articles_array=NULL, *json_article_obj=NULL;
+	// 输出，同一版面的文章是连续的，按版面分组
+	struct api_arena_buf out;
+	api_phase_begin(API_PHASE_JSON);
+	api_arena_buf_init(&out, 128 + num * 160);
+	api_arena_buf_puts(&out, "{\"errcode\":0, \"userid\":");
+	api_arena_buf_json_str(&out, query_ue->userid);
+	api_arena_buf_printf(&out, ", \"total\":%d, \"articles\":[", num);
 
 	int i;
-	char * curr_board = NULL;	// 判断版面名
+	const char * curr_board = NULL;	// 判断版面名
 	struct bmy_article *ap;
 	struct boardmem *b;
 	for(i=0; i<num; ++i) {
 		ap = &articles[i];
 
-		if(strcmp(curr_board, ap->board) != 0) {
+		if(curr_board == NULL || strcmp(curr_board, ap->board) != 0) {
 			// 新的版面
+			if(curr_board != NULL)
+				api_arena_buf_puts(&out, "]}, ");
 			curr_board = ap->board;
 			b = getboardbyname(curr_board);
 
-			asprintf(&tmp_buf, "{\"board\":\"%s\", \"secstr\":\"%s\", \"articles\":[]}", curr_board, b->header.sec1);
-			json_board_obj = json_tokener_parse(tmp_buf);
-			free(tmp_buf);
-
-			json_object_array_add(output_array, json_board_obj);
-
-			json_articles_array = json_object_object_get(json_board_obj, "articles");
+			api_arena_buf_puts(&out, "{\"board\":");
+			api_arena_buf_json_str(&out, curr_board);
+			api_arena_buf_puts(&out, ", \"secstr\":");
+			api_arena_buf_json_str(&out, b ? b->header.sec1 : "");
+			api_arena_buf_puts(&out, ", \"articles\":[");
+		} else {
+			api_arena_buf_puts(&out, ", ");
 		}
 
-		// 添加实体，因为此时 json_articles_array 指向了正确的数组
-		asprintf(&tmp_buf, "{\"aid\":%d, \"tid\":%d, \"mark\":%d, \"num\":%d}",
-				ap->filetime, ap->thread, ap->mark, ap->sequence_num);
-		json_article_obj = json_tokener_parse(tmp_buf);
-		free(tmp_buf);
-		json_object_object_add(json_article_obj, "title", json_object_new_string(ap->title));
-
-		json_object_array_add(json_articles_array, json_article_obj);
+		api_arena_buf_printf(&out, "{\"aid\":%d, \"tid\":%d, \"mark\":%d, \"num\":%d, \"title\":",
+				(int)ap->filetime, (int)ap->thread, ap->mark, ap->sequence_num);
+		api_arena_buf_json_str(&out, ap->title);
+		api_arena_buf_puts(&out, "}");
 	}
+	if(curr_board != NULL)
+		api_arena_buf_puts(&out, "]}");
+	api_arena_buf_puts(&out, "]}");
+	api_phase_end(API_PHASE_JSON);
 
-	char *s = strdup(json_object_to_json_string(output_obj));
+	char *s = out.s;
+	if(!s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
 
-	api_set_json_header(res);
-	onion_response_write0(res, s);
+	api_write_json(req, res, s);
 
 	// 缓存到 redis
-	rContext = redisConnect((char *)"127.0.0.1", 6379);
+	api_phase_begin(API_PHASE_REDIS);
+	rContext = redisConnect(conf->redis_host, conf->redis_port);
 	if(rContext!=NULL && rContext->err ==0) {
 		// 连接成功的情况下才执行
 		rReplyTime = redisCommand(rContext, "SET useractivities-%s-%s-timestamp %d",
@@ -517,23 +505,18 @@ int api_user_articlequery(ONION_FUNC_PROTO_STR)
 		rReplyOut = redisCommand(rContext, "SET useractivities-%s-%s %s",
 				ue->userid, query_ue->userid, s);
 
-		asprintf(&tmp_buf, "[redis] SET %s and %s", rReplyTime->str, rReplyOut->str);
-		newtrace(tmp_buf);
+		char *trace = api_arena_printf("[redis] SET %s and %s", rReplyTime->str, rReplyOut->str);
+		if(trace)
+			newtrace(trace);
 
 		freeReplyObject(rReplyTime);
 		freeReplyObject(rReplyOut);
-		free(tmp_buf);
 	}
 
 	if(rContext) {
 		redisFree(rContext);
 	}
-
-	free(s);
-	json_object_put(output_obj);
-	free(articles);
-	free(query_ue);
-	free(ue);
+	api_phase_end(API_PHASE_REDIS);
 
 	return OCS_PROCESSED;
 }
@@ -581,12 +564,11 @@ int api_user_autocomplete(ONION_FUNC_PROTO_STR)
 	if(strlen(search_str) < 2)
 		return api_error(p, req, res, API_RT_SUCCESSFUL);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
-	free(ue);
 	if(r != API_RT_SUCCESSFUL) {
 		return api_error(p, req, res, r);
 	}
@@ -600,8 +582,7 @@ int api_user_autocomplete(ONION_FUNC_PROTO_STR)
 			json_object_array_add(json_array_user, json_object_new_string(shm_ucache->userid[i]));
 	}
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(obj));
+	api_write_json(req, res, json_object_to_json_string(obj));
 
 	json_object_put(obj);
 
@@ -802,8 +783,9 @@ static int initfriends(struct user_info *u)
 
 	u->fnum = (u->fnum>=MAXFRIENDS) ? MAXFRIENDS : u->fnum;
 
-	struct override *fff = (struct override *)malloc(MAXFRIENDS * sizeof(struct override));
-	// TODO: 判断 malloc 调用失败
+	struct override *fff = api_arena_alloc(MAXFRIENDS * sizeof(struct override));
+	if(!fff)
+		return 0;
 	memset(fff, 0, MAXFRIENDS*sizeof(struct override));
 	fp = fopen(buf, "r");
 	fread(fff, sizeof(struct override), MAXFRIENDS, fp);
@@ -825,7 +807,6 @@ static int initfriends(struct user_info *u)
 	}
 
 	u->fnum = fnum;
-	free(fff);
 	fclose(fp);
 	return fnum;
 
@@ -926,19 +907,15 @@ static int adduser_with_activation_code(struct userec *x, char *code)
 
 static void api_newcomer(struct userec *x,char *fromhost, char *words)
 {
-	FILE *fp;
-	char filename[80];
-	sprintf(filename, "bbstmpfs/tmp/%s.tmp", x->userid);
-	fp = fopen(filename, "w");
-	fprintf(fp, "大家好, \n\n");
-	fprintf(fp, "我是 %s(%s), 来自 %s\n", x->userid, x->username, fromhost);
-	fprintf(fp, "今天初来此地报到, 请大家多多指教.\n\n");
-	fprintf(fp, "自我介绍:\n\n");
-	fprintf(fp, "%s", words);
-	fclose(fp);
-	do_article_post("newcomers", "API 新手上路", filename, x->userid,
-		     x->username, fromhost, -1, 0, 0, x->userid, -1);
-	unlink(filename);
+	char *content = api_arena_printf("大家好, \n\n"
+			"我是 %s(%s), 来自 %s\n"
+			"今天初来此地报到, 请大家多多指教.\n\n"
+			"自我介绍:\n\n"
+			"%s", x->userid, x->username, fromhost, words);
+	if(!content)
+		return;
+	do_article_post("newcomers", "API 新手上路", content, x->userid,
+		     x->username, fromhost, -1, 0, 0, x->userid, -1, NULL);
 }
 
 static int api_user_X_File_list(ONION_FUNC_PROTO_STR, int mode)
@@ -950,47 +927,46 @@ static int api_user_X_File_list(ONION_FUNC_PROTO_STR, int mode)
 	if(!userid || !sessid || !appkey)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
 		return api_error(p, req, res, r);
 	}
 
 	struct override * array;
 	int size=0;
 	if(mode == UFT_FRIENDS) {
-		array = (struct override *)malloc(sizeof(struct override) * MAXFRIENDS);
+		array = api_arena_alloc(sizeof(struct override) * MAXFRIENDS);
 		size = load_user_X_File(array, MAXFRIENDS, ue->userid, UFT_FRIENDS);
 	} else {
-		array = (struct override *)malloc(sizeof(struct override) * MAXREJECTS);
+		array = api_arena_alloc(sizeof(struct override) * MAXREJECTS);
 		size = load_user_X_File(array, MAXREJECTS, ue->userid, UFT_REJECTS);
 	}
 
 	char exp_utf[2*sizeof(array[0].exp)];
-	struct json_object * obj = json_tokener_parse("{\"errcode\":0, \"users\":[]}");
-	struct json_object * json_array_users = json_object_object_get(obj, "users");
+	struct api_arena_buf out;
+	api_arena_buf_init(&out, 64 + size * 96);
+	api_arena_buf_puts(&out, "{\"errcode\":0, \"users\":[");
 
 	int i;
 	for(i=0; i<size; ++i) {
-		struct json_object * user = json_object_new_object();
-		json_object_object_add(user, "userid", json_object_new_string(array[i].id));
+		api_arena_buf_puts(&out, (i == 0) ? "{\"userid\":" : ", {\"userid\":");
+		api_arena_buf_json_str(&out, array[i].id);
 
 		memset(exp_utf, 0, sizeof(exp_utf));
 		g2u(array[i].exp, strlen(array[i].exp), exp_utf, sizeof(exp_utf));
-		json_object_object_add(user, "explain", json_object_new_string(exp_utf));
-		json_object_array_add(json_array_users, user);
+		api_arena_buf_puts(&out, ", \"explain\":");
+		api_arena_buf_json_str(&out, exp_utf);
+		api_arena_buf_puts(&out, "}");
 	}
+	api_arena_buf_puts(&out, "]}");
 
-	api_set_json_header(res);
-	onion_response_write0(res, json_object_to_json_string(obj));
-
-	json_object_put(obj);
-	free(array);
-	free(ue);
+	if(!out.s)
+		return api_error(p, req, res, API_RT_NOTENGMEM);
+	api_write_json(req, res, out.s);
 
 	return OCS_PROCESSED;
 }
@@ -1006,43 +982,34 @@ static int api_user_X_File_add(ONION_FUNC_PROTO_STR, int mode)
 	if(!userid || !sessid || !appkey || !queryid)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	struct userec *query_ue = getuser(queryid);
 	if(query_ue == 0) {
-		free(ue);
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, r);
 	}
 
 	struct override * array;
 	int size=0;
 	if(mode == UFT_FRIENDS) {
-		array = (struct override *)malloc(sizeof(struct override) * MAXFRIENDS);
+		array = api_arena_alloc(sizeof(struct override) * MAXFRIENDS);
 		size = load_user_X_File(array, MAXFRIENDS, ue->userid, UFT_FRIENDS);
 
 		if(size >= MAXFRIENDS-1) {
-			free(array);
-			free(ue);
-			free(query_ue);
 			return api_error(p, req, res, API_RT_REACHMAXRCD);
 		}
 	} else {
-		array = (struct override *)malloc(sizeof(struct override) * MAXREJECTS);
+		array = api_arena_alloc(sizeof(struct override) * MAXREJECTS);
 		size = load_user_X_File(array, MAXREJECTS, ue->userid, UFT_REJECTS);
 
 		if(size >= MAXREJECTS-1) {
-			free(array);
-			free(ue);
-			free(query_ue);
 			return api_error(p, req, res, API_RT_REACHMAXRCD);
 		}
 	}
@@ -1050,9 +1017,6 @@ static int api_user_X_File_add(ONION_FUNC_PROTO_STR, int mode)
 	int pos = is_queryid_in_user_X_File(queryid, array, size);
 	if(pos>=0) {
 		// queryid 已存在
-		free(array);
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, API_RT_ALRDYINRCD);
 	}
 
@@ -1075,15 +1039,9 @@ static int api_user_X_File_add(ONION_FUNC_PROTO_STR, int mode)
 		api_set_json_header(res);
 		onion_response_printf(res, "{ \"errcode\": 0, \"userid\": \"%s\" }", query_ue->userid);
 
-		free(array);
-		free(ue);
-		free(query_ue);
 
 		return OCS_PROCESSED;
 	} else {
-		free(array);
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, API_RT_NOSUCHFILE);
 	}
 }
@@ -1098,39 +1056,33 @@ static int api_user_X_File_del(ONION_FUNC_PROTO_STR, int mode)
 	if(!userid || !sessid || !appkey || !queryid)
 		return api_error(p, req, res, API_RT_WRONGPARAM);
 
-	struct userec *ue = getuser(userid);
+	struct userec *ue = api_getuser(userid);
 	if(ue == 0)
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 
 	struct userec *query_ue = getuser(queryid);
 	if(query_ue == 0) {
-		free(ue);
 		return api_error(p, req, res, API_RT_NOSUCHUSER);
 	}
 
 	int r = check_user_session(ue, sessid, appkey);
 	if(r != API_RT_SUCCESSFUL) {
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, r);
 	}
 
 	struct override * array;
 	int size=0;
 	if(mode == UFT_FRIENDS) {
-		array = (struct override *)malloc(sizeof(struct override) * MAXFRIENDS);
+		array = api_arena_alloc(sizeof(struct override) * MAXFRIENDS);
 		size = load_user_X_File(array, MAXFRIENDS, ue->userid, UFT_FRIENDS);
 	} else {
-		array = (struct override *)malloc(sizeof(struct override) * MAXREJECTS);
+		array = api_arena_alloc(sizeof(struct override) * MAXREJECTS);
 		size = load_user_X_File(array, MAXREJECTS, ue->userid, UFT_REJECTS);
 	}
 
 	int pos = is_queryid_in_user_X_File(queryid, array, size);
 	if(pos < 0) {
 		// queryid 不存在
-		free(array);
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, API_RT_NOTINRCD);
 	}
 
@@ -1155,14 +1107,8 @@ static int api_user_X_File_del(ONION_FUNC_PROTO_STR, int mode)
 		api_set_json_header(res);
 		onion_response_printf(res, "{ \"errcode\": 0, \"userid\": \"%s\" }", query_ue->userid);
 
-		free(array);
-		free(ue);
-		free(query_ue);
 		return OCS_PROCESSED;
 	} else {
-		free(array);
-		free(ue);
-		free(query_ue);
 		return api_error(p, req, res, API_RT_NOSUCHFILE);
 	}
 }
@@ -5,6 +5,7 @@
  *      Author: shenyang
  */
 
+#include <pthread.h>
 #include "apilib.h"
 #include "error_code.h"
 char *ummap_ptr = NULL;
@@ -97,7 +98,7 @@ int ummap()
 
 /** 从共享内存中寻找用户
  * Hash userid and get index in PASSWDS file.
- * @warning remember to free userec address!
+ * 返回的副本分配自请求分配区，请求结束时自动回收，不要 free。
  * @param id
  * @return
  * @see getusernum
@@ -106,16 +107,26 @@ int ummap()
 struct userec * getuser(const char *id)
 {
 	int uid;
+	api_phase_begin(API_PHASE_AUTH);
 	uid = getusernum(id);
-	if(uid<0)
+	if(uid<0) {
+		api_phase_end(API_PHASE_AUTH);
 		return NULL;
+	}
 	if((uid+1) * sizeof(struct userec) > ummap_size)
 		ummap(); // 重新 mmap PASSWDS 文件到内存
-	if(!ummap_ptr)
+	if(!ummap_ptr) {
+		api_phase_end(API_PHASE_AUTH);
 		return 0;
+	}
 
-	struct userec *user = malloc(sizeof(struct userec));
+	struct userec *user = api_arena_alloc(sizeof(struct userec));
+	if(!user) {
+		api_phase_end(API_PHASE_AUTH);
+		return NULL;
+	}
 	memcpy(user, ummap_ptr + sizeof(*user) * uid, sizeof(*user));
+	api_phase_end(API_PHASE_AUTH);
 	return user;
 }
 
@@ -364,6 +375,61 @@ int count_uindex(int uid)
 	return count;
 }
 
+static int api_guest_valid(const struct user_info *ui)
+{
+	return ui->active && ui->pid != 0 && !strcasecmp(ui->userid, "guest");
+}
+
+struct user_info *api_guest_info(void)
+{
+	static struct user_info *guest_ui = NULL;
+	static int guest_uid = -1;
+	struct user_info *ui = __atomic_load_n(&guest_ui, __ATOMIC_RELAXED);
+	int uid, i, utmp_index;
+
+	if(ui && api_guest_valid(ui))
+		return ui;
+
+	uid = __atomic_load_n(&guest_uid, __ATOMIC_RELAXED);
+	if(uid < 0) {
+		uid = getusernum("guest");
+		if(uid < 0)
+			return NULL;
+		__atomic_store_n(&guest_uid, uid, __ATOMIC_RELAXED);
+	}
+
+	for(i=0; i<6; i++) {
+		utmp_index = shm_uindex->user[uid][i];
+		if(utmp_index <= 0)
+			continue;
+		ui = &(shm_utmp->uinfo[utmp_index-1]);
+		if(api_guest_valid(ui)) {
+			__atomic_store_n(&guest_ui, ui, __ATOMIC_RELAXED);
+			return ui;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * 当前线程上已经校验过的会话，由 batch 在执行子请求前设置
+ */
+static __thread const struct api_session *api_session_verified = NULL;
+
+void api_session_set_verified(const struct api_session *s)
+{
+	api_session_verified = s;
+}
+
+struct userec *api_getuser(const char *userid)
+{
+	const struct api_session *s = api_session_verified;
+
+	if(s && userid && !strcasecmp(userid, s->ue->userid))
+		return s->ue;
+	return getuser(userid);
+}
+
 int check_user_session(struct userec *x, const char *sessid, const char *appkey)
 {
 	return check_user_session_with_mode_change(x, sessid, appkey, -1);
@@ -374,6 +440,14 @@ int check_user_session_with_mode_change(struct userec *x, const char *sessid, co
 	if(!x || !sessid || !appkey)
 		return API_RT_WRONGSESS;
 
+	const struct api_session *s = api_session_verified;
+	if(s && x == s->ue && !strcmp(sessid, s->sessid) && !strcmp(appkey, s->appkey)) {
+		if(mode > 0)
+			shm_utmp->uinfo[s->utmp_index].mode = mode;
+		return API_RT_SUCCESSFUL;
+	}
+
+	api_phase_begin(API_PHASE_AUTH);
 	int uent_index = get_user_utmp_index(sessid);
 	char ssid[30];
 	strncpy(ssid, sessid+3, 30);
@@ -399,9 +473,12 @@ int check_user_session_with_mode_change(struct userec *x, const char *sessid, co
 		if(mode > 0) {
 			ui->mode = mode;
 		}
+		api_phase_end(API_PHASE_AUTH);
 		return API_RT_SUCCESSFUL;
-	} else
+	} else {
+		api_phase_end(API_PHASE_AUTH);
 		return API_RT_WRONGSESS;
+	}
 }
 
 char *string_replace(char *ori, const char *old, const char *new)
@@ -521,6 +598,32 @@ int getNextChar(register FILE* fp, int *future, int *future_char)
 	return -1; // error
 }
 
+char *api_arena_g2u(const char *gbk, size_t len)
+{
+	char *utf8 = api_arena_alloc(3 * len + 1);	// 一个 GBK 字符最多对应三个字节
+
+	if(!utf8)
+		return NULL;
+	memset(utf8, 0, 3 * len + 1);
+	api_phase_begin(API_PHASE_CONV);
+	g2u(gbk, len, utf8, 3 * len);
+	api_phase_end(API_PHASE_CONV);
+	return utf8;
+}
+
+char *api_arena_u2g(const char *utf8, size_t len)
+{
+	char *gbk = api_arena_alloc(2 * len + 1);
+
+	if(!gbk)
+		return NULL;
+	memset(gbk, 0, 2 * len + 1);
+	api_phase_begin(API_PHASE_CONV);
+	u2g(utf8, len, gbk, 2 * len);
+	api_phase_end(API_PHASE_CONV);
+	return gbk;
+}
+
 char *parse_article(const char *bname, const char *fname, int mode, struct attach_link **attach_link_list)
 {
 	if(!bname || !fname)
@@ -535,6 +638,8 @@ char *parse_article(const char *bname, const char *fname, int mode, struct attac
 	if(!article_stream)
 		return NULL;
 
+	api_phase_begin(API_PHASE_PARSE);
+
 	FILE *mem_stream, *html_stream;
 	char buf[512], attach_link[256], *tmp_buf, *mem_buf, *html_buf, *attach_filename;
 	size_t mem_buf_len, html_buf_len, attach_file_size;
@@ -559,14 +664,15 @@ char *parse_article(const char *bname, const char *fname, int mode, struct attac
 			fflush(mem_stream);
 			fclose(mem_stream);
 			free(mem_buf);
+			api_phase_end(API_PHASE_PARSE);
 			return NULL;
 		} else if(checkbinaryattach(buf, article_stream, &attach_file_size)) {
 			attach_no++;
 			attach_filename = buf + 18;
 			fprintf(mem_stream, "#attach %s\n", attach_filename);
 			memset(attach_link, 0, 256);
-			snprintf(attach_link, 256, "http://%s:8080/%s/%s/%d/%s", MY_BBS_DOMAIN,
-					bname, fname, -4+(int)ftell(article_stream), attach_filename);
+			snprintf(attach_link, 256, "/api/attach/show?type=board&board=%s&aid=%d&pos=%d&attname=%s",
+					bname, atoi(fname + 2), -4+(int)ftell(article_stream), attach_filename);
 			add_attach_link(attach_link_list, attach_link, attach_file_size);
 			fseek(article_stream, attach_file_size, SEEK_CUR);
 			continue;
@@ -575,14 +681,8 @@ char *parse_article(const char *bname, const char *fname, int mode, struct attac
 		// 常规字符处理
 		if(mode == ARTICLE_PARSE_WITHOUT_ANSICOLOR
 				&& strchr(buf, '\033') != NULL) {
-			tmp_buf = strdup(buf);
-
-			while(strchr(tmp_buf, '\033') != NULL)
-				tmp_buf = string_replace(tmp_buf, "\033", "[ESC]");
-
-			fprintf(mem_stream, "%s", tmp_buf);
-			free(tmp_buf);
-			tmp_buf = NULL;
+			tmp_buf = api_arena_replace_all(buf, "\033", "[ESC]");
+			fprintf(mem_stream, "%s", tmp_buf ? tmp_buf : buf);
 		} else{
 			fprintf(mem_stream, "%s", buf);
 		}
@@ -592,9 +692,7 @@ char *parse_article(const char *bname, const char *fname, int mode, struct attac
 
 	char *utf_content;
 	if(mode == ARTICLE_PARSE_WITHOUT_ANSICOLOR) { // 不包含 '\033'，直接转码
-		utf_content = (char *)malloc(3*mem_buf_len);
-		memset(utf_content, 0, 3*mem_buf_len);
-		g2u(mem_buf, mem_buf_len, utf_content, 3*mem_buf_len);
+		utf_content = api_arena_g2u(mem_buf, mem_buf_len);
 	} else { // 将 ansi 色彩转为 HTML 标记
 		html_stream = open_memstream(&html_buf, &html_buf_len);
 		fseek(mem_stream, 0, SEEK_SET);
@@ -607,9 +705,7 @@ char *parse_article(const char *bname, const char *fname, int mode, struct attac
 		fflush(html_stream);
 		fclose(html_stream);
 
-		utf_content = (char*)malloc(3*html_buf_len);
-		memset(utf_content, 0, 3*html_buf_len);
-		g2u(html_buf, html_buf_len, utf_content, 3*html_buf_len);
+		utf_content = api_arena_g2u(html_buf, html_buf_len);
 		free(html_buf);
 	}
 
@@ -617,6 +713,7 @@ char *parse_article(const char *bname, const char *fname, int mode, struct attac
 	fclose(mem_stream);
 	free(mem_buf);
 
+	api_phase_end(API_PHASE_PARSE);
 	return utf_content;
 }
 
@@ -837,9 +934,72 @@ int f_append(char *filename, char *buf)
 	return 0;
 }
 
+/** 站内信计数缓存
+ * 以 .DIR 路径为键，记录上一次统计时 .DIR 的大小和修改时间。文件未被其他进程
+ * 修改时直接使用缓存的计数，标记已读时由本进程增量维护，发信后作废缓存。
+ */
+struct mail_count_entry {
+	struct timespec mtime;	///< 统计时 .DIR 的修改时间
+	off_t size;				///< 统计时 .DIR 的大小
+	int total;
+	int unread;
+};
+
+static ght_hash_table_t *mail_count_table = NULL;
+static pthread_mutex_t mail_count_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int mail_count_stamp_equal(const struct mail_count_entry *e, const struct stat *st)
+{
+	return e->size == st->st_size
+		&& e->mtime.tv_sec == st->st_mtim.tv_sec
+		&& e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/**
+ * @brief 取得缓存项，不存在时创建。
+ * @warning 调用前需要持有 mail_count_lock。
+ */
+static struct mail_count_entry *mail_count_entry_get(const char *path, int create)
+{
+	struct mail_count_entry *e;
+
+	if(!mail_count_table) {
+		if(!create)
+			return NULL;
+		mail_count_table = ght_create(4096);
+		if(!mail_count_table)
+			return NULL;
+	}
+
+	e = ght_get(mail_count_table, strlen(path), path);
+	if(e || !create)
+		return e;
+
+	e = (struct mail_count_entry *)malloc(sizeof(struct mail_count_entry));
+	if(!e)
+		return NULL;
+	memset(e, 0, sizeof(*e));
+	e->size = -1;
+	if(ght_insert(mail_count_table, e, strlen(path), path) < 0) {
+		free(e);
+		return NULL;
+	}
+	return e;
+}
+
+static void mail_count_entry_set(struct mail_count_entry *e, const struct stat *st, int total, int unread)
+{
+	e->mtime = st->st_mtim;
+	e->size = st->st_size;
+	e->total = total;
+	e->unread = unread;
+}
+
 int mail_count(char *id, int *unread)
 {
 	struct fileheader *x;
+	struct mail_count_entry *e;
+	struct stat st;
 	char path[80];
 	int total=0, i=0;
 	struct mmapfile mf = { ptr:NULL };
@@ -847,6 +1007,20 @@ int mail_count(char *id, int *unread)
 
 	setmailfile(path, id, ".DIR");
 
+	if(stat(path, &st) < 0)
+		return 0;
+
+	pthread_mutex_lock(&mail_count_lock);
+	e = mail_count_entry_get(path, 0);
+	if(e && mail_count_stamp_equal(e, &st)) {
+		total = e->total;
+		*unread = e->unread;
+		pthread_mutex_unlock(&mail_count_lock);
+		return total;
+	}
+	pthread_mutex_unlock(&mail_count_lock);
+
+	// 缓存失效，说明文件被其他进程修改过，重新统计
 	if(mmapfile(path, &mf)<0)
 		return 0;
 
@@ -859,212 +1033,301 @@ int mail_count(char *id, int *unread)
 	}
 
 	mmapfile(NULL, &mf);
+
+	// 以统计前的 stat 作为戳记，统计期间若有变化，下次调用会再次统计
+	pthread_mutex_lock(&mail_count_lock);
+	e = mail_count_entry_get(path, 1);
+	if(e)
+		mail_count_entry_set(e, &st, total, *unread);
+	pthread_mutex_unlock(&mail_count_lock);
+
 	return total;
 }
 
-int do_article_post(char *board, char *title, char *filename, char *id,
-		char *nickname, char *ip, int sig, int mark, int outgoing, char *realauthor, int thread)
+void mail_count_append(const char *id)
 {
-	FILE *fp, *fp1, *fp2;
-	char buf3[1024], *content_utf8_buf, *content_gbk_buf, *title_gbk;
-	size_t content_utf8_buf_len;
-	struct fileheader header;
-	memset(&header, 0, sizeof(header));
-	int t;
+	struct mail_count_entry *e;
+	char path[80];
 
-	if(strcasecmp(id, "Anonymous") != 0)
-		fh_setowner(&header, id, 0);
-	else
-		fh_setowner(&header, realauthor, 1);
+	setmailfile(path, id, ".DIR");
 
-	sprintf(buf3, "boards/%s/", board);
+	// 不在原处累加：其他进程原地标记已读不改变大小，而追加在 api_append_record()
+	// 的锁内完成，这里得不到追加前的戳记，无法确认缓存在追加前仍然有效；同一批
+	// 追加多条记录时大小也不只增加一条。下次 mail_count() 会重新统计。
+	pthread_mutex_lock(&mail_count_lock);
+	e = mail_count_entry_get(path, 0);
+	if(e)
+		e->size = -1;
+	pthread_mutex_unlock(&mail_count_lock);
+}
 
-	time_t now_t = time(NULL);
-	t = trycreatefile(buf3, "M.%d.A", now_t, 100);
-	if(t<0)
-		return -1;
+int mail_mark_read(const char *id, int num, int filetime)
+{
+	struct mail_count_entry *e;
+	struct fileheader x;
+	struct stat st_before, st_after;
+	char path[80];
+	int fd, changed = 0;
 
-	header.filetime = t;
-	header.accessed |= mark;
+	if(num <= 0)
+		return -1;
 
-	if(outgoing)
-		header.accessed |= FH_INND;
+	setmailfile(path, id, ".DIR");
+	fd = open(path, O_RDWR);
+	if(fd < 0)
+		return -1;
 
-	fp1 = fopen(buf3, "w");
-	if(NULL == fp1)
+	flock(fd, LOCK_EX);
+	if(fstat(fd, &st_before) < 0
+			|| lseek(fd, (num-1)*sizeof(struct fileheader), SEEK_SET) < 0
+			|| read(fd, &x, sizeof(x)) != sizeof(x)
+			|| x.filetime != filetime) {
+		flock(fd, LOCK_UN);
+		close(fd);
 		return -1;
-	title_gbk = (char *)malloc(strlen(title)*2);
-	memset(title_gbk, 0, strlen(title)*2);
-	u2g(title, strlen(title), title_gbk, strlen(title)*2);
-	strsncpy(header.title, title_gbk, sizeof(header.title));
-	fp = open_memstream(&content_utf8_buf, &content_utf8_buf_len);
-	fprintf(fp,
-			"发信人: %s (%s), 信区: %s\n标  题: %s\n发信站: 兵马俑BBS (%24.24s), %s)\n\n",
-			id, nickname, board, title, Ctime(now_t),
-			outgoing ? "转信(" MY_BBS_DOMAIN : "本站(" MY_BBS_DOMAIN);
-	free(title_gbk);
-	fp2 = fopen(filename, "r");
-	if(fp2!=0) {
-		while(1) {  // 将 bbstmpfs 中文章主体的内容写到 content_utf8_buf 中
-			int retv = fread(buf3, 1, sizeof(buf3), fp2);
-			if(retv<=0)
-				break;
-			fwrite(buf3, 1, retv, fp);
-		}
+	}
 
-		fclose(fp2);
+	if(!(x.accessed & FH_READ)) {
+		x.accessed |= FH_READ;
+		lseek(fd, -1 * sizeof(x), SEEK_CUR);
+		if(write(fd, &x, sizeof(x)) == sizeof(x))
+			changed = 1;
+		fstat(fd, &st_after);
 	}
+	flock(fd, LOCK_UN);
+	close(fd);
 
-	// TODO: QMD
-	fprintf(fp, "\n--\n");
-	// sig_append
+	if(!changed)
+		return 0;
 
-	fprintf(fp, "\033[1;%dm※ 来源:．兵马俑BBS %s [FROM: %.20s]\033[0m\n",
-			31+rand()%7, MY_BBS_DOMAIN " API", ip);
+	pthread_mutex_lock(&mail_count_lock);
+	e = mail_count_entry_get(path, 0);
+	if(e) {
+		if(mail_count_stamp_equal(e, &st_before) && e->unread > 0)
+			mail_count_entry_set(e, &st_after, e->total, e->unread - 1);
+		else
+			e->size = -1;
+	}
+	pthread_mutex_unlock(&mail_count_lock);
 
-	fflush(fp);
-	fclose(fp);
+	return 1;
+}
 
-	content_gbk_buf = (char *)malloc(content_utf8_buf_len *2);
-	memset(content_gbk_buf, 0, content_utf8_buf_len *2);
-	u2g(content_utf8_buf, content_utf8_buf_len, content_gbk_buf, content_utf8_buf_len*2);
-	fprintf(fp1, "%s", content_gbk_buf);
-	fclose(fp1);
+static void mail_size_ledger_stamp_path(char *path, const char *userid)
+{
+	setmailfile(path, userid, ".DIR");
+}
 
-	sprintf(buf3, "boards/%s/M.%d.A", board, t);
-	header.sizebyte = numbyte(eff_size(buf3));
+static long long mail_size_ledger_scan(const char *userid)
+{
+	struct mmapfile mf = { ptr:NULL };
+	struct fileheader *x;
+	char path[STRLEN];
+	long long size = 0;
+	int i, total;
 
-	if(thread == -1)
-		header.thread = header.filetime;
-	else
-		header.thread = thread;
+	setmailfile(path, userid, ".DIR");
+	if(mmapfile(path, &mf) < 0)
+		return 0;
 
-	sprintf(buf3, "boards/%s/.DIR", board);
-	append_record(buf3, &header, sizeof(header));
+	total = mf.size / sizeof(struct fileheader);
+	x = (struct fileheader *)mf.ptr;
+	for(i=0; i<total; ++i) {
+		setmailfile(path, userid, fh2fname(&x[i]));
+		size += file_size_s(path);
+	}
 
-	//if(outgoing)
+	mmapfile(NULL, &mf);
+	return size;
+}
 
-	//updatelastpost(board);  //TODO:
+const struct api_ledger_kind mail_size_ledger = {
+	.filename = ".mailsize",
+	.scan = mail_size_ledger_scan,
+	.stamp_path = mail_size_ledger_stamp_path,
+	.record_size = sizeof(struct fileheader),
+	.max_age = 86400,
+};
+
+/**
+ * @brief 在正文之后追加签名档分隔线与来源
+ */
+static void api_post_append_footer(struct api_arena_buf *b, const char *content, const char *ip)
+{
+	api_arena_buf_puts(b, content);
+	api_arena_buf_puts(b, "\n--\n");
+	// TODO: QMD
+	// sig_append
+	api_arena_buf_printf(b, "\033[1;%dm※ 来源:．兵马俑BBS %s [FROM: %.20s]\033[0m\n",
+			31+rand()%7, MY_BBS_DOMAIN " API", ip);
+}
+
+/**
+ * @brief 将 utf8 编码的完整内容转为 gbk，在 dir 下新建 M.t.A 并一次写入
+ * @param path 传入目录（以 / 结尾），返回时为新建文件的路径
+ * @param size 返回写入的字节数，可以为 NULL
+ * @return 文件名中实际使用的时间戳，失败返回 -1，此时不会留下文件
+ */
+static int api_post_write(char *path, const struct api_arena_buf *b, time_t now_t, size_t *size)
+{
+	char *gbk;
+	size_t len;
+	int t, fd;
+
+	if(!b->s)
+		return -1;
+	gbk = api_arena_u2g(b->s, b->len);
+	if(!gbk)
+		return -1;
+	len = strlen(gbk);
+
+	t = trycreatefile(path, "M.%d.A", now_t, 100);
+	if(t<0)
+		return -1;
+
+	fd = open(path, O_WRONLY | O_TRUNC);
+	if(fd < 0 || write(fd, gbk, len) != (ssize_t)len) {
+		if(fd >= 0)
+			close(fd);
+		unlink(path);
+		return -1;
+	}
+	close(fd);
+
+	if(size)
+		*size = len;
 	return t;
 }
 
-int do_mail_post(char *to_userid, char *title, char *filename, char *id,
-				 char *nickname, char *ip, int sig, int mark)
+int do_article_post(char *board, char *title, const char *content, char *id,
+		char *nickname, char *ip, int sig, int mark, int outgoing, char *realauthor, int thread, int *num)
 {
-	FILE *fp, *fp2;
-	char buf[256], dir[256], tmp_utf_buf[1024], tmp_gbk_buf[1024];
+	char path[STRLEN], *title_gbk;
 	struct fileheader header;
-	int t;
-
+	struct api_arena_buf b;
 	memset(&header, 0, sizeof(header));
-	fh_setowner(&header, id, 0);
-	setmailfile(buf, to_userid, "");
+	int t, pos;
+
+	if(strcasecmp(id, "Anonymous") != 0)
+		fh_setowner(&header, id, 0);
+	else
+		fh_setowner(&header, realauthor, 1);
 
 	time_t now_t = time(NULL);
-	t = trycreatefile(buf, "M.%d.A", now_t, 100);
+	api_arena_buf_init(&b, strlen(content) + 512);
+	api_arena_buf_printf(&b,
+			"发信人: %s (%s), 信区: %s\n标  题: %s\n发信站: 兵马俑BBS (%24.24s), %s)\n\n",
+			id, nickname, board, title, Ctime(now_t),
+			outgoing ? "转信(" MY_BBS_DOMAIN : "本站(" MY_BBS_DOMAIN);
+	api_post_append_footer(&b, content, ip);
 
+	sprintf(path, "boards/%s/", board);
+	t = api_post_write(path, &b, now_t, NULL);
 	if(t<0)
 		return -1;
 
 	header.filetime = t;
-	header.thread = t;
-	u2g(title, strlen(title), header.title, sizeof(header.title));
 	header.accessed |= mark;
 
-	fp = fopen(buf, "w");
-	if(fp == 0)
-		return -2;
+	if(outgoing)
+		header.accessed |= FH_INND;
 
-	fp2 = fopen(filename, "r");
+	title_gbk = api_arena_u2g(title, strlen(title));
+	if(title_gbk)
+		strsncpy(header.title, title_gbk, sizeof(header.title));
 
-	sprintf(tmp_utf_buf, "寄信人: %s (%s)\n标  题: %s\n发信站: 兵马俑BBS (%s)\n来  源: %s\n\n",
-			id, nickname, title, Ctime(now_t), ip);
-	u2g(tmp_utf_buf, 1024, tmp_gbk_buf, 1024);
-	fwrite(tmp_gbk_buf, 1, strlen(tmp_gbk_buf), fp);
+	header.sizebyte = numbyte(eff_size(path));
 
-	if(fp2) {
-		int retv;
-		while(1) {
-			retv = fread(buf, 1, sizeof(buf), fp2);
-			if(retv<=0)
-				break;
-			fwrite(buf, 1, retv, fp);
-		}
-		fclose(fp2);
-	}
+	if(thread == -1)
+		header.thread = header.filetime;
+	else
+		header.thread = thread;
 
-	fprintf(fp, "\n--\n");
-	// TODO QMD
-	// sig_append();
+	sprintf(path, "boards/%s/.DIR", board);
+	pos = api_append_record(path, &header, sizeof(header));
+	if(pos < 0) {
+		sprintf(path, "boards/%s/%s", board, fh2fname(&header));
+		unlink(path);
+		return -1;
+	}
+	if(num)
+		*num = pos;
 
-	sprintf(tmp_utf_buf, "\033[1;%dm※ 来源:．兵马俑BBS %s [FROM: %.20s]\033[0m\n",
-			31+rand()%7, MY_BBS_DOMAIN " API", ip);
-	u2g(tmp_utf_buf, 1024, tmp_gbk_buf, 1024);
-	fwrite(tmp_gbk_buf, 1, strlen(tmp_gbk_buf), fp);
-	fclose(fp);	// 输出完成
+	//if(outgoing)
 
-	setmailfile(buf, to_userid, ".DIR");
-	append_record(buf, &header, sizeof(header));
-	return 0;
+	//updatelastpost(board);  //TODO:
+	return t;
 }
 
-int do_mail_post_to_sent_box(char *userid, char *title, char *filename, char *id,
-				 char *nickname, char *ip, int sig, int mark)
+/**
+ * @brief 写入一封邮件，do_mail_post() 与 do_mail_post_to_sent_box() 共用
+ * @param path 传入信箱目录（以 / 结尾），返回时为邮件文件的路径
+ * @param peer_label "寄信人" 或 "收信人"
+ */
+static int api_mail_write(char *path, struct fileheader *header, const char *peer_label,
+		char *title, const char *content, char *id, char *nickname, char *ip, int mark, size_t *size)
 {
-	FILE *fp, *fp2;
-	char buf[256], dir[256], tmp_utf_buf[1024], tmp_gbk_buf[1024];
-	struct fileheader header;
+	struct api_arena_buf b;
 	int t;
 
-	memset(&header, 0, sizeof(header));
-	fh_setowner(&header, id, 0);
-	setsentmailfile(buf, userid, "");
+	memset(header, 0, sizeof(*header));
+	fh_setowner(header, id, 0);
 
 	time_t now_t = time(NULL);
-	t = trycreatefile(buf, "M.%d.A", now_t, 100);
+	api_arena_buf_init(&b, strlen(content) + 512);
+	api_arena_buf_printf(&b, "%s: %s (%s)\n标  题: %s\n发信站: 兵马俑BBS (%s)\n来  源: %s\n\n",
+			peer_label, id, nickname, title, Ctime(now_t), ip);
+	api_post_append_footer(&b, content, ip);
 
+	t = api_post_write(path, &b, now_t, size);
 	if(t<0)
 		return -1;
 
-	header.filetime = t;
-	header.thread = t;
-	u2g(title, strlen(title), header.title, sizeof(header.title));
-	header.accessed |= mark;
-
-	fp = fopen(buf, "w");
-	if(fp == 0)
-		return -2;
+	header->filetime = t;
+	header->thread = t;
+	u2g(title, strlen(title), header->title, sizeof(header->title));
+	header->accessed |= mark;
+	return t;
+}
 
-	fp2 = fopen(filename, "r");
+int do_mail_post(char *to_userid, char *title, const char *content, char *id,
+				 char *nickname, char *ip, int sig, int mark)
+{
+	char buf[256];
+	struct fileheader header;
+	size_t size;
 
-	sprintf(tmp_utf_buf, "收信人: %s (%s)\n标  题: %s\n发信站: 兵马俑BBS (%s)\n来  源: %s\n\n",
-			id, nickname, title, Ctime(now_t), ip);
-	u2g(tmp_utf_buf, 1024, tmp_gbk_buf, 1024);
-	fwrite(tmp_gbk_buf, 1, strlen(tmp_gbk_buf), fp);
+	setmailfile(buf, to_userid, "");
+	if(api_mail_write(buf, &header, "寄信人", title, content, id, nickname, ip, mark, &size) < 0)
+		return -1;
 
-	if(fp2) {
-		int retv;
-		while(1) {
-			retv = fread(buf, 1, sizeof(buf), fp2);
-			if(retv<=0)
-				break;
-			fwrite(buf, 1, retv, fp);
-		}
-		fclose(fp2);
+	setmailfile(buf, to_userid, ".DIR");
+	if(api_append_record(buf, &header, sizeof(header)) < 0) {
+		setmailfile(buf, to_userid, fh2fname(&header));
+		unlink(buf);
+		return -1;
 	}
+	mail_count_append(to_userid);
+	api_ledger_add(&mail_size_ledger, to_userid, size, 1);
+	return 0;
+}
 
-	fprintf(fp, "\n--\n");
-	// TODO QMD
-	// sig_append();
+int do_mail_post_to_sent_box(char *userid, char *title, const char *content, char *id,
+				 char *nickname, char *ip, int sig, int mark)
+{
+	char buf[256];
+	struct fileheader header;
 
-	sprintf(tmp_utf_buf, "\033[1;%dm※ 来源:．兵马俑BBS %s [FROM: %.20s]\033[0m\n",
-			31+rand()%7, MY_BBS_DOMAIN " API", ip);
-	u2g(tmp_utf_buf, 1024, tmp_gbk_buf, 1024);
-	fwrite(tmp_gbk_buf, 1, strlen(tmp_gbk_buf), fp);
-	fclose(fp);	// 输出完成
+	setsentmailfile(buf, userid, "");
+	if(api_mail_write(buf, &header, "收信人", title, content, id, nickname, ip, mark, NULL) < 0)
+		return -1;
 
 	setsentmailfile(buf, userid, ".DIR");
-	append_record(buf, &header, sizeof(header));
+	if(api_append_record(buf, &header, sizeof(header)) < 0) {
+		setsentmailfile(buf, userid, fh2fname(&header));
+		unlink(buf);
+		return -1;
+	}
 	return 0;
 }
 
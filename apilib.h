@@ -74,6 +74,7 @@ extern int ummap_size;
 int ummap();
 
 
+int useridhash(const char *id);
 int finduseridhash(struct useridhashitem *ptr, int size, const char *userid);
 int insertuseridhash(struct useridhashitem *ptr, int size, char *userid, int num);
 int getusernum(const char *id);
@@ -95,6 +96,36 @@ int get_user_utmp_index(const char *sessid);
  */
 int count_uindex(int uid);
 
+/**
+ * @brief 获取 guest 的 utmp 项，作为未登录用户的权限上下文
+ * @details 找到的位置会被记住，之后只做校验，失效时才重新查找 shm_uindex。
+ * @return 不存在在线的 guest 时返回 NULL
+ */
+struct user_info *api_guest_info(void);
+
+/**
+ * @brief 已经校验过的会话，参见 api_session_set_verified()
+ */
+struct api_session {
+	struct userec *ue;
+	int utmp_index;				///< shm_utmp->uinfo 中的下标
+	const char *sessid;
+	const char *appkey;
+};
+
+/**
+ * @brief 设置当前线程上已经校验过的会话
+ * @details 设置之后，同一会话的 api_getuser() 直接返回 s->ue，check_user_session()
+ * 不再查询 shm_utmp。batch 校验一次后为每个子请求设置，执行完毕后以 NULL 清除。
+ * s 在清除之前需要保持有效。
+ */
+void api_session_set_verified(const struct api_session *s);
+
+/**
+ * @brief 代替 getuser()，userid 为已校验的会话用户时不再查找
+ */
+struct userec *api_getuser(const char *userid);
+
 /**
  * @brief 检查用户 session 是否有效
  * @param x
@@ -133,8 +164,7 @@ char *string_replace(char *ori, const char *old, const char *new);
  * @param fname 帖子名称
  * @param mode 参见 enum article_parse_mode
  * @param attach_link_list 存放BMY附件链接的链表
- * @return 处理后的字符串，该字符串已转换为 UTF-8 编码。
- * @warning 在使用完成后记得 free。
+ * @return 处理后的字符串，该字符串已转换为 UTF-8 编码，分配自请求分配区，不需要 free。
  */
 char *parse_article(const char *bname, const char *fname, int mode, struct attach_link **attach_link_list);
 
@@ -180,6 +210,23 @@ int f_append(char *filename, char *buf);
  */
 int append_record(char *filename, void *record, int size);
 
+/**
+ * @brief 向索引文件追加一条记录，同一文件上并发的追加合并为一次加锁写入，参见 api_append.c
+ * @param path 文件名
+ * @param record 需要存放的记录
+ * @param size 记录长度，同一文件的记录长度应相同
+ * @return 成功时返回记录在文件中的序号（从 1 开始），失败返回 -1
+ */
+int api_append_record(const char *path, const void *record, size_t size);
+
+/**
+ * @brief 登记一条 sizebyte 为 0 的文章记录，由后台线程修正 .DIR，参见 api_repair.c
+ * 调用者不需要持有 .DIR 的锁，也不会等待修正完成。
+ * @param board 版面名称
+ * @param fh 文章记录
+ */
+void api_repair_sizebyte(const char *board, const struct fileheader *fh);
+
 /**
  * @brief 计算某个id的站内信封数。
  * 该方法来自 nju09/bbsfoot.c int mails()。该函数不包含用户id有效性校验，需要在逻辑
@@ -190,6 +237,21 @@ int append_record(char *filename, void *record, int size);
  */
 int mail_count(char *id, int *unread);
 
+/**
+ * @brief 向收件箱追加记录后，作废站内信计数缓存。
+ * @param id 收件人 id
+ */
+void mail_count_append(const char *id);
+
+/**
+ * @brief 将收件箱中的一封信标记为已读，并更新站内信计数缓存。
+ * @param id 用户 id
+ * @param num 信件序号，从 1 开始
+ * @param filetime 用于校验记录的 fileheader.filetime
+ * @return 成功标记返回 1，原本已读返回 0，失败返回 -1。
+ */
+int mail_mark_read(const char *id, int num, int filetime);
+
 /**
  * @brief 计算用户等级
  * 该方法用于输出 utf8 编码的字符串，需要与 libythtbbs 保持一致。
@@ -208,10 +270,10 @@ char * calc_perf_str_utf8(int perf);
 
 /**
  * @brief 实际处理发文的函数。
- * 该函数来自 nju09。
+ * 该函数来自 nju09。文章头、正文与签名档在内存中拼接、转为 gbk 编码后一次写入文章文件。
  * @param board 版面名称
  * @param title 文章标题, utf8 编码
- * @param filename 位于 bbstmpfs 中的文章内容
+ * @param content 文章正文，utf8 编码
  * @param id 用于显示的作者 id
  * @param nickname 作者昵称
  * @param ip 来自 ip
@@ -220,19 +282,21 @@ char * calc_perf_str_utf8(int perf);
  * @param outgoing 是否转信
  * @param realauthor 实际的作者 id
  * @param thread 主题编号
- * @return 返回文件名中实际使用的时间戳
+ * @param num 不为 NULL 时返回文章在 .DIR 中的序号
+ * @return 返回文件名中实际使用的时间戳，失败返回 -1
  */
-int do_article_post(char *board, char *title, char *filename, char *id,
+int do_article_post(char *board, char *title, const char *content, char *id,
 					char *nickname, char *ip, int sig, int mark,
-					int outgoing, char *realauthor, int thread);
+					int outgoing, char *realauthor, int thread, int *num);
 
 /**
  * @brief 实际处理发站内信的函数。
- * 该函数参考 nju09。其中 filename 指向的文件需为 gbk 编码。本函数仅用于对站内用户发信。
+ * 该函数参考 nju09。与 do_article_post() 相同，内容在内存中转为 gbk 编码后一次写入。
+ * 本函数仅用于对站内用户发信。
  * @warning 需要提前做好用户是否可用的验证。
  * @param to_userid 指向的用户
  * @param title 站内信标题，utf8 编码
- * @param filename 位于 bbstmpfs 中的文章内容
+ * @param content 站内信正文，utf8 编码
  * @param id 用于显示的作者 id
  * @param nickname 作者昵称
  * @param ip 来自 ip
@@ -240,7 +304,7 @@ int do_article_post(char *board, char *title, char *filename, char *id,
  * @param mark fileheader 的标记
  * @return 返回文件名中实际使用的时间戳
  */
-int do_mail_post(char *to_userid, char *title, char *filename, char *id,
+int do_mail_post(char *to_userid, char *title, const char *content, char *id,
 				 char *nickname, char *ip, int sig, int mark);
 
 /**
@@ -248,7 +312,7 @@ int do_mail_post(char *to_userid, char *title, char *filename, char *id,
  * 该函数参考 nju09 的实现。为 2014.12 新增的功能
  * @param userid 发件人 ID
  * @param title
- * @param filename
+ * @param content 正文，utf8 编码
  * @param id 收件人 ID
  * @param nickname
  * @param ip
@@ -256,9 +320,26 @@ int do_mail_post(char *to_userid, char *title, char *filename, char *id,
  * @param mark
  * @return
  */
-int do_mail_post_to_sent_box(char *userid, char *title, char *filename, char *id,
+int do_mail_post_to_sent_box(char *userid, char *title, const char *content, char *id,
 		 char *nickname, char *ip, int sig, int mark);
 
+/**
+ * @brief 将 struct bmy_article 数组序列化为 json 字符串。
+ * 这个方法不考虑异常，因此方法里确定了 errcode 为 0，也就是 API_RT_SUCCESSFUL，
+ * 相关的异常应该在从 BMY 数据转为 bmy_article 的过程中判断、处理。
+ * @param ba_list struct bmy_article 数组
+ * @param count 数组长度
+ * @param mode 0:不输出文章所在版面信息, 1:输出每个文章所在的版面信息。
+ * @return json 字符串，分配自请求的分配区，不需要 free
+ */
+char* bmy_article_array_to_json_string(struct bmy_article *ba_list, int count, int mode);
+
+/**
+ * @brief 同 bmy_article_array_to_json_string，另外输出序号与主题大小
+ * @param mode 1:主题模式，输出参与评论的用户
+ */
+char* bmy_article_with_num_array_to_json_string(struct bmy_article *ba_list, int count, int mode);
+
 /**
  * @brief 将 ansi 颜色控制转换成 HTML 标记
  * 该方法来自 theZiz/aha。略作修改。
@@ -319,4 +400,165 @@ int is_queryid_in_user_X_File(const char *queryid, const struct override *array,
  */
 int file_size_s(const char *filepath);
 
+/**
+ * 用户空间占用账本的类型描述，参见 api_ledger.c
+ */
+struct api_ledger_kind {
+	const char *filename;		///< 账本在用户主目录下的文件名
+	long long (*scan)(const char *userid);	///< 完整统计占用字节数
+	void (*stamp_path)(char *path, const char *userid);	///< 用于校验账本的索引文件，可为 NULL
+	int record_size;			///< 索引文件中每条记录的长度，0 表示不定长，增量更新时不顺延戳记
+	int max_age;				///< 超过该秒数后由后台重新核对，0 表示不定期核对
+};
+
+/**
+ * @brief 读取账本中记录的字节数
+ * 账本不存在时同步统计一次；索引文件被其他进程修改或账本过期时，返回当前
+ * 记录的值，并交由后台线程核对。
+ * @param kind 账本类型
+ * @param userid 用户 id
+ * @return 字节数
+ */
+long long api_ledger_get(const struct api_ledger_kind *kind, const char *userid);
+
+/**
+ * @brief 增量更新账本
+ * @param kind 账本类型
+ * @param userid 用户 id
+ * @param delta 变化的字节数，删除时为负值
+ * @param records 本次变更在索引文件中增加的记录数，用于顺延账本戳记
+ */
+void api_ledger_add(const struct api_ledger_kind *kind, const char *userid, long long delta, int records);
+
+/**
+ * @brief 检查配额并预留空间，检查与增加在同一次加锁内完成
+ * 并发的请求不会同时通过检查而共同超出配额。索引文件被修改过时先在锁内重新
+ * 统计。写入失败时以 api_ledger_add() 加上 -delta 归还。
+ * @param kind 账本类型
+ * @param userid 用户 id
+ * @param delta 预留的字节数
+ * @param limit 配额
+ * @return 成功返回 0，超出配额返回 -1
+ */
+int api_ledger_reserve(const struct api_ledger_kind *kind, const char *userid, long long delta, long long limit);
+
+/**
+ * 邮箱占用账本，仅统计收件箱 .DIR 中的信件
+ */
+extern const struct api_ledger_kind mail_size_ledger;
+
+/**
+ * @brief 用户的提醒数量，等同于 count_notification_num
+ * 以下三个函数定义于 api_notification.c，在提醒文件未变化时直接使用内存中
+ * 的索引，不再重复解析文件。
+ * @param userid
+ * @return
+ */
+int api_notification_count(const char *userid);
+
+/**
+ * @brief 文章是否在用户的提醒中，等同于 is_post_in_notification
+ * @param userid
+ * @param board
+ * @param aid
+ * @return 存在返回 1，否则返回 0
+ */
+int api_notification_has_post(const char *userid, const char *board, int aid);
+
+/**
+ * @brief 删除文章对应的提醒，并使缓存失效
+ * @param userid
+ * @param board
+ * @param aid
+ */
+void api_notification_del_post(const char *userid, const char *board, int aid);
+
+/**
+ * 附件区占用账本，定义于 api_attach.c
+ */
+extern const struct api_ledger_kind attach_size_ledger;
+
+/**
+ * @brief 请求处理的阶段，用于 Server-Timing 和慢请求日志，参见 api_metrics.c
+ */
+enum api_phase {
+	API_PHASE_AUTH = 0,		///< getuser、check_user_session
+	API_PHASE_DIR,			///< 映射、扫描 .DIR 直至取出所需记录，包含其中的编码转换
+	API_PHASE_PARSE,		///< parse_article、parse_mail，包含其中的编码转换
+	API_PHASE_CONV,			///< GBK 与 UTF-8 的转换
+	API_PHASE_JSON,			///< JSON 序列化
+	API_PHASE_REDIS,		///< redis 往返
+	API_PHASE_OUTPUT,		///< 压缩与输出
+	API_PHASE_MAX
+};
+
+/**
+ * @brief 开始、结束一个阶段的计时
+ * 同一阶段可以多次进入，耗时累加；不在请求处理线程中调用时不做任何事。
+ */
+void api_phase_begin(enum api_phase phase);
+void api_phase_end(enum api_phase phase);
+
+
+/**
+ * @brief 从当前线程的请求分配区分配内存，参见 api_arena.c
+ * 分配的内存在 api_arena_reset() 时统一回收，不能 free。
+ * @return 失败返回 NULL
+ */
+void *api_arena_alloc(size_t size);
+
+/**
+ * @brief 扩展 ptr 指向的分配，ptr 为最近一次分配时原地扩展
+ * @return 失败返回 NULL，原有内容不变
+ */
+void *api_arena_grow(void *ptr, size_t old_size, size_t new_size);
+char *api_arena_strdup(const char *s);
+char *api_arena_strndup(const char *s, size_t n);
+char *api_arena_printf(const char *fmt, ...) __attribute__((format(printf, 1, 2)));
+
+/**
+ * @brief 替换 s 中所有的 old，结果分配自请求分配区
+ * 用于替代 strdup 之后循环调用 string_replace() 的写法，只扫描一遍。
+ * @param old 不能为空字符串
+ */
+char *api_arena_replace_all(const char *s, const char *old, const char *new);
+
+/**
+ * @brief GBK 与 UTF-8 的转换，结果分配自请求分配区并以 '\0' 结尾
+ * @return 失败返回 NULL
+ */
+char *api_arena_g2u(const char *gbk, size_t len);
+char *api_arena_u2g(const char *utf8, size_t len);
+
+/**
+ * @brief 回收当前线程分配区中的全部内存，保留第一个块供下一个请求使用
+ * 由 api_route_dispatch() 在请求结束时调用。
+ */
+void api_arena_reset(void);
+
+/**
+ * @brief 回收全部内存，包括保留的块，用于即将退出的线程
+ */
+void api_arena_release(void);
+
+/**
+ * @brief 分配自请求分配区的字符串缓冲，用于拼接 JSON
+ * 分配失败后 s 为 NULL，之后的写入都被忽略，调用者只需在最后检查一次。
+ */
+struct api_arena_buf {
+	char *s;
+	size_t len;
+	size_t cap;
+};
+
+void api_arena_buf_init(struct api_arena_buf *b, size_t cap);
+void api_arena_buf_append(struct api_arena_buf *b, const char *s, size_t n);
+void api_arena_buf_puts(struct api_arena_buf *b, const char *s);
+void api_arena_buf_printf(struct api_arena_buf *b, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+
+/**
+ * @brief 写入带引号的 JSON 字符串，转义引号、反斜杠与控制字符
+ */
+void api_arena_buf_json_str(struct api_arena_buf *b, const char *s);
+
 #endif
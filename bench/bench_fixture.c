@@ -0,0 +1,392 @@
+/**
+ * @file	bench_fixture.c
+ * @brief	压测数据生成，参见 bench_fixture.h。
+ * @details	文本使用 GBK 编码，与线上数据一致，使 g2u 与 aha_convert 的开销接近真实情况。
+ */
+
+#include "bench_fixture.h"
+
+#define BENCH_SECSTR		"0123456789"
+
+static const char *bench_titles[] = {
+	"\xb2\xe2\xca\xd4\xce\xc4\xd5\xc2",									// 测试文章
+	"\xb9\xd8\xd3\xda\xc6\xda\xc4\xa9\xbf\xbc\xca\xd4\xb5\xc4\xb0\xb2\xc5\xc5",	// 关于期末考试的安排
+	"\xbd\xf1\xcc\xec\xb5\xc4\xcc\xec\xc6\xf8\xd5\xe6\xb2\xbb\xb4\xed",			// 今天的天气真不错
+	"\xc7\xf3\xd6\xfa\xa3\xba\xb1\xe0\xd2\xeb\xb3\xf6\xb4\xed",					// 求助：编译出错
+	"\xbb\xb6\xd3\xad\xd0\xc2\xcd\xac\xd1\xa7",									// 欢迎新同学
+	"\xb9\xe0\xcb\xae",															// 灌水
+};
+
+static const char *bench_lines[] = {
+	"\xd5\xe2\xca\xc7\xd5\xfd\xce\xc4\xb5\xc4\xd2\xbb\xd0\xd0\xa3\xac\xb0\xfc\xba\xac\xd2\xbb\xd0\xa9\xd6\xd0\xce\xc4\xc4\xda\xc8\xdd\xa1\xa3\n",
+	"\033[1;31m\xbd\xbb\xb4\xf3\xb1\xf8\xc2\xed\xd9\xb8\033[m \033[1;33m\xb0\xe6\xc3\xe6\xb9\xab\xb8\xe6\033[m\n",
+	"plain ascii line with a url http://bbs.xjtu.edu.cn/ and some text.\n",
+	"\033[1;32;44m\xbb\xb6\xd3\xad\xd0\xc2\xcd\xac\xd1\xa7\033[0m, \033[4m\xb9\xe0\xcb\xae\033[m\n",
+	"\xa1\xbe \xd4\xda bench00001 \xb5\xc4\xb4\xf3\xd7\xf7\xd6\xd0\xcc\xe1\xb5\xbd: \xa1\xbf\n",	// 【 在 bench00001 的大作中提到: 】
+	": \xd5\xe2\xca\xc7\xd2\xfd\xd3\xc3\xb5\xc4\xc4\xda\xc8\xdd\n",							// : 这是引用的内容
+};
+
+#define BENCH_NTITLES	(int)(sizeof(bench_titles) / sizeof(bench_titles[0]))
+#define BENCH_NLINES	(int)(sizeof(bench_lines) / sizeof(bench_lines[0]))
+
+void bench_fixture_defaults(struct bench_fixture_conf *conf)
+{
+	memset(conf, 0, sizeof(*conf));
+	conf->home = "bench_home";
+	conf->boards = 50;
+	conf->articles = 20000;
+	conf->thread_len = 8;
+	conf->users = 2000;
+	conf->mails = 100;
+	conf->attach_every = 20;
+	conf->attach_size = 32 * 1024;
+	conf->body_lines = 30;
+	conf->seed = 1;
+}
+
+static void bench_userid(int n, char *buf)
+{
+	snprintf(buf, IDLEN+1, BENCH_USERID_FMT, n);
+}
+
+static int bench_mkdirs(const char *path)
+{
+	char buf[256], *s;
+
+	snprintf(buf, sizeof(buf), "%s", path);
+	for(s = buf + 1; *s; ++s) {
+		if(*s != '/')
+			continue;
+		*s = 0;
+		if(mkdir(buf, 0755) < 0 && errno != EEXIST)
+			return -1;
+		*s = '/';
+	}
+	if(mkdir(buf, 0755) < 0 && errno != EEXIST)
+		return -1;
+	return 0;
+}
+
+/**
+ * @brief 写入一篇文章或信件，返回文件大小
+ */
+static long bench_write_post(const char *path, const char *userid, const char *board,
+		const char *title, int filetime, int lines, int attach_size, unsigned int *seed)
+{
+	FILE *fp;
+	int i;
+	long size;
+	uint32_t len;
+	time_t t = filetime;
+
+	fp = fopen(path, "w");
+	if(!fp)
+		return -1;
+
+	fprintf(fp, "\xb7\xa2\xd0\xc5\xc8\xcb: %s (%s), \xd0\xc5\xc7\xf8: %s\n", userid, userid, board);
+	fprintf(fp, "\xb1\xea  \xcc\xe2: %s\n", title);
+	fprintf(fp, "\xb7\xa2\xd0\xc5\xd5\xbe: \xb1\xf8\xc2\xed\xd9\xb8" "BBS (%24.24s)\n\n", ctime(&t));
+
+	for(i=0; i<lines; ++i)
+		fputs(bench_lines[rand_r(seed) % BENCH_NLINES], fp);
+
+	if(attach_size > 0) {
+		fprintf(fp, "\nbeginbinaryattach bench%d.png\n", filetime);
+		fputc(0, fp);
+		len = htonl(attach_size);
+		fwrite(&len, sizeof(len), 1, fp);
+		for(i=0; i<attach_size; ++i)
+			fputc(rand_r(seed) & 0xff, fp);
+		fputc('\n', fp);
+	}
+
+	fprintf(fp, "--\n\033[1;36m\xa1\xf9 \xc0\xb4\xd4\xb4:\xa3\xae\xb1\xf8\xc2\xed\xd9\xb8" "BBS " MY_BBS_DOMAIN
+			"\xa3\xae[FROM: 10.0.%d.%d]\033[m\n", rand_r(seed) % 256, rand_r(seed) % 256);
+
+	size = ftell(fp);
+	fclose(fp);
+	return size;
+}
+
+static int bench_write_passwds(const struct bench_fixture_conf *conf)
+{
+	struct userec x;
+	char salt[3];
+	FILE *fp;
+	int i;
+
+	fp = fopen(".PASSWDS", "w");
+	if(!fp)
+		return -1;
+
+	// 序号 0 为 SYSOP，1 为 guest，之后为生成的用户
+	for(i=-2; i<conf->users; ++i) {
+		memset(&x, 0, sizeof(x));
+		if(i == -2) {
+			strcpy(x.userid, "SYSOP");
+			x.userlevel = ~0;
+		} else if(i == -1) {
+			strcpy(x.userid, "guest");
+			x.userlevel = 0;
+		} else {
+			bench_userid(i, x.userid);
+			x.userlevel = PERM_BASIC | PERM_DEFAULT;
+		}
+		strsncpy(x.username, x.userid, NAMELEN);
+		getsalt(salt);
+		strsncpy(x.passwd, crypt1(BENCH_PASSWD, salt), sizeof(x.passwd));
+		x.numlogins = 100 + i;
+		x.numposts = 10 + i;
+		x.numdays = 365;
+		x.firstlogin = BENCH_TIME_BASE - 86400 * 365;
+		x.lastlogin = BENCH_TIME_BASE;
+		strcpy(x.lasthost, "10.0.0.1");
+		fwrite(&x, sizeof(x), 1, fp);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static int bench_write_board(const struct bench_fixture_conf *conf, int n, unsigned int *seed)
+{
+	struct fileheader fh;
+	char bname[32], dir[80], path[128], userid[IDLEN+1], title[80];
+	int i, start, filetime;
+	long size;
+	FILE *fp;
+
+	bench_fixture_board_name(n, bname, sizeof(bname));
+	snprintf(dir, sizeof(dir), "boards/%s", bname);
+	if(bench_mkdirs(dir) < 0)
+		return -1;
+
+	snprintf(path, sizeof(path), "%s/.DIR", dir);
+	fp = fopen(path, "w");
+	if(!fp)
+		return -1;
+
+	for(i=0; i<conf->articles; ++i) {
+		memset(&fh, 0, sizeof(fh));
+		filetime = bench_fixture_article_time(n, i);
+
+		// 新主题，或者回复最近几个主题之一，使同主题文章交错排列
+		if(conf->thread_len <= 1 || i % conf->thread_len == 0) {
+			start = i;
+			snprintf(title, sizeof(title), "%s %d", bench_titles[rand_r(seed) % BENCH_NTITLES], i);
+		} else {
+			start = (i / conf->thread_len - rand_r(seed) % 8) * conf->thread_len;
+			if(start < 0)
+				start = 0;
+			snprintf(title, sizeof(title), "Re: %s %d", bench_titles[start % BENCH_NTITLES], start);
+		}
+
+		bench_userid(rand_r(seed) % conf->users, userid);
+		fh.filetime = filetime;
+		fh.thread = bench_fixture_article_time(n, start);
+		strsncpy(fh.owner, userid, sizeof(fh.owner));
+		strsncpy(fh.title, title, sizeof(fh.title));
+
+		snprintf(path, sizeof(path), "%s/M.%d.A", dir, filetime);
+		size = bench_write_post(path, userid, bname, title, filetime,
+				conf->body_lines / 2 + rand_r(seed) % (conf->body_lines + 1),
+				(conf->attach_every > 0 && i % conf->attach_every == conf->attach_every - 1) ? conf->attach_size : 0,
+				seed);
+		if(size < 0) {
+			fclose(fp);
+			return -1;
+		}
+		fh.sizebyte = numbyte(size);
+		fwrite(&fh, sizeof(fh), 1, fp);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+static int bench_write_mailbox(const struct bench_fixture_conf *conf, int n, unsigned int *seed)
+{
+	struct fileheader fh;
+	char userid[IDLEN+1], from[IDLEN+1], dir[80], path[128];
+	int i, filetime;
+	FILE *fp;
+
+	bench_userid(n, userid);
+
+	sethomepath(dir, userid);
+	if(bench_mkdirs(dir) < 0)
+		return -1;
+
+	setmailfile(path, userid, "");
+	if(bench_mkdirs(path) < 0)
+		return -1;
+
+	setmailfile(path, userid, ".DIR");
+	fp = fopen(path, "w");
+	if(!fp)
+		return -1;
+
+	for(i=0; i<conf->mails; ++i) {
+		memset(&fh, 0, sizeof(fh));
+		filetime = BENCH_TIME_BASE + i * 600 + n;
+		bench_userid(rand_r(seed) % conf->users, from);
+		fh.filetime = filetime;
+		fh.thread = filetime;
+		fh.accessed = (i < conf->mails - 5) ? FH_READ : 0;
+		strsncpy(fh.owner, from, sizeof(fh.owner));
+		strsncpy(fh.title, bench_titles[rand_r(seed) % BENCH_NTITLES], sizeof(fh.title));
+
+		snprintf(path, sizeof(path), "M.%d.A", filetime);
+		setmailfile(dir, userid, path);
+		if(bench_write_post(dir, from, userid, fh.title, filetime, conf->body_lines / 2, 0, seed) < 0) {
+			fclose(fp);
+			return -1;
+		}
+		fwrite(&fh, sizeof(fh), 1, fp);
+	}
+
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * @brief 十大与美文推荐，格式与 nju09 生成的一致
+ */
+static int bench_write_top(const struct bench_fixture_conf *conf, unsigned int *seed)
+{
+	struct commend c;
+	char bname[32];
+	int i, n, thread;
+	FILE *fp;
+
+	if(bench_mkdirs("wwwtmp") < 0)
+		return -1;
+
+	fp = fopen("wwwtmp/ctopten", "w");
+	if(!fp)
+		return -1;
+	fprintf(fp, "<html><body><table>\n<tr><td>No.</td><td>board</td><td>title</td><td>num</td></tr>\n");
+	for(i=0; i<10; ++i) {
+		n = rand_r(seed) % conf->boards;
+		bench_fixture_board_name(n, bname, sizeof(bname));
+		thread = bench_fixture_article_time(n, (rand_r(seed) % ((conf->articles - 1) / conf->thread_len + 1)) * conf->thread_len);
+		fprintf(fp, "<tr><td>%d</td><td>%s</td><td><div class='td-overflow'>"
+				"<a href='tfind?board=%s&th=%d'>%s</a></div></td><td>%d</td></tr>\n",
+				i + 1, bname, bname, thread, bench_titles[i % BENCH_NTITLES], 100 - i * 5);
+	}
+	fprintf(fp, "</table></body></html>\n");
+	fclose(fp);
+
+	fp = fopen(".COMMEND", "w");
+	if(!fp)
+		return -1;
+	for(i=0; i<100; ++i) {
+		memset(&c, 0, sizeof(c));
+		n = rand_r(seed) % conf->boards;
+		bench_fixture_board_name(n, c.board, sizeof(c.board));
+		bench_userid(rand_r(seed) % conf->users, c.userid);
+		strsncpy(c.title, bench_titles[i % BENCH_NTITLES], sizeof(c.title));
+		snprintf(c.filename, sizeof(c.filename), "M.%d.A",
+				bench_fixture_article_time(n, rand_r(seed) % conf->articles));
+		fwrite(&c, sizeof(c), 1, fp);
+	}
+	fclose(fp);
+	return 0;
+}
+
+int bench_fixture_write(const struct bench_fixture_conf *conf)
+{
+	char cwd[256];
+	unsigned int seed = conf->seed;
+	int i, r = -1;
+
+	if(conf->boards <= 0 || conf->articles <= 0 || conf->users <= 0 || conf->thread_len <= 0) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if(!getcwd(cwd, sizeof(cwd)) || bench_mkdirs(conf->home) < 0 || chdir(conf->home) < 0)
+		return -1;
+
+	if(bench_write_passwds(conf) < 0)
+		goto out;
+	for(i=0; i<conf->boards; ++i) {
+		if(bench_write_board(conf, i, &seed) < 0)
+			goto out;
+	}
+	for(i=0; i<conf->users; ++i) {
+		if(bench_write_mailbox(conf, i, &seed) < 0)
+			goto out;
+	}
+	if(bench_write_top(conf, &seed) < 0)
+		goto out;
+	if(bench_mkdirs("reclog") < 0 || bench_mkdirs(PATHUSERATTACH) < 0 || bench_mkdirs("etc/Area_Dir") < 0)
+		goto out;
+
+	r = 0;
+out:
+	chdir(cwd);
+	return r;
+}
+
+void bench_fixture_fill_shm(const struct bench_fixture_conf *conf,
+		struct UTMPFILE *utmp, struct BCACHE *bcache, struct UCACHE *ucache,
+		struct UCACHEHASH *uidhash, struct UINDEX *uindex)
+{
+	struct boardmem *b;
+	int i, n;
+
+	for(i=0; i<conf->boards && i<MAXBOARD; ++i) {
+		b = &bcache->bcache[i];
+		bench_fixture_board_name(i, b->header.filename, sizeof(b->header.filename));
+		strsncpy(b->header.title, bench_titles[i % BENCH_NTITLES], sizeof(b->header.title));
+		b->header.sec1[0] = BENCH_SECSTR[i % (sizeof(BENCH_SECSTR) - 1)];
+		strsncpy(b->header.type, "[BMY]", sizeof(b->header.type));
+		bench_userid(i % conf->users, b->header.bm[0]);
+		b->total = conf->articles;
+		b->score = conf->boards - i;
+		b->lastpost = bench_fixture_article_time(i, conf->articles - 1);
+	}
+	bcache->number = i;
+
+	n = conf->users + 2;
+	if(n > MAXUSERS)
+		n = MAXUSERS;
+	strcpy(ucache->userid[0], "SYSOP");
+	strcpy(ucache->userid[1], "guest");
+	for(i=2; i<n; ++i)
+		bench_userid(i - 2, ucache->userid[i]);
+	for(i=0; i<n; ++i)
+		insertuseridhash(uidhash->uhi, UCACHE_HASH_SIZE, ucache->userid[i], i + 1);
+	ucache->number = n;
+}
+
+int bench_fixture_login(const struct bench_fixture_conf *conf,
+		struct UTMPFILE *utmp, struct UINDEX *uindex, int n, char *userid, char *sessid)
+{
+	struct user_info *u;
+	int uid = n + 3;		// 跳过 SYSOP 和 guest，uid 从 1 开始
+	int pos = n;			// utmp 中的序号
+
+	if(n < 0 || n >= conf->users || pos >= MAXACTIVE || uid > MAXUSERS)
+		return -1;
+
+	u = &utmp->uinfo[pos];
+	memset(u, 0, sizeof(*u));
+	u->active = 1;
+	u->uid = uid;
+	u->pid = APPPID;
+	u->mode = LOGIN;
+	u->userlevel = PERM_BASIC | PERM_DEFAULT;
+	u->lasttime = time(NULL);
+	strsncpy(u->from, "10.0.0.1", sizeof(u->from));
+	bench_userid(n, u->userid);
+	strsncpy(u->username, u->userid, sizeof(u->username));
+	strsncpy(u->appkey, BENCH_APPKEY, sizeof(u->appkey));
+	snprintf(u->sessionid, sizeof(u->sessionid), "bench%d", n);
+	uindex->user[uid-1][3] = pos + 1;
+
+	strcpy(userid, u->userid);
+	sprintf(sessid, "%c%c%c%s", pos / 26 / 26 + 'A', pos / 26 % 26 + 'A', pos % 26 + 'A', u->sessionid);
+	return 0;
+}
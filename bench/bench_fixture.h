@@ -0,0 +1,60 @@
+/**
+ * @file	bench_fixture.h
+ * @brief	生成用于压测的 MY_BBS_HOME 以及对应的共享内存数据。
+ * @details	磁盘上生成 .PASSWDS、boards/<版面>/.DIR 与文章（含 ANSI 色彩与二进制附件）、
+ * 			mail/<X>/<用户>/.DIR 与信件、home/<X>/<用户>/、wwwtmp/ctopten 以及 .COMMEND。
+ * 			共享内存部分只负责填充调用者给出的结构体，结构体既可以是普通的堆内存
+ * 			（进程内压测），也可以是 SysV 共享内存段。
+ *
+ * 			相同的配置与随机种子总是生成相同的数据。
+ */
+
+#ifndef __BMYBBS_BENCH_FIXTURE_H
+#define __BMYBBS_BENCH_FIXTURE_H
+
+#include "../apilib.h"
+#include "bench_names.h"
+
+struct bench_fixture_conf {
+	const char *home;			///< 生成数据的目录，不存在时创建
+	int boards;					///< 版面数
+	int articles;				///< 每个版面的文章数
+	int thread_len;				///< 平均每个主题的文章数
+	int users;					///< 用户数，另有 guest 和 SYSOP
+	int mails;					///< 每个用户的信件数
+	int attach_every;			///< 每隔多少篇文章带一个附件，0 表示不带
+	int attach_size;			///< 附件大小，字节
+	int body_lines;				///< 每篇文章正文的行数
+	unsigned int seed;
+};
+
+/**
+ * @brief 填充默认配置，规模接近一个中等站点的热门版面
+ */
+void bench_fixture_defaults(struct bench_fixture_conf *conf);
+
+/**
+ * @brief 在 conf->home 下生成磁盘数据
+ * @return 0 成功，-1 失败（errno 说明原因）
+ */
+int bench_fixture_write(const struct bench_fixture_conf *conf);
+
+/**
+ * @brief 依据配置填充共享内存结构
+ * 调用前结构体应已清零。用户的序号与 .PASSWDS 中的位置一致。
+ */
+void bench_fixture_fill_shm(const struct bench_fixture_conf *conf,
+		struct UTMPFILE *utmp, struct BCACHE *bcache, struct UCACHE *ucache,
+		struct UCACHEHASH *uidhash, struct UINDEX *uindex);
+
+/**
+ * @brief 为第 n 个生成的用户建立一个 API 会话，等同于 user/login 的结果
+ * @param n 从 0 开始的用户序号
+ * @param userid 传出参数，长度至少为 IDLEN+1
+ * @param sessid 传出参数，长度至少为 40
+ * @return 0 成功，-1 序号超出范围
+ */
+int bench_fixture_login(const struct bench_fixture_conf *conf,
+		struct UTMPFILE *utmp, struct UINDEX *uindex, int n, char *userid, char *sessid);
+
+#endif
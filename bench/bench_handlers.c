@@ -0,0 +1,337 @@
+/**
+ * @file	bench_handlers.c
+ * @brief	接口处理函数的进程内压测。
+ * @details	在生成的 MY_BBS_HOME 上直接调用各个处理函数，不经过网络与 onion 的解析，
+ * 			共享内存以堆内存代替。每个用例先预热，再执行指定次数，输出每秒请求数、
+ * 			p50/p99 延迟以及平均响应大小。
+ *
+ * 			用法：bmyapi_bench [-d 目录] [-g] [-n 次数] [-w 预热次数] [-b 版面数]
+ * 			[-a 每版文章数] [-u 用户数] [-m 每人信件数] [-c 用例名过滤] [-s 种子]
+ *
+ * 			-g 强制重新生成数据，否则目录中已有 .PASSWDS 时直接使用。
+ */
+
+#include <onion/types_internal.h>
+#include "../api.h"
+#include "../api_hist.h"
+#include "bench_fixture.h"
+
+#define BENCH_SESSIONS		64		///< 轮流使用的会话数
+#define BENCH_CAPTURE		4096	///< 截获响应的前若干字节，用于检查 errcode
+
+onion *o = NULL;
+
+struct bench_ctx {
+	struct bench_fixture_conf conf;
+	char userid[BENCH_SESSIONS][IDLEN+1];
+	char sessid[BENCH_SESSIONS][40];
+	int sessions;
+	unsigned int seed;
+};
+
+struct bench_output {
+	char buf[BENCH_CAPTURE];
+	size_t len;			///< buf 中的字节数
+	size_t total;		///< 全部输出的字节数
+};
+
+struct bench_case {
+	const char *name;
+	int (*handler)(ONION_FUNC_PROTO_STR);
+	void (*query)(struct bench_ctx *ctx, int s, char *buf, size_t len);	///< s 为本次使用的会话
+};
+
+static ssize_t bench_write(onion_request *req, const char *data, size_t len)
+{
+	struct bench_output *out = (struct bench_output *)req->connection.user_data;
+	size_t n = len;
+
+	if(n > sizeof(out->buf) - 1 - out->len)
+		n = sizeof(out->buf) - 1 - out->len;
+	memcpy(out->buf + out->len, data, n);
+	out->len += n;
+	out->total += len;
+	return len;
+}
+
+static void bench_random_board(struct bench_ctx *ctx, char *buf, size_t len, int *n)
+{
+	*n = rand_r(&ctx->seed) % ctx->conf.boards;
+	bench_fixture_board_name(*n, buf, len);
+}
+
+static int bench_auth(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	return snprintf(buf, len, "userid=%s&sessid=%s&appkey=" BENCH_APPKEY, ctx->userid[s], ctx->sessid[s]);
+}
+
+static void q_article_list_board(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	char board[32];
+	int n, off = bench_auth(ctx, s, buf, len);
+	bench_random_board(ctx, board, sizeof(board), &n);
+	snprintf(buf + off, len - off, "&type=board&btype=n&board=%s&startnum=%d&count=20",
+			board, 1 + rand_r(&ctx->seed) % ctx->conf.articles);
+}
+
+static void q_article_list_board_t(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	char board[32];
+	int n, off = bench_auth(ctx, s, buf, len);
+	bench_random_board(ctx, board, sizeof(board), &n);
+	snprintf(buf + off, len - off, "&type=board&btype=t&board=%s&startnum=%d&count=20",
+			board, 1 + rand_r(&ctx->seed) % (ctx->conf.articles / ctx->conf.thread_len + 1));
+}
+
+static void q_article_list_thread(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	char board[32];
+	int n, i, off = bench_auth(ctx, s, buf, len);
+	bench_random_board(ctx, board, sizeof(board), &n);
+	i = (rand_r(&ctx->seed) % (ctx->conf.articles / ctx->conf.thread_len + 1)) * ctx->conf.thread_len;
+	if(i >= ctx->conf.articles)
+		i = 0;
+	snprintf(buf + off, len - off, "&type=thread&board=%s&thread=%d",
+			board, bench_fixture_article_time(n, i));
+}
+
+static void q_article_list_top10(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	snprintf(buf, len, "type=top10");
+}
+
+static void q_article_list_commend(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	snprintf(buf, len, "type=commend&startnum=%d&count=20", 1 + rand_r(&ctx->seed) % 80);
+}
+
+static void q_article_content(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	char board[32];
+	int n, off = bench_auth(ctx, s, buf, len);
+	bench_random_board(ctx, board, sizeof(board), &n);
+	snprintf(buf + off, len - off, "&board=%s&aid=%d", board,
+			bench_fixture_article_time(n, rand_r(&ctx->seed) % ctx->conf.articles));
+}
+
+static void q_board_list(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	int off = bench_auth(ctx, s, buf, len);
+	snprintf(buf + off, len - off, "&secstr=%d&sortmode=%d", rand_r(&ctx->seed) % 10, 1 + rand_r(&ctx->seed) % 3);
+}
+
+static void q_board_info(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	char board[32];
+	int n, off = bench_auth(ctx, s, buf, len);
+	bench_random_board(ctx, board, sizeof(board), &n);
+	snprintf(buf + off, len - off, "&bname=%s", board);
+}
+
+static void q_user_query(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	bench_auth(ctx, s, buf, len);
+}
+
+static void q_user_query_other(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	int off = bench_auth(ctx, s, buf, len);
+	snprintf(buf + off, len - off, "&queryid=" BENCH_USERID_FMT, rand_r(&ctx->seed) % ctx->conf.users);
+}
+
+static void q_mail_list(struct bench_ctx *ctx, int s, char *buf, size_t len)
+{
+	int off = bench_auth(ctx, s, buf, len);
+	snprintf(buf + off, len - off, "&count=20");
+}
+
+static const struct bench_case bench_cases[] = {
+	{ "article/list board",				api_article_list,				q_article_list_board },
+	{ "article/list board btype=t",		api_article_list,				q_article_list_board_t },
+	{ "article/list thread",			api_article_list,				q_article_list_thread },
+	{ "article/list top10",				api_article_list,				q_article_list_top10 },
+	{ "article/list commend",			api_article_list,				q_article_list_commend },
+	{ "article/getHTMLContent",			api_article_getHTMLContent,		q_article_content },
+	{ "article/getRAWContent",			api_article_getRAWContent,		q_article_content },
+	{ "board/list",						api_board_list,					q_board_list },
+	{ "board/info",						api_board_info,					q_board_info },
+	{ "user/query",						api_user_query,					q_user_query },
+	{ "user/query queryid",				api_user_query,					q_user_query_other },
+	{ "mail/list",						api_mail_list,					q_mail_list },
+	{ NULL, NULL, NULL }
+};
+
+/**
+ * @brief 构造请求并调用处理函数
+ * @return 0 成功，-1 HTTP 状态码或 errcode 不为 0
+ */
+static int bench_run_once(onion_listen_point *lp, const struct bench_case *c, char *query, struct bench_output *out)
+{
+	onion_request *req;
+	onion_response *res;
+	char *s, *key, *val, *body, *e;
+	int code, errcode = 0;
+
+	out->len = 0;
+	out->total = 0;
+
+	req = onion_request_new(lp);
+	if(!req)
+		return -1;
+	req->connection.user_data = out;
+	req->flags |= OR_GET;
+	if(!req->GET)
+		req->GET = onion_dict_new();
+
+	for(key = strtok_r(query, "&", &s); key; key = strtok_r(NULL, "&", &s)) {
+		val = strchr(key, '=');
+		if(!val)
+			continue;
+		*val++ = 0;
+		onion_dict_add(req->GET, key, val, OD_DUP_ALL);
+	}
+
+	res = onion_response_new(req);
+	c->handler(NULL, req, res);
+	api_arena_reset();		// 与 api_route_dispatch() 相同
+	code = res->code;
+	onion_response_free(res);
+	onion_request_free(req);
+
+	out->buf[out->len] = 0;
+	body = strstr(out->buf, "\r\n\r\n");
+	if(body && (e = strstr(body, "\"errcode\"")) != NULL) {
+		e = strchr(e, ':');
+		if(e)
+			errcode = atoi(e + 1);
+	}
+
+	return (code >= 200 && code < 400 && errcode == 0) ? 0 : -1;
+}
+
+static void bench_run_case(struct bench_ctx *ctx, onion_listen_point *lp, const struct bench_case *c,
+		int warmup, int iterations)
+{
+	static struct api_hist hist;
+	struct bench_output out;
+	struct timespec t0, t1, begin, end;
+	char query[512];
+	unsigned long long bytes = 0;
+	int i, errors = 0, s;
+	double secs;
+
+	for(i=0; i<warmup; ++i) {
+		c->query(ctx, i % ctx->sessions, query, sizeof(query));
+		bench_run_once(lp, c, query, &out);
+	}
+
+	memset(&hist, 0, sizeof(hist));
+	clock_gettime(CLOCK_MONOTONIC, &begin);
+	for(i=0; i<iterations; ++i) {
+		s = i % ctx->sessions;
+		c->query(ctx, s, query, sizeof(query));
+		clock_gettime(CLOCK_MONOTONIC, &t0);
+		if(bench_run_once(lp, c, query, &out) < 0)
+			errors++;
+		clock_gettime(CLOCK_MONOTONIC, &t1);
+		api_hist_record(&hist, (t1.tv_sec - t0.tv_sec) * 1000000000LL + (t1.tv_nsec - t0.tv_nsec));
+		bytes += out.total;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	secs = (end.tv_sec - begin.tv_sec) + (end.tv_nsec - begin.tv_nsec) / 1e9;
+	printf("%-28s %10.0f %10.1f %10.1f %10.1f %10llu %8d\n", c->name,
+			iterations / secs,
+			api_hist_quantile(&hist, 0.50) / 1e3,
+			api_hist_quantile(&hist, 0.99) / 1e3,
+			hist.max / 1e3,
+			iterations ? bytes / iterations : 0,
+			errors);
+}
+
+static void bench_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-g] [-n iterations] [-w warmup] [-b boards] [-a articles]"
+			" [-u users] [-m mails] [-c filter] [-s seed]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_ctx ctx;
+	const struct bench_case *c;
+	onion_listen_point *lp;
+	const char *filter = NULL;
+	char path[256];
+	int opt, regen = 0, iterations = 2000, warmup = 200, i;
+
+	memset(&ctx, 0, sizeof(ctx));
+	bench_fixture_defaults(&ctx.conf);
+
+	while((opt = getopt(argc, argv, "d:gn:w:b:a:u:m:c:s:h")) != -1) {
+		switch(opt) {
+		case 'd': ctx.conf.home = optarg; break;
+		case 'g': regen = 1; break;
+		case 'n': iterations = atoi(optarg); break;
+		case 'w': warmup = atoi(optarg); break;
+		case 'b': ctx.conf.boards = atoi(optarg); break;
+		case 'a': ctx.conf.articles = atoi(optarg); break;
+		case 'u': ctx.conf.users = atoi(optarg); break;
+		case 'm': ctx.conf.mails = atoi(optarg); break;
+		case 'c': filter = optarg; break;
+		case 's': ctx.conf.seed = atoi(optarg); break;
+		default:
+			bench_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/.PASSWDS", ctx.conf.home);
+	if(regen || access(path, F_OK) < 0) {
+		fprintf(stderr, "generating %s: %d boards x %d articles, %d users x %d mails\n",
+				ctx.conf.home, ctx.conf.boards, ctx.conf.articles, ctx.conf.users, ctx.conf.mails);
+		if(bench_fixture_write(&ctx.conf) < 0) {
+			perror("bench_fixture_write");
+			return 1;
+		}
+	}
+
+	shm_utmp = calloc(1, sizeof(struct UTMPFILE));
+	shm_bcache = calloc(1, sizeof(struct BCACHE));
+	shm_ucache = calloc(1, sizeof(struct UCACHE));
+	shm_uidhash = calloc(1, sizeof(struct UCACHEHASH));
+	shm_uindex = calloc(1, sizeof(struct UINDEX));
+	if(!shm_utmp || !shm_bcache || !shm_ucache || !shm_uidhash || !shm_uindex) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	bench_fixture_fill_shm(&ctx.conf, shm_utmp, shm_bcache, shm_ucache, shm_uidhash, shm_uindex);
+
+	ctx.sessions = (ctx.conf.users < BENCH_SESSIONS) ? ctx.conf.users : BENCH_SESSIONS;
+	for(i=0; i<ctx.sessions; ++i)
+		bench_fixture_login(&ctx.conf, shm_utmp, shm_uindex, i, ctx.userid[i], ctx.sessid[i]);
+	ctx.seed = ctx.conf.seed;
+
+	if(chdir(ctx.conf.home) < 0 || ummap() < 0) {
+		fprintf(stderr, "cannot load %s/.PASSWDS\n", ctx.conf.home);
+		return 1;
+	}
+
+	o = onion_new(O_ONE);
+	lp = onion_listen_point_new();
+	if(!o || !lp)
+		return 1;
+	lp->server = o;
+	lp->write = bench_write;
+	lp->read = NULL;
+	lp->close = NULL;
+
+	printf("%-28s %10s %10s %10s %10s %10s %8s\n", "case", "ops/s", "p50(us)", "p99(us)", "max(us)", "bytes", "errors");
+	for(c = bench_cases; c->name; ++c) {
+		if(filter && !strstr(c->name, filter))
+			continue;
+		bench_run_case(&ctx, lp, c, warmup, iterations);
+	}
+
+	onion_free(o);
+	return 0;
+}
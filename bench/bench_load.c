@@ -0,0 +1,763 @@
+/**
+ * @file	bench_load.c
+ * @brief	对运行中的 bmyapi 回放请求，统计吞吐、延迟分位数与错误码。
+ * @details	每个线程持有一个 keep-alive 连接。未指定 -r 时为闭环压测，每个连接收到
+ * 			响应后立即发出下一个请求；指定 -r 时为开环压测，请求按固定间隔排程，
+ * 			延迟从排程时间开始计算，服务端变慢时排队的时间同样计入，避免低估尾延迟。
+ *
+ * 			请求来自加权的请求组合（默认组合或 -m 指定的文件，每行为"权重 路径?参数"），
+ * 			或按顺序回放 -R 指定的请求日志（每行一个"路径?参数"）。两者都支持占位符：
+ * 			{auth}、{userid}、{sessid}、{appkey}、{board}、{aid}、{thread}、{page}、
+ * 			{sec}、{user}，其中 {aid}、{thread} 取自同一行中 {board} 选中的版面，
+ * 			版面与文章号的规则同 bench_names.h。
+ *
+ * 			会话来自 -S 指定的文件（bmyapi_fixture -l 的输出），或启动时通过
+ * 			user/login 为 -L 个生成的用户登录。
+ *
+ * 			用法：bmyapi_load [-H 主机] [-p 端口] [-c 连接数] [-r 每秒请求数] [-d 秒]
+ * 			[-w 预热秒数] [-m 组合文件 | -R 日志文件] [-S 会话文件 | -L 登录数]
+ * 			[-b 版面数] [-a 每版文章数] [-t 主题长度] [-u 用户数]
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <netdb.h>
+#include <netinet/tcp.h>
+#include "../api_hist.h"
+#include "bench_names.h"
+
+#define LOAD_MAX_ROUTES		64
+#define LOAD_MAX_ERRCODES	16		///< 每个路由记录的不同错误个数
+#define LOAD_MAX_SESSIONS	4096
+#define LOAD_MAX_ENTRIES	4096
+#define LOAD_LINE			1024
+#define LOAD_IO_ERROR		-1		///< 以负数记录非 errcode 的错误
+#define LOAD_HTTP_ERROR		-2
+
+struct load_entry {
+	int weight;				///< 累积权重，回放日志时不使用
+	char *tmpl;
+	int route;
+};
+
+struct load_errcode {
+	int code;
+	uint64_t count;
+};
+
+struct load_stats {
+	struct api_hist hist;			///< 微秒
+	uint64_t count;
+	uint64_t bytes;
+	struct load_errcode errcodes[LOAD_MAX_ERRCODES];
+	int errcode_num;
+};
+
+struct load_session {
+	char userid[BENCH_USERID_LEN];
+	char sessid[40];
+};
+
+struct load_conn {
+	int fd;
+	char *buf;					///< 接收缓冲
+	size_t len, cap;
+	char *body;					///< 解码后的响应体
+	size_t body_len, body_cap;
+};
+
+struct load_thread {
+	pthread_t tid;
+	int index;
+	unsigned int seed;
+	struct load_conn conn;
+	struct load_stats stats[LOAD_MAX_ROUTES];
+};
+
+static const char *load_host = "127.0.0.1";
+static const char *load_port = "8081";
+static struct addrinfo *load_addr = NULL;
+
+static int load_conns = 32;
+static double load_rps = 0;
+static int load_duration = 30;
+static int load_warmup = 5;
+static int load_boards = 50, load_articles = 20000, load_thread_len = 8, load_users = 2000;
+
+static struct load_entry load_entries[LOAD_MAX_ENTRIES];
+static int load_entry_num = 0;
+static int load_weight_total = 0;
+static int load_replay = 0;
+
+static char *load_routes[LOAD_MAX_ROUTES];
+static int load_route_num = 0;
+
+static struct load_session load_sessions[LOAD_MAX_SESSIONS];
+static int load_session_num = 0;
+
+static struct timespec load_start;
+
+static const char *load_default_mix[] = {
+	"30 article/list?type=board&btype=t&board={board}&startnum={page}&count=20&{auth}",
+	"10 article/list?type=board&btype=n&board={board}&startnum={page}&count=20&{auth}",
+	"10 article/list?type=thread&board={board}&thread={thread}&{auth}",
+	"25 article/getHTMLContent?board={board}&aid={aid}&{auth}",
+	"5 article/list?type=top10",
+	"5 board/list?secstr={sec}&sortmode=2&{auth}",
+	"5 board/info?bname={board}&{auth}",
+	"5 user/query?{auth}",
+	"5 mail/list?count=20&{auth}",
+	NULL
+};
+
+static uint64_t load_now_ns(void)
+{
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+/**
+ * @brief 路由名为路径，article/list 等以 type 区分子功能的接口附加 type 参数
+ */
+static int load_route_index(const char *tmpl)
+{
+	char name[128], type[64], *q, *t;
+	int i;
+
+	if(*tmpl == '/')
+		tmpl++;
+	snprintf(name, sizeof(name), "%s", tmpl);
+	q = strchr(name, '?');
+	if(q) {
+		*q++ = 0;
+		t = strstr(q, "type=");
+		if(t && (t == q || t[-1] == '&')) {
+			snprintf(type, sizeof(type), "%.*s", (int)strcspn(t, "&"), t);
+			snprintf(name + strlen(name), sizeof(name) - strlen(name), " %s", type);
+		}
+	}
+
+	for(i=0; i<load_route_num; ++i) {
+		if(!strcmp(load_routes[i], name))
+			return i;
+	}
+	if(load_route_num >= LOAD_MAX_ROUTES)
+		return LOAD_MAX_ROUTES - 1;
+	load_routes[load_route_num] = strdup(name);
+	return load_route_num++;
+}
+
+static int load_add_entry(int weight, const char *tmpl)
+{
+	char *s;
+
+	if(load_entry_num >= LOAD_MAX_ENTRIES || weight <= 0)
+		return -1;
+
+	while(*tmpl == '/')
+		tmpl++;
+	if(!strncmp(tmpl, "api/", 4))
+		tmpl += 4;
+
+	s = strdup(tmpl);
+	s[strcspn(s, "\r\n \t")] = 0;
+	if(!*s) {
+		free(s);
+		return -1;
+	}
+
+	load_weight_total += weight;
+	load_entries[load_entry_num].weight = load_weight_total;
+	load_entries[load_entry_num].tmpl = s;
+	load_entries[load_entry_num].route = load_route_index(s);
+	load_entry_num++;
+	return 0;
+}
+
+/**
+ * @brief 读取请求组合或回放日志，忽略空行与 # 开头的行
+ */
+static int load_read_entries(const char *path, int replay)
+{
+	char line[LOAD_LINE], *p;
+	FILE *fp = fopen(path, "r");
+
+	if(!fp)
+		return -1;
+	while(fgets(line, sizeof(line), fp)) {
+		p = line + strspn(line, " \t");
+		if(*p == '#' || *p == '\n' || *p == 0)
+			continue;
+		if(replay) {
+			load_add_entry(1, p);
+		} else {
+			int w = strtol(p, &p, 10);
+			load_add_entry(w, p + strspn(p, " \t"));
+		}
+	}
+	fclose(fp);
+	return load_entry_num > 0 ? 0 : -1;
+}
+
+static int load_is(const char *token, int n, const char *name)
+{
+	return (int)strlen(name) == n && !strncmp(token, name, n);
+}
+
+static void load_expand(const char *tmpl, char *out, size_t size, struct load_thread *t, int session)
+{
+	const struct load_session *s = &load_sessions[session];
+	size_t len = 0;
+	int board = -1, article, n;
+	const char *e;
+
+	while(*tmpl && len + 1 < size) {
+		if(*tmpl != '{' || !(e = strchr(tmpl, '}'))) {
+			out[len++] = *tmpl++;
+			continue;
+		}
+
+		n = e - tmpl - 1;
+		if(board < 0 && (load_is(tmpl + 1, n, "board") || load_is(tmpl + 1, n, "aid") || load_is(tmpl + 1, n, "thread")))
+			board = rand_r(&t->seed) % load_boards;
+
+		if(load_is(tmpl + 1, n, "auth")) {
+			len += snprintf(out + len, size - len, "userid=%s&sessid=%s&appkey=" BENCH_APPKEY, s->userid, s->sessid);
+		} else if(load_is(tmpl + 1, n, "userid")) {
+			len += snprintf(out + len, size - len, "%s", s->userid);
+		} else if(load_is(tmpl + 1, n, "sessid")) {
+			len += snprintf(out + len, size - len, "%s", s->sessid);
+		} else if(load_is(tmpl + 1, n, "appkey")) {
+			len += snprintf(out + len, size - len, BENCH_APPKEY);
+		} else if(load_is(tmpl + 1, n, "board")) {
+			len += snprintf(out + len, size - len, BENCH_BOARD_FMT, board);
+		} else if(load_is(tmpl + 1, n, "aid")) {
+			article = rand_r(&t->seed) % load_articles;
+			len += snprintf(out + len, size - len, "%d", bench_fixture_article_time(board, article));
+		} else if(load_is(tmpl + 1, n, "thread")) {
+			article = (rand_r(&t->seed) % ((load_articles - 1) / load_thread_len + 1)) * load_thread_len;
+			len += snprintf(out + len, size - len, "%d", bench_fixture_article_time(board, article));
+		} else if(load_is(tmpl + 1, n, "page")) {
+			len += snprintf(out + len, size - len, "%d", 1 + rand_r(&t->seed) % load_articles);
+		} else if(load_is(tmpl + 1, n, "sec")) {
+			len += snprintf(out + len, size - len, "%d", rand_r(&t->seed) % 10);
+		} else if(load_is(tmpl + 1, n, "user")) {
+			len += snprintf(out + len, size - len, BENCH_USERID_FMT, rand_r(&t->seed) % load_users);
+		} else {
+			len += snprintf(out + len, size - len, "%.*s", n + 2, tmpl);
+		}
+		if(len >= size)
+			len = size - 1;
+		tmpl = e + 1;
+	}
+	out[len] = 0;
+}
+
+static void load_conn_close(struct load_conn *c)
+{
+	if(c->fd >= 0)
+		close(c->fd);
+	c->fd = -1;
+	c->len = 0;
+}
+
+static int load_conn_open(struct load_conn *c)
+{
+	int one = 1;
+
+	load_conn_close(c);
+	c->fd = socket(load_addr->ai_family, SOCK_STREAM, 0);
+	if(c->fd < 0)
+		return -1;
+	if(connect(c->fd, load_addr->ai_addr, load_addr->ai_addrlen) < 0) {
+		load_conn_close(c);
+		return -1;
+	}
+	setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+	return 0;
+}
+
+static int load_reserve(char **buf, size_t *cap, size_t need)
+{
+	char *p;
+	size_t n = *cap ? *cap : 16384;
+
+	if(need <= *cap)
+		return 0;
+	while(n < need)
+		n *= 2;
+	p = realloc(*buf, n);
+	if(!p)
+		return -1;
+	*buf = p;
+	*cap = n;
+	return 0;
+}
+
+/**
+ * @brief 再读取一些数据到接收缓冲
+ * @return 读到的字节数，连接关闭时为 0，出错为 -1
+ */
+static ssize_t load_conn_fill(struct load_conn *c)
+{
+	ssize_t n;
+
+	if(load_reserve(&c->buf, &c->cap, c->len + 16384 + 1) < 0)
+		return -1;
+	do {
+		n = recv(c->fd, c->buf + c->len, c->cap - c->len - 1, 0);
+	} while(n < 0 && errno == EINTR);
+	if(n > 0) {
+		c->len += n;
+		c->buf[c->len] = 0;
+	}
+	return n;
+}
+
+static int load_conn_need(struct load_conn *c, size_t n)
+{
+	while(c->len < n) {
+		if(load_conn_fill(c) <= 0)
+			return -1;
+	}
+	return 0;
+}
+
+static int load_body_append(struct load_conn *c, const char *data, size_t n)
+{
+	if(load_reserve(&c->body, &c->body_cap, c->body_len + n + 1) < 0)
+		return -1;
+	memcpy(c->body + c->body_len, data, n);
+	c->body_len += n;
+	c->body[c->body_len] = 0;
+	return 0;
+}
+
+/**
+ * @brief 发出一个 GET 请求并读取完整的响应
+ * @return HTTP 状态码，连接出错时为 -1（连接已关闭）
+ */
+static int load_get(struct load_conn *c, const char *target)
+{
+	char req[LOAD_LINE + 256], *hdr_end, *h, *line;
+	size_t hlen, pos, chunk, sent = 0, total;
+	long content_length = -1;
+	int status, chunked = 0, keep = 1;
+	ssize_t n;
+
+	if(c->fd < 0 && load_conn_open(c) < 0)
+		return -1;
+
+	total = snprintf(req, sizeof(req), "GET /%s HTTP/1.1\r\nHost: %s\r\nConnection: keep-alive\r\n\r\n",
+			target, load_host);
+	while(sent < total) {
+		n = send(c->fd, req + sent, total - sent, MSG_NOSIGNAL);
+		if(n <= 0) {
+			if(n < 0 && errno == EINTR)
+				continue;
+			load_conn_close(c);
+			return -1;
+		}
+		sent += n;
+	}
+
+	while(!c->buf || !(hdr_end = strstr(c->buf, "\r\n\r\n"))) {
+		if(load_conn_fill(c) <= 0) {
+			load_conn_close(c);
+			return -1;
+		}
+	}
+	hlen = hdr_end - c->buf + 4;
+	status = (c->len > 12) ? atoi(c->buf + 9) : 0;
+
+	for(line = strstr(c->buf, "\r\n"); line && line < hdr_end; line = strstr(line + 2, "\r\n")) {
+		h = line + 2;
+		if(!strncasecmp(h, "Content-Length:", 15))
+			content_length = atol(h + 15);
+		else if(!strncasecmp(h, "Transfer-Encoding:", 18))
+			chunked = !strncasecmp(h + 18 + strspn(h + 18, " "), "chunked", 7);
+		else if(!strncasecmp(h, "Connection:", 11) && strncasecmp(h + 11 + strspn(h + 11, " "), "close", 5) == 0)
+			keep = 0;
+	}
+	if(!strncmp(c->buf, "HTTP/1.0", 8) && !strcasestr(c->buf, "Connection: keep-alive"))
+		keep = 0;
+
+	c->body_len = 0;
+	load_body_append(c, "", 0);
+	pos = hlen;
+
+	if(chunked) {
+		for(;;) {
+			while(!(line = strstr(c->buf + pos, "\r\n"))) {
+				if(load_conn_fill(c) <= 0)
+					goto fail;
+			}
+			chunk = strtoul(c->buf + pos, NULL, 16);
+			pos = line - c->buf + 2;
+			if(load_conn_need(c, pos + chunk + 2) < 0)
+				goto fail;
+			if(chunk == 0) {
+				pos += 2;
+				break;
+			}
+			load_body_append(c, c->buf + pos, chunk);
+			pos += chunk + 2;
+		}
+	} else if(content_length >= 0) {
+		if(load_conn_need(c, hlen + content_length) < 0)
+			goto fail;
+		load_body_append(c, c->buf + hlen, content_length);
+		pos = hlen + content_length;
+	} else {
+		// 没有长度信息，以连接关闭为结束
+		while((n = load_conn_fill(c)) > 0)
+			;
+		if(n < 0)
+			goto fail;
+		load_body_append(c, c->buf + hlen, c->len - hlen);
+		pos = c->len;
+		keep = 0;
+	}
+
+	memmove(c->buf, c->buf + pos, c->len - pos);
+	c->len -= pos;
+	c->buf[c->len] = 0;
+	if(!keep)
+		load_conn_close(c);
+	return status;
+
+fail:
+	load_conn_close(c);
+	return -1;
+}
+
+static int load_errcode(const struct load_conn *c)
+{
+	const char *e = c->body ? strstr(c->body, "\"errcode\"") : NULL;
+
+	if(!e || !(e = strchr(e, ':')))
+		return 0;
+	return atoi(e + 1);
+}
+
+static void load_count_error(struct load_stats *s, int code, uint64_t n)
+{
+	int i;
+
+	for(i=0; i<s->errcode_num; ++i) {
+		if(s->errcodes[i].code == code) {
+			s->errcodes[i].count += n;
+			return;
+		}
+	}
+	if(s->errcode_num < LOAD_MAX_ERRCODES) {
+		s->errcodes[i].code = code;
+		s->errcodes[i].count = n;
+		s->errcode_num++;
+	}
+}
+
+static const struct load_entry *load_pick(struct load_thread *t, uint64_t seq)
+{
+	int w, lo = 0, hi = load_entry_num - 1, mid;
+
+	if(load_replay)
+		return &load_entries[(t->index * (load_entry_num / load_conns + 1) + seq) % load_entry_num];
+
+	w = rand_r(&t->seed) % load_weight_total;
+	while(lo < hi) {
+		mid = (lo + hi) / 2;
+		if(load_entries[mid].weight > w)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return &load_entries[lo];
+}
+
+static void *load_thread_main(void *arg)
+{
+	struct load_thread *t = (struct load_thread *)arg;
+	const struct load_entry *e;
+	struct load_stats *s;
+	char target[LOAD_LINE + 256];
+	uint64_t start, warm, stop, interval = 0, next, sched, done, seq = 0;
+	struct timespec ts;
+	int status, errcode, session;
+
+	start = load_start.tv_sec * 1000000000ULL + load_start.tv_nsec;
+	warm = start + load_warmup * 1000000000ULL;
+	stop = warm + load_duration * 1000000000ULL;
+	session = t->index % load_session_num;
+
+	if(load_rps > 0) {
+		interval = (uint64_t)(load_conns * 1e9 / load_rps);
+		next = start + interval * t->index / load_conns;	// 错开各个连接
+	} else {
+		next = start;
+	}
+
+	for(;;) {
+		if(load_rps > 0) {
+			sched = next;
+			next += interval;
+			if(sched >= stop)
+				break;
+			ts.tv_sec = sched / 1000000000ULL;
+			ts.tv_nsec = sched % 1000000000ULL;
+			while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+				;
+		} else {
+			sched = load_now_ns();
+			if(sched >= stop)
+				break;
+		}
+
+		e = load_pick(t, seq++);
+		load_expand(e->tmpl, target, sizeof(target), t, session);
+		status = load_get(&t->conn, target);
+		done = load_now_ns();
+
+		if(sched < warm)
+			continue;
+
+		s = &t->stats[e->route];
+		s->count++;
+		api_hist_record(&s->hist, (done - sched) / 1000);
+		if(status < 0) {
+			load_count_error(s, LOAD_IO_ERROR, 1);
+			continue;
+		}
+		s->bytes += t->conn.body_len;
+		if(status < 200 || status >= 400)
+			load_count_error(s, LOAD_HTTP_ERROR - status, 1);
+		else if((errcode = load_errcode(&t->conn)) != 0)
+			load_count_error(s, errcode, 1);
+	}
+
+	load_conn_close(&t->conn);
+	return NULL;
+}
+
+static int load_read_sessions(const char *path)
+{
+	char line[LOAD_LINE];
+	FILE *fp = fopen(path, "r");
+
+	if(!fp)
+		return -1;
+	while(load_session_num < LOAD_MAX_SESSIONS && fgets(line, sizeof(line), fp)) {
+		struct load_session *s = &load_sessions[load_session_num];
+		if(sscanf(line, "%12s %39s", s->userid, s->sessid) == 2)
+			load_session_num++;
+	}
+	fclose(fp);
+	return 0;
+}
+
+/**
+ * @brief 通过 user/login 为前 n 个生成的用户登录
+ */
+static int load_login(int n)
+{
+	struct load_conn c = { .fd = -1 };
+	char target[256], *p;
+	int i, status;
+
+	for(i=0; i<n && load_session_num < LOAD_MAX_SESSIONS; ++i) {
+		struct load_session *s = &load_sessions[load_session_num];
+		snprintf(s->userid, sizeof(s->userid), BENCH_USERID_FMT, i % 100000);
+		snprintf(target, sizeof(target), "user/login?userid=%s&passwd=" BENCH_PASSWD "&appkey=" BENCH_APPKEY,
+				s->userid);
+		status = load_get(&c, target);
+		if(status != 200 || load_errcode(&c) != 0 || !(p = strstr(c.body, "\"sessid\""))) {
+			fprintf(stderr, "login %s failed: status %d, %s\n", s->userid, status, c.body ? c.body : "");
+			continue;
+		}
+		p = strchr(p + 8, '"');
+		if(!p || sscanf(p + 1, "%39[^\"]", s->sessid) != 1)
+			continue;
+		load_session_num++;
+	}
+
+	load_conn_close(&c);
+	free(c.buf);
+	free(c.body);
+	return load_session_num > 0 ? 0 : -1;
+}
+
+static void load_report(struct load_thread *threads)
+{
+	static struct load_stats merged[LOAD_MAX_ROUTES], all;
+	const struct load_stats *s;
+	int i, j, r;
+	double secs = load_duration;
+
+	memset(merged, 0, sizeof(merged));
+	memset(&all, 0, sizeof(all));
+	for(i=0; i<load_conns; ++i) {
+		for(r=0; r<load_route_num; ++r) {
+			s = &threads[i].stats[r];
+			api_hist_merge(&merged[r].hist, &s->hist);
+			api_hist_merge(&all.hist, &s->hist);
+			merged[r].count += s->count;
+			merged[r].bytes += s->bytes;
+			all.count += s->count;
+			all.bytes += s->bytes;
+			for(j=0; j<s->errcode_num; ++j) {
+				load_count_error(&merged[r], s->errcodes[j].code, s->errcodes[j].count);
+				load_count_error(&all, s->errcodes[j].code, s->errcodes[j].count);
+			}
+		}
+	}
+
+	printf("%-36s %9s %9s %9s %9s %9s %9s %9s %9s %8s\n", "route", "count", "rps",
+			"p50(ms)", "p90(ms)", "p99(ms)", "p999(ms)", "max(ms)", "bytes", "errors");
+	for(r=0; r<=load_route_num; ++r) {
+		const char *name = (r < load_route_num) ? load_routes[r] : "total";
+		uint64_t errors = 0;
+		s = (r < load_route_num) ? &merged[r] : &all;
+		if(!s->count)
+			continue;
+		for(j=0; j<s->errcode_num; ++j)
+			errors += s->errcodes[j].count;
+		printf("%-36s %9llu %9.1f %9.2f %9.2f %9.2f %9.2f %9.2f %9llu %8llu\n", name,
+				(unsigned long long)s->count, s->count / secs,
+				api_hist_quantile(&s->hist, 0.50) / 1e3,
+				api_hist_quantile(&s->hist, 0.90) / 1e3,
+				api_hist_quantile(&s->hist, 0.99) / 1e3,
+				api_hist_quantile(&s->hist, 0.999) / 1e3,
+				s->hist.max / 1e3,
+				(unsigned long long)(s->bytes / s->count),
+				(unsigned long long)errors);
+	}
+
+	for(r=0; r<load_route_num; ++r) {
+		s = &merged[r];
+		if(!s->errcode_num)
+			continue;
+		printf("errors %s:", load_routes[r]);
+		for(j=0; j<s->errcode_num; ++j) {
+			if(s->errcodes[j].code == LOAD_IO_ERROR)
+				printf(" io=%llu", (unsigned long long)s->errcodes[j].count);
+			else if(s->errcodes[j].code <= LOAD_HTTP_ERROR)
+				printf(" http%d=%llu", LOAD_HTTP_ERROR - s->errcodes[j].code, (unsigned long long)s->errcodes[j].count);
+			else
+				printf(" errcode%d=%llu", s->errcodes[j].code, (unsigned long long)s->errcodes[j].count);
+		}
+		printf("\n");
+	}
+}
+
+static void load_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-H host] [-p port] [-c connections] [-r rps] [-d seconds] [-w warmup]\n"
+			"\t[-m mixfile | -R logfile] [-S sessionfile | -L logins]\n"
+			"\t[-b boards] [-a articles] [-t thread_len] [-u users]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct addrinfo hints;
+	struct load_thread *threads;
+	const char *mix = NULL, *replay = NULL, *sessfile = NULL;
+	int opt, logins = -1, i;
+
+	while((opt = getopt(argc, argv, "H:p:c:r:d:w:m:R:S:L:b:a:t:u:h")) != -1) {
+		switch(opt) {
+		case 'H': load_host = optarg; break;
+		case 'p': load_port = optarg; break;
+		case 'c': load_conns = atoi(optarg); break;
+		case 'r': load_rps = atof(optarg); break;
+		case 'd': load_duration = atoi(optarg); break;
+		case 'w': load_warmup = atoi(optarg); break;
+		case 'm': mix = optarg; break;
+		case 'R': replay = optarg; break;
+		case 'S': sessfile = optarg; break;
+		case 'L': logins = atoi(optarg); break;
+		case 'b': load_boards = atoi(optarg); break;
+		case 'a': load_articles = atoi(optarg); break;
+		case 't': load_thread_len = atoi(optarg); break;
+		case 'u': load_users = atoi(optarg); break;
+		default:
+			load_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(load_conns <= 0 || load_duration <= 0 || load_boards <= 0 || load_articles <= 0
+			|| load_thread_len <= 0 || load_users <= 0) {
+		load_usage(argv[0]);
+		return 1;
+	}
+
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if(getaddrinfo(load_host, load_port, &hints, &load_addr) != 0) {
+		fprintf(stderr, "cannot resolve %s:%s\n", load_host, load_port);
+		return 1;
+	}
+
+	if(replay) {
+		load_replay = 1;
+		if(load_read_entries(replay, 1) < 0) {
+			fprintf(stderr, "cannot read %s\n", replay);
+			return 1;
+		}
+	} else if(mix) {
+		if(load_read_entries(mix, 0) < 0) {
+			fprintf(stderr, "cannot read %s\n", mix);
+			return 1;
+		}
+	} else {
+		for(i=0; load_default_mix[i]; ++i) {
+			char *p;
+			int w = strtol(load_default_mix[i], &p, 10);
+			load_add_entry(w, p + 1);
+		}
+	}
+
+	if(sessfile) {
+		if(load_read_sessions(sessfile) < 0 || load_session_num == 0) {
+			fprintf(stderr, "no sessions in %s\n", sessfile);
+			return 1;
+		}
+	} else {
+		if(logins < 0)
+			logins = (load_conns < load_users) ? load_conns : load_users;
+		if(load_login(logins) < 0) {
+			fprintf(stderr, "no user could log in\n");
+			return 1;
+		}
+	}
+
+	threads = calloc(load_conns, sizeof(*threads));
+	if(!threads)
+		return 1;
+
+	fprintf(stderr, "%d connections, %s, %d sessions, %ds warmup + %ds\n", load_conns,
+			load_rps > 0 ? "open loop" : "closed loop", load_session_num, load_warmup, load_duration);
+
+	clock_gettime(CLOCK_MONOTONIC, &load_start);
+	for(i=0; i<load_conns; ++i) {
+		threads[i].index = i;
+		threads[i].seed = i + 1;
+		threads[i].conn.fd = -1;
+		if(pthread_create(&threads[i].tid, NULL, load_thread_main, &threads[i]) != 0) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	for(i=0; i<load_conns; ++i)
+		pthread_join(threads[i].tid, NULL);
+
+	load_report(threads);
+	freeaddrinfo(load_addr);
+	return 0;
+}
@@ -0,0 +1,600 @@
+/**
+ * @file	bench_micro.c
+ * @brief	apilib 中文本处理与序列化函数的微基准测试。
+ * @details	以生成的 MY_BBS_HOME 中的文章与 .DIR 为语料，逐个测试 parse_article（两种模式）、
+ * 			aha_convert、string_replace、api_arena_replace_all、g2u/u2g、文章列表的 json 序列化、useridhash/finduseridhash
+ * 			以及 .DIR 上的 Search_Bin。
+ *
+ * 			每个函数按批计时，批的大小自动调整到至少 MICRO_BATCH_NS，避免计时本身的开销
+ * 			淹没耗时很短的函数。输出每次调用的平均耗时、各批的 p50/p99、每次处理的字节数与吞吐。
+ *
+ * 			用法：bmyapi_micro [-d 目录] [-g] [-t 秒] [-k 语料篇数] [-c 函数名过滤] [-j]
+ * 			[-B 基线文件] [-T 百分比]
+ *
+ * 			-j 以 JSON Lines 输出，每行一个函数，便于保存与比较；-B 读入之前 -j 的输出作为
+ * 			基线，平均耗时比基线慢 -T（默认 10）% 以上的函数标记为退化，此时退出码为 2。
+ */
+
+#include "../api.h"
+#include "../api_hist.h"
+#include "bench_fixture.h"
+
+#define MICRO_BATCH_NS		100000		///< 每批至少运行 100 微秒
+#define MICRO_DIRS			16			///< 参与测试的版面数
+#define MICRO_LIST_LEN		20			///< 每个文章列表的长度，同 article/list 的默认值
+#define MICRO_LISTS			64
+#define MICRO_MISS_IDS		256
+#define MICRO_MAX_BASELINE	64
+
+/**
+ * 该工具不调用处理函数，但链接的库函数中引用了 onion 实例。
+ */
+onion *o = NULL;
+
+struct micro_article {
+	char board[24];
+	char fname[32];
+	char *gbk;			///< 原始正文，截止到第一个附件之前
+	size_t gbk_len;
+	char *utf8;			///< gbk 转码后的结果，用于 u2g
+	size_t utf8_len;
+};
+
+struct micro_dir {
+	char *ptr;			///< .DIR 的内容
+	int total;
+};
+
+struct micro_ctx {
+	struct bench_fixture_conf conf;
+	struct micro_article *articles;
+	int narticles;
+	struct micro_dir dirs[MICRO_DIRS];
+	int ndirs;
+	struct bmy_article lists[MICRO_LISTS][MICRO_LIST_LEN];
+	char miss_ids[MICRO_MISS_IDS][IDLEN+1];
+	char *outbuf;		///< g2u/u2g 的输出缓冲区
+	size_t outlen;
+	volatile long sink;	///< 保存返回值，防止调用被优化掉
+};
+
+struct micro_kernel {
+	const char *name;
+	size_t (*run)(struct micro_ctx *ctx, int i);	///< 执行第 i 次，返回处理的字节数
+};
+
+struct micro_result {
+	unsigned long long ops;
+	double ns_per_op;
+	double p50;
+	double p99;
+	double bytes_per_op;
+	double mb_per_s;
+};
+
+struct micro_baseline {
+	char name[64];
+	double ns_per_op;
+};
+
+static long long micro_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static size_t k_parse_article(struct micro_ctx *ctx, int i, int mode)
+{
+	struct micro_article *a = &ctx->articles[i % ctx->narticles];
+	struct attach_link *attach_link_list = NULL;
+	char *s;
+
+	s = parse_article(a->board, a->fname, mode, &attach_link_list);
+	ctx->sink += (s != NULL);
+	free_attach_link_list(attach_link_list);
+	api_arena_reset();
+	return a->gbk_len;
+}
+
+static size_t k_parse_article_ansi(struct micro_ctx *ctx, int i)
+{
+	return k_parse_article(ctx, i, ARTICLE_PARSE_WITH_ANSICOLOR);
+}
+
+static size_t k_parse_article_raw(struct micro_ctx *ctx, int i)
+{
+	return k_parse_article(ctx, i, ARTICLE_PARSE_WITHOUT_ANSICOLOR);
+}
+
+static size_t k_aha_convert(struct micro_ctx *ctx, int i)
+{
+	struct micro_article *a = &ctx->articles[i % ctx->narticles];
+	FILE *in, *out;
+	char *buf = NULL;
+	size_t len = 0;
+
+	in = fmemopen(a->gbk, a->gbk_len, "r");
+	out = open_memstream(&buf, &len);
+	if(in && out)
+		aha_convert(in, out);
+	if(in)
+		fclose(in);
+	if(out)
+		fclose(out);
+	free(buf);
+	return a->gbk_len;
+}
+
+/**
+ * 原先 parse_article 的 RAW 模式，逐行以 string_replace 反复替换其中的 \033，
+ * 保留用于与旧的基线比较
+ */
+static size_t k_string_replace(struct micro_ctx *ctx, int i)
+{
+	struct micro_article *a = &ctx->articles[i % ctx->narticles];
+	const char *p = a->gbk, *e;
+	char *tmp;
+	size_t len;
+
+	while(*p) {
+		e = strchr(p, '\n');
+		len = e ? (size_t)(e - p + 1) : strlen(p);
+		if(memchr(p, '\033', len)) {
+			tmp = strndup(p, len);
+			while(strchr(tmp, '\033') != NULL)
+				tmp = string_replace(tmp, "\033", "[ESC]");
+			ctx->sink += strlen(tmp);
+			free(tmp);
+		}
+		p += len;
+	}
+	return a->gbk_len;
+}
+
+/**
+ * 与 parse_article 的 RAW 模式相同，逐行以 api_arena_replace_all 一次替换其中的 \033
+ */
+static size_t k_arena_replace_all(struct micro_ctx *ctx, int i)
+{
+	struct micro_article *a = &ctx->articles[i % ctx->narticles];
+	const char *p = a->gbk, *e;
+	char *tmp;
+	size_t len;
+
+	while(*p) {
+		e = strchr(p, '\n');
+		len = e ? (size_t)(e - p + 1) : strlen(p);
+		if(memchr(p, '\033', len)) {
+			tmp = api_arena_replace_all(api_arena_strndup(p, len), "\033", "[ESC]");
+			ctx->sink += strlen(tmp);
+		}
+		p += len;
+	}
+	api_arena_reset();
+	return a->gbk_len;
+}
+
+static size_t k_g2u(struct micro_ctx *ctx, int i)
+{
+	struct micro_article *a = &ctx->articles[i % ctx->narticles];
+	ctx->sink += g2u(a->gbk, a->gbk_len, ctx->outbuf, ctx->outlen);
+	return a->gbk_len;
+}
+
+static size_t k_u2g(struct micro_ctx *ctx, int i)
+{
+	struct micro_article *a = &ctx->articles[i % ctx->narticles];
+	ctx->sink += u2g(a->utf8, a->utf8_len, ctx->outbuf, ctx->outlen);
+	return a->utf8_len;
+}
+
+static size_t k_json_list(struct micro_ctx *ctx, int i, int with_num, int mode)
+{
+	struct bmy_article *list = ctx->lists[i % MICRO_LISTS];
+	size_t len;
+	char *s;
+
+	if(with_num)
+		s = bmy_article_with_num_array_to_json_string(list, MICRO_LIST_LEN, mode);
+	else
+		s = bmy_article_array_to_json_string(list, MICRO_LIST_LEN, mode);
+	len = s ? strlen(s) : 0;
+	api_arena_reset();
+	return len;
+}
+
+static size_t k_json_list_plain(struct micro_ctx *ctx, int i)
+{
+	return k_json_list(ctx, i, 0, 0);
+}
+
+static size_t k_json_list_board(struct micro_ctx *ctx, int i)
+{
+	return k_json_list(ctx, i, 0, 1);
+}
+
+static size_t k_json_list_thread(struct micro_ctx *ctx, int i)
+{
+	return k_json_list(ctx, i, 1, 1);
+}
+
+static size_t k_useridhash(struct micro_ctx *ctx, int i)
+{
+	const char *id = shm_ucache->userid[i % shm_ucache->number];
+	ctx->sink += useridhash(id);
+	return strlen(id);
+}
+
+static size_t k_finduseridhash(struct micro_ctx *ctx, int i)
+{
+	const char *id = shm_ucache->userid[i % shm_ucache->number];
+	ctx->sink += finduseridhash(shm_uidhash->uhi, UCACHE_HASH_SIZE, id);
+	return strlen(id);
+}
+
+/**
+ * 不存在的用户需要探查完整个冲突链，是 finduseridhash 最慢的情况
+ */
+static size_t k_finduseridhash_miss(struct micro_ctx *ctx, int i)
+{
+	const char *id = ctx->miss_ids[i % MICRO_MISS_IDS];
+	ctx->sink += finduseridhash(shm_uidhash->uhi, UCACHE_HASH_SIZE, id);
+	return strlen(id);
+}
+
+static size_t k_search_bin(struct micro_ctx *ctx, int i)
+{
+	struct micro_dir *d = &ctx->dirs[i % ctx->ndirs];
+	struct fileheader *fh = (struct fileheader *)d->ptr;
+	int key = fh[(unsigned int)i * 2654435761u % d->total].filetime;
+
+	ctx->sink += Search_Bin(d->ptr, key, 0, d->total - 1);
+	return sizeof(struct fileheader);
+}
+
+static const struct micro_kernel micro_kernels[] = {
+	{ "parse_article ansi",			k_parse_article_ansi },
+	{ "parse_article raw",			k_parse_article_raw },
+	{ "aha_convert",				k_aha_convert },
+	{ "string_replace",				k_string_replace },
+	{ "arena_replace_all",			k_arena_replace_all },
+	{ "g2u",						k_g2u },
+	{ "u2g",						k_u2g },
+	{ "json article list",			k_json_list_plain },
+	{ "json article list board",	k_json_list_board },
+	{ "json article list thread",	k_json_list_thread },
+	{ "useridhash",					k_useridhash },
+	{ "finduseridhash",				k_finduseridhash },
+	{ "finduseridhash miss",		k_finduseridhash_miss },
+	{ "Search_Bin",					k_search_bin },
+	{ NULL, NULL }
+};
+
+/**
+ * @brief 读入整个文件，结尾补 0
+ * @return 需要 free，失败时返回 NULL
+ */
+static char *micro_read_file(const char *path, size_t *len)
+{
+	struct stat st;
+	char *buf;
+	int fd;
+
+	fd = open(path, O_RDONLY);
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || (buf = malloc(st.st_size + 1)) == NULL) {
+		close(fd);
+		return NULL;
+	}
+	if(read(fd, buf, st.st_size) != st.st_size) {
+		free(buf);
+		close(fd);
+		return NULL;
+	}
+	close(fd);
+	buf[st.st_size] = 0;
+	*len = st.st_size;
+	return buf;
+}
+
+static int micro_load_dirs(struct micro_ctx *ctx)
+{
+	char board[32], path[256];
+	size_t len;
+	int n;
+
+	for(n=0; n<ctx->conf.boards && ctx->ndirs<MICRO_DIRS; ++n) {
+		bench_fixture_board_name(n, board, sizeof(board));
+		snprintf(path, sizeof(path), "boards/%s/.DIR", board);
+		ctx->dirs[ctx->ndirs].ptr = micro_read_file(path, &len);
+		if(!ctx->dirs[ctx->ndirs].ptr)
+			return -1;
+		ctx->dirs[ctx->ndirs].total = len / sizeof(struct fileheader);
+		if(ctx->dirs[ctx->ndirs].total == 0)
+			return -1;
+		ctx->ndirs++;
+	}
+	return ctx->ndirs > 0 ? 0 : -1;
+}
+
+static int micro_load_articles(struct micro_ctx *ctx, int count, unsigned int *seed)
+{
+	struct micro_article *a;
+	struct micro_dir *d;
+	struct fileheader *fh;
+	char path[256], *p;
+	size_t len, maxlen = 0;
+	int i;
+
+	ctx->articles = calloc(count, sizeof(struct micro_article));
+	if(!ctx->articles)
+		return -1;
+
+	for(i=0; i<count; ++i) {
+		a = &ctx->articles[i];
+		d = &ctx->dirs[i % ctx->ndirs];
+		fh = (struct fileheader *)d->ptr + rand_r(seed) % d->total;
+		bench_fixture_board_name(i % ctx->ndirs, a->board, sizeof(a->board));
+		strsncpy(a->fname, fh2fname(fh), sizeof(a->fname));
+
+		snprintf(path, sizeof(path), "boards/%s/%s", a->board, a->fname);
+		a->gbk = micro_read_file(path, &len);
+		if(!a->gbk)
+			return -1;
+		p = strstr(a->gbk, "\nbeginbinaryattach ");
+		if(p)
+			p[1] = 0;
+		a->gbk_len = strlen(a->gbk);
+
+		a->utf8 = malloc(3 * a->gbk_len + 1);
+		if(!a->utf8)
+			return -1;
+		memset(a->utf8, 0, 3 * a->gbk_len + 1);
+		g2u(a->gbk, a->gbk_len, a->utf8, 3 * a->gbk_len);
+		a->utf8_len = strlen(a->utf8);
+
+		if(3 * a->gbk_len > maxlen)
+			maxlen = 3 * a->gbk_len;
+	}
+
+	ctx->narticles = count;
+	ctx->outlen = maxlen + 1;
+	ctx->outbuf = malloc(ctx->outlen);
+	return ctx->outbuf ? 0 : -1;
+}
+
+/**
+ * 与 article/list 相同，由 .DIR 中连续的若干篇文章构造 bmy_article 数组
+ */
+static void micro_build_lists(struct micro_ctx *ctx, unsigned int *seed)
+{
+	struct bmy_article *ba;
+	struct micro_dir *d;
+	struct fileheader *fh;
+	int i, j, k, n, start;
+
+	for(i=0; i<MICRO_LISTS; ++i) {
+		n = i % ctx->ndirs;
+		d = &ctx->dirs[n];
+		start = (d->total > MICRO_LIST_LEN) ? rand_r(seed) % (d->total - MICRO_LIST_LEN) : 0;
+
+		for(j=0; j<MICRO_LIST_LEN; ++j) {
+			ba = &ctx->lists[i][j];
+			memset(ba, 0, sizeof(*ba));
+			fh = (struct fileheader *)d->ptr + (start + j) % d->total;
+
+			ba->type = (fh->thread == fh->filetime) ? 1 : 0;
+			bench_fixture_board_name(n, ba->board, sizeof(ba->board));
+			strsncpy(ba->author, fh2owner(fh), sizeof(ba->author));
+			g2u(fh->title, strlen(fh->title), ba->title, sizeof(ba->title));
+			ba->filetime = fh->filetime;
+			ba->thread = fh->thread;
+			ba->mark = fh->accessed;
+			ba->sequence_num = start + j + 1;
+			ba->th_num = 1 + rand_r(seed) % MAX_COMMENTER_COUNT;
+			ba->th_size = 1024 * ba->th_num;
+			ba->th_commenter_count = ba->th_num;
+			for(k=0; k<ba->th_commenter_count; ++k)
+				strsncpy(ba->th_commenter[k], shm_ucache->userid[rand_r(seed) % shm_ucache->number],
+						sizeof(ba->th_commenter[k]));
+		}
+	}
+
+	for(i=0; i<MICRO_MISS_IDS; ++i)
+		snprintf(ctx->miss_ids[i], IDLEN+1, "nobody%d", i);
+}
+
+static void micro_measure(struct micro_ctx *ctx, const struct micro_kernel *k, double secs,
+		struct micro_result *r)
+{
+	static struct api_hist hist;	// 记录每批中单次调用的耗时，单位为皮秒
+	long long t0, t, begin, elapsed;
+	unsigned long long bytes = 0;
+	int batch = 1, i, n = 0;
+
+	// 确定批的大小，同时作为预热
+	for(;;) {
+		t0 = micro_now();
+		for(i=0; i<batch; ++i)
+			k->run(ctx, n++);
+		t = micro_now() - t0;
+		if(t >= MICRO_BATCH_NS || batch >= (1 << 24))
+			break;
+		batch *= 2;
+	}
+
+	memset(&hist, 0, sizeof(hist));
+	memset(r, 0, sizeof(*r));
+	begin = micro_now();
+	do {
+		t0 = micro_now();
+		for(i=0; i<batch; ++i)
+			bytes += k->run(ctx, n++);
+		t = micro_now() - t0;
+		r->ops += batch;
+		api_hist_record(&hist, (uint64_t)t * 1000 / batch);
+		elapsed = micro_now() - begin;
+	} while(elapsed < secs * 1e9);
+
+	r->ns_per_op = (double)elapsed / r->ops;
+	r->p50 = api_hist_quantile(&hist, 0.50) / 1e3;
+	r->p99 = api_hist_quantile(&hist, 0.99) / 1e3;
+	r->bytes_per_op = (double)bytes / r->ops;
+	r->mb_per_s = bytes * 1e3 / elapsed;
+}
+
+/**
+ * @brief 读入 -j 输出的基线
+ * @return 读到的条目数，文件无法打开时返回 -1
+ */
+static int micro_load_baseline(const char *path, struct micro_baseline *base, int max)
+{
+	char line[512], *p, *e;
+	int n = 0;
+	FILE *fp;
+
+	fp = fopen(path, "r");
+	if(!fp)
+		return -1;
+	while(n < max && fgets(line, sizeof(line), fp)) {
+		p = strstr(line, "\"kernel\":\"");
+		if(!p)
+			continue;
+		p += 10;
+		e = strchr(p, '"');
+		if(!e || e - p >= (int)sizeof(base[n].name))
+			continue;
+		memcpy(base[n].name, p, e - p);
+		base[n].name[e - p] = 0;
+		p = strstr(e, "\"ns_per_op\":");
+		if(!p)
+			continue;
+		base[n].ns_per_op = atof(p + 12);
+		n++;
+	}
+	fclose(fp);
+	return n;
+}
+
+static const struct micro_baseline *micro_find_baseline(const struct micro_baseline *base, int n, const char *name)
+{
+	int i;
+	for(i=0; i<n; ++i) {
+		if(!strcmp(base[i].name, name))
+			return &base[i];
+	}
+	return NULL;
+}
+
+static void micro_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-g] [-t seconds] [-k articles] [-c filter] [-j]"
+			" [-B baseline] [-T percent]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	static struct micro_ctx ctx;
+	struct micro_baseline base[MICRO_MAX_BASELINE];
+	const struct micro_baseline *b;
+	const struct micro_kernel *k;
+	struct micro_result r;
+	const char *filter = NULL, *baseline = NULL;
+	char path[256];
+	double secs = 1.0, threshold = 10.0, delta;
+	unsigned int seed;
+	int opt, regen = 0, json = 0, corpus = 200, nbase = 0, regressed = 0, worse;
+
+	bench_fixture_defaults(&ctx.conf);
+
+	while((opt = getopt(argc, argv, "d:gt:k:c:jB:T:h")) != -1) {
+		switch(opt) {
+		case 'd': ctx.conf.home = optarg; break;
+		case 'g': regen = 1; break;
+		case 't': secs = atof(optarg); break;
+		case 'k': corpus = atoi(optarg); break;
+		case 'c': filter = optarg; break;
+		case 'j': json = 1; break;
+		case 'B': baseline = optarg; break;
+		case 'T': threshold = atof(optarg); break;
+		default:
+			micro_usage(argv[0]);
+			return 1;
+		}
+	}
+	if(corpus <= 0 || secs <= 0) {
+		micro_usage(argv[0]);
+		return 1;
+	}
+
+	if(baseline) {
+		nbase = micro_load_baseline(baseline, base, MICRO_MAX_BASELINE);
+		if(nbase < 0) {
+			perror(baseline);
+			return 1;
+		}
+	}
+
+	snprintf(path, sizeof(path), "%s/.PASSWDS", ctx.conf.home);
+	if(regen || access(path, F_OK) < 0) {
+		fprintf(stderr, "generating %s: %d boards x %d articles, %d users x %d mails\n",
+				ctx.conf.home, ctx.conf.boards, ctx.conf.articles, ctx.conf.users, ctx.conf.mails);
+		if(bench_fixture_write(&ctx.conf) < 0) {
+			perror("bench_fixture_write");
+			return 1;
+		}
+	}
+
+	shm_utmp = calloc(1, sizeof(struct UTMPFILE));
+	shm_bcache = calloc(1, sizeof(struct BCACHE));
+	shm_ucache = calloc(1, sizeof(struct UCACHE));
+	shm_uidhash = calloc(1, sizeof(struct UCACHEHASH));
+	shm_uindex = calloc(1, sizeof(struct UINDEX));
+	if(!shm_utmp || !shm_bcache || !shm_ucache || !shm_uidhash || !shm_uindex) {
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	bench_fixture_fill_shm(&ctx.conf, shm_utmp, shm_bcache, shm_ucache, shm_uidhash, shm_uindex);
+
+	seed = ctx.conf.seed;
+	if(chdir(ctx.conf.home) < 0 || micro_load_dirs(&ctx) < 0 || micro_load_articles(&ctx, corpus, &seed) < 0) {
+		fprintf(stderr, "cannot load corpus from %s\n", ctx.conf.home);
+		return 1;
+	}
+	micro_build_lists(&ctx, &seed);
+
+	if(!json)
+		printf("%-28s %12s %10s %10s %10s %10s %10s %8s\n", "kernel", "ops", "ns/op", "p50(ns)", "p99(ns)",
+				"bytes/op", "MB/s", "vs base");
+
+	for(k = micro_kernels; k->name; ++k) {
+		if(filter && !strstr(k->name, filter))
+			continue;
+
+		micro_measure(&ctx, k, secs, &r);
+		b = micro_find_baseline(base, nbase, k->name);
+		delta = (b && b->ns_per_op > 0) ? (r.ns_per_op / b->ns_per_op - 1) * 100 : 0;
+		worse = b && delta > threshold;
+		regressed |= worse;
+
+		if(json) {
+			printf("{\"kernel\":\"%s\",\"ops\":%llu,\"ns_per_op\":%.1f,\"p50_ns\":%.1f,\"p99_ns\":%.1f,"
+					"\"bytes_per_op\":%.0f,\"mb_per_s\":%.1f", k->name, r.ops, r.ns_per_op, r.p50, r.p99,
+					r.bytes_per_op, r.mb_per_s);
+			if(b)
+				printf(",\"baseline_ns_per_op\":%.1f,\"regression\":%s", b->ns_per_op, worse ? "true" : "false");
+			printf("}\n");
+		} else {
+			printf("%-28s %12llu %10.1f %10.1f %10.1f %10.0f %10.1f", k->name, r.ops, r.ns_per_op,
+					r.p50, r.p99, r.bytes_per_op, r.mb_per_s);
+			if(b)
+				printf(" %+7.1f%%%s", delta, worse ? " !" : "");
+			printf("\n");
+		}
+		fflush(stdout);
+	}
+
+	return regressed ? 2 : 0;
+}
@@ -0,0 +1,36 @@
+/**
+ * @file	bench_names.h
+ * @brief	生成数据的命名规则，压测客户端与 bench_fixture 共用。
+ * @details	只依赖 C 标准库，bench_load.c 不需要 BBS 的头文件即可编译。
+ */
+
+#ifndef __BMYBBS_BENCH_NAMES_H
+#define __BMYBBS_BENCH_NAMES_H
+
+#include <stdio.h>
+
+#define BENCH_APPKEY		"bench"
+#define BENCH_USERID_FMT	"bench%05d"
+#define BENCH_USERID_LEN	16				///< 足以容纳 BENCH_USERID_FMT 生成的用户名
+#define BENCH_PASSWD		"benchpass"		///< 所有生成用户的密码
+#define BENCH_BOARD_FMT		"Bench%03d"
+#define BENCH_TIME_BASE		1500000000
+
+/**
+ * @brief 第 n 个版面的名称
+ */
+static inline void bench_fixture_board_name(int n, char *buf, size_t len)
+{
+	snprintf(buf, len, BENCH_BOARD_FMT, n);
+}
+
+/**
+ * @brief 第 n 个版面第 i 篇文章的 filetime
+ * 每个版面的文章依次相隔 60 秒，不依赖配置，压测客户端可以直接推算出文章号。
+ */
+static inline int bench_fixture_article_time(int n, int i)
+{
+	return BENCH_TIME_BASE + i * 60 + n;
+}
+
+#endif
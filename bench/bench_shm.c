@@ -0,0 +1,215 @@
+/**
+ * @file	bench_shm.c
+ * @brief	为本地运行 bmyapi 准备数据：生成磁盘数据，并创建、填充 SysV 共享内存段。
+ * @details	bmyapi 启动时通过 shm_init() 连接 UTMP、BCACHE、UCACHE、UCACHEHASH、UINDEX
+ * 			五个由 bbsd 等进程创建的共享内存段。本工具以相同的键值创建这些段，并填入
+ * 			与磁盘数据一致的版面与用户信息，使 bmyapi 可以在单台机器上独立运行、压测。
+ *
+ * 			用法：bmyapi_fixture [-d 目录] [-b 版面数] [-a 每版文章数] [-u 用户数]
+ * 			[-m 每人信件数] [-s 种子] [-S] [-l 会话数] [-f] [-x]
+ *
+ * 			-S 只创建共享内存，不生成磁盘数据；-l 预先建立会话，并以
+ * 			"userid sessid" 每行一个输出到标准输出；-f 删除已存在的同键值段后重建，
+ * 			并允许在非空目录中生成数据；-x 删除这些段后退出。
+ *
+ * @warning	不要在运行中的 BBS 主机上使用。写入任何数据之前会先检查，已存在的段
+ * 			或非空的数据目录默认不会被覆盖。
+ */
+
+#include <dirent.h>
+#include <sys/ipc.h>
+#include <sys/shm.h>
+#include "../api.h"
+#include "bench_fixture.h"
+
+/**
+ * 该工具不调用处理函数，但链接的库函数中引用了 onion 实例。
+ */
+onion *o = NULL;
+
+struct bench_shm_seg {
+	const char *name;
+	key_t key;
+	size_t size;
+	void **ptr;
+};
+
+static struct bench_shm_seg bench_shm_segs[] = {
+	{ "UTMP",		UTMP_SHMKEY,		sizeof(struct UTMPFILE),	(void **)&shm_utmp },
+	{ "BCACHE",		BCACHE_SHMKEY,		sizeof(struct BCACHE),		(void **)&shm_bcache },
+	{ "UCACHE",		UCACHE_SHMKEY,		sizeof(struct UCACHE),		(void **)&shm_ucache },
+	{ "UCACHEHASH",	UCACHE_HASH_SHMKEY,	sizeof(struct UCACHEHASH),	(void **)&shm_uidhash },
+	{ "UINDEX",		UINDEX_SHMKEY,		sizeof(struct UINDEX),		(void **)&shm_uindex },
+	{ NULL, 0, 0, NULL }
+};
+
+static int bench_shm_remove(const struct bench_shm_seg *seg)
+{
+	int id = shmget(seg->key, 0, 0);
+
+	if(id < 0)
+		return (errno == ENOENT) ? 0 : -1;
+	return shmctl(id, IPC_RMID, NULL);
+}
+
+/**
+ * @brief 检查同键值的段是否已经存在
+ * @return 存在返回 1，不存在返回 0，无法确定返回 -1
+ */
+static int bench_shm_exists(const struct bench_shm_seg *seg)
+{
+	if(shmget(seg->key, 0, 0) >= 0)
+		return 1;
+	return (errno == ENOENT) ? 0 : -1;
+}
+
+/**
+ * @brief 检查目录是否为空，不存在的目录视为空
+ * @return 为空返回 1，否则返回 0
+ */
+static int bench_dir_empty(const char *path)
+{
+	struct dirent *de;
+	DIR *dir = opendir(path);
+	int empty = 1;
+
+	if(!dir)
+		return errno == ENOENT;
+	while(empty && (de = readdir(dir)) != NULL) {
+		if(strcmp(de->d_name, ".") && strcmp(de->d_name, ".."))
+			empty = 0;
+	}
+	closedir(dir);
+	return empty;
+}
+
+static int bench_shm_create(const struct bench_shm_seg *seg, int force)
+{
+	void *p;
+	int id;
+
+	id = shmget(seg->key, seg->size, IPC_CREAT | IPC_EXCL | 0660);
+	if(id < 0 && errno == EEXIST) {
+		if(!force) {
+			fprintf(stderr, "%s (key %d) already exists, use -f to replace it\n", seg->name, (int)seg->key);
+			return -1;
+		}
+		if(bench_shm_remove(seg) < 0)
+			return -1;
+		id = shmget(seg->key, seg->size, IPC_CREAT | IPC_EXCL | 0660);
+	}
+	if(id < 0)
+		return -1;
+
+	p = shmat(id, NULL, 0);
+	if(p == (void *)-1)
+		return -1;
+
+	memset(p, 0, seg->size);
+	*seg->ptr = p;
+	return 0;
+}
+
+static void bench_shm_usage(const char *prog)
+{
+	fprintf(stderr, "usage: %s [-d dir] [-b boards] [-a articles] [-u users] [-m mails] [-s seed]"
+			" [-S] [-l sessions] [-f] [-x]\n", prog);
+}
+
+int main(int argc, char *argv[])
+{
+	struct bench_fixture_conf conf;
+	struct bench_shm_seg *seg;
+	char userid[IDLEN+1], sessid[40];
+	int opt, shm_only = 0, force = 0, remove_only = 0, sessions = 0, i, ret;
+
+	bench_fixture_defaults(&conf);
+	conf.home = MY_BBS_HOME;
+
+	while((opt = getopt(argc, argv, "d:b:a:u:m:s:Sl:fxh")) != -1) {
+		switch(opt) {
+		case 'd': conf.home = optarg; break;
+		case 'b': conf.boards = atoi(optarg); break;
+		case 'a': conf.articles = atoi(optarg); break;
+		case 'u': conf.users = atoi(optarg); break;
+		case 'm': conf.mails = atoi(optarg); break;
+		case 's': conf.seed = atoi(optarg); break;
+		case 'S': shm_only = 1; break;
+		case 'l': sessions = atoi(optarg); break;
+		case 'f': force = 1; break;
+		case 'x': remove_only = 1; break;
+		default:
+			bench_shm_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	if(remove_only) {
+		ret = 0;
+		for(seg = bench_shm_segs; seg->name; ++seg) {
+			if(bench_shm_remove(seg) < 0) {
+				perror(seg->name);
+				ret = 1;
+			}
+		}
+		return ret;
+	}
+
+	// 先检查，确认不会覆盖已有的数据后再写入
+	if(!force) {
+		ret = 0;
+		for(seg = bench_shm_segs; seg->name; ++seg) {
+			switch(bench_shm_exists(seg)) {
+			case 1:
+				fprintf(stderr, "%s (key %d) already exists, use -f to replace it\n", seg->name, (int)seg->key);
+				ret = 1;
+				break;
+			case -1:
+				perror(seg->name);
+				ret = 1;
+				break;
+			}
+		}
+		if(!shm_only && !bench_dir_empty(conf.home)) {
+			fprintf(stderr, "%s is not empty, use -f to generate into it\n", conf.home);
+			ret = 1;
+		}
+		if(ret)
+			return ret;
+	}
+
+	if(!shm_only) {
+		fprintf(stderr, "generating %s: %d boards x %d articles, %d users x %d mails\n",
+				conf.home, conf.boards, conf.articles, conf.users, conf.mails);
+		if(bench_fixture_write(&conf) < 0) {
+			perror("bench_fixture_write");
+			return 1;
+		}
+	}
+
+	for(seg = bench_shm_segs; seg->name; ++seg) {
+		if(bench_shm_create(seg, force) < 0) {
+			if(errno != EEXIST)
+				perror(seg->name);
+			// 删除已经建立的段，不留下不完整的一组
+			while(seg-- > bench_shm_segs) {
+				shmdt(*seg->ptr);
+				*seg->ptr = NULL;
+				bench_shm_remove(seg);
+			}
+			return 1;
+		}
+	}
+
+	bench_fixture_fill_shm(&conf, shm_utmp, shm_bcache, shm_ucache, shm_uidhash, shm_uindex);
+
+	for(i=0; i<sessions; ++i) {
+		if(bench_fixture_login(&conf, shm_utmp, shm_uindex, i, userid, sessid) < 0)
+			break;
+		printf("%s %s\n", userid, sessid);
+	}
+
+	fprintf(stderr, "shared memory ready: %d boards, %d users, %d sessions (appkey " BENCH_APPKEY ")\n",
+			shm_bcache->number, shm_ucache->number, i);
+	return 0;
+}
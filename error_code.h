@@ -21,6 +21,8 @@ enum api_error_code {
 	API_RT_NOTLOGGEDIN	= 1002,		///< 没有登录
 	API_RT_FUNCNOTIMPL	= 1003,		///< 功能未实现
 	API_RT_WRONGMETHOD	= 1004,		///< 错误的 HTTP 方法
+	API_RT_THROTTLED	= 1005,		///< 请求过于频繁
+	API_RT_OVERLOADED	= 1006,		///< 服务器繁忙，请稍后再试
 	API_RT_NOTEMPLATE	= 1100,		///< 没有模板
 	API_RT_NOSUCHUSER 	= 100000, 	///< 没有此用户
 	API_RT_SITEFBDIP	= 100001,	///< 站点禁用IP
@@ -2,6 +2,49 @@
 
 onion *o=NULL;
 
+// 第四列为频率限制中的 cost，省略时为 1，参见 api_ratelimit.c
+static struct api_route api_routes[] = {
+	{ "user/query",				api_user_query,					API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "user/login",				api_user_login,					API_ROUTE_POST | API_ROUTE_NOSTORE, 5 },
+	{ "user/logout",			api_user_logout,				API_ROUTE_POST | API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "user/checksession",		api_user_check_session,			API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "user/register",			api_user_register,				API_ROUTE_NOSTORE, 10 },
+	{ "user/articlequery",		api_user_articlequery,			API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH | API_ROUTE_DIR, 20 },
+	{ "user/friends/list",		api_user_friends_list,			API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "user/friends/add",		api_user_friends_add,			API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "user/friends/del",		api_user_friends_del,			API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "user/rejects/list",		api_user_rejects_list,			API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "user/rejects/add",		api_user_rejects_add,			API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "user/rejects/del",		api_user_rejects_del,			API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "user/autocomplete",		api_user_autocomplete,			API_ROUTE_AUTH | API_ROUTE_NOSTORE, 2 },
+	{ "article/list",			api_article_list,				API_ROUTE_BATCH | API_ROUTE_DIR, 4 },
+	{ "article/getHTMLContent",	api_article_getHTMLContent,		API_ROUTE_BATCH | API_ROUTE_DIR },
+	{ "article/getRAWContent",	api_article_getRAWContent,		API_ROUTE_BATCH | API_ROUTE_DIR },
+	{ "article/post",			api_article_post,				API_ROUTE_POST | API_ROUTE_NOSTORE, 5 },
+	{ "article/reply",			api_article_reply,				API_ROUTE_POST | API_ROUTE_NOSTORE, 5 },
+	{ "board/list",				api_board_list,					API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "board/info",				api_board_info,					API_ROUTE_AUTH | API_ROUTE_BATCH },
+	{ "board/fav/add",			api_board_fav_add,				API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "board/fav/del",			api_board_fav_del,				API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "board/fav/list",			api_board_fav_list,				API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "board/autocomplete",		api_board_autocomplete,			API_ROUTE_AUTH | API_ROUTE_NOSTORE, 2 },
+	{ "meta/loginpics",			api_meta_loginpics,				API_ROUTE_BATCH },
+	{ "meta/metrics",			api_meta_metrics,				API_ROUTE_NOSTORE },
+	{ "mail/list",				api_mail_list,					API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH | API_ROUTE_DIR },
+	{ "mail/getHTMLContent",	api_mail_getHTMLContent,		API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH | API_ROUTE_DIR },
+	{ "mail/getRAWContent",		api_mail_getRAWContent,			API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH | API_ROUTE_DIR },
+	{ "mail/post",				api_mail_send,					API_ROUTE_AUTH | API_ROUTE_NOSTORE, 5 },
+	{ "mail/reply",				api_mail_reply,					API_ROUTE_AUTH | API_ROUTE_NOSTORE, 5 },
+	{ "attach/show",			api_attach_show,				0 },
+	{ "attach/list",			api_attach_list,				API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "attach/upload",			api_attach_upload,				API_ROUTE_NOSTORE, 5 },
+	{ "attach/delete",			api_attach_delete,				API_ROUTE_POST | API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "notification/list",		api_notification_list,			API_ROUTE_AUTH | API_ROUTE_NOSTORE | API_ROUTE_BATCH },
+	{ "notification/del",		api_notification_del,			API_ROUTE_AUTH | API_ROUTE_NOSTORE },
+	{ "batch",					api_batch,						API_ROUTE_NOSTORE },
+	{ NULL, NULL, 0 }
+};
+
 static void shutdown_server(int _)
 {
 	if (o)
@@ -10,66 +53,78 @@ static void shutdown_server(int _)
 
 int main(int argc, char *argv[])
 {
+	const struct api_config *conf;
+	char conf_path[PATH_MAX], *conf_arg = NULL;
+	int opt;
+
+	while((opt = getopt(argc, argv, "c:")) != -1) {
+		switch(opt) {
+		case 'c':
+			// 在 chdir 之前解析为绝对路径
+			if(!realpath(optarg, conf_path)) {
+				perror(optarg);
+				return -1;
+			}
+			conf_arg = conf_path;
+			break;
+		default:
+			fprintf(stderr, "usage: %s [-c config]\n", argv[0]);
+			return -1;
+		}
+	}
+
 	seteuid(BBSUID);
 	setuid(BBSUID);
 	setgid(BBSGID);
 
 	chdir(MY_BBS_HOME);
 
+	if(api_config_load(conf_arg) < 0)
+		return -1;
+	conf = api_config_get();
+
+	if(conf->workers > 0 && !api_prefork_is_worker())
+		return api_prefork_run(conf_arg);
+
 	if(shm_init()<0)
 		return -1;
 	if(ummap()<0)
 		return -1;
+	if(api_ratelimit_init() < 0)
+		fprintf(stderr, "cannot map the rate limit table, requests are not limited\n");
 
 	signal(SIGINT, shutdown_server);
 	signal(SIGTERM, shutdown_server);
 
+	// 其他线程都在这之后创建，继承对 SIGHUP 的屏蔽
+	if(api_config_watch() < 0)
+		return -1;
+
 	o=onion_new(O_POOL);
-	onion_set_max_threads(o, 32);
-
-	onion_set_timeout(o, 5000);
-	onion_set_hostname(o, "127.0.0.1");
-	onion_set_port(o, "8081");
-
-	onion_url *urls=onion_root_url(o);
-	onion_url_add(urls, "", api_error);
-
-	onion_url_add(urls, "^user/query$", api_user_query);
-	onion_url_add(urls, "^user/login$", api_user_login);
-	onion_url_add(urls, "^user/logout$", api_user_logout);
-	onion_url_add(urls, "^user/checksession$", api_user_check_session);
-	onion_url_add(urls, "^user/register$", api_user_register);
-	onion_url_add(urls, "^user/articlequery$", api_user_articlequery);
-	onion_url_add(urls, "^user/friends/list$", api_user_friends_list);
-	onion_url_add(urls, "^user/friends/add$", api_user_friends_add);
-	onion_url_add(urls, "^user/friends/del$", api_user_friends_del);
-	onion_url_add(urls, "^user/rejects/list$", api_user_rejects_list);
-	onion_url_add(urls, "^user/rejects/add$", api_user_rejects_add);
-	onion_url_add(urls, "^user/rejects/del$", api_user_rejects_del);
-	onion_url_add(urls, "^user/autocomplete$", api_user_autocomplete);
-	onion_url_add(urls, "^article/list$", api_article_list);
-	onion_url_add(urls, "^article/getHTMLContent$", api_article_getHTMLContent);
-	onion_url_add(urls, "^article/getRAWContent$", api_article_getRAWContent);
-	onion_url_add(urls, "^article/post$", api_article_post);
-	onion_url_add(urls, "^article/reply$", api_article_reply);
-	onion_url_add(urls, "^board/list$", api_board_list);
-	onion_url_add(urls, "^board/info$", api_board_info);
-	onion_url_add(urls, "^board/fav/add$", api_board_fav_add);
-	onion_url_add(urls, "^board/fav/del$", api_board_fav_del);
-	onion_url_add(urls, "^board/fav/list$", api_board_fav_list);
-	onion_url_add(urls, "^board/autocomplete$", api_board_autocomplete);
-	onion_url_add(urls, "^meta/loginpics", api_meta_loginpics);
-	onion_url_add(urls, "^mail/list$", api_mail_list);
-	onion_url_add(urls, "^mail/getHTMLContent$", api_mail_getHTMLContent);
-	onion_url_add(urls, "^mail/getRAWContent$", api_mail_getRAWContent);
-	onion_url_add(urls, "^mail/post$", api_mail_send);
-	onion_url_add(urls, "^mail/reply$", api_mail_reply);
-	onion_url_add(urls, "^attach/show$", api_attach_show);
-	onion_url_add(urls, "^attach/list$", api_attach_list);
-	onion_url_add(urls, "^attach/upload$", api_attach_upload);
-	onion_url_add(urls, "^notification/list$", api_notification_list);
-	onion_url_add(urls, "^notification/del$", api_notification_del);
+	onion_set_max_threads(o, conf->threads);
+	if(api_pool_init(conf->threads) < 0)
+		return -1;
+
+	onion_set_timeout(o, conf->timeout_ms);
+	switch(api_prefork_worker_init(o)) {
+	case 0:
+		onion_set_hostname(o, conf->listen_host);
+		onion_set_port(o, conf->listen_port);
+		break;
+	case 1:
+		break;
+	default:
+		return -1;
+	}
+
+	// 超过上限的上传在解析请求体时即被拒绝，不会写入临时文件
+	onion_set_max_file_size(o, API_ATTACH_UPLOAD_MAX);
+
+	if(api_router_init(api_routes) < 0)
+		return -1;
+	onion_set_root_handler(o, onion_handler_new(api_router_handler, NULL, NULL));
 
+	api_prefork_ready();
 	onion_listen(o);
 
 	onion_free(o);
@@ -0,0 +1,47 @@
+/**
+ * @file 批量请求接口自动化测试
+ * 登录 test 用户后，通过一次 batch 请求读取用户信息和收藏夹，收藏夹数据同 test_board.js。
+ *
+ * @warning 新增测试用例前请补充测试场景、测试数据说明。
+ */
+
+var $ = require('jquery');
+
+exports.test_batch_query_and_fav_list = function(test) {
+	var login_url = 'http://extdev.ironblood.net:8080/user/login?userid=test&passwd=testtest&appkey=newweb';
+	$.getJSON(login_url, function(login_data) {
+		if(login_data.errcode != 0) {
+			test.ok(false, "user login failed. errcode: " + login_data.errcode);
+			test.done();
+			return;
+		}
+
+		var requests = JSON.stringify([
+			{ path: 'user/query' },
+			{ path: 'board/list', query: { secstr: 'fav', sortmode: '1' } }
+		]);
+		var batch_url = 'http://extdev.ironblood.net:8080/batch?userid=test&sessid=' + login_data.SessionID
+			+ '&appkey=newweb&parallel=1&requests=' + encodeURIComponent(requests);
+		$.getJSON(batch_url, function(data) {
+			test.equal(data.errcode, 0, "errcode 错误，预期 0，实际 " + data.errcode);
+			test.equal(data.results.length, 2, "数组长度错误，预期2，实际 " + data.results.length);
+
+			test.equal(data.results[0].path, "user/query");
+			test.equal(data.results[0].body.errcode, 0);
+
+			test.equal(data.results[1].path, "board/list");
+			test.equal(data.results[1].body.errcode, 0);
+			test.equal(data.results[1].body.boardlist.length, 2);
+			test.done();
+		});
+	});
+};
+
+exports.test_batch_rejects_unknown_path = function(test) {
+	var requests = JSON.stringify([ { path: 'user/login' } ]);
+	var batch_url = 'http://extdev.ironblood.net:8080/batch?requests=' + encodeURIComponent(requests);
+	$.getJSON(batch_url, function(data) {
+		test.notEqual(data.errcode, 0, "写接口不应允许批量调用");
+		test.done();
+	});
+};